@@ -0,0 +1,865 @@
+/****************************************************************************
+ * Project: SawMill
+ * Authors:
+ *          Bart Meuris <bart . meuris @ gmail . com>
+ *
+ * License: (to be discussed LGPL version 2.0?)
+ ****************************************************************************
+ * Module description:
+ *     Time indexed event archive: writer, reader and replay input.
+ *
+ ***************************************************************************/
+
+#include "archive.h"
+#include "sawlog.h"
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <google/protobuf/io/coded_stream.h>
+#ifdef HAVE_LZ4
+# include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+# include <zstd.h>
+#endif
+
+#define ARCHIVE_VERSION     1
+#define ARCHIVE_HEADER_SIZE 64
+#define ARCHIVE_FLUSH_MS    5000
+
+namespace sawmill {
+
+static_assert(sizeof(ArchiveBlock) == 64, "ArchiveBlock is stored as is");
+
+struct ArchiveHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t entrysize;
+	char reserved[ARCHIVE_HEADER_SIZE - 16];
+};
+
+static uint64_t clock_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static bool writeAll(int fd, const char *data, size_t len, uint64_t offset)
+{
+	while (len) {
+		ssize_t n = pwrite(fd, data, len, offset);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		data += n;
+		len -= n;
+		offset += n;
+	}
+	return true;
+}
+
+static bool readAll(int fd, char *data, size_t len, uint64_t offset)
+{
+	while (len) {
+		ssize_t n = pread(fd, data, len, offset);
+		if (n <= 0) {
+			if ((n < 0) && (errno == EINTR))
+				continue;
+			return false;
+		}
+		data += n;
+		len -= n;
+		offset += n;
+	}
+	return true;
+}
+
+static uint32_t checksum(const char *data, size_t len)
+{
+	return crc32(0, reinterpret_cast<const Bytef *>(data), len);
+}
+
+static uint64_t entryOffset(uint64_t i)
+{
+	return ARCHIVE_HEADER_SIZE + i * sizeof(ArchiveBlock);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+ArchiveWriter::ArchiveWriter()
+	:codec(ARCHIVE_ZLIB), level(0), blocksize(ARCHIVE_BLOCK_SIZE), blockspan(ARCHIVE_BLOCK_SPAN * 1000000000LL),
+	 flushinterval(ARCHIVE_FLUSH_MS), path(), datafd(-1), indexfd(-1), dataend(0), blocks(0), maxsofar(INT64_MIN),
+	 raw(), packed(), block(), started_ms(0), events(0)
+{
+	resetBlock();
+}
+
+ArchiveWriter::~ArchiveWriter()
+{
+	close();
+}
+
+bool ArchiveWriter::hasCodec(ArchiveCodec c)
+{
+	switch (c) {
+	case ARCHIVE_RAW:
+	case ARCHIVE_ZLIB:
+		return true;
+	case ARCHIVE_LZ4:
+#ifdef HAVE_LZ4
+		return true;
+#else
+		return false;
+#endif
+	case ARCHIVE_ZSTD:
+#ifdef HAVE_ZSTD
+		return true;
+#else
+		return false;
+#endif
+	}
+	return false;
+}
+
+bool ArchiveWriter::parseCodec(const std::string &name, ArchiveCodec &c)
+{
+	static const ArchiveCodec codecs[] = { ARCHIVE_RAW, ARCHIVE_ZLIB, ARCHIVE_LZ4, ARCHIVE_ZSTD };
+	for (size_t i = 0; i < sizeof(codecs) / sizeof(codecs[0]); i++) {
+		if (name == codecName(codecs[i])) {
+			c = codecs[i];
+			return true;
+		}
+	}
+	return false;
+}
+
+const char *ArchiveWriter::codecName(ArchiveCodec c)
+{
+	switch (c) {
+	case ARCHIVE_RAW:  return "none";
+	case ARCHIVE_ZLIB: return "zlib";
+	case ARCHIVE_LZ4:  return "lz4";
+	case ARCHIVE_ZSTD: return "zstd";
+	}
+	return "unknown";
+}
+
+bool ArchiveWriter::setCodec(ArchiveCodec c, int l)
+{
+	if (!hasCodec(c)) {
+		ERR("Archive compression %s is not compiled in", codecName(c));
+		return false;
+	}
+	codec = c;
+	level = l;
+	return true;
+}
+
+bool ArchiveWriter::open(const std::string &p)
+{
+	close();
+	path = p;
+	datafd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (datafd < 0) {
+		ERR("Could not open archive %s: %s", path.c_str(), strerror(errno));
+		return false;
+	}
+	std::string indexpath = path + ARCHIVE_INDEX_SUFFIX;
+	indexfd = ::open(indexpath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (indexfd < 0) {
+		ERR("Could not open archive index %s: %s", indexpath.c_str(), strerror(errno));
+		::close(datafd);
+		datafd = -1;
+		return false;
+	}
+	if (!recover()) {
+		::close(datafd);
+		::close(indexfd);
+		datafd = indexfd = -1;
+		return false;
+	}
+	resetBlock();
+	return true;
+}
+
+bool ArchiveWriter::recover()
+{
+	struct stat ist, dst;
+	if ((fstat(indexfd, &ist) != 0) || (fstat(datafd, &dst) != 0)) {
+		ERR("Could not stat archive %s: %s", path.c_str(), strerror(errno));
+		return false;
+	}
+	ArchiveHeader header;
+	if ((size_t)ist.st_size < sizeof(header)) {
+		if (dst.st_size > 0) {
+			ERR("Archive %s has data but no index", path.c_str());
+			return false;
+		}
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, ARCHIVE_INDEX_MAGIC, sizeof(header.magic));
+		header.version = ARCHIVE_VERSION;
+		header.entrysize = sizeof(ArchiveBlock);
+		if ((ftruncate(indexfd, 0) != 0) || !writeAll(indexfd, reinterpret_cast<const char *>(&header), sizeof(header), 0) ||
+		    (ftruncate(datafd, 0) != 0)) {
+			ERR("Could not initialize archive %s: %s", path.c_str(), strerror(errno));
+			return false;
+		}
+		blocks = 0;
+		dataend = 0;
+		maxsofar = INT64_MIN;
+		return true;
+	}
+	if (!readAll(indexfd, reinterpret_cast<char *>(&header), sizeof(header), 0) ||
+	    (memcmp(header.magic, ARCHIVE_INDEX_MAGIC, sizeof(header.magic)) != 0) ||
+	    (header.version != ARCHIVE_VERSION) || (header.entrysize != sizeof(ArchiveBlock))) {
+		ERR("%s%s is not an archive index this version can continue", path.c_str(), ARCHIVE_INDEX_SUFFIX);
+		return false;
+	}
+	// Drop the entries at the end of which the block didn't make it to the data file
+	uint64_t n = (ist.st_size - sizeof(header)) / sizeof(ArchiveBlock);
+	ArchiveBlock last;
+	while (n) {
+		if (readAll(indexfd, reinterpret_cast<char *>(&last), sizeof(last), entryOffset(n - 1)) &&
+		    (last.offset + last.length <= (uint64_t)dst.st_size)) {
+			packed.resize(last.length);
+			if (readAll(datafd, &packed[0], last.length, last.offset) && (checksum(packed.data(), last.length) == last.checksum))
+				break;
+		}
+		WARN("Dropping damaged block %llu at the end of archive %s", (unsigned long long)(n - 1), path.c_str());
+		n--;
+	}
+	blocks = n;
+	dataend = n ? last.offset + last.length : 0;
+	maxsofar = n ? last.maxsofar : INT64_MIN;
+	if ((ftruncate(indexfd, entryOffset(n)) != 0) || (ftruncate(datafd, dataend) != 0)) {
+		ERR("Could not truncate archive %s: %s", path.c_str(), strerror(errno));
+		return false;
+	}
+	if (n)
+		NOTICE("Continuing archive %s after %llu blocks", path.c_str(), (unsigned long long)n);
+	return true;
+}
+
+void ArchiveWriter::resetBlock()
+{
+	raw.clear();
+	memset(&block, 0, sizeof(block));
+	block.offset = dataend;
+	block.mintime = INT64_MAX;
+	block.maxtime = INT64_MIN;
+}
+
+void ArchiveWriter::close()
+{
+	if (datafd < 0)
+		return;
+	if (!raw.empty())
+		writeBlock();
+	if ((fdatasync(datafd) != 0) || (fdatasync(indexfd) != 0))
+		ERR("Could not sync archive %s: %s", path.c_str(), strerror(errno));
+	::close(datafd);
+	::close(indexfd);
+	datafd = indexfd = -1;
+	resetBlock();
+}
+
+bool ArchiveWriter::writeBlock()
+{
+	const char *out = raw.data();
+	size_t outlen = raw.size();
+	block.codec = ARCHIVE_RAW;
+	switch (codec) {
+	case ARCHIVE_RAW:
+		break;
+	case ARCHIVE_ZLIB: {
+		uLongf n = compressBound(raw.size());
+		packed.resize(n);
+		if (compress2(reinterpret_cast<Bytef *>(&packed[0]), &n, reinterpret_cast<const Bytef *>(raw.data()), raw.size(),
+		              level ? level : Z_DEFAULT_COMPRESSION) == Z_OK) {
+			out = packed.data();
+			outlen = n;
+			block.codec = ARCHIVE_ZLIB;
+		}
+		break;
+	}
+	case ARCHIVE_LZ4: {
+#ifdef HAVE_LZ4
+		packed.resize(LZ4_compressBound(raw.size()));
+		int n = LZ4_compress_fast(raw.data(), &packed[0], raw.size(), packed.size(), level > 0 ? level : 1);
+		if (n > 0) {
+			out = packed.data();
+			outlen = n;
+			block.codec = ARCHIVE_LZ4;
+		}
+#endif
+		break;
+	}
+	case ARCHIVE_ZSTD: {
+#ifdef HAVE_ZSTD
+		packed.resize(ZSTD_compressBound(raw.size()));
+		size_t n = ZSTD_compress(&packed[0], packed.size(), raw.data(), raw.size(), level ? level : ZSTD_CLEVEL_DEFAULT);
+		if (!ZSTD_isError(n)) {
+			out = packed.data();
+			outlen = n;
+			block.codec = ARCHIVE_ZSTD;
+		}
+#endif
+		break;
+	}
+	}
+	// Blocks that don't get smaller are kept as they are
+	if (outlen >= raw.size()) {
+		out = raw.data();
+		outlen = raw.size();
+		block.codec = ARCHIVE_RAW;
+	}
+
+	block.offset = dataend;
+	block.length = outlen;
+	block.rawlength = raw.size();
+	block.checksum = checksum(out, outlen);
+	maxsofar = std::max(maxsofar, block.maxtime);
+	block.maxsofar = maxsofar;
+	bool ok = writeAll(datafd, out, outlen, dataend) &&
+	          writeAll(indexfd, reinterpret_cast<const char *>(&block), sizeof(block), entryOffset(blocks));
+	if (ok) {
+		dataend += outlen;
+		blocks++;
+	} else {
+		ERR("Could not write to archive %s, lost %u events: %s", path.c_str(), block.events, strerror(errno));
+	}
+	resetBlock();
+	return ok;
+}
+
+void ArchiveWriter::output(LogEvent &event)
+{
+	if (datafd < 0)
+		return;
+	if (event.has_timestamp_ns()) {
+		int64_t t = event.timestamp_ns();
+		int64_t lo = std::min(block.mintime, t);
+		int64_t hi = std::max(block.maxtime, t);
+		// Unsigned, the difference of any two int64_t fits
+		if ((block.mintime <= block.maxtime) && ((uint64_t)hi - (uint64_t)lo > (uint64_t)blockspan)) {
+			writeBlock();
+			lo = hi = t;
+		}
+		block.mintime = lo;
+		block.maxtime = hi;
+	} else {
+		block.untimed++;
+	}
+	if (raw.empty())
+		started_ms = clock_ms();
+
+	size_t size = event.ByteSizeLong();
+	size_t at = raw.size();
+	raw.resize(at + google::protobuf::io::CodedOutputStream::VarintSize32(size) + size);
+	google::protobuf::uint8 *q = reinterpret_cast<google::protobuf::uint8 *>(&raw[at]);
+	q = google::protobuf::io::CodedOutputStream::WriteVarint32ToArray(size, q);
+	event.SerializeWithCachedSizesToArray(q);
+	block.types |= ArchiveReader::typeBits(event.type());
+	block.events++;
+	events++;
+
+	if (raw.size() >= blocksize)
+		writeBlock();
+}
+
+long ArchiveWriter::timeout() const
+{
+	if (raw.empty() || (flushinterval <= 0))
+		return -1;
+	uint64_t now = clock_ms();
+	uint64_t due = started_ms + flushinterval;
+	return (now >= due) ? 0 : (long)(due - now);
+}
+
+void ArchiveWriter::flush()
+{
+	if ((datafd >= 0) && (timeout() == 0))
+		writeBlock();
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+ArchiveReader::ArchiveReader()
+	:path(), index(NULL), count(0), indexmap(MAP_FAILED), indexsize(0), data(NULL), datasize(0)
+{
+}
+
+ArchiveReader::~ArchiveReader()
+{
+	close();
+}
+
+uint64_t ArchiveReader::typeBits(const std::string &type)
+{
+	// FNV-1a, the bits are stored so they have to stay the same
+	uint64_t h = 14695981039346656037ULL;
+	for (size_t i = 0; i < type.size(); i++) {
+		h ^= (unsigned char)type[i];
+		h *= 1099511628211ULL;
+	}
+	return (1ULL << (h & 63)) | (1ULL << ((h >> 6) & 63));
+}
+
+bool ArchiveReader::open(const std::string &p)
+{
+	close();
+	path = p;
+	std::string indexpath = path + ARCHIVE_INDEX_SUFFIX;
+	int fd = ::open(indexpath.c_str(), O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if ((fd < 0) || (fstat(fd, &st) != 0)) {
+		ERR("Could not open archive index %s: %s", indexpath.c_str(), strerror(errno));
+		if (fd >= 0)
+			::close(fd);
+		return false;
+	}
+	indexsize = st.st_size;
+	if (indexsize >= ARCHIVE_HEADER_SIZE)
+		indexmap = mmap(NULL, indexsize, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	const ArchiveHeader *header = static_cast<const ArchiveHeader *>(indexmap);
+	if ((indexmap == MAP_FAILED) || (memcmp(header->magic, ARCHIVE_INDEX_MAGIC, sizeof(header->magic)) != 0) ||
+	    (header->version != ARCHIVE_VERSION) || (header->entrysize != sizeof(ArchiveBlock))) {
+		ERR("%s is not an archive index this version can read", indexpath.c_str());
+		close();
+		return false;
+	}
+
+	fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if ((fd < 0) || (fstat(fd, &st) != 0)) {
+		ERR("Could not open archive %s: %s", path.c_str(), strerror(errno));
+		if (fd >= 0)
+			::close(fd);
+		close();
+		return false;
+	}
+	datasize = st.st_size;
+	if (datasize) {
+		void *m = mmap(NULL, datasize, PROT_READ, MAP_SHARED, fd, 0);
+		if (m == MAP_FAILED) {
+			ERR("Could not map archive %s: %s", path.c_str(), strerror(errno));
+			::close(fd);
+			close();
+			return false;
+		}
+		// Only the blocks that are read should be paged in
+		madvise(m, datasize, MADV_RANDOM);
+		data = static_cast<const char *>(m);
+	}
+	::close(fd);
+
+	index = reinterpret_cast<const ArchiveBlock *>(static_cast<const char *>(indexmap) + ARCHIVE_HEADER_SIZE);
+	count = (indexsize - ARCHIVE_HEADER_SIZE) / sizeof(ArchiveBlock);
+	// A writer can have the entry of a block out before all of the data is visible here
+	while (count && (index[count - 1].offset + index[count - 1].length > datasize))
+		count--;
+	return true;
+}
+
+void ArchiveReader::close()
+{
+	if (indexmap != MAP_FAILED)
+		munmap(indexmap, indexsize);
+	if (data)
+		munmap(const_cast<char *>(data), datasize);
+	indexmap = MAP_FAILED;
+	indexsize = 0;
+	index = NULL;
+	count = 0;
+	data = NULL;
+	datasize = 0;
+}
+
+size_t ArchiveReader::firstBlock(int64_t from) const
+{
+	// maxsofar only goes up: all blocks before the first one that reaches 'from' end before it
+	size_t lo = 0, hi = count;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (index[mid].maxsofar < from)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+bool ArchiveReader::blockMatches(size_t i, int64_t from, int64_t to, const std::string &type) const
+{
+	const ArchiveBlock &b = index[i];
+	if ((b.mintime >= to) || (b.maxtime < from))
+		return false;
+	if (type.empty())
+		return true;
+	uint64_t bits = typeBits(type);
+	return (b.types & bits) == bits;
+}
+
+void ArchiveReader::findBlocks(int64_t from, int64_t to, const std::string &type, std::vector<size_t> &found) const
+{
+	found.clear();
+	if (from >= to)
+		return;
+	// Events come in roughly in order, but late ones can end up in any later block: the rest of
+	// the index is checked, which is only its (small) entries, not the data
+	for (size_t i = firstBlock(from); i < count; i++) {
+		if (blockMatches(i, from, to, type))
+			found.push_back(i);
+	}
+}
+
+const char *ArchiveReader::readBlock(size_t i, std::string &buf, size_t &len) const
+{
+	const ArchiveBlock &b = index[i];
+	const char *src = data + b.offset;
+	if (checksum(src, b.length) != b.checksum) {
+		ERR("Block %lu of archive %s is damaged", (unsigned long)i, path.c_str());
+		return NULL;
+	}
+	bool ok = false;
+	switch (b.codec) {
+	case ARCHIVE_RAW:
+		len = b.length;
+		return src;
+	case ARCHIVE_ZLIB: {
+		buf.resize(b.rawlength);
+		uLongf n = b.rawlength;
+		ok = (uncompress(reinterpret_cast<Bytef *>(&buf[0]), &n, reinterpret_cast<const Bytef *>(src), b.length) == Z_OK) &&
+		     (n == b.rawlength);
+		break;
+	}
+#ifdef HAVE_LZ4
+	case ARCHIVE_LZ4:
+		buf.resize(b.rawlength);
+		ok = (LZ4_decompress_safe(src, &buf[0], b.length, b.rawlength) == (int)b.rawlength);
+		break;
+#endif
+#ifdef HAVE_ZSTD
+	case ARCHIVE_ZSTD:
+		buf.resize(b.rawlength);
+		ok = (ZSTD_decompress(&buf[0], b.rawlength, src, b.length) == b.rawlength);
+		break;
+#endif
+	default:
+		ERR("Block %lu of archive %s uses compression %u, which is not compiled in", (unsigned long)i, path.c_str(), b.codec);
+		return NULL;
+	}
+	if (!ok) {
+		ERR("Could not decompress block %lu of archive %s", (unsigned long)i, path.c_str());
+		return NULL;
+	}
+	len = b.rawlength;
+	return buf.data();
+}
+
+bool ArchiveReader::nextEvent(const char *&p, const char *end, LogEvent &event)
+{
+	uint32_t size = 0;
+	for (int shift = 0; ; shift += 7) {
+		if ((p >= end) || (shift > 28))
+			return false;
+		uint8_t c = *p++;
+		size |= (uint32_t)(c & 0x7f) << shift;
+		if (!(c & 0x80))
+			break;
+	}
+	if ((size_t)(end - p) < size)
+		return false;
+	if (!event.ParseFromArray(p, size))
+		return false;
+	p += size;
+	return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+ArchiveInput::ArchiveInput()
+	:reader(), from(0), to(0), type(), blocks(), nextblock(0), buf(), pos(NULL), end(NULL), scratch(), blocksread(0),
+	 replayed(0)
+{
+}
+
+bool ArchiveInput::open(const std::string &path, int64_t f, int64_t t, const std::string &ty)
+{
+	close();
+	if (!reader.open(path))
+		return false;
+	from = f;
+	to = t;
+	type = ty;
+	reader.findBlocks(from, to, type, blocks);
+	NOTICE("Replaying %lu of the %lu blocks of archive %s", (unsigned long)blocks.size(),
+	       (unsigned long)reader.blockCount(), path.c_str());
+	return true;
+}
+
+void ArchiveInput::close()
+{
+	reader.close();
+	blocks.clear();
+	nextblock = 0;
+	pos = end = NULL;
+	blocksread = 0;
+	replayed = 0;
+}
+
+size_t ArchiveInput::read(EventSink &sink, size_t max)
+{
+	size_t n = 0;
+	while ((n < max) && !done()) {
+		if (pos == end) {
+			size_t len = 0;
+			const char *b = reader.readBlock(blocks[nextblock++], buf, len);
+			blocksread++;
+			pos = b;
+			end = b ? b + len : NULL;
+			continue;
+		}
+		if (!ArchiveReader::nextEvent(pos, end, scratch)) {
+			WARN("Skipping the rest of damaged archive block %lu", (unsigned long)blocks[nextblock - 1]);
+			pos = end;
+			continue;
+		}
+		if (!scratch.has_timestamp_ns() || (scratch.timestamp_ns() < from) || (scratch.timestamp_ns() >= to) ||
+		    (!type.empty() && (scratch.type() != type)))
+			continue;
+		LogEvent *event = sink.newEvent();
+		event->Swap(&scratch);
+		sink.submit(event);
+		n++;
+		replayed++;
+	}
+	return n;
+}
+
+} // namespace sawmill
+
+/////////////////////////////////////////////////////////////////////////////
+
+#ifdef DEBUG_ARCHIVE_CPP
+
+#include "testcheck.h"
+
+#define DAY_EVENTS 864000 // One every 100ms
+#define DAY_START  1792368000000000000LL // 2026-10-19 00:00:00 UTC
+#define HOUR_NS    3600000000000LL
+
+using namespace sawmill;
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void makeEvent(LogEvent &event, int i, int64_t ts)
+{
+	char msg[160];
+	event.Clear();
+	snprintf(msg, sizeof(msg), "192.168.%d.%d - - \"GET /index.html?id=%d HTTP/1.1\" 200 %d",
+	         (i >> 8) & 255, i & 255, i, 1000 + i % 5000);
+	event.set_type((i % 10) ? "apache" : "syslog");
+	if (ts)
+		event.set_timestamp_ns(ts);
+	event.set_source("/var/log/apache2/access.log");
+	event.set_message(msg);
+	Field *f = event.add_field();
+	f->set_key("status");
+	f->set_value("200");
+}
+
+/**
+ * Counts the events and checks that they are in the range.
+ */
+class RangeSink : public EventSink
+{
+public:
+	RangeSink(int64_t f, int64_t t, const std::string &ty) :from(f), to(t), type(ty), events(0), outside(0) {}
+	LogEvent *newEvent() { return &event; }
+	void submit(LogEvent *e)
+	{
+		events++;
+		if ((e->timestamp_ns() < from) || (e->timestamp_ns() >= to) || (!type.empty() && (e->type() != type)))
+			outside++;
+	}
+
+	int64_t from, to;
+	std::string type;
+	size_t events;
+	size_t outside;
+	LogEvent event;
+};
+
+static size_t replay(const std::string &path, int64_t from, int64_t to, const std::string &type, size_t &blocksread,
+                     size_t &outside, double &ms)
+{
+	ArchiveInput input;
+	RangeSink sink(from, to, type);
+	uint64_t start = now_ns();
+	if (!input.open(path, from, to, type))
+		return 0;
+	while (!input.done())
+		input.read(sink, 512);
+	ms = (now_ns() - start) / 1e6;
+	blocksread = input.blocksRead();
+	outside = sink.outside;
+	return sink.events;
+}
+
+int main()
+{
+	int rc = 0;
+	char tmpl[] = "/tmp/archiveXXXXXX";
+	if (!mkdtemp(tmpl)) {
+		perror("mkdtemp");
+		return 1;
+	}
+	std::string dir = tmpl;
+	std::string path = dir + "/day.arc";
+	LogEvent event;
+	ArchiveBlock blk;
+
+	// A day of events, every 1000th without a timestamp
+	{
+		ArchiveWriter out;
+		rc |= check("Open", out.open(path));
+		uint64_t start = now_ns();
+		for (int i = 0; i < DAY_EVENTS; i++) {
+			makeEvent(event, i, (i % 1000 == 999) ? 0 : DAY_START + (int64_t)i * 100000000LL);
+			out.output(event);
+		}
+		out.close();
+		double secs = (now_ns() - start) / 1e9;
+		printf("Wrote %d events in %llu blocks, %.1f MB in %.3fs (%.0f events/s)\n", DAY_EVENTS,
+		       (unsigned long long)out.blockCount(), out.bytesWritten() / 1048576.0, secs, DAY_EVENTS / secs);
+	}
+
+	ArchiveReader reader;
+	rc |= check("Open reader", reader.open(path));
+	size_t untimed = 0, total = 0;
+	bool spans = true;
+	for (size_t i = 0; i < reader.blockCount(); i++) {
+		blk = reader.block(i);
+		untimed += blk.untimed;
+		total += blk.events;
+		spans = spans && (blk.maxtime - blk.mintime <= ARCHIVE_BLOCK_SPAN * 1000000000LL);
+	}
+	rc |= check("Index has all events", total == DAY_EVENTS);
+	rc |= check("Index counts the untimed events", untimed == DAY_EVENTS / 1000);
+	rc |= check("Blocks span at most the block span", spans);
+	size_t blockcount = reader.blockCount();
+
+	// One hour out of the day
+	size_t blocksread, outside;
+	double hourms, dayms;
+	int64_t from = DAY_START + 13 * HOUR_NS;
+	size_t hour = replay(path, from, from + HOUR_NS, "", blocksread, outside, hourms);
+	rc |= check("Hour replays its events", hour == 36000 - 36);
+	rc |= check("Hour replays nothing outside it", outside == 0);
+	rc |= check("Hour reads only its blocks", blocksread <= blockcount / 24 + 2);
+	printf("Hour: %lu events from %lu of %lu blocks in %.2fms\n", (unsigned long)hour, (unsigned long)blocksread,
+	       (unsigned long)blockcount, hourms);
+	size_t day = replay(path, INT64_MIN, INT64_MAX, "", blocksread, outside, dayms);
+	rc |= check("Day replays all timed events", day == DAY_EVENTS - DAY_EVENTS / 1000);
+	printf("Day: %lu events from %lu blocks in %.2fms, the hour took %.1f%% of that\n", (unsigned long)day,
+	       (unsigned long)blocksread, dayms, 100.0 * hourms / dayms);
+
+	size_t syslog = replay(path, from, from + HOUR_NS, "syslog", blocksread, outside, hourms);
+	rc |= check("Type filter", (syslog == 3600) && (outside == 0));
+	rc |= check("Unknown type reads no blocks", !replay(path, from, from + HOUR_NS, "nginx", blocksread, outside, hourms) &&
+	            (blocksread == 0));
+	rc |= check("Empty range", !replay(path, from, from, "", blocksread, outside, hourms) && (blocksread == 0));
+	rc |= check("Range before the day", !replay(path, 0, DAY_START, "", blocksread, outside, hourms) && (blocksread == 0));
+
+	// Continue the archive with late events of the hour
+	{
+		ArchiveWriter out;
+		rc |= check("Reopen", out.open(path) && (out.blockCount() == blockcount));
+		for (int i = 0; i < 10; i++) {
+			makeEvent(event, i + 1, from + HOUR_NS / 2 + i);
+			out.output(event);
+		}
+		out.close();
+	}
+	rc |= check("Late events are found", replay(path, from, from + HOUR_NS, "", blocksread, outside, hourms) == 36000 - 36 + 10);
+
+	// A block cut off at the end, as if the writer crashed
+	{
+		std::string datapath = path;
+		struct stat st;
+		stat(datapath.c_str(), &st);
+		rc |= check("Truncate data", truncate(datapath.c_str(), st.st_size - 10) == 0);
+		ArchiveReader partial;
+		rc |= check("Reader ignores the cut block", partial.open(path) && (partial.blockCount() == blockcount));
+		ArchiveWriter out;
+		rc |= check("Writer drops the cut block", out.open(path) && (out.blockCount() == blockcount));
+		out.close();
+	}
+	rc |= check("Back to the hour", replay(path, from, from + HOUR_NS, "", blocksread, outside, hourms) == 36000 - 36);
+
+	// Damaged data in a block
+	{
+		reader.close();
+		reader.open(path);
+		std::vector<size_t> found;
+		reader.findBlocks(from, from + HOUR_NS, "", found);
+		blk = reader.block(found[0]);
+		reader.close();
+		int fd = ::open(path.c_str(), O_WRONLY);
+		char junk = 0x55;
+		pwrite(fd, &junk, 1, blk.offset + blk.length / 2);
+		::close(fd);
+		size_t damaged = replay(path, from, from + HOUR_NS, "", blocksread, outside, hourms);
+		rc |= check("Damaged block is skipped", (damaged < 36000 - 36) && (damaged + blk.events >= 36000 - 36));
+	}
+
+	// Benchmark of the codecs
+	static const ArchiveCodec codecs[] = { ARCHIVE_RAW, ARCHIVE_ZLIB, ARCHIVE_LZ4, ARCHIVE_ZSTD };
+	for (size_t c = 0; c < sizeof(codecs) / sizeof(codecs[0]); c++) {
+		if (!ArchiveWriter::hasCodec(codecs[c]))
+			continue;
+		std::string p = dir + "/bench-" + ArchiveWriter::codecName(codecs[c]);
+		ArchiveWriter out;
+		out.setCodec(codecs[c]);
+		out.open(p);
+		uint64_t start = now_ns();
+		for (int i = 0; i < DAY_EVENTS; i++) {
+			makeEvent(event, i, DAY_START + (int64_t)i * 100000000LL);
+			out.output(event);
+		}
+		out.close();
+		double wsecs = (now_ns() - start) / 1e9;
+		size_t n = replay(p, INT64_MIN, INT64_MAX, "", blocksread, outside, dayms);
+		size_t h = replay(p, from, from + HOUR_NS, "", blocksread, outside, hourms);
+		printf("%-5s: %.1f MB, write %.0f events/s, replay day %.0f events/s, hour %lu events in %.2fms\n",
+		       ArchiveWriter::codecName(codecs[c]), out.bytesWritten() / 1048576.0, DAY_EVENTS / wsecs,
+		       n / (dayms / 1000), (unsigned long)h, hourms);
+		unlink(p.c_str());
+		unlink((p + ARCHIVE_INDEX_SUFFIX).c_str());
+	}
+
+	unlink(path.c_str());
+	unlink((path + ARCHIVE_INDEX_SUFFIX).c_str());
+	rmdir(dir.c_str());
+	printf("%s\n", rc ? "FAILED" : "All tests passed");
+	return rc;
+}
+
+#endif // DEBUG_ARCHIVE_CPP
@@ -0,0 +1,221 @@
+#ifndef __ARCHIVE_H
+# define __ARCHIVE_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "eventinput.h"
+#include "eventoutput.h"
+
+#define ARCHIVE_BLOCK_SIZE  (1024 * 1024) // Delimited events per block, before compression
+#define ARCHIVE_BLOCK_SPAN  60            // Seconds of timestamps in one block
+#define ARCHIVE_INDEX_MAGIC "SAWARCH1"
+#define ARCHIVE_INDEX_SUFFIX ".idx"
+
+namespace sawmill {
+
+enum ArchiveCodec {
+	ARCHIVE_RAW  = 0,
+	ARCHIVE_ZLIB = 1,
+	ARCHIVE_LZ4  = 2,
+	ARCHIVE_ZSTD = 3
+};
+
+/**
+ * Entry of the archive index, one per block. The index file is a 64 byte header (the magic, the
+ * version and the entry size) followed by these, in the byte order of the host.
+ */
+struct ArchiveBlock {
+	uint64_t offset;     // Of the block in the data file
+	uint32_t length;     // Stored (compressed) length
+	uint32_t rawlength;  // Length of the delimited events
+	uint32_t events;
+	uint32_t codec;      // ArchiveCodec
+	int64_t mintime;     // timestamp_ns range of the events that have one, INT64_MAX/INT64_MIN if none do
+	int64_t maxtime;
+	int64_t maxsofar;    // Highest maxtime of this block and all before it, goes up only
+	uint64_t types;      // Bloom filter of the event types
+	uint32_t checksum;   // crc32 of the stored data
+	uint32_t untimed;    // Events without timestamp_ns
+};
+
+/**
+ * Writes the events to a time indexed archive: a data file of blocks of length delimited
+ * (varint) LogEvent messages, each compressed on its own, and an index file next to it
+ * ('path' + ARCHIVE_INDEX_SUFFIX) with an ArchiveBlock per block.
+ *
+ * A block is finished when it is ARCHIVE_BLOCK_SIZE, when its timestamps span more than the block
+ * span, or at the flush interval. Its data is written before its index entry. Opening an existing
+ * archive continues it: index entries at the end whose block doesn't check out (an interrupted
+ * write) are dropped, and the data after the last good block is cut off.
+ */
+class ArchiveWriter : public EventOutput
+{
+public:
+	ArchiveWriter();
+	~ArchiveWriter();
+
+	/**
+	 * 'level' 0 is the default of the codec. Returns false if the codec is not compiled in.
+	 */
+	bool setCodec(ArchiveCodec codec, int level = 0);
+	void setBlockSize(size_t bytes) { blocksize = bytes; }
+	void setBlockSpan(long seconds) { blockspan = (int64_t)seconds * 1000000000LL; }
+	void setFlushInterval(long ms) { flushinterval = ms; }
+
+	bool open(const std::string &path);
+	/**
+	 * Write the last block and sync both files.
+	 */
+	void close();
+	bool isOpen() const { return datafd >= 0; }
+
+	uint64_t eventCount() const { return events; }
+	uint64_t blockCount() const { return blocks; }
+	uint64_t bytesWritten() const { return dataend; }
+
+	static bool hasCodec(ArchiveCodec codec);
+	static bool parseCodec(const std::string &name, ArchiveCodec &codec);
+	static const char *codecName(ArchiveCodec codec);
+
+	// EventOutput
+	void output(LogEvent &event);
+	long timeout() const;
+	void flush();
+private:
+	bool recover();
+	bool writeBlock();
+	void resetBlock();
+
+	ArchiveCodec codec;
+	int level;
+	size_t blocksize;
+	int64_t blockspan;
+	long flushinterval;
+
+	std::string path;
+	int datafd;
+	int indexfd;
+	uint64_t dataend;
+	uint64_t blocks;     // Entries in the index
+	int64_t maxsofar;
+
+	std::string raw;     // Delimited events of the block being filled
+	std::string packed;  // Compressed block
+	ArchiveBlock block;  // Index entry of the block being filled
+	uint64_t started_ms; // When the first event of the block came in
+
+	uint64_t events;
+
+	// Not copyable
+	ArchiveWriter(const ArchiveWriter &);
+	ArchiveWriter &operator=(const ArchiveWriter &);
+};
+
+/**
+ * Reads an archive written by ArchiveWriter. The index and the data are mapped, finding the
+ * blocks of a time range is a binary search on the index, and only the blocks that are read are
+ * touched (the data is mapped for random access, without read-ahead).
+ *
+ * Time ranges are timestamp_ns values, 'from' included and 'to' not. Events without timestamp_ns
+ * are never in a range.
+ */
+class ArchiveReader
+{
+public:
+	ArchiveReader();
+	~ArchiveReader();
+
+	bool open(const std::string &path);
+	void close();
+	bool isOpen() const { return index != NULL; }
+
+	size_t blockCount() const { return count; }
+	const ArchiveBlock &block(size_t i) const { return index[i]; }
+	/**
+	 * First block that can have events at or after 'from'.
+	 */
+	size_t firstBlock(int64_t from) const;
+	/**
+	 * Whether block 'i' can have events of 'type' in the range, an empty type for any type.
+	 */
+	bool blockMatches(size_t i, int64_t from, int64_t to, const std::string &type) const;
+	/**
+	 * Numbers of the blocks that can have events of 'type' in the range, in the order they were
+	 * written.
+	 */
+	void findBlocks(int64_t from, int64_t to, const std::string &type, std::vector<size_t> &found) const;
+	/**
+	 * The delimited events of block 'i': in the mapping for uncompressed blocks, else decompressed
+	 * into 'buf'. Returns NULL if the block is damaged.
+	 */
+	const char *readBlock(size_t i, std::string &buf, size_t &len) const;
+	/**
+	 * Parse the event at 'p' and move 'p' past it. Returns false at the end or on a damaged event.
+	 */
+	static bool nextEvent(const char *&p, const char *end, LogEvent &event);
+
+	/**
+	 * Types hash to two bits of ArchiveBlock::types.
+	 */
+	static uint64_t typeBits(const std::string &type);
+private:
+	std::string path;
+	const ArchiveBlock *index;
+	size_t count;
+	void *indexmap;
+	size_t indexsize;
+	const char *data;
+	size_t datasize;
+
+	// Not copyable
+	ArchiveReader(const ArchiveReader &);
+	ArchiveReader &operator=(const ArchiveReader &);
+};
+
+/**
+ * Replays the events of a time range (and optionally a type) from an archive, a block at a time.
+ */
+class ArchiveInput : public EventInput
+{
+public:
+	ArchiveInput();
+
+	bool open(const std::string &path, int64_t from, int64_t to, const std::string &type = std::string());
+	void close();
+	/**
+	 * All events of the range were submitted.
+	 */
+	bool done() const { return !reader.isOpen() || ((nextblock >= blocks.size()) && (pos == end)); }
+
+	uint64_t blocksRead() const { return blocksread; }
+	uint64_t eventsReplayed() const { return replayed; }
+	size_t blocksTotal() const { return reader.blockCount(); }
+
+	// EventInput
+	int fd() const { return -1; }
+	long timeout() const { return done() ? -1 : 0; }
+	size_t read(EventSink &sink, size_t max);
+private:
+	ArchiveReader reader;
+	int64_t from;
+	int64_t to;
+	std::string type;
+	std::vector<size_t> blocks;
+	size_t nextblock;
+	std::string buf;
+	const char *pos;
+	const char *end;
+	LogEvent scratch;
+
+	uint64_t blocksread;
+	uint64_t replayed;
+
+	// Not copyable
+	ArchiveInput(const ArchiveInput &);
+	ArchiveInput &operator=(const ArchiveInput &);
+};
+
+} // namespace sawmill
+
+#endif // ifndef __ARCHIVE_H
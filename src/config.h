@@ -19,4 +19,12 @@
 # define SM_DEFAULT_CONFIGFILE "/etc/sawmill/sawmill.conf"
 #endif
 
+#ifndef SM_DEFAULT_ENDPOINT
+# define SM_DEFAULT_ENDPOINT "ipc:///tmp/sawmill-dispatcher"
+#endif
+
+#ifndef SM_DEFAULT_STATEFILE
+# define SM_DEFAULT_STATEFILE "/var/lib/sawmill/positions"
+#endif
+
 #endif
@@ -33,7 +33,7 @@ namespace bio = boost::iostreams;
 namespace sawmill {
 
 ConfigManager::ConfigManager()
-	:configsources(), configfiles(), version(-1), current_md5(), loaded(false)
+	:configsources(), configfiles(), version(-1), current_md5(), loaded(false), filters()
 {
 }
 
@@ -75,7 +75,8 @@ void ConfigManager::reload()
 	// Also calculate hashes so we update our config version if it differs
 	unsigned char configmd5[MD5_DIGEST_LENGTH];
 	MD5_Init(&md5context);
-	boost::property_tree::ptree config;
+	FilterConfig filterconfig;
+	bool failed = false;
 
 	for (std::vector<std::string>::const_iterator it = configfiles.begin(); it != configfiles.end(); it++) {
 		std::cout << "Found configfile: " << *it << std::endl;
@@ -84,27 +85,27 @@ void ConfigManager::reload()
 		in.push(JSONFixerFilter(true, true));
 		in.push(bio::file_source(*it));
 
-		std::string line;
-		while (in) {
-			std::getline (in, line);
-			std::cout << line << std::endl;
-		}
-		continue;
-
-		// Todo: Load this configuration file
 		boost::property_tree::ptree pt;
-		std::cout << "Parsing json file..." << std::endl << std::flush;
-		boost::property_tree::read_json(in, pt);
-		std::cout << "Parsed json file" << std::endl << std::flush;
-		BOOST_FOREACH(boost::property_tree::ptree::value_type &v, pt.get_child(""))
-		{
-			//assert(v.first.empty()); // array elements have no names
-			std::cout << "ptree: " << v.first.data() << " = " << v.second.data() << std::endl;
+		try {
+			boost::property_tree::read_json(in, pt);
+		} catch (const boost::property_tree::json_parser_error &e) {
+			std::cout << "ERROR: Could not parse configfile " << *it << ": " << e.message() << " (line " << e.line() << ")" << std::endl;
+			failed = true;
+			continue;
+		}
+		if (!parseFilters(*it, pt, filterconfig)) {
+			failed = true;
+			continue;
 		}
 
 		this->addMD5(*it);
 	}
 	MD5_Final(configmd5, &md5context);
+
+	if (failed) {
+		std::cout << "ERROR: Configuration not loaded, keeping v" << this->version << std::endl;
+		return;
+	}
 	
 	// Compare and store the MD5
 	std::ostringstream md5hash;
@@ -119,12 +120,90 @@ void ConfigManager::reload()
 		this->version++;
 		this->current_md5 = md5hash.str();
 		loaded = true;
-		std::cout << "Loaded new configuration: v" << this->version << " (hash: " << this->current_md5 << " / file count: " << configfiles.size() <<  ")" <<  std::endl;
+
+		filterconfig.set_version(this->version);
+		filters.update(filterconfig);
+		std::cout << "Loaded new configuration: v" << this->version << " (hash: " << this->current_md5 << " / file count: " << configfiles.size() <<  " / filters: " << filterconfig.filter_size() << ")" <<  std::endl;
 	} else {
 		std::cout << "Configuration not changed: v" << this->version << " (hash: " << this->current_md5 << " / file count: " << configfiles.size() <<  ")" <<  std::endl;
 	}
 }
 
+bool ConfigManager::parseFilters(const std::string &fn, const boost::property_tree::ptree &pt, FilterConfig &config) const
+{
+	static const boost::property_tree::ptree empty;
+	boost::optional<const boost::property_tree::ptree &> filterlist = pt.get_child_optional("filters");
+	if (!filterlist)
+		return true;
+
+	BOOST_FOREACH(const boost::property_tree::ptree::value_type &f, *filterlist) {
+		std::vector<std::string> types;
+		readList(f.second.get_child("type", empty), types);
+		if (types.empty()) {
+			std::cout << "ERROR: " << fn << ": filter " << (config.filter_size() + 1) << " has no type" << std::endl;
+			return false;
+		}
+		boost::optional<const boost::property_tree::ptree &> steps = f.second.get_child_optional("steps");
+		if (!steps || steps->empty()) {
+			std::cout << "ERROR: " << fn << ": filter " << (config.filter_size() + 1) << " has no steps" << std::endl;
+			return false;
+		}
+
+		// A filter for more than one type is copied for each of them
+		for (std::vector<std::string>::const_iterator t = types.begin(); t != types.end(); ++t) {
+			Filter *filter = config.add_filter();
+			filter->set_filterid(config.filter_size());
+			filter->set_type(*t);
+
+			BOOST_FOREACH(const boost::property_tree::ptree::value_type &s, *steps) {
+				FilterStep *step = filter->add_step();
+				step->set_stepnumber(filter->step_size() - 1);
+				step->set_plugin(s.second.get("plugin", ""));
+				if (step->plugin().empty()) {
+					std::cout << "ERROR: " << fn << ": step " << step->stepnumber() << " of filter for type " << *t << " has no plugin" << std::endl;
+					return false;
+				}
+
+				std::vector<std::string> tags;
+				readList(s.second.get_child("requireTag", empty), tags);
+				for (std::vector<std::string>::const_iterator tag = tags.begin(); tag != tags.end(); ++tag) {
+					step->add_requiretag(*tag);
+				}
+				// An empty value only requires the field to be present
+				BOOST_FOREACH(const boost::property_tree::ptree::value_type &r, s.second.get_child("requireField", empty)) {
+					Field *field = step->add_requirefield();
+					field->set_key(r.first);
+					if (!r.second.data().empty())
+						field->set_value(r.second.data());
+				}
+				boost::optional<std::string> match = s.second.get_optional<std::string>("requireMatch");
+				if (match)
+					step->set_requirematch(*match);
+				BOOST_FOREACH(const boost::property_tree::ptree::value_type &p, s.second.get_child("parameters", empty)) {
+					Field *field = step->add_parameter();
+					field->set_key(p.first);
+					field->set_value(p.second.data());
+				}
+			}
+		}
+	}
+	return true;
+}
+
+void ConfigManager::readList(const boost::property_tree::ptree &pt, std::vector<std::string> &list)
+{
+	// Either a single string or an array of them
+	if (pt.empty()) {
+		if (!pt.data().empty())
+			list.push_back(pt.data());
+		return;
+	}
+	BOOST_FOREACH(const boost::property_tree::ptree::value_type &v, pt) {
+		if (!v.second.data().empty())
+			list.push_back(v.second.data());
+	}
+}
+
 void ConfigManager::addMD5(const std::string &fn)
 {
 	// Use memory mapped files for calculating MD5sum, should be faster :)
@@ -218,6 +297,11 @@ unsigned int ConfigManager::getVersion() const
 	return this->version;
 }
 
+const FilterConfigStore &ConfigManager::getFilters() const
+{
+	return this->filters;
+}
+
 
 void ConfigManager::escapeRegex(std::string &regex) const
 {
@@ -237,3 +321,81 @@ void ConfigManager::escapeRegex(std::string &regex) const
 }
 
 }
+
+#ifdef DEBUG_CONFIGMANAGER_CPP
+
+#include <cstdio>
+#include <fstream>
+#include "filterengine.h"
+
+#define SAMPLE_FILTERS "samples/filters.json" // Run from the top of the tree
+
+using namespace sawmill;
+
+int main(int argc, char **argv)
+{
+	std::string path = "/tmp/configmanager_test.json";
+	ConfigManager config;
+	config.addConfigSource((argc > 1) ? std::string(argv[1]) : path);
+	if (argc <= 1) {
+		std::ofstream out(path.c_str());
+		out << "{\n\t// comment\n\t\"filters\": [ { \"type\": [ \"a\", \"b\" ], \"steps\": [\n"
+		       "\t\t{ \"plugin\": \"addtag\", \"requireTag\": \"x\", \"requireField\": { \"k\": \"\", \"l\": \"v\" },\n"
+		       "\t\t  \"requireMatch\": \"^f\", \"parameters\": { \"tag\": \"t\" } },\n"
+		       "\t\t{ \"plugin\": \"drop\" } ] } ]\n}\n";
+	}
+	config.reload();
+	FilterConfig filters;
+	config.getFilters().toConfig(filters);
+	std::cout << filters.DebugString();
+	if (argc > 1)
+		return 0;
+
+	bool ok = (filters.version() == 0) && (filters.filter_size() == 2) && (filters.filter(1).filterid() == 2) &&
+	          (filters.filter(1).type() == "b") && (filters.filter(0).step_size() == 2) &&
+	          (filters.filter(0).step(1).stepnumber() == 1) && (filters.filter(0).step(0).requiretag(0) == "x") &&
+	          (filters.filter(0).step(0).requirefield_size() == 2) && !filters.filter(0).step(0).requirefield(0).has_value() &&
+	          (filters.filter(0).step(0).requirefield(1).value() == "v") && (filters.filter(0).step(0).requirematch() == "^f") &&
+	          (filters.filter(0).step(0).parameter(0).key() == "tag");
+
+	// A broken file keeps the loaded config
+	std::ofstream(path.c_str()) << "{ \"filters\": [ { \"type\": \"a\" } ] }\n";
+	config.reload();
+	ok = ok && (config.getFilters().getVersion() == 0) && (config.getFilters().getFilters().size() == 2);
+	std::ofstream(path.c_str()) << "{ \"filters\": [ \n";
+	config.reload();
+	ok = ok && (config.getFilters().getVersion() == 0);
+	std::ofstream(path.c_str()) << "{ \"filters\": [ { \"type\": \"a\", \"steps\": [ { \"plugin\": \"drop\" } ] } ] }\n";
+	config.reload();
+	ok = ok && (config.getFilters().getVersion() == 1) && (config.getFilters().getFilters().size() == 1);
+	remove(path.c_str());
+
+	// The sample configuration compiles, and its steps run
+	ConfigManager sample;
+	sample.addConfigSource(SAMPLE_FILTERS);
+	sample.reload();
+	FilterEngine engine;
+	bool loaded = sample.isLoaded() && (sample.getFilters().getFilters().size() == 3) && engine.load(sample.getFilters());
+	FilterEngine::EventList events;
+	LogEvent *event = events.Add();
+	event->set_type("auth");
+	event->set_message("Oct 19 12:00:00 host sshd[42]: Accepted publickey for bart");
+	event = events.Add();
+	event->set_type("apache");
+	event->set_message("a=1&b=2");
+	std::vector<StepResult> results;
+	engine.process(events, results);
+	const LogEvent &auth = events.Get(0);
+	bool parsed = loaded && (auth.tag_size() == 1) && (auth.tag(0) == "parsed") && (events.Get(1).field_size() == 2);
+	for (int i = 0; i < auth.field_size(); i++) {
+		if (auth.field(i).key() == "program")
+			parsed = parsed && (auth.field(i).value() == "sshd[42]");
+	}
+	std::cout << SAMPLE_FILTERS << ": " << (parsed ? "OK" : "FAILED") << std::endl;
+	ok = ok && parsed;
+
+	std::cout << (ok ? "OK" : "FAILED") << std::endl;
+	return ok ? 0 : 1;
+}
+
+#endif // DEBUG_CONFIGMANAGER_CPP
@@ -4,6 +4,8 @@
 #include <string>
 #include <vector>
 #include <openssl/md5.h>
+#include <boost/property_tree/ptree.hpp>
+#include "filterconfig.h"
 
 namespace sawmill {
 
@@ -17,17 +19,26 @@ class ConfigManager
 		int  sourceCount();
 		
 		/**
-		 * (re)load the configuration
+		 * (re)load the configuration. The config files are JSON (comments allowed) with a list of
+		 * filters, see samples/filters.json:
+		 *   "filters": [ { "type": "syslog" or [ ... ], "steps": [ { "plugin": "...",
+		 *       "requireTag": "..." or [ ... ], "requireField": { "key": "value", ... },
+		 *       "requireMatch": "regex", "parameters": { "key": "value", ... } }, ... ] }, ... ]
+		 * The filters get their ID's in the order of the files and the filters in them. When a
+		 * file has errors, the previous configuration is kept.
 		 */
 		void reload();
 		bool isLoaded();
 		void check();
 
 		unsigned int getVersion() const;
+		const FilterConfigStore &getFilters() const;
 		
 		void escapeRegex(std::string &regex) const;
 	protected:
 	private:
+		bool parseFilters(const std::string &fn, const boost::property_tree::ptree &pt, FilterConfig &config) const;
+		static void readList(const boost::property_tree::ptree &pt, std::vector<std::string> &list);
 		void addMD5(const std::string &fn);
 		void findConfigFiles();
 		void findConfigFiles(const std::string &source);
@@ -38,6 +49,7 @@ class ConfigManager
 		MD5_CTX md5context;
 		std::string current_md5;
 		bool loaded;
+		FilterConfigStore filters;
 };
 
 }
@@ -0,0 +1,859 @@
+/****************************************************************************
+ * Project: SawMill
+ * Authors:
+ *          Bart Meuris <bart . meuris @ gmail . com>
+ *
+ * License: (to be discussed LGPL version 2.0?)
+ ****************************************************************************
+ * Module description:
+ *     Disk queue: segmented, memory mapped queue of events on disk.
+ *
+ ***************************************************************************/
+
+#include "diskqueue.h"
+#include "sawlog.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SEGMENT_HEADER    64         // Bytes before the first record of a segment
+#define SEGMENT_VERSION   1
+#define RECORD_HEADER     8          // Length and checksum
+#define RECORD_SKIP       0xFFFFFFFFU // Length of the record after the last one of a segment
+#define OFFSETS_SEED      0x5157444F46465345ULL
+#define QUEUE_MAX_SPARES  2          // Recycled segments kept for reuse
+
+#define QUEUE_BATCH_EVENTS 512       // Events per queued batch...
+#define QUEUE_BATCH_BYTES  (1024 * 1024) // ...or about this many bytes of messages
+#define QUEUE_READ_MAX     65536     // Events taken from the input per read()
+#define QUEUE_COMMIT_MS    10        // Commits are at most this far apart...
+#define QUEUE_COMMIT_BYTES (16 * 1024 * 1024) // ...or this many appended bytes
+
+namespace sawmill {
+
+static const char segmentmagic[8] = { 'S', 'A', 'W', 'M', 'I', 'L', 'L', 'Q' };
+
+struct SegmentHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+	uint64_t seq;
+	uint64_t size;
+};
+
+static inline uint32_t posSegment(uint64_t pos) { return (uint32_t)(pos >> 32); }
+static inline size_t posOffset(uint64_t pos) { return (size_t)(pos & 0xFFFFFFFFU); }
+static inline uint64_t makePos(uint64_t seq, size_t offset) { return (seq << 32) | offset; }
+static inline size_t align8(size_t len) { return (len + 7) & ~(size_t)7; }
+
+/**
+ * Multiply-xorshift hash over 8 byte words. Seeded with the position of the record, so records
+ * left over in a recycled segment don't check out.
+ */
+static uint32_t checksum(const char *data, size_t len, uint64_t seed)
+{
+	uint64_t h = seed ^ (len * 0x9E3779B97F4A7C15ULL);
+	size_t i = 0;
+	for (; i + 8 <= len; i += 8) {
+		uint64_t w;
+		memcpy(&w, data + i, 8);
+		h = (h ^ w) * 0xFF51AFD7ED558CCDULL;
+		h ^= h >> 32;
+	}
+	uint64_t w = 0;
+	memcpy(&w, data + i, len - i);
+	h = (h ^ w) * 0xC4CEB9FE1A85EC53ULL;
+	h ^= h >> 29;
+	return (uint32_t)(h ^ (h >> 32));
+}
+
+static uint64_t clock_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+DiskQueue::DiskQueue()
+	:dir(), segmentsize(DISKQUEUE_SEGMENT_SIZE), segments(), mapped(), spares(0), offsetsfd(-1), offsetslot(1),
+	 writepos(0), commitpos(0), readpos(0), ackpos(0), committedack(0)
+{
+}
+
+DiskQueue::~DiskQueue()
+{
+	close();
+}
+
+bool DiskQueue::open(const std::string &path, size_t size)
+{
+	close();
+	if ((size < SEGMENT_HEADER * 2) || (size > 0xFFFFFFFFU)) {
+		ERR("Invalid disk queue segment size %lu", (unsigned long)size);
+		return false;
+	}
+	segmentsize = size & ~(size_t)7;
+	if ((mkdir(path.c_str(), 0755) < 0) && (errno != EEXIST)) {
+		ERR("Could not create disk queue directory %s: %s", path.c_str(), strerror(errno));
+		return false;
+	}
+	DIR *d = opendir(path.c_str());
+	if (!d) {
+		ERR("Could not open disk queue directory %s: %s", path.c_str(), strerror(errno));
+		return false;
+	}
+	dir = path;
+	struct dirent *entry;
+	while ((entry = readdir(d)) != NULL) {
+		const char *name = entry->d_name;
+		char *end = NULL;
+		unsigned long long seq = strtoull(name, &end, 16);
+		if ((end == name + 16) && (strcmp(end, ".seg") == 0))
+			segments.push_back(seq);
+	}
+	closedir(d);
+	std::sort(segments.begin(), segments.end());
+
+	// Keep the spares numbered from 0
+	for (int i = 0; i < QUEUE_MAX_SPARES; i++) {
+		if (access(sparePath(i).c_str(), F_OK) < 0)
+			continue;
+		if (i != spares)
+			rename(sparePath(i).c_str(), sparePath(spares).c_str());
+		spares++;
+	}
+
+	std::string offsets = dir + "/consumer";
+	offsetsfd = ::open(offsets.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (offsetsfd < 0) {
+		ERR("Could not open %s: %s", offsets.c_str(), strerror(errno));
+		close();
+		return false;
+	}
+	loadOffsets();
+	if (!recover()) {
+		close();
+		return false;
+	}
+	DBG("Disk queue %s: %d segments, %llu bytes to read", dir.c_str(), (int)segments.size(), (unsigned long long)backlog());
+	return true;
+}
+
+uint64_t DiskQueue::backlog() const
+{
+	uint64_t readseq = posSegment(readpos);
+	uint64_t writeseq = posSegment(writepos);
+	if (readseq == writeseq)
+		return writepos - readpos;
+	// The segments in between are about full
+	return (segmentsize - posOffset(readpos)) + (writeseq - readseq - 1) * segmentsize + posOffset(writepos);
+}
+
+void DiskQueue::close()
+{
+	if (dir.empty())
+		return;
+	if (!segments.empty())
+		commit();
+	for (std::map<uint64_t, Segment>::iterator it = mapped.begin(); it != mapped.end(); ++it) {
+		munmap(it->second.map, it->second.size);
+		::close(it->second.fd);
+	}
+	mapped.clear();
+	segments.clear();
+	if (offsetsfd >= 0)
+		::close(offsetsfd);
+	offsetsfd = -1;
+	spares = 0;
+	dir.clear();
+}
+
+bool DiskQueue::loadOffsets()
+{
+	uint64_t slots[4];
+	ackpos = 0;
+	offsetslot = 1; // The first save goes to slot 0
+	ssize_t len = pread(offsetsfd, slots, sizeof(slots), 0);
+	bool found = false;
+	for (int i = 0; (i < 2) && (len >= (ssize_t)((i + 1) * 2 * sizeof(uint64_t))); i++) {
+		uint64_t pos = slots[i * 2];
+		if (checksum(reinterpret_cast<const char *>(&pos), sizeof(pos), OFFSETS_SEED) != slots[i * 2 + 1])
+			continue;
+		if (!found || (pos > ackpos)) {
+			ackpos = pos;
+			offsetslot = i;
+			found = true;
+		}
+	}
+	return found;
+}
+
+bool DiskQueue::saveOffsets()
+{
+	// Two slots written in turn, a torn write leaves the other one
+	int slot = offsetslot ^ 1;
+	uint64_t rec[2] = { ackpos, checksum(reinterpret_cast<const char *>(&ackpos), sizeof(ackpos), OFFSETS_SEED) };
+	if ((pwrite(offsetsfd, rec, sizeof(rec), slot * sizeof(rec)) != (ssize_t)sizeof(rec)) || (fdatasync(offsetsfd) < 0)) {
+		ERR("Could not save the disk queue offsets in %s: %s", dir.c_str(), strerror(errno));
+		return false;
+	}
+	offsetslot = slot;
+	committedack = ackpos;
+	return true;
+}
+
+bool DiskQueue::recover()
+{
+	if (segments.empty()) {
+		if (!newSegment())
+			return false;
+	} else {
+		uint64_t seq = segments.back();
+		Segment *seg = segment(seq);
+		if (!seg)
+			return false;
+		SegmentHeader *header = reinterpret_cast<SegmentHeader *>(seg->map);
+		if ((memcmp(header->magic, segmentmagic, sizeof(segmentmagic)) != 0) || (header->seq != seq)) {
+			// Crashed while starting it
+			memcpy(header->magic, segmentmagic, sizeof(segmentmagic));
+			header->version = SEGMENT_VERSION;
+			header->reserved = 0;
+			header->seq = seq;
+			header->size = seg->size;
+		}
+		// The written records are those up to the first one that doesn't check out
+		size_t off = SEGMENT_HEADER;
+		while (off + RECORD_HEADER <= seg->size) {
+			uint32_t hdr[2];
+			memcpy(hdr, seg->map + off, sizeof(hdr));
+			if ((hdr[0] == 0) || (hdr[0] == RECORD_SKIP) || (off + RECORD_HEADER + hdr[0] > seg->size))
+				break;
+			if (checksum(seg->map + off + RECORD_HEADER, hdr[0], makePos(seq, off)) != hdr[1])
+				break;
+			off += RECORD_HEADER + align8(hdr[0]);
+		}
+		writepos = makePos(seq, off);
+		commitpos = makePos(seq, 0);
+	}
+
+	uint64_t first = makePos(segments.front(), SEGMENT_HEADER);
+	if (ackpos < first)
+		ackpos = first;
+	if (ackpos > writepos) {
+		WARN("Disk queue %s: consumer offset is past the end of the data, starting at the end", dir.c_str());
+		ackpos = writepos;
+	}
+	readpos = ackpos;
+	committedack = ackpos;
+	while ((segments.size() > 1) && (segments.front() < posSegment(ackpos))) {
+		recycle(segments.front());
+		segments.pop_front();
+	}
+	return true;
+}
+
+std::string DiskQueue::segmentPath(uint64_t seq) const
+{
+	char name[32];
+	snprintf(name, sizeof(name), "/%016llx.seg", (unsigned long long)seq);
+	return dir + name;
+}
+
+std::string DiskQueue::sparePath(int index) const
+{
+	char name[32];
+	snprintf(name, sizeof(name), "/spare.%d", index);
+	return dir + name;
+}
+
+DiskQueue::Segment *DiskQueue::segment(uint64_t seq)
+{
+	std::map<uint64_t, Segment>::iterator it = mapped.find(seq);
+	if (it != mapped.end())
+		return &it->second;
+
+	std::string path = segmentPath(seq);
+	int fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+	struct stat st;
+	if ((fd < 0) || (fstat(fd, &st) < 0)) {
+		ERR("Could not open disk queue segment %s: %s", path.c_str(), strerror(errno));
+		if (fd >= 0)
+			::close(fd);
+		return NULL;
+	}
+	size_t size = std::min((size_t)st.st_size, (size_t)0xFFFFFFFFU);
+	void *map = (size >= SEGMENT_HEADER) ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+	if (map == MAP_FAILED) {
+		ERR("Could not map disk queue segment %s: %s", path.c_str(), strerror(errno));
+		::close(fd);
+		return NULL;
+	}
+	Segment &seg = mapped[seq];
+	seg.fd = fd;
+	seg.map = static_cast<char *>(map);
+	seg.size = size;
+	return &seg;
+}
+
+void DiskQueue::release(uint64_t seq)
+{
+	if ((seq == posSegment(readpos)) || (seq == posSegment(writepos)))
+		return;
+	std::map<uint64_t, Segment>::iterator it = mapped.find(seq);
+	if (it == mapped.end())
+		return;
+	munmap(it->second.map, it->second.size);
+	::close(it->second.fd);
+	mapped.erase(it);
+}
+
+void DiskQueue::recycle(uint64_t seq)
+{
+	std::map<uint64_t, Segment>::iterator it = mapped.find(seq);
+	if (it != mapped.end()) {
+		munmap(it->second.map, it->second.size);
+		::close(it->second.fd);
+		mapped.erase(it);
+	}
+	std::string path = segmentPath(seq);
+	if ((spares < QUEUE_MAX_SPARES) && (rename(path.c_str(), sparePath(spares).c_str()) == 0)) {
+		spares++;
+		return;
+	}
+	unlink(path.c_str());
+}
+
+bool DiskQueue::sync(Segment *seg, size_t from, size_t to)
+{
+	static const size_t pagesize = sysconf(_SC_PAGESIZE);
+	from &= ~(pagesize - 1);
+	if ((to > from) && (msync(seg->map + from, to - from, MS_SYNC) < 0)) {
+		ERR("Could not sync the disk queue in %s: %s", dir.c_str(), strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+bool DiskQueue::newSegment()
+{
+	uint64_t seq = segments.empty() ? posSegment(ackpos) + 1 : segments.back() + 1;
+	std::string path = segmentPath(seq);
+	int fd = -1;
+	if (spares > 0) {
+		spares--;
+		if (rename(sparePath(spares).c_str(), path.c_str()) == 0)
+			fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+	}
+	if (fd < 0)
+		fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		ERR("Could not create disk queue segment %s: %s", path.c_str(), strerror(errno));
+		return false;
+	}
+	struct stat st;
+	int rc = 0;
+	if ((fstat(fd, &st) < 0) || ((size_t)st.st_size != segmentsize)) {
+		// Allocate it all now, writes to a mapping can't report a full disk
+		if (ftruncate(fd, 0) < 0)
+			rc = errno;
+		else
+			rc = posix_fallocate(fd, 0, segmentsize);
+	}
+	::close(fd);
+	if (rc != 0) {
+		ERR("Could not allocate disk queue segment %s: %s", path.c_str(), strerror(rc));
+		unlink(path.c_str());
+		return false;
+	}
+	int dirfd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dirfd >= 0) {
+		fsync(dirfd);
+		::close(dirfd);
+	}
+
+	// Everything in the previous segment has to be on disk before its records are left behind
+	bool first = segments.empty();
+	uint64_t oldseq = posSegment(writepos);
+	if (!first) {
+		Segment *old = segment(oldseq);
+		if (old)
+			sync(old, posOffset(commitpos), posOffset(writepos));
+	}
+	segments.push_back(seq);
+	Segment *seg = segment(seq);
+	if (!seg) {
+		segments.pop_back();
+		unlink(path.c_str());
+		return false;
+	}
+	SegmentHeader *header = reinterpret_cast<SegmentHeader *>(seg->map);
+	memcpy(header->magic, segmentmagic, sizeof(segmentmagic));
+	header->version = SEGMENT_VERSION;
+	header->reserved = 0;
+	header->seq = seq;
+	header->size = seg->size;
+	writepos = makePos(seq, SEGMENT_HEADER);
+	commitpos = makePos(seq, 0);
+	if (!first)
+		release(oldseq);
+	return true;
+}
+
+bool DiskQueue::append(const google::protobuf::MessageLite &msg)
+{
+	size_t len = msg.ByteSizeLong();
+	if (len == 0)
+		return true;
+	size_t need = RECORD_HEADER + align8(len);
+	if (need > segmentsize - SEGMENT_HEADER) {
+		ERR("Message of %lu bytes does not fit in a disk queue segment", (unsigned long)len);
+		return false;
+	}
+	Segment *seg = segment(posSegment(writepos));
+	if (!seg)
+		return false;
+	size_t off = posOffset(writepos);
+	if (off + need > seg->size) {
+		if (off + RECORD_HEADER <= seg->size) {
+			uint32_t skip[2] = { RECORD_SKIP, 0 };
+			memcpy(seg->map + off, skip, sizeof(skip));
+			writepos += RECORD_HEADER;
+		}
+		if (!newSegment())
+			return false;
+		seg = segment(posSegment(writepos));
+		off = SEGMENT_HEADER;
+	}
+	char *rec = seg->map + off;
+	msg.SerializeWithCachedSizesToArray(reinterpret_cast<google::protobuf::uint8 *>(rec + RECORD_HEADER));
+	uint32_t hdr[2] = { (uint32_t)len, checksum(rec + RECORD_HEADER, len, writepos) };
+	memcpy(rec, hdr, sizeof(hdr));
+	writepos += need;
+	return true;
+}
+
+bool DiskQueue::read(google::protobuf::MessageLite &msg)
+{
+	while (readpos != writepos) {
+		uint64_t seq = posSegment(readpos);
+		size_t off = posOffset(readpos);
+		Segment *seg = segment(seq);
+		uint32_t hdr[2] = { RECORD_SKIP, 0 };
+		if (seg && (off + RECORD_HEADER <= seg->size))
+			memcpy(hdr, seg->map + off, sizeof(hdr));
+		bool next = (hdr[0] == RECORD_SKIP) || (hdr[0] == 0);
+		if (!next && ((off + RECORD_HEADER + hdr[0] > seg->size) ||
+		              (checksum(seg->map + off + RECORD_HEADER, hdr[0], readpos) != hdr[1]))) {
+			WARN("Damaged record in disk queue segment %s, skipping the rest of it", segmentPath(seq).c_str());
+			next = true;
+		}
+		if (next) {
+			std::deque<uint64_t>::iterator it = std::upper_bound(segments.begin(), segments.end(), seq);
+			readpos = (it == segments.end()) ? writepos : makePos(*it, SEGMENT_HEADER);
+			release(seq);
+			continue;
+		}
+		readpos += RECORD_HEADER + align8(hdr[0]);
+		if (msg.ParseFromArray(seg->map + off + RECORD_HEADER, hdr[0]))
+			return true;
+		WARN("Could not parse a message in disk queue segment %s", segmentPath(seq).c_str());
+	}
+	return false;
+}
+
+void DiskQueue::ack(uint64_t position)
+{
+	position = std::min(position, readpos);
+	if (position <= ackpos)
+		return;
+	ackpos = position;
+	while ((segments.size() > 1) && (segments.front() < posSegment(ackpos))) {
+		recycle(segments.front());
+		segments.pop_front();
+	}
+}
+
+bool DiskQueue::commit()
+{
+	bool ok = true;
+	if (writepos != commitpos) {
+		Segment *seg = segment(posSegment(writepos));
+		ok = seg && sync(seg, posOffset(commitpos), posOffset(writepos));
+		commitpos = writepos;
+	}
+	if (ackpos != committedack)
+		ok = saveOffsets() && ok;
+	return ok;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+QueuedInput::QueuedInput(EventInput *in)
+	:input(in), diskqueue(), staged(), stagedbytes(0), current(), currentpos(0), acks(), nextcommit_ms(0)
+{
+}
+
+QueuedInput::~QueuedInput()
+{
+}
+
+bool QueuedInput::open(const std::string &dir, size_t segmentsize)
+{
+	return diskqueue.open(dir, segmentsize);
+}
+
+void QueuedInput::close()
+{
+	appendStaged();
+	diskqueue.close();
+}
+
+long QueuedInput::timeout() const
+{
+	if ((currentpos < current.event_size()) || !diskqueue.empty() || staged.event_size())
+		return 0;
+	long t = input->timeout();
+	if (!diskqueue.needsCommit() && acks.empty())
+		return t;
+	uint64_t now = clock_ms();
+	long commit = (nextcommit_ms > now) ? (long)(nextcommit_ms - now) : 0;
+	return ((t < 0) || (commit < t)) ? commit : t;
+}
+
+size_t QueuedInput::read(EventSink &sink, size_t max)
+{
+	// Take in all there is, also when the sink is full
+	input->read(*this, QUEUE_READ_MAX);
+	appendStaged();
+
+	size_t count = 0;
+	while (count < max) {
+		if (currentpos >= current.event_size()) {
+			if (!diskqueue.read(current))
+				break;
+			currentpos = 0;
+			continue;
+		}
+		LogEvent *event = sink.newEvent();
+		event->Swap(current.mutable_event(currentpos++));
+		sink.submit(event);
+		count++;
+		if (currentpos == current.event_size())
+			acks.push_back(std::make_pair(sink.submitted(), diskqueue.readPosition()));
+	}
+
+	// Batches are done with when the sink is done with their last event and all before it
+	uint64_t oldest = sink.oldestPending();
+	bool acked = false;
+	uint64_t pos = 0;
+	while (!acks.empty() && (acks.front().first <= oldest)) {
+		pos = acks.front().second;
+		acks.pop_front();
+		acked = true;
+	}
+	if (acked)
+		diskqueue.ack(pos);
+
+	uint64_t now = clock_ms();
+	if (diskqueue.needsCommit() && ((now >= nextcommit_ms) || (diskqueue.uncommitted() >= QUEUE_COMMIT_BYTES))) {
+		diskqueue.commit();
+		nextcommit_ms = now + QUEUE_COMMIT_MS;
+	}
+	return count;
+}
+
+LogEvent *QueuedInput::newEvent()
+{
+	return staged.add_event();
+}
+
+void QueuedInput::submit(LogEvent *event)
+{
+	stagedbytes += event->message().size() + event->source().size();
+	if ((staged.event_size() >= QUEUE_BATCH_EVENTS) || (stagedbytes >= QUEUE_BATCH_BYTES))
+		appendStaged();
+}
+
+void QueuedInput::appendStaged()
+{
+	if (!staged.event_size())
+		return;
+	if (!diskqueue.append(staged))
+		ERR("Dropped %d events that could not be queued", staged.event_size());
+	// Clear() keeps the events for the next batch
+	staged.Clear();
+	stagedbytes = 0;
+}
+
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Test and benchmark
+/////////////////////////////////////////////////////////////////////////////
+
+#ifdef DEBUG_DISKQUEUE_CPP
+
+#include <string>
+#include <vector>
+#include <sys/wait.h>
+#include "eventbatch.h"
+#include "testcheck.h"
+
+#define BENCH_BYTES   (512ULL * 1024 * 1024)
+#define BENCH_CHUNK   (1024 * 1024)
+#define BENCH_SEGMENT (64 * 1024 * 1024)
+
+using namespace sawmill;
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void removeDir(const std::string &dir)
+{
+	DIR *d = opendir(dir.c_str());
+	struct dirent *entry;
+	while (d && ((entry = readdir(d)) != NULL)) {
+		if (entry->d_name[0] != '.')
+			unlink((dir + "/" + entry->d_name).c_str());
+	}
+	if (d)
+		closedir(d);
+	rmdir(dir.c_str());
+}
+
+static void makeBatch(LogEventBatch &batch, int first, int count)
+{
+	batch.Clear();
+	char msg[160];
+	for (int i = 0; i < count; i++) {
+		LogEvent *event = batch.add_event();
+		snprintf(msg, sizeof(msg), "Oct 19 12:00:00 host app[123]: event %d with some text to make it a realistic log line", first + i);
+		event->set_source("/var/log/app.log");
+		event->set_message(msg);
+	}
+}
+
+static int eventNumber(const LogEvent &event)
+{
+	size_t p = event.message().find("event ");
+	return (p == std::string::npos) ? -1 : atoi(event.message().c_str() + p + 6);
+}
+
+/**
+ * Plays the dispatcher: takes everything, done with an event when told so.
+ */
+class CountSink : public EventSink
+{
+public:
+	CountSink() :pool(), next(0), done(0), numbers() {}
+	LogEvent *newEvent() { return pool.get(); }
+	void submit(LogEvent *event) { numbers.push_back(eventNumber(*event)); pool.put(event); next++; }
+	uint64_t submitted() const { return next; }
+	uint64_t oldestPending() const { return done; }
+	EventPool pool;
+	uint64_t next;
+	uint64_t done;
+	std::vector<int> numbers;
+};
+
+class BatchInput : public EventInput
+{
+public:
+	BatchInput() :batch(), pos(0) {}
+	int fd() const { return -1; }
+	long timeout() const { return (pos < batch.event_size()) ? 0 : -1; }
+	size_t read(EventSink &sink, size_t max)
+	{
+		size_t count = 0;
+		for (; (pos < batch.event_size()) && (count < max); pos++, count++) {
+			LogEvent *event = sink.newEvent();
+			event->CopyFrom(batch.event(pos));
+			sink.submit(event);
+		}
+		return count;
+	}
+	LogEventBatch batch;
+	int pos;
+};
+
+int main()
+{
+	int rc = 0;
+	char tmpl[] = "/tmp/diskqueueXXXXXX";
+	if (!mkdtemp(tmpl)) {
+		perror("mkdtemp");
+		return 1;
+	}
+	std::string base = tmpl;
+
+	// Raw sequential write bandwidth, for comparison
+	{
+		std::string path = base + "/raw";
+		int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		std::vector<char> chunk(BENCH_CHUNK, 'x');
+		uint64_t begin = now_ns();
+		for (uint64_t done = 0; done < BENCH_BYTES; done += BENCH_CHUNK) {
+			if (pwrite(fd, &chunk[0], BENCH_CHUNK, done) != BENCH_CHUNK)
+				break;
+			if ((done + BENCH_CHUNK) % (16 * BENCH_CHUNK) == 0)
+				fdatasync(fd);
+		}
+		fdatasync(fd);
+		uint64_t elapsed = now_ns() - begin;
+		::close(fd);
+		unlink(path.c_str());
+		printf("Raw pwrite + fdatasync: %.0f MB/s\n", BENCH_BYTES * 1e3 / elapsed);
+	}
+
+	// Queue append throughput
+	std::string dir = base + "/bench";
+	{
+		DiskQueue queue;
+		rc |= check("Open a new queue", queue.open(dir, BENCH_SEGMENT));
+		LogEventBatch batch;
+		makeBatch(batch, 0, 512);
+		size_t batchbytes = batch.ByteSizeLong();
+		size_t batches = BENCH_BYTES / batchbytes;
+		uint64_t begin = now_ns();
+		bool ok = true;
+		for (size_t i = 0; i < batches; i++) {
+			ok = queue.append(batch) && ok;
+			if (queue.uncommitted() >= 16 * 1024 * 1024)
+				ok = queue.commit() && ok;
+		}
+		ok = queue.commit() && ok;
+		uint64_t elapsed = now_ns() - begin;
+		printf("Disk queue append + commit: %.0f MB/s, %.0f events/s, %d segments\n", batches * batchbytes * 1e3 / elapsed,
+		       batches * 512 * 1e9 / elapsed, (int)queue.segmentCount());
+		rc |= check("Append", ok);
+
+		// Read it all back, acknowledging as we go
+		size_t count = 0;
+		LogEventBatch in;
+		begin = now_ns();
+		while (queue.read(in)) {
+			count++;
+			queue.ack(queue.readPosition());
+		}
+		queue.commit();
+		elapsed = now_ns() - begin;
+		printf("Disk queue read: %.0f MB/s\n", count * batchbytes * 1e3 / elapsed);
+		rc |= check("Read back every batch", (count == batches) && (in.event_size() == 512) && (eventNumber(in.event(511)) == 511));
+		rc |= check("Acknowledged segments recycled", queue.segmentCount() == 1);
+	}
+	removeDir(dir);
+
+	// Crash replay: a child appends, gets half of it done and dies without closing
+	dir = base + "/crash";
+	pid_t pid = fork();
+	if (pid == 0) {
+		DiskQueue queue;
+		if (!queue.open(dir, 1024 * 1024))
+			_exit(1);
+		LogEventBatch batch;
+		for (int i = 0; i < 1000; i++) {
+			makeBatch(batch, i * 10, 10);
+			queue.append(batch);
+		}
+		queue.commit();
+		for (int i = 0; i < 500; i++) {
+			queue.read(batch);
+		}
+		queue.ack(queue.readPosition());
+		queue.commit();
+		// A torn record at the end
+		makeBatch(batch, 10000, 10);
+		queue.append(batch);
+		_exit(0);
+	}
+	int status = 0;
+	waitpid(pid, &status, 0);
+	rc |= check("Crashing child ran", WIFEXITED(status) && (WEXITSTATUS(status) == 0));
+	{
+		// Tear the last record, as if the crash was in the middle of writing it
+		std::vector<uint64_t> segs;
+		DIR *d = opendir(dir.c_str());
+		struct dirent *entry;
+		while (d && ((entry = readdir(d)) != NULL)) {
+			if (strstr(entry->d_name, ".seg"))
+				segs.push_back(strtoull(entry->d_name, NULL, 16));
+		}
+		if (d)
+			closedir(d);
+		std::sort(segs.begin(), segs.end());
+		char name[32];
+		snprintf(name, sizeof(name), "/%016llx.seg", (unsigned long long)segs.back());
+		int fd = ::open((dir + name).c_str(), O_RDWR);
+		char buf[1024 * 1024];
+		ssize_t len = pread(fd, buf, sizeof(buf), 0);
+		// The last record is the one without zeros after it
+		ssize_t end = len;
+		while ((end > 0) && (buf[end - 1] == 0))
+			end--;
+		buf[end - 20] ^= 0x55;
+		pwrite(fd, buf + end - 20, 1, end - 20);
+		::close(fd);
+	}
+	{
+		DiskQueue queue;
+		rc |= check("Reopen after the crash", queue.open(dir, 1024 * 1024));
+		LogEventBatch batch;
+		int batches = 0, first = -1, last = -1;
+		while (queue.read(batch)) {
+			if (first < 0)
+				first = eventNumber(batch.event(0));
+			last = eventNumber(batch.event(batch.event_size() - 1));
+			batches++;
+		}
+		rc |= check("Replays what was not acknowledged", (batches == 500) && (first == 5000) && (last == 9999));
+		makeBatch(batch, 20000, 10);
+		queue.append(batch);
+		rc |= check("Appends after the recovered end", queue.read(batch) && (eventNumber(batch.event(0)) == 20000));
+		queue.close();
+	}
+	removeDir(dir);
+
+	// Through QueuedInput: acknowledged once the sink is done
+	dir = base + "/input";
+	{
+		BatchInput in;
+		makeBatch(in.batch, 0, 2000);
+		QueuedInput queued(&in);
+		queued.open(dir, 1024 * 1024);
+		CountSink sink;
+		queued.read(sink, 0);
+		rc |= check("Spools while the sink takes nothing", (sink.next == 0) && !queued.queue().empty());
+		while (queued.timeout() == 0 && sink.next < 2000)
+			queued.read(sink, 300);
+		rc |= check("Feeds every event in order", (sink.numbers.size() == 2000) && (sink.numbers[0] == 0) &&
+		            (sink.numbers[1999] == 1999));
+		sink.done = 1000;
+		queued.read(sink, 300);
+		queued.close();
+		// Batches of 512: the first one is done, the rest comes again
+		QueuedInput again(&in);
+		again.open(dir, 1024 * 1024);
+		CountSink sink2;
+		while (again.timeout() == 0)
+			again.read(sink2, 4096);
+		rc |= check("Replays from the first batch not done", (sink2.numbers.size() == 2000 - 512) && (sink2.numbers[0] == 512));
+		again.close();
+	}
+	removeDir(dir);
+	rmdir(base.c_str());
+	return rc;
+}
+
+#endif // DEBUG_DISKQUEUE_CPP
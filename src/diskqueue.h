@@ -0,0 +1,179 @@
+#ifndef __DISKQUEUE_H
+# define __DISKQUEUE_H
+
+#include <map>
+#include <deque>
+#include <string>
+#include <utility>
+#include <stdint.h>
+#include <google/protobuf/message_lite.h>
+#include "eventinput.h"
+
+#define DISKQUEUE_SEGMENT_SIZE (64 * 1024 * 1024)
+
+namespace sawmill {
+
+/**
+ * Append-only queue of protobuf messages on disk, for more events than fit in memory and to
+ * keep them over a crash.
+ *
+ * The queue is a directory of segment files of a fixed size. Segments are preallocated and
+ * mapped, messages are serialized straight into the mapping. commit() makes everything appended
+ * so far durable with one msync() (group commit), together with the consumer offset: the position
+ * up to which the messages are done with, set by ack(). Segments before that position are
+ * recycled as the next segments to write, a few are kept to not have to allocate new files.
+ *
+ * Every record has a checksum seeded with its position, so after a crash the end of the written
+ * data is found by scanning the last segment, also when it is a recycled one with old records.
+ * Reading starts again at the last committed consumer offset, so messages can be read twice but
+ * are not lost once committed.
+ *
+ * Positions are (segment number << 32) + offset in the segment, and only go up.
+ */
+class DiskQueue
+{
+public:
+	DiskQueue();
+	~DiskQueue();
+
+	/**
+	 * Open the queue in 'dir', which is created if it doesn't exist, and recover what is in it.
+	 * 'segmentsize' only applies to new segments.
+	 */
+	bool open(const std::string &dir, size_t segmentsize = DISKQUEUE_SEGMENT_SIZE);
+	/**
+	 * Commit and close.
+	 */
+	void close();
+	bool isOpen() const { return !dir.empty(); }
+
+	/**
+	 * Returns false if the message doesn't fit in a segment or no new segment could be made.
+	 */
+	bool append(const google::protobuf::MessageLite &msg);
+	/**
+	 * Read the next message, returns false if there is none.
+	 */
+	bool read(google::protobuf::MessageLite &msg);
+	/**
+	 * Position after the last message read, pass it to ack() when that message is done with.
+	 */
+	uint64_t readPosition() const { return readpos; }
+	/**
+	 * Everything before 'position' is done with. Durable after the next commit().
+	 */
+	void ack(uint64_t position);
+	bool commit();
+
+	/**
+	 * Bytes appended since the last commit().
+	 */
+	size_t uncommitted() const { return writepos - commitpos; }
+	bool needsCommit() const { return (writepos != commitpos) || (ackpos != committedack); }
+	/**
+	 * No messages left to read.
+	 */
+	bool empty() const { return readpos == writepos; }
+	/**
+	 * Bytes left to read, records and their headers.
+	 */
+	uint64_t backlog() const;
+	/**
+	 * Segment files in use.
+	 */
+	size_t segmentCount() const { return segments.size(); }
+private:
+	struct Segment {
+		int fd;
+		char *map;
+		size_t size;
+	};
+
+	bool loadOffsets();
+	bool saveOffsets();
+	bool recover();
+	bool newSegment();
+	Segment *segment(uint64_t seq);
+	void release(uint64_t seq);
+	void recycle(uint64_t seq);
+	std::string segmentPath(uint64_t seq) const;
+	std::string sparePath(int index) const;
+	bool sync(Segment *seg, size_t from, size_t to);
+
+	std::string dir;
+	size_t segmentsize;
+	std::deque<uint64_t> segments; // Numbers of the segment files, oldest first
+	std::map<uint64_t, Segment> mapped;
+	int spares;
+	int offsetsfd;
+	int offsetslot;
+
+	uint64_t writepos;
+	uint64_t commitpos;
+	uint64_t readpos;
+	uint64_t ackpos;
+	uint64_t committedack;
+
+	// Not copyable
+	DiskQueue(const DiskQueue &);
+	DiskQueue &operator=(const DiskQueue &);
+};
+
+/**
+ * Puts a DiskQueue between an input and the dispatcher.
+ *
+ * Everything the input has is taken in and appended to the queue in batches, also when the
+ * dispatcher is full, and the dispatcher is fed from the queue. A batch is acknowledged once the
+ * dispatcher is done with all its events, so after a crash the events that were not done are
+ * submitted again. Commits are grouped: at most every QUEUE_COMMIT_MS, or sooner when a lot was
+ * appended.
+ */
+class QueuedInput : public EventInput, private EventSink
+{
+public:
+	/**
+	 * The input is not owned.
+	 */
+	explicit QueuedInput(EventInput *input);
+	~QueuedInput();
+
+	bool open(const std::string &dir, size_t segmentsize = DISKQUEUE_SEGMENT_SIZE);
+	/**
+	 * Append what is still waiting and commit.
+	 */
+	void close();
+	/**
+	 * Events submitted here go to the queue like the events of the input.
+	 */
+	EventSink &spool() { return *this; }
+	const DiskQueue &queue() const { return diskqueue; }
+
+	// EventInput
+	int fd() const { return input->fd(); }
+	long timeout() const;
+	size_t read(EventSink &sink, size_t max);
+	bool spools() const { return true; }
+private:
+	// EventSink, for the input
+	LogEvent *newEvent();
+	void submit(LogEvent *event);
+
+	void appendStaged();
+
+	EventInput *input;
+	DiskQueue diskqueue;
+	LogEventBatch staged;    // Events of the input, not in the queue yet
+	size_t stagedbytes;
+	LogEventBatch current;   // Batch read from the queue...
+	int currentpos;          // ...and the next event of it to submit
+	std::deque<std::pair<uint64_t, uint64_t> > acks; // Sink event number and queue position after a batch
+	uint64_t nextcommit_ms;
+
+	// Not copyable
+	QueuedInput(const QueuedInput &);
+	QueuedInput &operator=(const QueuedInput &);
+};
+
+} // namespace sawmill
+
+#endif // ifndef __DISKQUEUE_H
@@ -0,0 +1,1266 @@
+/****************************************************************************
+ * Project: SawMill
+ * Authors:
+ *          Bart Meuris <bart . meuris @ gmail . com>
+ *
+ * License: (to be discussed LGPL version 2.0?)
+ ****************************************************************************
+ * Module description:
+ *     Dispatcher side of the FilterMessage protocol, and the management of
+ *     the filter slave processes/threads.
+ *
+ ***************************************************************************/
+
+#include "dispatcher.h"
+#include "filterslave.h"
+#include "zmqutil.h"
+#include "sawlog.h"
+#include <sstream>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#define STOP_WAIT_MS 5000
+#define INPUT_READ_MAX  4096  // Events per input per poll
+#define INPUT_QUEUE_MAX 65536 // Default queue limit
+#define MAX_CREDITS     64    // Limit on the credits a slave can ask for
+#define SHM_DRAIN_MS    1     // Poll interval while a message waits for its ring to be read empty
+
+namespace sawmill {
+
+static inline uint64_t now_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+BatchSizer::BatchSizer(size_t minsize, size_t maxsize, long maxlatency_us)
+	:minbatch(1), maxbatch(1), maxlatency(0)
+{
+	setLimits(minsize, maxsize, maxlatency_us);
+}
+
+void BatchSizer::setLimits(size_t minsize, size_t maxsize, long maxlatency_us)
+{
+	maxbatch = (maxsize > 0) ? maxsize : 1;
+	minbatch = (minsize > 0) ? std::min(minsize, maxbatch) : 1;
+	maxlatency = (maxlatency_us > 0) ? maxlatency_us : 0;
+}
+
+size_t BatchSizer::next(size_t queued, size_t idleslaves, uint64_t oldestage_us) const
+{
+	if ((queued == 0) || (idleslaves == 0))
+		return 0;
+
+	// Spread what is queued over the idle slaves
+	size_t size = (queued + idleslaves - 1) / idleslaves;
+	if (size > maxbatch)
+		size = maxbatch;
+	if ((size < minbatch) && (oldestage_us < (uint64_t)maxlatency)) {
+		// Not worth a message yet, wait a bit for more events
+		return 0;
+	}
+	return size;
+}
+
+struct Dispatcher::SlaveThread
+{
+	std::string identity;
+	std::vector<std::string> plugins; // Empty for all plugins
+	ShmChannel *channel;              // Owned by the Slave entry
+	int credits;
+	std::thread thread;
+	std::atomic<bool> done;
+	int rc;
+
+	SlaveThread() : identity(), plugins(), channel(NULL), credits(SLAVE_DEFAULT_CREDITS), thread(), done(false), rc(0) {}
+};
+
+Dispatcher::Dispatcher(const std::string &ep)
+	:endpoint(ep), slavecount(1), stages(), ringsize(0), slavecredits(SLAVE_DEFAULT_CREDITS), queuelimit(INPUT_QUEUE_MAX),
+	 paused(0), nextslaveid(0), spawned(0), running(false), config(NULL), output(NULL), inputs(),
+	 context(NULL), socket(NULL), slaves(), slavepids(), threads(), idle(), pool(), queue(), nextseq(0),
+	 frontcount(0), frontmin(0), batchseqs(), stopseq((uint64_t)-1), inflight(0),
+	 batchsizer(), sparebatches(), nextbatchid(0), handoffs(), handedoff(), recvidentity(), received(),
+	 pollitems(), shmslaves(), shmwaiting(), brokenshm()
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus > 0)
+		slavecount = cpus;
+}
+
+Dispatcher::~Dispatcher()
+{
+	if (running)
+		stop();
+	for (size_t i = 0; i < sparebatches.size(); i++) {
+		delete sparebatches[i];
+	}
+	delete socket;
+	delete context;
+}
+
+void Dispatcher::setEndpoint(const std::string &ep)
+{
+	endpoint = ep;
+}
+
+void Dispatcher::setSlaveCount(int count)
+{
+	slavecount = (count > 0) ? count : 1;
+}
+
+int Dispatcher::getSlaveCount() const
+{
+	return slavecount;
+}
+
+void Dispatcher::setPipeline(const std::vector<std::vector<std::string> > &pipeline)
+{
+	stages = pipeline;
+}
+
+void Dispatcher::setSharedMemory(size_t size)
+{
+	ringsize = size;
+}
+
+void Dispatcher::setSlaveCredits(int credits)
+{
+	slavecredits = std::max(1, std::min(credits, MAX_CREDITS));
+}
+
+void Dispatcher::setQueueLimit(size_t events)
+{
+	queuelimit = (events > 0) ? events : 1;
+}
+
+void Dispatcher::addInput(EventInput *input)
+{
+	inputs.push_back(input);
+}
+
+void Dispatcher::setOutput(EventOutput *out)
+{
+	output = out;
+}
+
+bool Dispatcher::isThreaded() const
+{
+	return endpoint.compare(0, 9, "inproc://") == 0;
+}
+
+bool Dispatcher::start(const FilterConfigStore &cfg)
+{
+	config = &cfg;
+	try {
+		context = new zmq::context_t(1);
+		socket = new zmq::socket_t(*context, ZMQ_ROUTER);
+		int linger = 0;
+		socket->setsockopt(ZMQ_LINGER, &linger, sizeof(linger));
+		socket->bind(endpoint.c_str());
+	} catch (zmq::error_t &e) {
+		ERR("Could not bind dispatcher to %s: %s", endpoint.c_str(), e.what());
+		return false;
+	}
+	running = true;
+	NOTICE("Dispatcher listening on %s, starting %d slaves", endpoint.c_str(), slavecount);
+	for (int i = 0; i < slavecount; i++) {
+		spawnSlave(stages.empty() ? -1 : (int)(i % stages.size()));
+	}
+	return true;
+}
+
+void Dispatcher::stop()
+{
+	if (!running)
+		return;
+	running = false;
+	// The batches still out are dropped below, inputs must not take them as done
+	stopseq = oldestPending();
+	if (output)
+		output->flush();
+
+	FilterMessage bye;
+	bye.set_command(FilterMessage::BYE);
+	for (std::map<std::string, Slave>::iterator it = slaves.begin(); it != slaves.end(); ++it) {
+		if (it->second.hello)
+			sendTo(it->first, bye);
+	}
+
+	// Give the slaves some time to exit by themselves
+	for (int waited = 0; (waited < STOP_WAIT_MS) && !slavepids.empty(); waited += 10) {
+		reapSlaves();
+		usleep(10000);
+	}
+	for (std::map<pid_t, std::string>::iterator it = slavepids.begin(); it != slavepids.end(); ++it) {
+		WARN("Slave %s did not exit, killing it", it->second.c_str());
+		kill(it->first, SIGKILL);
+		waitpid(it->first, NULL, 0);
+	}
+	slavepids.clear();
+
+	for (size_t i = 0; i < threads.size(); i++) {
+		threads[i]->thread.join();
+		delete threads[i];
+	}
+	threads.clear();
+	for (size_t i = 0; i < brokenshm.size(); i++) {
+		delete brokenshm[i];
+	}
+	brokenshm.clear();
+	for (std::map<int, Handoff>::iterator it = handoffs.begin(); it != handoffs.end(); ++it) {
+		// The others are still in the inflight list of their slave
+		if (it->second.replied)
+			freeBatch(it->second.batch);
+	}
+	handoffs.clear();
+	for (std::map<std::string, Slave>::iterator it = slaves.begin(); it != slaves.end(); ++it) {
+		for (size_t i = 0; i < it->second.inflight.size(); i++) {
+			freeBatch(it->second.inflight[i]);
+		}
+		delete it->second.shm;
+	}
+	slaves.clear();
+	idle.clear();
+}
+
+void Dispatcher::spawnSlave(int stage)
+{
+	std::ostringstream identity;
+	pid_t pid = 0;
+	ShmChannel *channel = NULL;
+
+	if (ringsize > 0) {
+		channel = ShmChannel::create(ringsize);
+		if (!channel)
+			WARN("Could not set up shared memory for a slave, using 0MQ");
+	}
+
+	if (isThreaded()) {
+		SlaveThread *st = new SlaveThread();
+		identity << "thread-" << ++spawned;
+		st->identity = identity.str();
+		if (stage >= 0)
+			st->plugins = stages[stage];
+		st->channel = channel;
+		st->credits = slavecredits;
+		threads.push_back(st);
+		st->thread = std::thread(runSlaveThread, context, endpoint, st);
+	} else {
+		pid_t parent = getpid();
+		pid = fork();
+		if (pid < 0) {
+			ERR("Could not fork filter slave");
+			delete channel;
+			return;
+		}
+		if (pid == 0) {
+			// Child: never touch the parent's 0MQ context
+			int rc = 1;
+			identity << "slave-" << getpid();
+			try {
+				zmq::context_t ctx(1);
+				FilterSlave slave(ctx, endpoint, identity.str(), parent);
+				if (stage >= 0)
+					slave.setPlugins(stages[stage]);
+				slave.setCredits(slavecredits);
+				if (channel)
+					slave.setChannel(channel);
+				rc = slave.run();
+			} catch (std::exception &e) {
+				ERR("Slave %s: %s", identity.str().c_str(), e.what());
+			}
+			_exit(rc);
+		}
+		identity << "slave-" << pid;
+		slavepids[pid] = identity.str();
+	}
+
+	Slave &slave = slaves[identity.str()];
+	slave.identity = identity.str();
+	slave.slaveid = -1;
+	slave.pid = pid;
+	slave.hello = false;
+	slave.configversion = -1;
+	slave.stage = stage;
+	slave.credits = 1;
+	slave.ready = false;
+	slave.endpoint.clear();
+	slave.plugins.clear();
+	slave.inflight.clear();
+	slave.shm = channel;
+	slave.shmbacklog.clear();
+}
+
+void Dispatcher::getSlavePids(std::vector<pid_t> &pids) const
+{
+	for (std::map<pid_t, std::string>::const_iterator it = slavepids.begin(); it != slavepids.end(); ++it) {
+		pids.push_back(it->first);
+	}
+}
+
+void Dispatcher::runSlaveThread(zmq::context_t *context, std::string endpoint, SlaveThread *st)
+{
+	try {
+		FilterSlave slave(*context, endpoint, st->identity);
+		if (!st->plugins.empty())
+			slave.setPlugins(st->plugins);
+		slave.setCredits(st->credits);
+		if (st->channel)
+			slave.setChannel(st->channel);
+		st->rc = slave.run();
+	} catch (std::exception &e) {
+		ERR("Slave %s: %s", st->identity.c_str(), e.what());
+		st->rc = 1;
+	}
+	st->done = true;
+}
+
+void Dispatcher::reapSlaves()
+{
+	int status;
+	pid_t pid;
+
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		std::map<pid_t, std::string>::iterator it = slavepids.find(pid);
+		if (it == slavepids.end())
+			continue;
+		if (running) {
+			if (WIFSIGNALED(status)) {
+				ERR("Slave %s killed by signal %d, restarting", it->second.c_str(), WTERMSIG(status));
+			} else {
+				ERR("Slave %s exited with code %d, restarting", it->second.c_str(), WEXITSTATUS(status));
+			}
+		}
+		int stage = slaveStage(it->second);
+		slaveLost(it->second);
+		slavepids.erase(it);
+		if (running)
+			spawnSlave(stage);
+	}
+
+	for (size_t i = 0; i < threads.size(); ) {
+		SlaveThread *st = threads[i];
+		if (!st->done) {
+			i++;
+			continue;
+		}
+		st->thread.join();
+		if (running)
+			ERR("Slave thread %s exited with code %d, restarting", st->identity.c_str(), st->rc);
+		int stage = slaveStage(st->identity);
+		slaveLost(st->identity);
+		threads.erase(threads.begin() + i);
+		delete st;
+		if (running)
+			spawnSlave(stage);
+	}
+}
+
+int Dispatcher::slaveStage(const std::string &identity) const
+{
+	std::map<std::string, Slave>::const_iterator it = slaves.find(identity);
+	return (it != slaves.end()) ? it->second.stage : -1;
+}
+
+void Dispatcher::slaveLost(const std::string &identity)
+{
+	std::map<std::string, Slave>::iterator it = slaves.find(identity);
+	if (it == slaves.end())
+		return;
+
+	requeueHandoffs(it->second);
+	// Whatever it was working on has to be done again, before anything else
+	requeueInFlight(it->second);
+	for (std::deque<std::string>::iterator idit = idle.begin(); idit != idle.end(); ++idit) {
+		if (*idit == identity) {
+			idle.erase(idit);
+			break;
+		}
+	}
+	delete it->second.shm;
+	slaves.erase(it);
+	if (running)
+		sendPeers();
+}
+
+void Dispatcher::requeueHandoffs(Slave &slave)
+{
+	// There is no telling which handed off events the slave had, queue them all again. Results
+	// that still come in for them are ignored. The batches of the other slaves count as well:
+	// they can have handed events off to it before we heard of it.
+	for (std::map<std::string, Slave>::iterator sit = slaves.begin(); sit != slaves.end(); ++sit) {
+		std::deque<FilterMessage *> &sent = sit->second.inflight;
+		for (size_t i = 0; (&sit->second != &slave) && (i < sent.size()); i++) {
+			if (handoffs.find(sent[i]->batchid()) == handoffs.end())
+				handoffs.insert(std::make_pair(sent[i]->batchid(), Handoff(sent[i])));
+		}
+	}
+	for (std::map<int, Handoff>::iterator hit = handoffs.begin(); hit != handoffs.end(); ) {
+		Handoff &handoff = hit->second;
+		if (!handoff.replied) {
+			handoff.requeue = true;
+			++hit;
+			continue;
+		}
+		for (int i = (int)handoff.done.size() - 1; i >= 0; i--) {
+			if (!handoff.done[i])
+				requeue(handoff, i);
+		}
+		freeBatch(handoff.batch);
+		handoffs.erase(hit++);
+	}
+}
+
+void Dispatcher::requeueInFlight(Slave &slave)
+{
+	std::deque<FilterMessage *> &lost = slave.inflight;
+	while (!lost.empty()) {
+		FilterMessage *batch = lost.back();
+		std::map<int, Handoff>::iterator hit = handoffs.find(batch->batchid());
+		if (hit != handoffs.end()) {
+			// Some events of the batch were already finished by another slave
+			for (int i = batch->events_size() - 1; i >= 0; i--) {
+				if (!hit->second.done[i])
+					requeue(hit->second, i);
+			}
+			handoffs.erase(hit);
+		} else {
+			for (int i = batch->events_size() - 1; i >= 0; i--) {
+				LogEvent *event = pool.get();
+				event->Swap(batch->mutable_events(i));
+				requeueEvent(event, batchSeq(batch));
+			}
+			inflight -= batch->events_size();
+		}
+		freeBatch(batch);
+		lost.pop_back();
+	}
+}
+
+void Dispatcher::shmBroken(Slave &slave)
+{
+	WARN("Shared memory channel of slave %s is broken, using 0MQ", slave.identity.c_str());
+	// A slave thread may still look at it, it goes away in stop()
+	slave.shm->markBroken();
+	brokenshm.push_back(slave.shm);
+	slave.shm = NULL;
+	slave.shmbacklog.clear();
+
+	// What was in the rings is lost, the results of the events handed off to it as well: the
+	// batches go again, and the slave has to confirm its config before it gets new ones
+	requeueHandoffs(slave);
+	requeueInFlight(slave);
+	for (std::deque<std::string>::iterator idit = idle.begin(); idit != idle.end(); ++idit) {
+		if (*idit == slave.identity) {
+			idle.erase(idit);
+			break;
+		}
+	}
+	slave.ready = false;
+	slave.configversion = -1;
+	sendConfig(slave);
+	sendPeers();
+}
+
+void Dispatcher::configChanged()
+{
+	for (std::map<std::string, Slave>::iterator it = slaves.begin(); it != slaves.end(); ++it) {
+		if (it->second.hello)
+			sendConfig(it->second);
+	}
+}
+
+void Dispatcher::sendConfig(Slave &slave)
+{
+	FilterMessage msg;
+	config->fillConfigMessage(slave.configversion, msg);
+	sendTo(slave.identity, msg);
+}
+
+void Dispatcher::sendPeers()
+{
+	FilterMessage msg;
+	msg.set_command(FilterMessage::HELLO);
+	for (std::map<std::string, Slave>::iterator it = slaves.begin(); it != slaves.end(); ++it) {
+		if (!it->second.hello || it->second.endpoint.empty())
+			continue;
+		SlavePeer *peer = msg.add_peer();
+		peer->set_slaveid(it->second.slaveid);
+		peer->set_endpoint(it->second.endpoint);
+		for (size_t i = 0; i < it->second.plugins.size(); i++) {
+			peer->add_plugin(it->second.plugins[i]);
+		}
+	}
+	// Every slave skips itself in the list
+	for (std::map<std::string, Slave>::iterator it = slaves.begin(); it != slaves.end(); ++it) {
+		if (!it->second.hello)
+			continue;
+		msg.set_slaveid(it->second.slaveid);
+		sendTo(it->first, msg);
+	}
+}
+
+void Dispatcher::sendTo(const std::string &identity, const FilterMessage &msg)
+{
+	std::map<std::string, Slave>::iterator it = slaves.find(identity);
+	if ((it != slaves.end()) && it->second.shm) {
+		Slave &slave = it->second;
+		ShmRing::WriteResult result = ShmRing::WRITE_FULL;
+		if (slave.shmbacklog.empty())
+			result = slave.shm->down->write(msg);
+		if (result == ShmRing::WRITE_OK)
+			return;
+		if (result != ShmRing::WRITE_BROKEN) {
+			// Keeps the order, flushed on every poll. A slave with more than one credit can still
+			// have batches in the ring, so a message that is too big for it waits in line as well
+			// and only goes over 0MQ once the ring was read empty.
+			size_t size = msg.ByteSizeLong();
+			slave.shmbacklog.push_back(ShmPending());
+			ShmPending &pending = slave.shmbacklog.back();
+			msg.SerializeToString(&pending.data);
+			pending.zmq = (result == ShmRing::WRITE_TOO_BIG) || (size >= slave.shm->down->capacity() / 2);
+			if (pending.zmq) {
+				DBG("Message of %d bytes for %s does not fit its ring, using 0MQ", (int)size, identity.c_str());
+				flushBacklog(slave);
+			}
+			return;
+		}
+	}
+	zmq_send_frame(*socket, identity, ZMQ_SNDMORE);
+	zmq_send_message(*socket, msg);
+}
+
+LogEvent *Dispatcher::newEvent()
+{
+	return pool.get();
+}
+
+void Dispatcher::submit(LogEvent *event)
+{
+	queue.push_back(event, now_us(), nextseq++);
+}
+
+void Dispatcher::submit(const LogEvent &event)
+{
+	LogEvent *copy = pool.get();
+	copy->CopyFrom(event);
+	submit(copy);
+}
+
+uint64_t Dispatcher::submitted() const
+{
+	return nextseq;
+}
+
+uint64_t Dispatcher::oldestPending() const
+{
+	uint64_t oldest = nextseq;
+	if (!queue.empty())
+		oldest = frontcount ? frontmin : queue.frontSeq();
+	for (std::map<int, uint64_t>::const_iterator it = batchseqs.begin(); it != batchseqs.end(); ++it) {
+		if (it->second < oldest)
+			oldest = it->second;
+	}
+	return (stopseq < oldest) ? stopseq : oldest;
+}
+
+size_t Dispatcher::pending() const
+{
+	return queue.size();
+}
+
+size_t Dispatcher::inFlight() const
+{
+	return inflight;
+}
+
+size_t Dispatcher::readySlaves() const
+{
+	return idle.size();
+}
+
+void Dispatcher::getStats(DispatcherStats &stats) const
+{
+	stats.queued = queue.size();
+	stats.queuelimit = queuelimit;
+	stats.inflight = inflight;
+	stats.batches = 0;
+	stats.credits = 0;
+	for (std::map<std::string, Slave>::const_iterator it = slaves.begin(); it != slaves.end(); ++it) {
+		stats.batches += it->second.inflight.size();
+		if (it->second.configversion >= 0)
+			stats.credits += it->second.credits;
+	}
+	stats.readyslaves = idle.size();
+	stats.submitted = nextseq;
+	stats.paused = paused;
+}
+
+void Dispatcher::handleMessage(const std::string &identity, FilterMessage &msg)
+{
+	std::map<std::string, Slave>::iterator it = slaves.find(identity);
+	if (it == slaves.end()) {
+		if (msg.command() != FilterMessage::HELLO) {
+			WARN("Message from unknown slave %s ignored", identity.c_str());
+			return;
+		}
+		// Slave not started by us, for example on another host
+		it = slaves.insert(std::make_pair(identity, Slave())).first;
+		it->second.identity = identity;
+		it->second.pid = 0;
+		it->second.configversion = -1;
+		it->second.stage = -1;
+		it->second.credits = 1;
+		it->second.ready = false;
+		it->second.shm = NULL;
+	}
+	Slave &slave = it->second;
+
+	switch (msg.command()) {
+	case FilterMessage::HELLO: {
+		slave.hello = true;
+		slave.slaveid = nextslaveid++;
+		slave.plugins.assign(msg.plugin().begin(), msg.plugin().end());
+		slave.endpoint = msg.endpoint();
+		slave.credits = msg.has_credits() ? std::max(1, std::min((int)msg.credits(), MAX_CREDITS)) : 1;
+		DBG("Slave %s said HELLO with %d plugins and %d credits, assigned ID %d", identity.c_str(), msg.plugin_size(),
+		    slave.credits, slave.slaveid);
+
+		// Gives the new slave its ID, and everybody the new peer list
+		sendPeers();
+		sendConfig(slave);
+		break;
+	}
+	case FilterMessage::CONFIG: {
+		if (msg.status() == FilterMessage::RESYNC) {
+			DBG("Slave %s could not apply delta, sending full config", identity.c_str());
+			slave.configversion = -1;
+			sendConfig(slave);
+			break;
+		}
+		if (msg.status() != FilterMessage::OK) {
+			WARN("Slave %s reported errors loading config v%d", identity.c_str(), msg.configversion());
+		}
+		slave.configversion = msg.configversion();
+		markReady(slave);
+		break;
+	}
+	case FilterMessage::PROCESS:
+		if (slave.inflight.empty()) {
+			WARN("Unexpected PROCESS reply from slave %s", identity.c_str());
+			break;
+		}
+		if (msg.has_credits())
+			slave.credits = std::max(1, std::min((int)msg.credits(), MAX_CREDITS));
+		handleProcessed(slave, msg);
+		markReady(slave);
+		break;
+	case FilterMessage::CONTINUE:
+		handleContinued(slave, msg);
+		break;
+	case FilterMessage::BYE:
+		slaveLost(identity);
+		break;
+	default:
+		WARN("Unexpected command %d from slave %s", msg.command(), identity.c_str());
+		break;
+	}
+}
+
+void Dispatcher::markReady(Slave &slave)
+{
+	if (slave.ready || (slave.configversion < 0) || (slave.inflight.size() >= (size_t)slave.credits))
+		return;
+	idle.push_back(slave.identity);
+	slave.ready = true;
+}
+
+void Dispatcher::handleProcessed(Slave &slave, FilterMessage &msg)
+{
+	// With more batches at the slave, one that went over 0MQ can be overtaken by one that went
+	// through the ring
+	std::deque<FilterMessage *>::iterator bit = slave.inflight.begin();
+	if (msg.has_batchid()) {
+		while ((bit != slave.inflight.end()) && ((*bit)->batchid() != msg.batchid()))
+			++bit;
+	}
+	if (bit == slave.inflight.end()) {
+		WARN("PROCESS reply from slave %s for unknown batch %d", slave.identity.c_str(), msg.batchid());
+		return;
+	}
+	FilterMessage *batch = *bit;
+	slave.inflight.erase(bit);
+
+	if (msg.status() != FilterMessage::OK) {
+		WARN("Slave %s failed processing a batch: %s", slave.identity.c_str(), msg.statusmessage().c_str());
+	}
+	if (msg.result_size() != batch->events_size()) {
+		WARN("Slave %s returned %d results for %d events", slave.identity.c_str(), msg.result_size(), batch->events_size());
+	}
+
+	std::map<int, Handoff>::iterator hit = handoffs.find(batch->batchid());
+	if (hit == handoffs.end()) {
+		bool continued = false;
+		for (int i = 0; (i < msg.result_size()) && !continued; i++) {
+			continued = (msg.result(i).action() == EventResult::CONTINUE) || (msg.result(i).action() == EventResult::REQUEUE);
+		}
+		if (!continued) {
+			// Everything finished here
+			inflight -= batch->events_size();
+			int next = 0;
+			for (int i = 0; i < msg.result_size(); i++) {
+				const EventResult &result = msg.result(i);
+				if ((result.action() == EventResult::DROP) || (result.action() == EventResult::FAILED))
+					continue;
+				if (next >= msg.events_size())
+					break;
+				if (output)
+					output->output(*msg.mutable_events(next));
+				next++;
+			}
+			freeBatch(batch);
+			return;
+		}
+		hit = handoffs.insert(std::make_pair(batch->batchid(), Handoff(batch))).first;
+	}
+
+	// Keep the batch until the handed off events are finished as well
+	Handoff &handoff = hit->second;
+	handoff.replied = true;
+	handedoff.assign(batch->events_size(), false);
+	int next = 0;
+	for (int i = 0; i < msg.result_size(); i++) {
+		const EventResult &result = msg.result(i);
+		int index = result.has_index() ? result.index() : i;
+		bool valid = (index >= 0) && (index < batch->events_size()) && !handoff.done[index];
+		switch (result.action()) {
+		case EventResult::PASS:
+			if (next >= msg.events_size())
+				break;
+			if (valid && output)
+				output->output(*msg.mutable_events(next));
+			next++;
+			break;
+		case EventResult::CONTINUE:
+			if (valid && handoff.requeue)
+				requeue(handoff, index);
+			else if (valid)
+				handedoff[index] = true;
+			break;
+		case EventResult::REQUEUE:
+			if (valid)
+				requeue(handoff, index);
+			break;
+		default:
+			break;
+		}
+	}
+	// Everything that was not handed off is finished, or lost when results are missing
+	for (int i = 0; i < batch->events_size(); i++) {
+		if (!handoff.done[i] && !handedoff[i])
+			resolve(handoff, i);
+	}
+	if (handoff.remaining == 0) {
+		freeBatch(batch);
+		handoffs.erase(hit);
+	}
+}
+
+void Dispatcher::handleContinued(Slave &slave, FilterMessage &msg)
+{
+	std::map<int, Handoff>::iterator hit = handoffs.find(msg.batchid());
+	if (hit == handoffs.end()) {
+		// Can come in before the PROCESS reply of the slave that handed the events off
+		FilterMessage *batch = findInFlight(msg.batchid());
+		if (!batch) {
+			DBG("Results for unknown batch %d from slave %s ignored", msg.batchid(), slave.identity.c_str());
+			return;
+		}
+		hit = handoffs.insert(std::make_pair(msg.batchid(), Handoff(batch))).first;
+	}
+	Handoff &handoff = hit->second;
+	bool resync = (msg.status() == FilterMessage::RESYNC);
+	if (resync) {
+		DBG("Slave %s runs another config version, queueing %d events again", slave.identity.c_str(), msg.result_size());
+	}
+
+	int next = 0;
+	for (int i = 0; i < msg.result_size(); i++) {
+		const EventResult &result = msg.result(i);
+		int index = result.index();
+		bool valid = (index >= 0) && (index < (int)handoff.done.size()) && !handoff.done[index];
+		switch (result.action()) {
+		case EventResult::PASS:
+			if (next >= msg.events_size())
+				break;
+			if (valid) {
+				if (output)
+					output->output(*msg.mutable_events(next));
+				resolve(handoff, index);
+			}
+			next++;
+			break;
+		case EventResult::CONTINUE:
+			// Handed off once more, unless it has to start over
+			if (valid && (resync || handoff.requeue))
+				requeue(handoff, index);
+			break;
+		case EventResult::REQUEUE:
+			if (valid)
+				requeue(handoff, index);
+			break;
+		default:
+			if (valid)
+				resolve(handoff, index);
+			break;
+		}
+	}
+	if (handoff.replied && (handoff.remaining == 0)) {
+		freeBatch(handoff.batch);
+		handoffs.erase(hit);
+	}
+}
+
+FilterMessage *Dispatcher::findInFlight(int batchid)
+{
+	for (std::map<std::string, Slave>::iterator it = slaves.begin(); it != slaves.end(); ++it) {
+		std::deque<FilterMessage *> &sent = it->second.inflight;
+		for (size_t i = 0; i < sent.size(); i++) {
+			if (sent[i]->batchid() == batchid)
+				return sent[i];
+		}
+	}
+	return NULL;
+}
+
+void Dispatcher::resolve(Handoff &handoff, int index)
+{
+	handoff.done[index] = true;
+	handoff.remaining--;
+	inflight--;
+}
+
+void Dispatcher::requeue(Handoff &handoff, int index)
+{
+	LogEvent *event = pool.get();
+	event->Swap(handoff.batch->mutable_events(index));
+	requeueEvent(event, batchSeq(handoff.batch));
+	resolve(handoff, index);
+}
+
+void Dispatcher::requeueEvent(LogEvent *event, uint64_t seq)
+{
+	// Numbered as the oldest of its batch, that is all we know
+	queue.push_front(event, 0, seq);
+	if (!frontcount || (seq < frontmin))
+		frontmin = seq;
+	frontcount++;
+}
+
+uint64_t Dispatcher::batchSeq(const FilterMessage *batch) const
+{
+	std::map<int, uint64_t>::const_iterator it = batchseqs.find(batch->batchid());
+	return (it != batchseqs.end()) ? it->second : 0;
+}
+
+FilterMessage *Dispatcher::newBatch()
+{
+	if (sparebatches.empty())
+		return new FilterMessage();
+	FilterMessage *batch = sparebatches.back();
+	sparebatches.pop_back();
+	return batch;
+}
+
+void Dispatcher::freeBatch(FilterMessage *batch)
+{
+	batchseqs.erase(batch->batchid());
+	// Clear() keeps the allocated events around for the next batch
+	batch->Clear();
+	sparebatches.push_back(batch);
+}
+
+long Dispatcher::dispatchDelay() const
+{
+	if (queue.empty() || idle.empty())
+		return -1;
+	uint64_t age = now_us() - queue.frontTime();
+	if (age >= (uint64_t)batchsizer.getMaxLatency())
+		return 0;
+	return (batchsizer.getMaxLatency() - age + 999) / 1000;
+}
+
+void Dispatcher::dispatch()
+{
+	while (!queue.empty() && !idle.empty()) {
+		size_t size = batchsizer.next(queue.size(), idle.size(), now_us() - queue.frontTime());
+		if (size == 0)
+			break;
+
+		Slave &slave = slaves[idle.front()];
+		idle.pop_front();
+		slave.ready = false;
+
+		FilterMessage *batch = newBatch();
+		batch->set_command(FilterMessage::PROCESS);
+		batch->set_batchid(nextbatchid++);
+		uint64_t minseq = UINT64_MAX;
+		for (size_t i = 0; i < size; i++) {
+			if (queue.frontSeq() < minseq)
+				minseq = queue.frontSeq();
+			if (frontcount)
+				frontcount--;
+			batch->add_events()->Swap(queue.front());
+			pool.put(queue.front());
+			queue.pop_front();
+		}
+		batchseqs[batch->batchid()] = minseq;
+		slave.inflight.push_back(batch);
+		inflight += size;
+		sendTo(slave.identity, *batch);
+		// Back in line if it has credits left
+		markReady(slave);
+	}
+}
+
+void Dispatcher::flushBacklogs()
+{
+	for (std::map<std::string, Slave>::iterator it = slaves.begin(); it != slaves.end(); ++it) {
+		flushBacklog(it->second);
+	}
+}
+
+void Dispatcher::flushBacklog(Slave &slave)
+{
+	while (!slave.shmbacklog.empty()) {
+		ShmRing &ring = *slave.shm->down;
+		const ShmPending &pending = slave.shmbacklog.front();
+		if (pending.zmq) {
+			// The slave answers the messages before it, which wakes us up to try again
+			if (ring.broken() || !ring.drained())
+				break;
+			zmq_send_frame(*socket, slave.identity, ZMQ_SNDMORE);
+			zmq_send_frame(*socket, pending.data);
+		} else if (ring.write(pending.data.data(), pending.data.size()) != ShmRing::WRITE_OK) {
+			break;
+		}
+		slave.shmbacklog.pop_front();
+	}
+}
+
+void Dispatcher::receiveShm()
+{
+	// handleMessage() can lose the slave and its ring, look it up for every message
+	for (size_t i = 0; i < shmslaves.size(); i++) {
+		for (;;) {
+			std::map<std::string, Slave>::iterator it = slaves.find(shmslaves[i]);
+			if ((it == slaves.end()) || !it->second.shm)
+				break;
+			if (it->second.shm->broken()) {
+				shmBroken(it->second);
+				break;
+			}
+			if (it->second.shm->up->empty())
+				break;
+			if (it->second.shm->up->read(received))
+				handleMessage(shmslaves[i], received);
+		}
+	}
+}
+
+void Dispatcher::readInputs(size_t first)
+{
+	// 'first' is the index of the first input in pollitems
+	for (size_t i = 0; i < inputs.size(); i++) {
+		bool full = (queue.size() >= queuelimit);
+		bool readable = (pollitems[first + i].revents & ZMQ_POLLIN);
+		if (full && !inputs[i]->spools())
+			continue;
+		if (readable || (!full && (inputs[i]->timeout() == 0)))
+			inputs[i]->read(*this, full ? 0 : std::min((size_t)INPUT_READ_MAX, queuelimit - queue.size()));
+	}
+}
+
+void Dispatcher::poll(long timeout)
+{
+	reapSlaves();
+
+	// Don't sleep past the moment a partial batch has to go out
+	long delay = dispatchDelay();
+	if ((delay >= 0) && ((timeout < 0) || (delay < timeout)))
+		timeout = delay;
+
+	flushBacklogs();
+
+	zmq::pollitem_t item = { *socket, 0, ZMQ_POLLIN, 0 };
+	pollitems.assign(1, item);
+	shmslaves.clear();
+	shmwaiting.clear();
+	for (std::map<std::string, Slave>::iterator it = slaves.begin(); it != slaves.end(); ++it) {
+		ShmChannel *shm = it->second.shm;
+		if (!shm)
+			continue;
+		bool wait = shm->up->prepareWait();
+		if (!wait)
+			timeout = 0;
+		// Not every message gets an answer to wake us up once the slave read it
+		const std::deque<ShmPending> &backlog = it->second.shmbacklog;
+		if (!backlog.empty() && backlog.front().zmq && ((timeout < 0) || (timeout > SHM_DRAIN_MS)))
+			timeout = SHM_DRAIN_MS;
+		zmq::pollitem_t ringitem = { NULL, shm->up->fd(), ZMQ_POLLIN, 0 };
+		pollitems.push_back(ringitem);
+		shmslaves.push_back(it->first);
+		shmwaiting.push_back(wait);
+	}
+	// With a full queue only the inputs that spool get to take in their input when it comes in,
+	// the fds of the others would stay readable and their timeouts would keep waking us up
+	bool full = (queue.size() >= queuelimit);
+	if (full && !inputs.empty())
+		paused++;
+	size_t firstinput = pollitems.size();
+	for (size_t i = 0; i < inputs.size(); i++) {
+		zmq::pollitem_t inputitem = { NULL, (full && !inputs[i]->spools()) ? -1 : inputs[i]->fd(), ZMQ_POLLIN, 0 };
+		pollitems.push_back(inputitem);
+		long t = full ? -1 : inputs[i]->timeout();
+		if ((t >= 0) && ((timeout < 0) || (t < timeout)))
+			timeout = t;
+	}
+	long outputtimeout = output ? output->timeout() : -1;
+	if ((outputtimeout >= 0) && ((timeout < 0) || (outputtimeout < timeout)))
+		timeout = outputtimeout;
+	try {
+		zmq_poll_ms(&pollitems[0], pollitems.size(), timeout);
+	} catch (zmq::error_t &e) {
+		if (e.num() != EINTR)
+			throw;
+	}
+	for (size_t i = 0; i < shmslaves.size(); i++) {
+		if (shmwaiting[i])
+			slaves[shmslaves[i]].shm->up->finishWait();
+	}
+	receiveShm();
+	if (pollitems[0].revents & ZMQ_POLLIN) {
+		while (zmq_recv_frame(*socket, recvidentity, ZMQ_DONTWAIT)) {
+			if (!zmq_has_more(*socket)) {
+				WARN("Message without payload from %s", recvidentity.c_str());
+				continue;
+			}
+			if (zmq_recv_message(*socket, received))
+				handleMessage(recvidentity, received);
+		}
+	}
+	readInputs(firstinput);
+	dispatch();
+	if (output && (output->timeout() == 0))
+		output->flush();
+}
+
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Integration test
+/////////////////////////////////////////////////////////////////////////////
+
+#ifdef DEBUG_DISPATCHER_CPP
+
+#include <fstream>
+
+#define TEST_SLAVES 3
+#define TEST_EVENTS 200000
+
+using namespace sawmill;
+
+#define TEST_PREFIX "integration test "
+#define TEST_LINGER_MS 500 // Polled after the last event came out, to see late duplicates
+
+/**
+ * Counts how often every event comes out, by the number in its message.
+ */
+class CountingOutput : public EventOutput
+{
+public:
+	CountingOutput() : count(0), distinct(0), tagged(0), unknown(0), seen(TEST_EVENTS, 0) {}
+	void output(LogEvent &event)
+	{
+		count++;
+		if ((event.tag_size() == 1) && (event.tag(0) == "seen"))
+			tagged++;
+		const std::string &msg = event.message();
+		long n = -1;
+		if (msg.compare(0, sizeof(TEST_PREFIX) - 1, TEST_PREFIX) == 0)
+			n = strtol(msg.c_str() + sizeof(TEST_PREFIX) - 1, NULL, 10);
+		if ((n >= 0) && (n < TEST_EVENTS)) {
+			if (!seen[n]++)
+				distinct++;
+		} else {
+			unknown++;
+		}
+	}
+	int count;
+	int distinct; // Events that came out at least once
+	int tagged;
+	int unknown;
+	std::vector<int> seen;
+};
+
+/**
+ * Corrupt the first shared memory ring of the process, as a bad write would: its head runs far
+ * past what fits. Returns false if there is no ring.
+ */
+static bool corrupt_ring()
+{
+	std::ifstream maps("/proc/self/maps");
+	std::string line;
+	unsigned long page = sysconf(_SC_PAGESIZE);
+	while (std::getline(maps, line)) {
+		unsigned long start, end, offset;
+		char perms[8];
+		if ((line.find("/memfd:sawmill-ring") == std::string::npos) ||
+		    (sscanf(line.c_str(), "%lx-%lx %7s %lx", &start, &end, perms, &offset) != 4))
+			continue;
+		// The header is the first page of the memfd, it starts with the head of the producer
+		if ((offset != 0) || (end - start != page))
+			continue;
+		reinterpret_cast<std::atomic<uint64_t> *>(start)->fetch_add(1ULL << 40);
+		return true;
+	}
+	return false;
+}
+
+/**
+ * What goes wrong in the middle of a run.
+ */
+enum Trouble {
+	TROUBLE_NONE,
+	TROUBLE_KILL,    // A slave is killed, its events must be redone
+	TROUBLE_CORRUPT, // A ring is corrupted, it is given up for 0MQ
+	TROUBLE_STOP     // The slaves of the first stage stop for a while: handoffs to them come back
+};
+
+static int run_test(const std::string &endpoint, Trouble trouble, bool pipelined = false, size_t ringsize = 0,
+                    int credits = SLAVE_DEFAULT_CREDITS)
+{
+	FilterConfig config;
+	config.set_version(0);
+	Filter *f = config.add_filter();
+	f->set_filterid(1);
+	f->set_type("test");
+	FilterStep *s = f->add_step();
+	s->set_plugin("addtag");
+	s->set_stepnumber(0);
+	Field *p = s->add_parameter();
+	p->set_key("tag");
+	p->set_value("seen");
+	FilterConfigStore store;
+	store.update(config);
+
+	CountingOutput out;
+	Dispatcher dispatcher(endpoint);
+	dispatcher.setSlaveCount(TEST_SLAVES);
+	dispatcher.setOutput(&out);
+	if (pipelined) {
+		// The events that go to the second slave are handed off to the others for addtag
+		std::vector<std::vector<std::string> > stages(2);
+		stages[0].push_back("addtag");
+		stages[1].push_back("removefield");
+		dispatcher.setPipeline(stages);
+	}
+	dispatcher.setSharedMemory(ringsize);
+	dispatcher.setSlaveCredits(credits);
+	if (trouble == TROUBLE_STOP) {
+		// A handoff per event, to fill the queues of the stopped peers
+		dispatcher.batching().setLimits(1, 1, 5000);
+	}
+	if (!dispatcher.start(store))
+		return 1;
+
+	char message[64];
+	for (int i = 0; i < TEST_EVENTS; i++) {
+		LogEvent *event = dispatcher.newEvent();
+		event->mutable_type()->assign("test");
+		snprintf(message, sizeof(message), TEST_PREFIX "%d", i);
+		event->mutable_message()->assign(message);
+		dispatcher.submit(event);
+	}
+	bool happened = (trouble == TROUBLE_NONE);
+	time_t stopped = 0;
+	bool withincredits = true;
+	size_t maxbatches = 0;
+	DispatcherStats stats;
+	uint64_t start = now_us();
+	time_t deadline = time(NULL) + 30;
+	while ((out.distinct < TEST_EVENTS) && (time(NULL) < deadline)) {
+		dispatcher.poll(10);
+		dispatcher.getStats(stats);
+		withincredits = withincredits && (stats.batches <= stats.credits);
+		maxbatches = std::max(maxbatches, stats.batches);
+		if (!happened && (out.count > TEST_EVENTS / 3)) {
+			std::vector<pid_t> pids;
+			dispatcher.getSlavePids(pids);
+			if (trouble == TROUBLE_KILL) {
+				kill(pids[0], SIGKILL);
+				happened = true;
+			} else if (trouble == TROUBLE_CORRUPT) {
+				happened = corrupt_ring();
+			} else if (trouble == TROUBLE_STOP) {
+				// Started first and third
+				kill(pids[0], SIGSTOP);
+				kill(pids[2], SIGSTOP);
+				stopped = time(NULL);
+				happened = true;
+			}
+		}
+		if (stopped && (time(NULL) > stopped + 2)) {
+			std::vector<pid_t> pids;
+			dispatcher.getSlavePids(pids);
+			for (size_t i = 0; i < pids.size(); i++) {
+				kill(pids[i], SIGCONT);
+			}
+			stopped = 0;
+		}
+	}
+	uint64_t elapsed = now_us() - start;
+	// Events redone after a failure could still come out a second time
+	uint64_t linger = now_us() + TEST_LINGER_MS * 1000;
+	while (now_us() < linger) {
+		dispatcher.poll(10);
+	}
+	dispatcher.stop();
+	static const char *const troubles[] = { "", " (slave killed)", " (ring corrupted)", " (peers stopped)" };
+	int missing = TEST_EVENTS - out.distinct, duplicates = out.count - out.unknown - out.distinct;
+	bool ok = !missing && !duplicates && !out.unknown && (out.tagged == out.count) && withincredits && happened;
+	printf("%s%s%s%s, %d credits: %d/%d events, %d missing, %d duplicates, %d tagged, at most %d batches out, "
+	       "%.0f events/s -> %s\n", endpoint.c_str(), pipelined ? " (pipeline)" : "", ringsize ? " (shm)" : "",
+	       troubles[trouble], credits, out.count, TEST_EVENTS, missing, duplicates, out.tagged, (int)maxbatches,
+	       TEST_EVENTS * 1000000.0 / elapsed, ok ? "OK" : "FAILED");
+	return ok ? 0 : 1;
+}
+
+int main()
+{
+	std::ostringstream ipc;
+	ipc << "ipc:///tmp/sawmill-test-" << getpid();
+	int rc = run_test(ipc.str(), TROUBLE_KILL);
+	rc |= run_test(ipc.str(), TROUBLE_KILL, false, 1024 * 1024);
+	rc |= run_test("inproc://sawmill-test", TROUBLE_NONE);
+	rc |= run_test("inproc://sawmill-test", TROUBLE_NONE, false, 0, 1);
+	rc |= run_test("inproc://sawmill-test", TROUBLE_NONE, false, 1024 * 1024, 4);
+	rc |= run_test("inproc://sawmill-test", TROUBLE_NONE, true);
+	rc |= run_test("inproc://sawmill-test", TROUBLE_NONE, true, 1024 * 1024);
+	// Batches that don't fit a small ring go over 0MQ behind the ones in it
+	rc |= run_test("inproc://sawmill-test", TROUBLE_NONE, false, 4096, 4);
+	rc |= run_test(ipc.str(), TROUBLE_NONE, false, 4096, 4);
+	rc |= run_test("inproc://sawmill-test", TROUBLE_CORRUPT, false, 1024 * 1024, 4);
+	rc |= run_test(ipc.str(), TROUBLE_CORRUPT, true, 1024 * 1024);
+	rc |= run_test(ipc.str(), TROUBLE_KILL, true);
+	rc |= run_test(ipc.str(), TROUBLE_STOP, true);
+	return rc;
+}
+#endif
@@ -0,0 +1,269 @@
+#ifndef __DISPATCHER_H
+# define __DISPATCHER_H
+
+#include <map>
+#include <deque>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <sys/types.h>
+#include <zmq.hpp>
+#include "filterconfig.h"
+#include "eventoutput.h"
+#include "eventinput.h"
+#include "eventbatch.h"
+#include "shmring.h"
+
+namespace sawmill {
+
+/**
+ * Decides how many queued events go into the next PROCESS batch.
+ *
+ * The queue is spread over the idle slaves, so batches grow with the queue depth. Batches
+ * smaller than the minimum size are held back until the oldest queued event reaches the
+ * maximum latency.
+ */
+class BatchSizer
+{
+public:
+	BatchSizer(size_t minbatch = 16, size_t maxbatch = 512, long maxlatency_us = 5000);
+
+	void setLimits(size_t minbatch, size_t maxbatch, long maxlatency_us);
+	long getMaxLatency() const { return maxlatency; }
+
+	/**
+	 * Returns the size of the next batch, 0 if it is better to wait for more events.
+	 */
+	size_t next(size_t queued, size_t idleslaves, uint64_t oldestage_us) const;
+private:
+	size_t minbatch;
+	size_t maxbatch;
+	long maxlatency;
+};
+
+/**
+ * Queue depths and counters of a Dispatcher.
+ */
+struct DispatcherStats
+{
+	size_t queued;       // Events waiting for a slave
+	size_t queuelimit;   // From this many queued events on, the inputs are paused or spool
+	size_t inflight;     // Events sent to the slaves that are not done yet
+	size_t batches;      // PROCESS batches at the slaves without reply
+	size_t credits;      // Batches the slaves take at once, all together
+	size_t readyslaves;  // Slaves with credits left
+	uint64_t submitted;  // Events submitted since the start
+	uint64_t paused;     // Polls that found the queue full
+};
+
+/**
+ * Dispatcher side of the FilterMessage protocol: starts the filter slaves, keeps them
+ * configured and hands out the queued events to them.
+ *
+ * Slaves are forked processes for ipc:// and tcp:// endpoints, and threads for inproc://
+ * endpoints. Dead slaves are restarted and the events they had in flight are queued again.
+ * Events are sent in batches sized by the BatchSizer. Every slave takes as many batches at once
+ * as the credits it announced, slaves with credits left are served in least-recently-used order,
+ * so the load is spread fairly.
+ *
+ * The slaves it starts itself can exchange their messages with it through shared memory rings
+ * instead of the 0MQ socket.
+ *
+ * Every slave gets the endpoints and plugins of the others, so it can hand events off to a slave
+ * that runs the plugin of their next step. The batch is kept until the results of all its events
+ * came back, from whichever slave finished them.
+ *
+ * The inputs are polled in the same loop. While the queue is full they only get to take in
+ * their input (to buffer it on disk, for example), not to submit it. So the events in memory are
+ * bounded by the queue limit plus the credits of the slaves times the batch size, and a slow
+ * filter slows down the inputs.
+ *
+ * Submitted events are numbered, so inputs can tell which of their events are done with.
+ */
+class Dispatcher : public EventSink
+{
+public:
+	explicit Dispatcher(const std::string &endpoint);
+	~Dispatcher();
+
+	void setEndpoint(const std::string &ep);
+	void setSlaveCount(int count);
+	int getSlaveCount() const;
+	void setOutput(EventOutput *out);
+	BatchSizer &batching() { return batchsizer; }
+	/**
+	 * Run the slaves as a pipeline: slave i only runs the plugins of stages[i % stages.size()],
+	 * the other steps are handed off. Call before start().
+	 */
+	void setPipeline(const std::vector<std::vector<std::string> > &stages);
+	/**
+	 * Talk to the slaves started from now on through shared memory rings of 'ringsize' bytes
+	 * per direction, 0 for 0MQ only. Messages that don't fit a ring still go over 0MQ.
+	 */
+	void setSharedMemory(size_t ringsize);
+	/**
+	 * Credits of the slaves started from now on, see FilterSlave::setCredits().
+	 */
+	void setSlaveCredits(int credits);
+	/**
+	 * The inputs are not read (or only spool) while this many events are queued.
+	 */
+	void setQueueLimit(size_t events);
+	/**
+	 * Read events from 'input' in poll(). The input is not owned.
+	 */
+	void addInput(EventInput *input);
+
+	/**
+	 * Bind the endpoint and start the slaves, which get 'config' once they said HELLO.
+	 */
+	bool start(const FilterConfigStore &config);
+	/**
+	 * Say BYE to all slaves and wait for them to exit.
+	 */
+	void stop();
+
+	/**
+	 * The config store has a new version: push it to all slaves.
+	 */
+	void configChanged();
+
+	/**
+	 * Get an empty event to fill in and pass to submit(LogEvent *). Events are recycled, so
+	 * filling them in with assign() on the mutable strings doesn't allocate.
+	 */
+	LogEvent *newEvent();
+	void submit(LogEvent *event);
+	void submit(const LogEvent &event);
+	uint64_t submitted() const;
+	uint64_t oldestPending() const;
+	size_t pending() const;
+	size_t inFlight() const;
+	size_t readySlaves() const;
+	void getStats(DispatcherStats &stats) const;
+	void getSlavePids(std::vector<pid_t> &pids) const;
+
+	/**
+	 * One iteration of the dispatcher loop: handle the messages of the slaves, send queued
+	 * events to idle slaves and restart dead slaves. Waits at most 'timeout' milliseconds.
+	 */
+	void poll(long timeout);
+private:
+	/**
+	 * A message for a slave that waits in line for its ring. One that is too big for the ring
+	 * goes over 0MQ, once the slave read everything before it from the ring.
+	 */
+	struct ShmPending {
+		std::string data; // Serialized
+		bool zmq;         // Too big for the ring
+	};
+	struct Slave {
+		std::string identity;
+		int slaveid;
+		pid_t pid;
+		bool hello;
+		int configversion;
+		int stage;            // Index in the pipeline stages, -1 for all plugins
+		int credits;          // PROCESS batches it takes at once
+		bool ready;           // In the idle list: configured and credits left
+		std::string endpoint; // Where it accepts handoffs, empty if it doesn't
+		std::vector<std::string> plugins;
+		std::deque<FilterMessage *> inflight; // PROCESS messages sent, oldest first
+		ShmChannel *shm;                      // NULL when using 0MQ only
+		std::deque<ShmPending> shmbacklog;    // Messages waiting for room in the ring, in order
+	};
+	struct SlaveThread;
+	/**
+	 * Batch with events that were handed off to another slave.
+	 */
+	struct Handoff {
+		FilterMessage *batch;   // As it was sent, to queue events again
+		std::vector<bool> done; // Per event: output, dropped or queued again
+		int remaining;
+		bool replied;           // The PROCESS reply is in, the batch is no longer in flight at a slave
+		bool requeue;           // A slave was lost, queue the handed off events again instead of waiting
+
+		explicit Handoff(FilterMessage *b)
+			:batch(b), done(b->events_size(), false), remaining(b->events_size()), replied(false), requeue(false) {}
+	};
+
+	bool isThreaded() const;
+	void spawnSlave(int stage);
+	static void runSlaveThread(zmq::context_t *context, std::string endpoint, SlaveThread *st);
+	void reapSlaves();
+	int slaveStage(const std::string &identity) const;
+	void slaveLost(const std::string &identity);
+	void requeueHandoffs(Slave &slave);
+	void requeueInFlight(Slave &slave);
+	void shmBroken(Slave &slave);
+	void handleMessage(const std::string &identity, FilterMessage &msg);
+	void sendConfig(Slave &slave);
+	void sendPeers();
+	void sendTo(const std::string &identity, const FilterMessage &msg);
+	void flushBacklogs();
+	void flushBacklog(Slave &slave);
+	void receiveShm();
+	void readInputs(size_t first);
+	void dispatch();
+	void handleProcessed(Slave &slave, FilterMessage &msg);
+	void handleContinued(Slave &slave, FilterMessage &msg);
+	void markReady(Slave &slave);
+	FilterMessage *findInFlight(int batchid);
+	void resolve(Handoff &handoff, int index);
+	void requeue(Handoff &handoff, int index);
+	void requeueEvent(LogEvent *event, uint64_t seq);
+	uint64_t batchSeq(const FilterMessage *batch) const;
+	long dispatchDelay() const;
+	FilterMessage *newBatch();
+	void freeBatch(FilterMessage *batch);
+
+	std::string endpoint;
+	int slavecount;
+	std::vector<std::vector<std::string> > stages;
+	size_t ringsize;
+	int slavecredits;
+	size_t queuelimit;
+	uint64_t paused;
+	int nextslaveid;
+	int spawned;
+	bool running;
+	const FilterConfigStore *config;
+	EventOutput *output;
+	std::vector<EventInput *> inputs;
+	zmq::context_t *context;
+	zmq::socket_t *socket;
+
+	std::map<std::string, Slave> slaves;
+	std::map<pid_t, std::string> slavepids;
+	std::vector<SlaveThread *> threads;
+	std::deque<std::string> idle; // Slaves with credits left, least recently used first
+	EventPool pool;
+	EventQueue queue;
+	uint64_t nextseq;
+	size_t frontcount;  // Events put back at the front of the queue and still in it...
+	uint64_t frontmin;  // ...and the lowest number they had, the others in the queue are newer
+	std::map<int, uint64_t> batchseqs; // Lowest event number per batch ID, until the batch is done
+	uint64_t stopseq;   // oldestPending() when stop() dropped the events in flight, they are never done
+	size_t inflight;
+	BatchSizer batchsizer;
+	std::vector<FilterMessage *> sparebatches;
+	int nextbatchid;
+	std::map<int, Handoff> handoffs; // By batch ID
+	std::vector<bool> handedoff;     // Scratch space for handleProcessed()
+
+	// Receive buffers, reused so their memory is recycled
+	std::string recvidentity;
+	FilterMessage received;
+	std::vector<zmq::pollitem_t> pollitems;
+	std::vector<std::string> shmslaves; // Identity per ring in pollitems
+	std::vector<char> shmwaiting;       // Per ring: prepareWait() said to wait
+	std::vector<ShmChannel *> brokenshm; // Given up channels, kept until the slave threads are gone
+
+	// Not copyable
+	Dispatcher(const Dispatcher &);
+	Dispatcher &operator=(const Dispatcher &);
+};
+
+} // namespace sawmill
+
+#endif // ifndef __DISPATCHER_H
@@ -0,0 +1,227 @@
+/****************************************************************************
+ * Project: SawMill
+ * Authors:
+ *          Bart Meuris <bart . meuris @ gmail . com>
+ *
+ * License: (to be discussed LGPL version 2.0?)
+ ****************************************************************************
+ * Module description:
+ *     Recycling of LogEvents on the event hot path, so processing an event
+ *     doesn't need any allocations once the pools are warmed up.
+ *
+ ***************************************************************************/
+
+#include "eventbatch.h"
+
+#define EVENTQUEUE_INITIAL 1024
+
+namespace sawmill {
+
+EventPool::EventPool(size_t max)
+	:events(), maxspare(max), count(0)
+{
+}
+
+EventPool::~EventPool()
+{
+	for (size_t i = 0; i < events.size(); i++) {
+		delete events[i];
+	}
+}
+
+LogEvent *EventPool::get()
+{
+	if (events.empty()) {
+		count++;
+		return new LogEvent();
+	}
+	LogEvent *event = events.back();
+	events.pop_back();
+	return event;
+}
+
+void EventPool::put(LogEvent *event)
+{
+	if (events.size() >= maxspare) {
+		delete event;
+		return;
+	}
+	event->Clear();
+	events.push_back(event);
+}
+
+size_t EventPool::spare() const
+{
+	return events.size();
+}
+
+uint64_t EventPool::created() const
+{
+	return count;
+}
+
+EventQueue::EventQueue()
+	:ring(EVENTQUEUE_INITIAL), head(0), count(0)
+{
+}
+
+void EventQueue::grow()
+{
+	std::vector<Entry> bigger(ring.size() * 2);
+	for (size_t i = 0; i < count; i++) {
+		bigger[i] = ring[(head + i) % ring.size()];
+	}
+	ring.swap(bigger);
+	head = 0;
+}
+
+void EventQueue::push_back(LogEvent *event, uint64_t time, uint64_t seq)
+{
+	if (count == ring.size())
+		grow();
+	Entry &entry = ring[(head + count) % ring.size()];
+	entry.event = event;
+	entry.time = time;
+	entry.seq = seq;
+	count++;
+}
+
+void EventQueue::push_front(LogEvent *event, uint64_t time, uint64_t seq)
+{
+	if (count == ring.size())
+		grow();
+	head = (head + ring.size() - 1) % ring.size();
+	ring[head].event = event;
+	ring[head].time = time;
+	ring[head].seq = seq;
+	count++;
+}
+
+void EventQueue::pop_front()
+{
+	head = (head + 1) % ring.size();
+	count--;
+}
+
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Benchmark: allocations per event on the dispatcher/slave path
+/////////////////////////////////////////////////////////////////////////////
+
+#ifdef DEBUG_EVENTBATCH_CPP
+
+#include <new>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include "command.pb.h"
+#include "filterengine.h"
+
+#define BENCH_WARMUP     100
+#define BENCH_BATCHES    2000
+#define BENCH_BATCHSIZE  256
+
+static uint64_t allocations = 0;
+
+void *operator new(size_t size)
+{
+	allocations++;
+	void *p = malloc(size ? size : 1);
+	if (p == NULL)
+		throw std::bad_alloc();
+	return p;
+}
+void *operator new[](size_t size) { return operator new(size); }
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+void operator delete[](void *p, size_t) noexcept { free(p); }
+
+using namespace sawmill;
+
+int main()
+{
+	FilterConfig config;
+	config.set_version(0);
+	Filter *f = config.add_filter();
+	f->set_filterid(1);
+	f->set_type("syslog");
+	FilterStep *s = f->add_step();
+	s->set_plugin("setfield");
+	s->set_stepnumber(0);
+	Field *p = s->add_parameter();
+	p->set_key("environment");
+	p->set_value("production-datacenter-1");
+	s = f->add_step();
+	s->set_plugin("addtag");
+	s->set_stepnumber(1);
+	p = s->add_parameter();
+	p->set_key("tag");
+	p->set_value("processed-by-sawmill");
+
+	FilterConfigStore store;
+	store.update(config);
+	FilterEngine engine;
+	engine.load(store);
+
+	// Dispatcher side
+	EventPool pool;
+	EventQueue queue;
+	FilterMessage batch, received;
+	std::string wire;
+	// Slave side
+	FilterMessage msg, reply;
+	FilterEngine::EventList events;
+	std::vector<StepResult> results;
+	uint64_t outputs = 0;
+
+	uint64_t before = 0;
+	for (int b = 0; b < BENCH_WARMUP + BENCH_BATCHES; b++) {
+		if (b == BENCH_WARMUP)
+			before = allocations;
+
+		// Input fills pooled events. Note: set_xxx(const char *) builds a temporary std::string,
+		// assign() on the mutable string reuses the memory of the recycled event.
+		for (int i = 0; i < BENCH_BATCHSIZE; i++) {
+			LogEvent *e = pool.get();
+			e->mutable_type()->assign("syslog");
+			e->mutable_timestamp()->assign("2013-11-13T10:11:12.123456+01:00");
+			e->mutable_source()->assign("/var/log/syslog.with.a.long.name");
+			e->mutable_message()->assign("Nov 13 10:11:12 host program[1234]: a message that is longer than the small string buffer");
+			queue.push_back(e, 0);
+		}
+		// Dispatcher builds and serializes the batch
+		batch.Clear();
+		batch.set_command(FilterMessage::PROCESS);
+		while (!queue.empty()) {
+			batch.add_events()->Swap(queue.front());
+			pool.put(queue.front());
+			queue.pop_front();
+		}
+		batch.SerializeToString(&wire);
+
+		// Slave processes it
+		msg.ParseFromString(wire);
+		reply.Clear();
+		reply.set_command(FilterMessage::PROCESS);
+		events.Swap(msg.mutable_events());
+		engine.process(events, results);
+		for (int i = 0; i < events.size(); i++) {
+			reply.add_result()->set_action(EventResult::PASS);
+			reply.add_events()->Swap(events.Mutable(i));
+		}
+		reply.SerializeToString(&wire);
+
+		// Dispatcher handles the reply
+		received.ParseFromString(wire);
+		outputs += received.events_size();
+	}
+	uint64_t total = allocations - before;
+
+	printf("%llu events, %llu allocations after warmup: %.4f allocations/event (pool created %llu events)\n",
+	       (unsigned long long)outputs, (unsigned long long)total,
+	       (double)total / (BENCH_BATCHES * BENCH_BATCHSIZE), (unsigned long long)pool.created());
+	return 0;
+}
+#endif
@@ -0,0 +1,72 @@
+#ifndef __EVENTBATCH_H
+# define __EVENTBATCH_H
+
+#include <vector>
+#include <utility>
+#include <stdint.h>
+#include "logevent.pb.h"
+
+namespace sawmill {
+
+/**
+ * Recycles LogEvent objects. Clear() keeps the memory of their strings and repeated fields, so
+ * once the pool is warmed up, filling in an event does not allocate.
+ *
+ * Not thread safe, use one pool per thread.
+ */
+class EventPool
+{
+public:
+	explicit EventPool(size_t maxspare = 65536);
+	~EventPool();
+
+	LogEvent *get();
+	void put(LogEvent *event);
+
+	size_t spare() const;
+	uint64_t created() const;
+private:
+	std::vector<LogEvent *> events;
+	size_t maxspare;
+	uint64_t count;
+
+	// Not copyable
+	EventPool(const EventPool &);
+	EventPool &operator=(const EventPool &);
+};
+
+/**
+ * FIFO of events with the time they were queued and their sequence number. Unlike std::deque it
+ * keeps its memory when it shrinks, so it doesn't allocate either at steady state.
+ */
+class EventQueue
+{
+public:
+	EventQueue();
+
+	void push_back(LogEvent *event, uint64_t time, uint64_t seq = 0);
+	void push_front(LogEvent *event, uint64_t time, uint64_t seq = 0);
+	void pop_front();
+
+	LogEvent *front() const { return ring[head].event; }
+	uint64_t frontTime() const { return ring[head].time; }
+	uint64_t frontSeq() const { return ring[head].seq; }
+	size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+private:
+	struct Entry {
+		LogEvent *event;
+		uint64_t time;
+		uint64_t seq;
+	};
+
+	void grow();
+
+	std::vector<Entry> ring;
+	size_t head;
+	size_t count;
+};
+
+} // namespace sawmill
+
+#endif // ifndef __EVENTBATCH_H
@@ -0,0 +1,64 @@
+#ifndef __EVENTINPUT_H
+# define __EVENTINPUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "logevent.pb.h"
+
+namespace sawmill {
+
+/**
+ * Takes the events of the inputs, implemented by the Dispatcher.
+ */
+class EventSink
+{
+public:
+	virtual ~EventSink() {}
+
+	/**
+	 * Get an empty (recycled) event to fill in and pass to submit().
+	 */
+	virtual LogEvent *newEvent() = 0;
+	virtual void submit(LogEvent *event) = 0;
+
+	/**
+	 * Events are numbered in the order they are submitted. submitted() is the number of the next
+	 * one, oldestPending() the number of the oldest one that isn't done yet, or submitted() when
+	 * all are. Sinks that are done with an event when submit() returns keep the defaults.
+	 */
+	virtual uint64_t submitted() const { return 0; }
+	virtual uint64_t oldestPending() const { return submitted(); }
+};
+
+/**
+ * Source of events, polled together with the slaves by the dispatcher loop.
+ */
+class EventInput
+{
+public:
+	virtual ~EventInput() {}
+
+	/**
+	 * File descriptor that becomes readable when there is new input, -1 if there is none.
+	 */
+	virtual int fd() const = 0;
+	/**
+	 * Milliseconds until read() has to be called even if fd() didn't become readable, -1 for
+	 * never. 0 when there is input left that read() didn't get to.
+	 */
+	virtual long timeout() const = 0;
+	/**
+	 * Submit at most 'max' events of the available input, without blocking. Returns the number
+	 * of events submitted.
+	 */
+	virtual size_t read(EventSink &sink, size_t max) = 0;
+	/**
+	 * Whether read() with a 'max' of 0 still takes in the available input, to submit it later.
+	 * Only these inputs are read while the sink is full.
+	 */
+	virtual bool spools() const { return false; }
+};
+
+} // namespace sawmill
+
+#endif // ifndef __EVENTINPUT_H
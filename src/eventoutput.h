@@ -0,0 +1,30 @@
+#ifndef __EVENTOUTPUT_H
+# define __EVENTOUTPUT_H
+
+#include "logevent.pb.h"
+
+namespace sawmill {
+
+/**
+ * Receives the events that made it through the filters.
+ */
+class EventOutput
+{
+public:
+	virtual ~EventOutput() {}
+
+	virtual void output(LogEvent &event) = 0;
+
+	/**
+	 * Milliseconds until flush() has to be called, -1 for never. For outputs that buffer.
+	 */
+	virtual long timeout() const { return -1; }
+	/**
+	 * Write out what is buffered, also called when the dispatcher stops.
+	 */
+	virtual void flush() {}
+};
+
+} // namespace sawmill
+
+#endif // ifndef __EVENTOUTPUT_H
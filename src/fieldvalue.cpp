@@ -0,0 +1,511 @@
+/****************************************************************************
+ * Project: SawMill
+ * Authors:
+ *          Bart Meuris <bart . meuris @ gmail . com>
+ *
+ * License: (to be discussed LGPL version 2.0?)
+ ****************************************************************************
+ * Module description:
+ *     Typed field values, parsed once and carried next to their text.
+ *
+ ***************************************************************************/
+
+#include "fieldvalue.h"
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
+
+namespace sawmill {
+
+bool FieldValue::typeByName(const std::string &name, Field::Type &type)
+{
+	static const struct {
+		const char *name;
+		Field::Type type;
+	} types[] = {
+		{ "string", Field::STRING },
+		{ "int",    Field::INT },
+		{ "double", Field::DOUBLE },
+		{ "bool",   Field::BOOL },
+		{ "bytes",  Field::BYTES },
+	};
+	for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+		if (name == types[i].name) {
+			type = types[i].type;
+			return true;
+		}
+	}
+	return false;
+}
+
+const char *FieldValue::typeName(Field::Type type)
+{
+	switch (type) {
+	case Field::STRING:
+		return "string";
+	case Field::INT:
+		return "int";
+	case Field::DOUBLE:
+		return "double";
+	case Field::BOOL:
+		return "bool";
+	case Field::BYTES:
+		return "bytes";
+	}
+	return "unknown";
+}
+
+void FieldValue::clearType(Field &field)
+{
+	field.clear_type();
+	field.clear_int_value();
+	field.clear_double_value();
+	field.clear_bool_value();
+}
+
+void FieldValue::setString(Field &field, const std::string &value)
+{
+	clearType(field);
+	field.mutable_value()->assign(value);
+}
+
+void FieldValue::setBytes(Field &field, const std::string &value)
+{
+	clearType(field);
+	field.set_type(Field::BYTES);
+	field.mutable_value()->assign(value);
+}
+
+void FieldValue::setInt(Field &field, int64_t value)
+{
+	clearType(field);
+	field.set_type(Field::INT);
+	field.set_int_value(value);
+	formatInt(value, *field.mutable_value());
+}
+
+void FieldValue::setDouble(Field &field, double value)
+{
+	clearType(field);
+	field.set_type(Field::DOUBLE);
+	field.set_double_value(value);
+	formatDouble(value, *field.mutable_value());
+}
+
+void FieldValue::setBool(Field &field, bool value)
+{
+	clearType(field);
+	field.set_type(Field::BOOL);
+	field.set_bool_value(value);
+	field.mutable_value()->assign(value ? "true" : "false");
+}
+
+void FieldValue::copyValue(const Field &src, Field &dst)
+{
+	clearType(dst);
+	if (src.has_value())
+		dst.mutable_value()->assign(src.value());
+	else
+		dst.clear_value();
+	if (!src.has_type())
+		return;
+	dst.set_type(src.type());
+	switch (src.type()) {
+	case Field::INT:
+		dst.set_int_value(src.int_value());
+		break;
+	case Field::DOUBLE:
+		dst.set_double_value(src.double_value());
+		break;
+	case Field::BOOL:
+		dst.set_bool_value(src.bool_value());
+		break;
+	default:
+		break;
+	}
+}
+
+bool FieldValue::convert(Field &field, Field::Type type)
+{
+	if (field.has_type() && (field.type() == type))
+		return true;
+	// The text of a string field is kept as it is, only a typed value is written out again
+	bool keeptext = !field.has_type() || (field.type() == Field::STRING) || (field.type() == Field::BYTES);
+	switch (type) {
+	case Field::INT: {
+		int64_t v;
+		if (!getInt(field, v))
+			return false;
+		if (!keeptext) {
+			setInt(field, v);
+			return true;
+		}
+		field.set_type(Field::INT);
+		field.set_int_value(v);
+		return true;
+	}
+	case Field::DOUBLE: {
+		double v;
+		if (!getDouble(field, v))
+			return false;
+		if (!keeptext) {
+			setDouble(field, v);
+			return true;
+		}
+		field.set_type(Field::DOUBLE);
+		field.set_double_value(v);
+		return true;
+	}
+	case Field::BOOL: {
+		bool v;
+		if (!getBool(field, v))
+			return false;
+		if (!keeptext) {
+			setBool(field, v);
+			return true;
+		}
+		field.set_type(Field::BOOL);
+		field.set_bool_value(v);
+		return true;
+	}
+	case Field::BYTES:
+		clearType(field);
+		field.set_type(Field::BYTES);
+		return true;
+	case Field::STRING:
+		clearType(field);
+		return true;
+	}
+	return false;
+}
+
+bool FieldValue::getInt(const Field &field, int64_t &value)
+{
+	if (field.has_type()) {
+		switch (field.type()) {
+		case Field::INT:
+			value = field.int_value();
+			return true;
+		case Field::DOUBLE: {
+			// Only whole numbers in range
+			double d = field.double_value();
+			if ((d < -9223372036854775808.0) || (d >= 9223372036854775808.0) || (d != (double)(int64_t)d))
+				return false;
+			value = (int64_t)d;
+			return true;
+		}
+		case Field::BOOL:
+			value = field.bool_value() ? 1 : 0;
+			return true;
+		default:
+			break;
+		}
+	}
+	return parseInt(field.value(), value);
+}
+
+bool FieldValue::getDouble(const Field &field, double &value)
+{
+	if (field.has_type()) {
+		switch (field.type()) {
+		case Field::INT:
+			value = (double)field.int_value();
+			return true;
+		case Field::DOUBLE:
+			value = field.double_value();
+			return true;
+		case Field::BOOL:
+			value = field.bool_value() ? 1.0 : 0.0;
+			return true;
+		default:
+			break;
+		}
+	}
+	return parseDouble(field.value(), value);
+}
+
+bool FieldValue::getBool(const Field &field, bool &value)
+{
+	if (field.has_type()) {
+		switch (field.type()) {
+		case Field::INT:
+			value = (field.int_value() != 0);
+			return true;
+		case Field::DOUBLE:
+			value = (field.double_value() != 0.0);
+			return true;
+		case Field::BOOL:
+			value = field.bool_value();
+			return true;
+		default:
+			break;
+		}
+	}
+	return parseBool(field.value(), value);
+}
+
+bool FieldValue::equals(const Field &field, const Field &wanted)
+{
+	if (!wanted.has_type())
+		return field.value() == wanted.value();
+	switch (wanted.type()) {
+	case Field::INT: {
+		int64_t i;
+		double d;
+		if (getInt(field, i))
+			return i == wanted.int_value();
+		return getDouble(field, d) && (d == (double)wanted.int_value());
+	}
+	case Field::DOUBLE: {
+		double d;
+		return getDouble(field, d) && (d == wanted.double_value());
+	}
+	case Field::BOOL: {
+		bool b;
+		return getBool(field, b) && (b == wanted.bool_value());
+	}
+	default:
+		break;
+	}
+	return field.value() == wanted.value();
+}
+
+bool FieldValue::parseInt(const std::string &text, int64_t &value)
+{
+	const char *s = text.c_str();
+	size_t len = text.size();
+	size_t i = 0;
+	bool negative = false;
+	if ((i < len) && ((s[i] == '-') || (s[i] == '+'))) {
+		negative = (s[i] == '-');
+		i++;
+	}
+	if (i == len)
+		return false;
+	uint64_t v = 0;
+	uint64_t limit = negative ? (uint64_t)INT64_MAX + 1 : (uint64_t)INT64_MAX;
+	for (; i < len; i++) {
+		if ((s[i] < '0') || (s[i] > '9'))
+			return false;
+		unsigned d = s[i] - '0';
+		if (v > (limit - d) / 10)
+			return false;
+		v = v * 10 + d;
+	}
+	value = negative ? (int64_t)(0 - v) : (int64_t)v;
+	return true;
+}
+
+bool FieldValue::parseDouble(const std::string &text, double &value)
+{
+	// strtod() skips leading white space, we don't
+	if (text.empty() || isspace((unsigned char)text[0]))
+		return false;
+	char *end;
+	errno = 0;
+	double v = strtod(text.c_str(), &end);
+	if ((end != text.c_str() + text.size()) || (errno == ERANGE))
+		return false;
+	value = v;
+	return true;
+}
+
+bool FieldValue::parseBool(const std::string &text, bool &value)
+{
+	static const char *truths[] = { "true", "yes", "on", "1" };
+	static const char *falsehoods[] = { "false", "no", "off", "0" };
+	for (size_t i = 0; i < sizeof(truths) / sizeof(truths[0]); i++) {
+		if (strcasecmp(text.c_str(), truths[i]) == 0) {
+			value = true;
+			return true;
+		}
+		if (strcasecmp(text.c_str(), falsehoods[i]) == 0) {
+			value = false;
+			return true;
+		}
+	}
+	return false;
+}
+
+void FieldValue::formatInt(int64_t value, std::string &text)
+{
+	char buf[24];
+	char *p = buf + sizeof(buf);
+	uint64_t v = (value < 0) ? 0 - (uint64_t)value : (uint64_t)value;
+	do {
+		*--p = '0' + (v % 10);
+		v /= 10;
+	} while (v);
+	if (value < 0)
+		*--p = '-';
+	text.assign(p, buf + sizeof(buf) - p);
+}
+
+void FieldValue::formatDouble(double value, std::string &text)
+{
+	// Shortest of the two precisions that reads back as the same value
+	char buf[32];
+	snprintf(buf, sizeof(buf), "%.15g", value);
+	if (strtod(buf, NULL) != value)
+		snprintf(buf, sizeof(buf), "%.17g", value);
+	text.assign(buf);
+}
+
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Benchmark: metric steps parsing the text every time against typed values
+/////////////////////////////////////////////////////////////////////////////
+
+#ifdef DEBUG_FIELDVALUE_CPP
+
+#include <time.h>
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/descriptor.pb.h>
+#include <google/protobuf/dynamic_message.h>
+
+#define BENCH_EVENTS 200000
+#define BENCH_STEPS  6 // Steps that read the numeric fields, after extraction
+
+using namespace sawmill;
+using namespace google::protobuf;
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Parse 'data' with the LogEvent schema from before typed fields, and check that every field
+ * reads back as the text in 'expected'.
+ */
+static bool old_peer_reads(const std::string &data, const LogEvent &expected)
+{
+	FileDescriptorProto file;
+	LogEvent::descriptor()->file()->CopyTo(&file);
+	file.set_name("old_logevent.proto");
+	for (int m = 0; m < file.message_type_size(); m++) {
+		DescriptorProto *msg = file.mutable_message_type(m);
+		if (msg->name() != "Field")
+			continue;
+		msg->clear_enum_type();
+		while (msg->field_size() > 2) {
+			msg->mutable_field()->RemoveLast();
+		}
+	}
+	for (int m = 0; m < file.message_type_size(); m++) {
+		DescriptorProto *msg = file.mutable_message_type(m);
+		if (msg->name() != "LogEvent")
+			continue;
+		for (int f = msg->field_size() - 1; f >= 0; f--) {
+			if (msg->field(f).name() == "timestamp_ns")
+				msg->mutable_field()->DeleteSubrange(f, 1);
+		}
+	}
+	DescriptorPool pool;
+	const FileDescriptor *fd = pool.BuildFile(file);
+	if (!fd)
+		return false;
+	DynamicMessageFactory factory(&pool);
+	const Descriptor *eventtype = fd->FindMessageTypeByName("LogEvent");
+	Message *old = factory.GetPrototype(eventtype)->New();
+	bool ok = old->ParseFromString(data);
+	const Reflection *refl = old->GetReflection();
+	const FieldDescriptor *fields = eventtype->FindFieldByName("field");
+	ok &= (refl->FieldSize(*old, fields) == expected.field_size());
+	for (int i = 0; ok && (i < expected.field_size()); i++) {
+		const Message &f = refl->GetRepeatedMessage(*old, fields, i);
+		ok &= (f.GetReflection()->GetString(f, f.GetDescriptor()->FindFieldByName("value")) == expected.field(i).value());
+	}
+	delete old;
+	return ok;
+}
+
+int main()
+{
+	char buf[32];
+	std::vector<LogEvent> events(BENCH_EVENTS);
+	for (int i = 0; i < BENCH_EVENTS; i++) {
+		Field *f = events[i].add_field();
+		f->set_key("bytes");
+		snprintf(buf, sizeof(buf), "%d", 100 + (i * 7919) % 1000000);
+		f->set_value(buf);
+		f = events[i].add_field();
+		f->set_key("duration");
+		snprintf(buf, sizeof(buf), "%d.%03d", i % 30, i % 1000);
+		f->set_value(buf);
+	}
+	std::vector<LogEvent> typed(events);
+
+	// Every step reads both values, as thresholds, buckets and sums do
+	int64_t isum1 = 0, isum2 = 0;
+	double dsum1 = 0, dsum2 = 0;
+	uint64_t t0 = now_ns();
+	for (int i = 0; i < BENCH_EVENTS; i++) {
+		for (int s = 0; s < BENCH_STEPS; s++) {
+			int64_t b;
+			double d;
+			FieldValue::parseInt(events[i].field(0).value(), b);
+			FieldValue::parseDouble(events[i].field(1).value(), d);
+			isum1 += b;
+			dsum1 += d;
+		}
+	}
+	uint64_t t1 = now_ns();
+	for (int i = 0; i < BENCH_EVENTS; i++) {
+		FieldValue::convert(*typed[i].mutable_field(0), Field::INT);
+		FieldValue::convert(*typed[i].mutable_field(1), Field::DOUBLE);
+		for (int s = 0; s < BENCH_STEPS; s++) {
+			int64_t b;
+			double d;
+			FieldValue::getInt(typed[i].field(0), b);
+			FieldValue::getDouble(typed[i].field(1), d);
+			isum2 += b;
+			dsum2 += d;
+		}
+	}
+	uint64_t t2 = now_ns();
+	printf("%d numeric steps: parse every step %.1f ns/event, convert once %.1f ns/event (%s)\n", BENCH_STEPS,
+	       (double)(t1 - t0) / BENCH_EVENTS, (double)(t2 - t1) / BENCH_EVENTS,
+	       ((isum1 == isum2) && (dsum1 == dsum2)) ? "same" : "DIFFERENT");
+
+	bool ok = true;
+	LogEvent e;
+	Field *f = e.add_field();
+	f->set_key("count");
+	FieldValue::setInt(*f, -9223372036854775807LL - 1);
+	f = e.add_field();
+	f->set_key("ratio");
+	FieldValue::setDouble(*f, 0.1);
+	f = e.add_field();
+	f->set_key("ok");
+	FieldValue::setBool(*f, true);
+	f = e.add_field();
+	f->set_key("name");
+	FieldValue::setString(*f, "sawmill");
+	ok &= (e.field(0).value() == "-9223372036854775808") && (e.field(1).value() == "0.1") && (e.field(2).value() == "true");
+
+	Field wanted;
+	wanted.set_key("ratio");
+	FieldValue::setDouble(wanted, 0.10);
+	Field text;
+	text.set_key("ratio");
+	text.set_value("1e-1");
+	ok &= FieldValue::equals(text, wanted) && FieldValue::equals(e.field(1), wanted);
+	int64_t v;
+	ok &= !FieldValue::parseInt("9223372036854775808", v) && !FieldValue::parseInt(" 1", v) && !FieldValue::parseInt("-", v);
+
+	LogEvent back;
+	back.ParseFromString(e.SerializeAsString());
+	ok &= (back.field(0).int_value() == e.field(0).int_value()) && (back.field(1).type() == Field::DOUBLE);
+	printf("Conversions: %s\n", ok ? "OK" : "FAILED");
+	bool compatible = old_peer_reads(e.SerializeAsString(), e) && old_peer_reads(typed[0].SerializeAsString(), typed[0]);
+	printf("Read by a string-only peer: %s\n", compatible ? "OK" : "FAILED");
+	return (ok && compatible) ? 0 : 1;
+}
+#endif
@@ -0,0 +1,66 @@
+#ifndef __FIELDVALUE_H
+# define __FIELDVALUE_H
+
+#include <string>
+#include <stdint.h>
+#include "logevent.pb.h"
+
+namespace sawmill {
+
+/**
+ * Typed access to the values of Fields.
+ *
+ * The setters store the typed value together with its text, so peers that only know string
+ * fields see the same value. The getters use the typed value when the field has one, and only
+ * parse the text for fields that were never converted.
+ */
+class FieldValue
+{
+public:
+	/**
+	 * Type from its name as used in the config: string, int, double, bool or bytes.
+	 */
+	static bool typeByName(const std::string &name, Field::Type &type);
+	static const char *typeName(Field::Type type);
+
+	static void setString(Field &field, const std::string &value);
+	static void setBytes(Field &field, const std::string &value);
+	static void setInt(Field &field, int64_t value);
+	static void setDouble(Field &field, double value);
+	static void setBool(Field &field, bool value);
+	/**
+	 * Copy the value and its type from 'src', the key of 'dst' is left alone.
+	 */
+	static void copyValue(const Field &src, Field &dst);
+	/**
+	 * Drop the typed value, the field is a plain string field again.
+	 */
+	static void clearType(Field &field);
+
+	/**
+	 * Parse the text of the field into a value of 'type'. Returns false if the text is not a
+	 * valid value of that type, the field is unchanged then.
+	 */
+	static bool convert(Field &field, Field::Type type);
+
+	static bool getInt(const Field &field, int64_t &value);
+	static bool getDouble(const Field &field, double &value);
+	static bool getBool(const Field &field, bool &value);
+
+	/**
+	 * True if 'field' has the value of 'wanted': compared as numbers or booleans when 'wanted'
+	 * is typed, as text otherwise.
+	 */
+	static bool equals(const Field &field, const Field &wanted);
+
+	// Text conversions, the parsers only accept the complete text
+	static bool parseInt(const std::string &text, int64_t &value);
+	static bool parseDouble(const std::string &text, double &value);
+	static bool parseBool(const std::string &text, bool &value);
+	static void formatInt(int64_t value, std::string &text);
+	static void formatDouble(double value, std::string &text);
+};
+
+} // namespace sawmill
+
+#endif // ifndef __FIELDVALUE_H
@@ -0,0 +1,1135 @@
+/****************************************************************************
+ * Project: SawMill
+ * Authors:
+ *          Bart Meuris <bart . meuris @ gmail . com>
+ *
+ * License: (to be discussed LGPL version 2.0?)
+ ****************************************************************************
+ * Module description:
+ *     File output: buffered, optionally compressed event files.
+ *
+ ***************************************************************************/
+
+#include "fileoutput.h"
+#include "sawlog.h"
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <zlib.h>
+#include <google/protobuf/io/coded_stream.h>
+#ifdef HAVE_LZ4
+# include <lz4frame.h>
+#endif
+#ifdef HAVE_ZSTD
+# include <zstd.h>
+#endif
+
+#define FILEOUTPUT_ALIGN        4096 // Blocks are page aligned
+#define FILEOUTPUT_WRITE_BLOCKS 8    // Blocks written with one writev()
+#define FILEOUTPUT_SPARE_BLOCKS (FILEOUTPUT_WRITE_BLOCKS * 2 + 2)
+#define COMPRESS_ERROR ((size_t)-1)
+
+namespace sawmill {
+
+static uint64_t clock_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * One compressed stream per file, fed a block at a time. Everything given to compress() comes
+ * out of it, so a block can be written as soon as it is compressed.
+ */
+class Compressor
+{
+public:
+	virtual ~Compressor() {}
+
+	/**
+	 * Room needed in the output for 'len' bytes of input, or for begin() and end() with 0.
+	 */
+	virtual size_t bound(size_t len) const = 0;
+	/**
+	 * These return the number of bytes put in 'dst', COMPRESS_ERROR on errors.
+	 */
+	virtual size_t begin(char *dst, size_t cap) = 0;
+	virtual size_t compress(const char *src, size_t len, char *dst, size_t cap) = 0;
+	virtual size_t end(char *dst, size_t cap) = 0;
+};
+
+class GzipCompressor : public Compressor
+{
+public:
+	explicit GzipCompressor(int level) :strm(), ok(false)
+	{
+		memset(&strm, 0, sizeof(strm));
+		// 16 + window bits: gzip header and trailer
+		ok = (deflateInit2(&strm, level ? level : Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK);
+		if (!ok)
+			ERR("Could not initialize gzip compression");
+	}
+	~GzipCompressor()
+	{
+		if (ok)
+			deflateEnd(&strm);
+	}
+	bool isOk() const { return ok; }
+	size_t bound(size_t len) const { return deflateBound(const_cast<z_stream *>(&strm), len) + 64; }
+	size_t begin(char *, size_t)
+	{
+		return (deflateReset(&strm) == Z_OK) ? 0 : COMPRESS_ERROR;
+	}
+	size_t compress(const char *src, size_t len, char *dst, size_t cap)
+	{
+		return run(src, len, dst, cap, Z_SYNC_FLUSH);
+	}
+	size_t end(char *dst, size_t cap)
+	{
+		return run(NULL, 0, dst, cap, Z_FINISH);
+	}
+private:
+	size_t run(const char *src, size_t len, char *dst, size_t cap, int flush)
+	{
+		strm.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(src));
+		strm.avail_in = len;
+		strm.next_out = reinterpret_cast<Bytef *>(dst);
+		strm.avail_out = cap;
+		int rc = deflate(&strm, flush);
+		if (((rc != Z_OK) && (rc != Z_STREAM_END) && (rc != Z_BUF_ERROR)) || strm.avail_in ||
+		    ((flush == Z_FINISH) && (rc != Z_STREAM_END))) {
+			ERR("gzip compression failed: %s", strm.msg ? strm.msg : "out of room");
+			return COMPRESS_ERROR;
+		}
+		return cap - strm.avail_out;
+	}
+
+	z_stream strm;
+	bool ok;
+};
+
+#ifdef HAVE_LZ4
+class Lz4Compressor : public Compressor
+{
+public:
+	explicit Lz4Compressor(int level) :ctx(NULL), prefs()
+	{
+		memset(&prefs, 0, sizeof(prefs));
+		prefs.frameInfo.blockSizeID = LZ4F_max1MB;
+		prefs.frameInfo.contentChecksumFlag = LZ4F_contentChecksumEnabled;
+		prefs.compressionLevel = level;
+		if (LZ4F_isError(LZ4F_createCompressionContext(&ctx, LZ4F_VERSION))) {
+			ERR("Could not initialize LZ4 compression");
+			ctx = NULL;
+		}
+	}
+	~Lz4Compressor()
+	{
+		if (ctx)
+			LZ4F_freeCompressionContext(ctx);
+	}
+	bool isOk() const { return ctx != NULL; }
+	size_t bound(size_t len) const { return LZ4F_compressBound(len, &prefs) + LZ4F_HEADER_SIZE_MAX; }
+	size_t begin(char *dst, size_t cap)
+	{
+		return check(LZ4F_compressBegin(ctx, dst, cap, &prefs));
+	}
+	size_t compress(const char *src, size_t len, char *dst, size_t cap)
+	{
+		size_t n = check(LZ4F_compressUpdate(ctx, dst, cap, src, len, NULL));
+		if (n == COMPRESS_ERROR)
+			return n;
+		size_t f = check(LZ4F_flush(ctx, dst + n, cap - n, NULL));
+		return (f == COMPRESS_ERROR) ? f : n + f;
+	}
+	size_t end(char *dst, size_t cap)
+	{
+		return check(LZ4F_compressEnd(ctx, dst, cap, NULL));
+	}
+private:
+	static size_t check(size_t rc)
+	{
+		if (!LZ4F_isError(rc))
+			return rc;
+		ERR("LZ4 compression failed: %s", LZ4F_getErrorName(rc));
+		return COMPRESS_ERROR;
+	}
+
+	LZ4F_cctx *ctx;
+	LZ4F_preferences_t prefs;
+};
+#endif // HAVE_LZ4
+
+#ifdef HAVE_ZSTD
+class ZstdCompressor : public Compressor
+{
+public:
+	explicit ZstdCompressor(int level) :ctx(ZSTD_createCCtx())
+	{
+		if (!ctx) {
+			ERR("Could not initialize zstd compression");
+			return;
+		}
+		ZSTD_CCtx_setParameter(ctx, ZSTD_c_compressionLevel, level ? level : ZSTD_CLEVEL_DEFAULT);
+		ZSTD_CCtx_setParameter(ctx, ZSTD_c_checksumFlag, 1);
+	}
+	~ZstdCompressor()
+	{
+		ZSTD_freeCCtx(ctx);
+	}
+	bool isOk() const { return ctx != NULL; }
+	// The bound of a whole frame, with room for the block headers and checksum of the flushes
+	size_t bound(size_t len) const { return ZSTD_compressBound(len) + 64; }
+	size_t begin(char *, size_t)
+	{
+		return ZSTD_isError(ZSTD_CCtx_reset(ctx, ZSTD_reset_session_only)) ? COMPRESS_ERROR : 0;
+	}
+	size_t compress(const char *src, size_t len, char *dst, size_t cap)
+	{
+		return run(src, len, dst, cap, ZSTD_e_flush);
+	}
+	size_t end(char *dst, size_t cap)
+	{
+		return run(NULL, 0, dst, cap, ZSTD_e_end);
+	}
+private:
+	size_t run(const char *src, size_t len, char *dst, size_t cap, ZSTD_EndDirective mode)
+	{
+		ZSTD_inBuffer in = { src, len, 0 };
+		ZSTD_outBuffer out = { dst, cap, 0 };
+		size_t left;
+		do {
+			left = ZSTD_compressStream2(ctx, &out, &in, mode);
+			if (ZSTD_isError(left)) {
+				ERR("zstd compression failed: %s", ZSTD_getErrorName(left));
+				return COMPRESS_ERROR;
+			}
+		} while (left && (out.pos < out.size));
+		if (left) {
+			ERR("zstd compression failed: out of room");
+			return COMPRESS_ERROR;
+		}
+		return out.pos;
+	}
+
+	ZSTD_CCtx *ctx;
+};
+#endif // HAVE_ZSTD
+
+static Compressor *createCompressor(FileOutput::Codec codec, int level)
+{
+	switch (codec) {
+	case FileOutput::GZIP: {
+		GzipCompressor *c = new GzipCompressor(level);
+		if (c->isOk())
+			return c;
+		delete c;
+		return NULL;
+	}
+#ifdef HAVE_LZ4
+	case FileOutput::LZ4: {
+		Lz4Compressor *c = new Lz4Compressor(level);
+		if (c->isOk())
+			return c;
+		delete c;
+		return NULL;
+	}
+#endif
+#ifdef HAVE_ZSTD
+	case FileOutput::ZSTD: {
+		ZstdCompressor *c = new ZstdCompressor(level);
+		if (c->isOk())
+			return c;
+		delete c;
+		return NULL;
+	}
+#endif
+	default:
+		return NULL;
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Appends 's' as a JSON string. Needs at most 6 bytes per character plus 2.
+ */
+static char *jsonString(char *p, const std::string &s)
+{
+	static const char hex[] = "0123456789abcdef";
+	*p++ = '"';
+	const unsigned char *c = reinterpret_cast<const unsigned char *>(s.data());
+	const unsigned char *end = c + s.size();
+	for (; c < end; c++) {
+		if ((*c >= 0x20) && (*c != '"') && (*c != '\\')) {
+			*p++ = *c;
+			continue;
+		}
+		*p++ = '\\';
+		switch (*c) {
+		case '"':  *p++ = '"'; break;
+		case '\\': *p++ = '\\'; break;
+		case '\n': *p++ = 'n'; break;
+		case '\r': *p++ = 'r'; break;
+		case '\t': *p++ = 't'; break;
+		default:
+			memcpy(p, "u00", 3);
+			p[3] = hex[*c >> 4];
+			p[4] = hex[*c & 0xF];
+			p += 5;
+			break;
+		}
+	}
+	*p++ = '"';
+	return p;
+}
+
+static inline char *jsonKey(char *p, const char *key, bool &first)
+{
+	if (!first)
+		*p++ = ',';
+	first = false;
+	size_t len = strlen(key);
+	*p++ = '"';
+	memcpy(p, key, len);
+	p += len;
+	*p++ = '"';
+	*p++ = ':';
+	return p;
+}
+
+size_t FileOutput::jsonBound(const LogEvent &event) const
+{
+	size_t n = 160 + 6 * (event.type().size() + event.timestamp().size() + event.source().size() + event.message().size());
+	for (int i = 0; i < event.field_size(); i++) {
+		n += 6 * (event.field(i).key().size() + event.field(i).value().size()) + 48;
+	}
+	for (int i = 0; i < event.tag_size(); i++) {
+		n += 6 * event.tag(i).size() + 4;
+	}
+	return n;
+}
+
+char *FileOutput::writeJson(char *p, const LogEvent &event) const
+{
+	bool first = true;
+	*p++ = '{';
+	if (event.has_type())
+		p = jsonString(jsonKey(p, "type", first), event.type());
+	if (event.has_timestamp())
+		p = jsonString(jsonKey(p, "timestamp", first), event.timestamp());
+	if (event.has_timestamp_ns())
+		p += sprintf(jsonKey(p, "timestamp_ns", first), "%lld", (long long)event.timestamp_ns());
+	if (event.has_source())
+		p = jsonString(jsonKey(p, "source", first), event.source());
+	if (event.has_message())
+		p = jsonString(jsonKey(p, "message", first), event.message());
+	if (event.field_size()) {
+		p = jsonKey(p, "fields", first);
+		*p++ = '{';
+		for (int i = 0; i < event.field_size(); i++) {
+			const Field &field = event.field(i);
+			if (i)
+				*p++ = ',';
+			p = jsonString(p, field.key());
+			*p++ = ':';
+			switch (field.type()) {
+			case Field::INT:
+				p += sprintf(p, "%lld", (long long)field.int_value());
+				break;
+			case Field::DOUBLE:
+				if (std::isfinite(field.double_value()))
+					p += sprintf(p, "%.17g", field.double_value());
+				else
+					p = jsonString(p, field.value());
+				break;
+			case Field::BOOL:
+				p += sprintf(p, "%s", field.bool_value() ? "true" : "false");
+				break;
+			default:
+				p = jsonString(p, field.value());
+				break;
+			}
+		}
+		*p++ = '}';
+	}
+	if (event.tag_size()) {
+		p = jsonKey(p, "tags", first);
+		*p++ = '[';
+		for (int i = 0; i < event.tag_size(); i++) {
+			if (i)
+				*p++ = ',';
+			p = jsonString(p, event.tag(i));
+		}
+		*p++ = ']';
+	}
+	*p++ = '}';
+	*p++ = '\n';
+	return p;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+FileOutput::FileOutput()
+	:format(JSON), codec(NONE), level(0), syncpolicy(SYNC_INTERVAL), syncinterval(1000), flushinterval(1000), maxbytes(0),
+	 maxage(0), path(), fd(-1), compressor(NULL), opened(0), filebytes(0), unsynced(false), nextsync_ms(0), nextflush_ms(0),
+	 current(), pending(), pendingbytes(0), spare(), scratch(), events(0), serialized(0), written(0)
+{
+	current.data = NULL;
+	current.len = 0;
+	current.cap = 0;
+}
+
+FileOutput::~FileOutput()
+{
+	close();
+	for (size_t i = 0; i < spare.size(); i++) {
+		free(spare[i].data);
+	}
+}
+
+void FileOutput::setFormat(Format f)
+{
+	format = f;
+}
+
+bool FileOutput::setCodec(Codec c, int l)
+{
+	if (!hasCodec(c)) {
+		ERR("The %s codec is not compiled in", codecName(c));
+		return false;
+	}
+	codec = c;
+	level = l;
+	return true;
+}
+
+void FileOutput::setRotation(uint64_t bytes, long age)
+{
+	maxbytes = bytes;
+	maxage = (age > 0) ? age : 0;
+}
+
+void FileOutput::setSync(SyncPolicy policy, long interval_ms)
+{
+	syncpolicy = policy;
+	syncinterval = (interval_ms > 0) ? interval_ms : 0;
+}
+
+void FileOutput::setFlushInterval(long ms)
+{
+	flushinterval = (ms > 0) ? ms : 0;
+}
+
+bool FileOutput::hasCodec(Codec c)
+{
+	switch (c) {
+	case NONE:
+	case GZIP:
+		return true;
+#ifdef HAVE_LZ4
+	case LZ4:
+		return true;
+#endif
+#ifdef HAVE_ZSTD
+	case ZSTD:
+		return true;
+#endif
+	default:
+		return false;
+	}
+}
+
+bool FileOutput::parseCodec(const std::string &name, Codec &c)
+{
+	static const Codec codecs[] = { NONE, GZIP, LZ4, ZSTD };
+	for (size_t i = 0; i < sizeof(codecs) / sizeof(codecs[0]); i++) {
+		if (name == codecName(codecs[i])) {
+			c = codecs[i];
+			return true;
+		}
+	}
+	return false;
+}
+
+const char *FileOutput::codecName(Codec c)
+{
+	switch (c) {
+	case NONE: return "none";
+	case GZIP: return "gzip";
+	case LZ4:  return "lz4";
+	case ZSTD: return "zstd";
+	}
+	return "unknown";
+}
+
+bool FileOutput::open(const std::string &p)
+{
+	close();
+	path = p;
+	if (codec != NONE) {
+		compressor = createCompressor(codec, level);
+		if (!compressor)
+			return false;
+		// A compressed stream can't be continued, move the one of an earlier run aside
+		struct stat st;
+		if ((stat(path.c_str(), &st) == 0) && (st.st_size > 0)) {
+			opened = st.st_mtime;
+			moveAside();
+		}
+	}
+	current = getBlock(FILEOUTPUT_BLOCK);
+	return openFile();
+}
+
+void FileOutput::close()
+{
+	if (fd >= 0)
+		closeFile(false);
+	if (current.data)
+		putBlock(current);
+	current.data = NULL;
+	current.cap = 0;
+	delete compressor;
+	compressor = NULL;
+}
+
+bool FileOutput::openFile()
+{
+	fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		ERR("Could not open output file %s: %s", path.c_str(), strerror(errno));
+		return false;
+	}
+	struct stat st;
+	filebytes = (fstat(fd, &st) == 0) ? st.st_size : 0;
+	opened = time(NULL);
+	unsynced = false;
+	uint64_t now = clock_ms();
+	nextsync_ms = now + syncinterval;
+	nextflush_ms = now + flushinterval;
+	if (compressor) {
+		Block out = getBlock(compressor->bound(0));
+		out.len = compressor->begin(out.data, out.cap);
+		if ((out.len == COMPRESS_ERROR) || !out.len) {
+			putBlock(out);
+		} else {
+			pendingbytes += out.len;
+			pending.push_back(out);
+		}
+	}
+	return true;
+}
+
+void FileOutput::closeFile(bool rotated)
+{
+	if (fd >= 0) {
+		seal();
+		if (compressor) {
+			Block out = getBlock(compressor->bound(0));
+			out.len = compressor->end(out.data, out.cap);
+			if ((out.len == COMPRESS_ERROR) || !out.len) {
+				putBlock(out);
+			} else {
+				pendingbytes += out.len;
+				pending.push_back(out);
+			}
+		}
+		writeOut();
+		if (syncpolicy != SYNC_NONE)
+			sync();
+		::close(fd);
+	}
+	fd = -1;
+	if (rotated)
+		moveAside();
+}
+
+void FileOutput::moveAside()
+{
+	char stamp[32];
+	struct tm tm;
+	localtime_r(&opened, &tm);
+	strftime(stamp, sizeof(stamp), ".%Y%m%d-%H%M%S", &tm);
+	std::string target = path + stamp;
+	for (int n = 1; access(target.c_str(), F_OK) == 0; n++) {
+		std::ostringstream name;
+		name << path << stamp << "-" << n;
+		target = name.str();
+	}
+	if (rename(path.c_str(), target.c_str()) < 0) {
+		ERR("Could not rotate %s: %s", path.c_str(), strerror(errno));
+		return;
+	}
+	DBG("Rotated %s to %s", path.c_str(), target.c_str());
+	if (syncpolicy != SYNC_NONE) {
+		size_t slash = path.rfind('/');
+		std::string dir = (slash == std::string::npos) ? "." : path.substr(0, slash ? slash : 1);
+		int dirfd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (dirfd >= 0) {
+			fsync(dirfd);
+			::close(dirfd);
+		}
+	}
+}
+
+void FileOutput::rotate()
+{
+	closeFile(true);
+	openFile();
+}
+
+FileOutput::Block FileOutput::getBlock(size_t cap)
+{
+	for (size_t i = spare.size(); i > 0; i--) {
+		if (spare[i - 1].cap >= cap) {
+			Block block = spare[i - 1];
+			spare.erase(spare.begin() + (i - 1));
+			return block;
+		}
+	}
+	Block block;
+	block.len = 0;
+	block.cap = (cap + FILEOUTPUT_ALIGN - 1) & ~(size_t)(FILEOUTPUT_ALIGN - 1);
+	void *mem = NULL;
+	if (posix_memalign(&mem, FILEOUTPUT_ALIGN, block.cap) != 0) {
+		ERR("Out of memory for an output block of %lu bytes", (unsigned long)block.cap);
+		abort();
+	}
+	block.data = static_cast<char *>(mem);
+	return block;
+}
+
+void FileOutput::putBlock(Block &block)
+{
+	block.len = 0;
+	if (spare.size() < FILEOUTPUT_SPARE_BLOCKS)
+		spare.push_back(block);
+	else
+		free(block.data);
+	block.data = NULL;
+}
+
+void FileOutput::seal()
+{
+	if (!current.len)
+		return;
+	if (!compressor) {
+		// The block itself is written
+		pendingbytes += current.len;
+		pending.push_back(current);
+		current = getBlock(FILEOUTPUT_BLOCK);
+		return;
+	}
+	compressInto(current.data, current.len);
+	current.len = 0;
+}
+
+void FileOutput::compressInto(const char *data, size_t len)
+{
+	Block out = getBlock(compressor->bound(len));
+	out.len = compressor->compress(data, len, out.data, out.cap);
+	if ((out.len == COMPRESS_ERROR) || !out.len) {
+		putBlock(out);
+		return;
+	}
+	pendingbytes += out.len;
+	pending.push_back(out);
+}
+
+void FileOutput::append(const char *data, size_t len)
+{
+	while (len) {
+		size_t n = std::min(len, current.cap - current.len);
+		memcpy(current.data + current.len, data, n);
+		current.len += n;
+		data += n;
+		len -= n;
+		if (current.len == current.cap)
+			seal();
+	}
+}
+
+void FileOutput::writeOut()
+{
+	if (pending.empty())
+		return;
+	std::vector<struct iovec> iov(pending.size());
+	for (size_t i = 0; i < pending.size(); i++) {
+		iov[i].iov_base = pending[i].data;
+		iov[i].iov_len = pending[i].len;
+	}
+	size_t first = 0;
+	while ((first < iov.size()) && (fd >= 0)) {
+		ssize_t n = writev(fd, &iov[first], std::min(iov.size() - first, (size_t)IOV_MAX));
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			ERR("Could not write to %s, %lu bytes lost: %s", path.c_str(), (unsigned long)pendingbytes, strerror(errno));
+			break;
+		}
+		written += n;
+		filebytes += n;
+		// Skip what was written, a partial write continues in the middle of a block
+		while (n > 0) {
+			if ((size_t)n >= iov[first].iov_len) {
+				n -= iov[first].iov_len;
+				first++;
+			} else {
+				iov[first].iov_base = static_cast<char *>(iov[first].iov_base) + n;
+				iov[first].iov_len -= n;
+				n = 0;
+			}
+		}
+	}
+	for (size_t i = 0; i < pending.size(); i++) {
+		putBlock(pending[i]);
+	}
+	pending.clear();
+	pendingbytes = 0;
+	unsynced = true;
+
+	if (syncpolicy == SYNC_ALWAYS)
+		sync();
+	else if ((syncpolicy == SYNC_INTERVAL) && (clock_ms() >= nextsync_ms))
+		sync();
+}
+
+void FileOutput::sync()
+{
+	if (!unsynced || (fd < 0))
+		return;
+	if (fdatasync(fd) < 0)
+		ERR("Could not sync %s: %s", path.c_str(), strerror(errno));
+	unsynced = false;
+	nextsync_ms = clock_ms() + syncinterval;
+}
+
+void FileOutput::output(LogEvent &event)
+{
+	if (fd < 0)
+		return;
+	size_t size = 0;
+	size_t bound;
+	if (format == JSON) {
+		bound = jsonBound(event);
+	} else {
+		size = event.ByteSizeLong();
+		bound = size + 5;
+	}
+
+	size_t len;
+	if (bound <= current.cap - current.len) {
+		// Straight into the block
+		char *p = current.data + current.len;
+		char *end;
+		if (format == JSON) {
+			end = writeJson(p, event);
+		} else {
+			google::protobuf::uint8 *q = reinterpret_cast<google::protobuf::uint8 *>(p);
+			q = google::protobuf::io::CodedOutputStream::WriteVarint32ToArray(size, q);
+			end = reinterpret_cast<char *>(event.SerializeWithCachedSizesToArray(q));
+		}
+		len = end - p;
+		current.len += len;
+	} else if (bound <= current.cap) {
+		seal();
+		output(event);
+		return;
+	} else {
+		// Bigger than a block
+		scratch.resize(bound);
+		char *p = &scratch[0];
+		char *end;
+		if (format == JSON) {
+			end = writeJson(p, event);
+		} else {
+			google::protobuf::uint8 *q = reinterpret_cast<google::protobuf::uint8 *>(p);
+			q = google::protobuf::io::CodedOutputStream::WriteVarint32ToArray(size, q);
+			end = reinterpret_cast<char *>(event.SerializeWithCachedSizesToArray(q));
+		}
+		len = end - p;
+		append(p, len);
+	}
+	events++;
+	serialized += len;
+
+	if (pending.size() >= FILEOUTPUT_WRITE_BLOCKS) {
+		writeOut();
+		if (maxbytes && (filebytes >= maxbytes))
+			rotate();
+	}
+}
+
+long FileOutput::timeout() const
+{
+	if (fd < 0)
+		return -1;
+	uint64_t deadline = UINT64_MAX;
+	if (current.len || !pending.empty())
+		deadline = nextflush_ms;
+	if (unsynced && (syncpolicy == SYNC_INTERVAL))
+		deadline = std::min(deadline, nextsync_ms);
+	uint64_t now = clock_ms();
+	if (maxage && (filebytes || current.len)) {
+		time_t left = opened + maxage - time(NULL);
+		deadline = std::min(deadline, now + ((left > 0) ? left * 1000 : 0));
+	}
+	if (deadline == UINT64_MAX)
+		return -1;
+	return (deadline > now) ? (long)(deadline - now) : 0;
+}
+
+void FileOutput::flush()
+{
+	if (fd < 0)
+		return;
+	seal();
+	writeOut();
+	uint64_t now = clock_ms();
+	if ((syncpolicy == SYNC_INTERVAL) && (now >= nextsync_ms))
+		sync();
+	nextflush_ms = now + flushinterval;
+	if ((maxbytes && (filebytes >= maxbytes)) || (maxage && filebytes && (time(NULL) >= opened + maxage)))
+		rotate();
+}
+
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Test and benchmark
+/////////////////////////////////////////////////////////////////////////////
+
+#ifdef DEBUG_FILEOUTPUT_CPP
+
+#include <dirent.h>
+#include <fstream>
+#include <sstream>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+#include "testcheck.h"
+
+#define BENCH_EVENTS 500000
+
+using namespace sawmill;
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void makeEvent(LogEvent &event, int i)
+{
+	char msg[160];
+	event.Clear();
+	snprintf(msg, sizeof(msg), "192.168.%d.%d - - [19/Oct/2026:12:00:00 +0000] \"GET /index.html?id=%d HTTP/1.1\" 200 %d",
+	         (i >> 8) & 255, i & 255, i, 1000 + i % 5000);
+	event.set_type("apache");
+	event.set_timestamp("19/Oct/2026:12:00:00 +0000");
+	event.set_timestamp_ns(1792411200000000000LL + i);
+	event.set_source("/var/log/apache2/access.log");
+	event.set_message(msg);
+	Field *f = event.add_field();
+	f->set_key("status");
+	f->set_value("200");
+	f->set_type(Field::INT);
+	f->set_int_value(200);
+	f = event.add_field();
+	f->set_key("verb");
+	f->set_value("GET");
+	event.add_tag("web");
+}
+
+static std::string readFile(const std::string &path)
+{
+	std::ifstream in(path.c_str(), std::ios::binary);
+	std::ostringstream out;
+	out << in.rdbuf();
+	return out.str();
+}
+
+static std::string readGzip(const std::string &path)
+{
+	std::string data;
+	gzFile gz = gzopen(path.c_str(), "rb");
+	char buf[65536];
+	int n;
+	while (gz && ((n = gzread(gz, buf, sizeof(buf))) > 0))
+		data.append(buf, n);
+	if (gz)
+		gzclose(gz);
+	return data;
+}
+
+#ifdef HAVE_LZ4
+static std::string readLz4(const std::string &path)
+{
+	std::string in = readFile(path);
+	std::string data;
+	LZ4F_dctx *ctx;
+	if (LZ4F_isError(LZ4F_createDecompressionContext(&ctx, LZ4F_VERSION)))
+		return data;
+	char buf[65536];
+	size_t pos = 0;
+	size_t rc = 0;
+	while ((pos < in.size()) && !LZ4F_isError(rc)) {
+		size_t outlen = sizeof(buf);
+		size_t inlen = in.size() - pos;
+		rc = LZ4F_decompress(ctx, buf, &outlen, in.data() + pos, &inlen, NULL);
+		data.append(buf, outlen);
+		pos += inlen;
+	}
+	LZ4F_freeDecompressionContext(ctx);
+	// 0 once the frame is complete
+	return (rc == 0) ? data : std::string();
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static std::string readZstd(const std::string &path)
+{
+	std::string in = readFile(path);
+	std::string data;
+	ZSTD_DCtx *ctx = ZSTD_createDCtx();
+	if (!ctx)
+		return data;
+	char buf[65536];
+	ZSTD_inBuffer input = { in.data(), in.size(), 0 };
+	ZSTD_outBuffer output;
+	size_t rc;
+	do {
+		output.dst = buf;
+		output.size = sizeof(buf);
+		output.pos = 0;
+		rc = ZSTD_decompressStream(ctx, &output, &input);
+		if (!ZSTD_isError(rc))
+			data.append(buf, output.pos);
+	} while (!ZSTD_isError(rc) && ((input.pos < input.size) || (output.pos == output.size)));
+	ZSTD_freeDCtx(ctx);
+	// 0 once the frame is complete
+	return (rc == 0) ? data : std::string();
+}
+#endif
+
+/**
+ * Files in 'dir' starting with 'prefix', the current one last.
+ */
+static std::vector<std::string> listFiles(const std::string &dir, const std::string &prefix)
+{
+	std::vector<std::string> files;
+	DIR *d = opendir(dir.c_str());
+	struct dirent *entry;
+	while (d && ((entry = readdir(d)) != NULL)) {
+		std::string name = entry->d_name;
+		if ((name.compare(0, prefix.size(), prefix) == 0) && (name != prefix))
+			files.push_back(dir + "/" + name);
+	}
+	if (d)
+		closedir(d);
+	std::sort(files.begin(), files.end());
+	files.push_back(dir + "/" + prefix);
+	return files;
+}
+
+static size_t countLines(const std::string &data)
+{
+	return std::count(data.begin(), data.end(), '\n');
+}
+
+int main()
+{
+	int rc = 0;
+	char tmpl[] = "/tmp/fileoutputXXXXXX";
+	if (!mkdtemp(tmpl)) {
+		perror("mkdtemp");
+		return 1;
+	}
+	std::string dir = tmpl;
+	LogEvent event;
+
+	// JSON lines, escaping and typed fields
+	{
+		FileOutput out;
+		rc |= check("Open", out.open(dir + "/events.json"));
+		event.set_type("test");
+		event.set_message("quote \" backslash \\ tab \t bell \x07");
+		Field *f = event.add_field();
+		f->set_key("n");
+		f->set_value("42");
+		f->set_type(Field::INT);
+		f->set_int_value(42);
+		f = event.add_field();
+		f->set_key("ok");
+		f->set_type(Field::BOOL);
+		f->set_bool_value(true);
+		event.add_tag("a");
+		out.output(event);
+		event.Clear();
+		event.set_message("second");
+		out.output(event);
+		out.close();
+		std::string data = readFile(dir + "/events.json");
+		rc |= check("JSON lines", data ==
+		            "{\"type\":\"test\",\"message\":\"quote \\\" backslash \\\\ tab \\t bell \\u0007\",\"fields\":{\"n\":42,\"ok\":true},\"tags\":[\"a\"]}\n"
+		            "{\"message\":\"second\"}\n");
+	}
+
+	// Length delimited protobuf
+	{
+		FileOutput out;
+		out.setFormat(FileOutput::PROTOBUF);
+		out.open(dir + "/events.pb");
+		for (int i = 0; i < 1000; i++) {
+			makeEvent(event, i);
+			out.output(event);
+		}
+		out.close();
+		std::string data = readFile(dir + "/events.pb");
+		google::protobuf::io::ArrayInputStream raw(data.data(), data.size());
+		google::protobuf::io::CodedInputStream in(&raw);
+		int count = 0;
+		bool same = true;
+		uint32_t size;
+		LogEvent back;
+		while (in.ReadVarint32(&size)) {
+			google::protobuf::io::CodedInputStream::Limit limit = in.PushLimit(size);
+			same = same && back.ParseFromCodedStream(&in);
+			in.PopLimit(limit);
+			makeEvent(event, count++);
+			same = same && (back.SerializeAsString() == event.SerializeAsString());
+		}
+		rc |= check("Protobuf read back", same && (count == 1000));
+	}
+
+	// gzip, the same as uncompressed
+	{
+		FileOutput plain, gz;
+		plain.open(dir + "/plain.json");
+		gz.setCodec(FileOutput::GZIP);
+		gz.open(dir + "/compressed.json.gz");
+		for (int i = 0; i < 20000; i++) {
+			makeEvent(event, i);
+			plain.output(event);
+			gz.output(event);
+			if (i % 5000 == 0) {
+				plain.flush();
+				gz.flush();
+			}
+		}
+		plain.close();
+		gz.close();
+		std::string data = readFile(dir + "/plain.json");
+		rc |= check("gzip stream decompresses to the same", (countLines(data) == 20000) && (readGzip(dir + "/compressed.json.gz") == data));
+		// Reopening moves the finished stream aside
+		gz.open(dir + "/compressed.json.gz");
+		gz.close();
+		rc |= check("Earlier compressed file moved aside", listFiles(dir, "compressed.json.gz").size() == 2);
+	}
+
+	// LZ4 and zstd, the same as uncompressed
+	{
+		std::string data = readFile(dir + "/plain.json");
+#ifdef HAVE_LZ4
+		FileOutput lz4;
+		lz4.setCodec(FileOutput::LZ4);
+		lz4.open(dir + "/compressed.json.lz4");
+#endif
+#ifdef HAVE_ZSTD
+		FileOutput zstd;
+		zstd.setCodec(FileOutput::ZSTD);
+		zstd.open(dir + "/compressed.json.zst");
+#endif
+		for (int i = 0; i < 20000; i++) {
+			makeEvent(event, i);
+#ifdef HAVE_LZ4
+			lz4.output(event);
+			if (i % 5000 == 0)
+				lz4.flush();
+#endif
+#ifdef HAVE_ZSTD
+			zstd.output(event);
+			if (i % 5000 == 0)
+				zstd.flush();
+#endif
+		}
+#ifdef HAVE_LZ4
+		lz4.close();
+		rc |= check("LZ4 frame decompresses to the same", (countLines(data) == 20000) && (readLz4(dir + "/compressed.json.lz4") == data));
+#endif
+#ifdef HAVE_ZSTD
+		zstd.close();
+		rc |= check("zstd frame decompresses to the same", (countLines(data) == 20000) && (readZstd(dir + "/compressed.json.zst") == data));
+#endif
+	}
+
+	// Rotation by size, every file a complete stream
+	{
+		FileOutput out;
+		out.setCodec(FileOutput::GZIP);
+		out.setRotation(64 * 1024, 0);
+		out.setSync(FileOutput::SYNC_ALWAYS);
+		out.open(dir + "/rotated.json.gz");
+		for (int i = 0; i < 50000; i++) {
+			makeEvent(event, i);
+			out.output(event);
+			if (i % 2000 == 1999)
+				out.flush();
+		}
+		out.close();
+		std::vector<std::string> files = listFiles(dir, "rotated.json.gz");
+		size_t lines = 0;
+		for (size_t i = 0; i < files.size(); i++) {
+			lines += countLines(readGzip(files[i]));
+		}
+		rc |= check("Rotated into complete files", (files.size() > 2) && (lines == 50000));
+	}
+
+	// Throughput per format and codec
+	std::vector<LogEvent> sample(50000);
+	for (size_t i = 0; i < sample.size(); i++) {
+		makeEvent(sample[i], i);
+	}
+	static const FileOutput::Codec codecs[] = { FileOutput::NONE, FileOutput::GZIP, FileOutput::LZ4, FileOutput::ZSTD };
+	for (int f = 0; f < 2; f++) {
+		for (size_t c = 0; c < sizeof(codecs) / sizeof(codecs[0]); c++) {
+			if (!FileOutput::hasCodec(codecs[c]))
+				continue;
+			std::string path = dir + "/bench";
+			FileOutput out;
+			out.setFormat(f ? FileOutput::PROTOBUF : FileOutput::JSON);
+			out.setCodec(codecs[c]);
+			out.setSync(FileOutput::SYNC_INTERVAL, 1000);
+			out.open(path);
+			uint64_t begin = now_ns();
+			for (int i = 0; i < BENCH_EVENTS; i++) {
+				out.output(sample[i % sample.size()]);
+			}
+			out.close();
+			uint64_t elapsed = now_ns() - begin;
+			printf("%-8s %-5s: %8.0f events/s, %6.0f MB/s in, %6.0f MB/s written, ratio %.2f\n", f ? "protobuf" : "json",
+			       FileOutput::codecName(codecs[c]), BENCH_EVENTS * 1e9 / elapsed, out.bytesSerialized() * 1e3 / elapsed,
+			       out.bytesWritten() * 1e3 / elapsed, (double)out.bytesSerialized() / out.bytesWritten());
+			unlink(path.c_str());
+		}
+	}
+
+	std::vector<std::string> files = listFiles(dir, "");
+	for (size_t i = 0; i + 1 < files.size(); i++) {
+		unlink(files[i].c_str());
+	}
+	rmdir(dir.c_str());
+	return rc;
+}
+
+#endif // DEBUG_FILEOUTPUT_CPP
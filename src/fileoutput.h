@@ -0,0 +1,129 @@
+#ifndef __FILEOUTPUT_H
+# define __FILEOUTPUT_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <time.h>
+#include "eventoutput.h"
+
+#define FILEOUTPUT_BLOCK (1024 * 1024) // Events are serialized into blocks of this size
+
+namespace sawmill {
+
+class Compressor;
+
+/**
+ * Writes the events to a file, as JSON lines or as length delimited (varint) protobuf messages,
+ * optionally compressed.
+ *
+ * Events are serialized straight into large page aligned blocks. A full block is compressed as
+ * one piece of a stream (every file is one complete gzip, LZ4 frame or zstd stream) and the blocks
+ * are written several at a time with one writev(). What is buffered is written out at least every
+ * flush interval.
+ *
+ * The file is rotated when it reaches a size or an age: it is finished, renamed to its name with
+ * the time it was opened appended, and a new one is started. Data is made durable according to
+ * the sync policy: never (left to the kernel), with one fdatasync() per interval for everything
+ * written in it (group commit), or after every write.
+ */
+class FileOutput : public EventOutput
+{
+public:
+	enum Format { JSON, PROTOBUF };
+	enum Codec { NONE, GZIP, LZ4, ZSTD };
+	enum SyncPolicy { SYNC_NONE, SYNC_INTERVAL, SYNC_ALWAYS };
+
+	FileOutput();
+	~FileOutput();
+
+	void setFormat(Format format);
+	/**
+	 * 'level' 0 is the default of the codec. Returns false if the codec is not compiled in.
+	 * Call before open().
+	 */
+	bool setCodec(Codec codec, int level = 0);
+	/**
+	 * Rotate after 'maxbytes' written or 'maxage' seconds, 0 for no limit.
+	 */
+	void setRotation(uint64_t maxbytes, long maxage);
+	void setSync(SyncPolicy policy, long interval_ms = 1000);
+	void setFlushInterval(long ms);
+
+	bool open(const std::string &path);
+	/**
+	 * Write everything out, finish the stream and sync unless the policy is SYNC_NONE.
+	 */
+	void close();
+	bool isOpen() const { return fd >= 0; }
+
+	uint64_t eventCount() const { return events; }
+	uint64_t bytesSerialized() const { return serialized; }
+	uint64_t bytesWritten() const { return written; }
+
+	static bool hasCodec(Codec codec);
+	static bool parseCodec(const std::string &name, Codec &codec);
+	static const char *codecName(Codec codec);
+
+	// EventOutput
+	void output(LogEvent &event);
+	long timeout() const;
+	void flush();
+private:
+	struct Block {
+		char *data;
+		size_t len;
+		size_t cap;
+	};
+
+	bool openFile();
+	void closeFile(bool rotated);
+	void moveAside();
+	void rotate();
+	Block getBlock(size_t cap);
+	void putBlock(Block &block);
+	void seal();
+	void append(const char *data, size_t len);
+	void compressInto(const char *data, size_t len);
+	void writeOut();
+	void sync();
+
+	size_t jsonBound(const LogEvent &event) const;
+	char *writeJson(char *p, const LogEvent &event) const;
+
+	Format format;
+	Codec codec;
+	int level;
+	SyncPolicy syncpolicy;
+	long syncinterval;
+	long flushinterval;
+	uint64_t maxbytes;
+	long maxage;
+
+	std::string path;
+	int fd;
+	Compressor *compressor;
+	time_t opened;
+	uint64_t filebytes;  // Written to the current file
+	bool unsynced;
+	uint64_t nextsync_ms;
+	uint64_t nextflush_ms;
+
+	Block current;               // Block being filled with events
+	std::vector<Block> pending;  // Blocks waiting to be written
+	size_t pendingbytes;
+	std::vector<Block> spare;
+	std::string scratch;         // Events that don't fit a block
+
+	uint64_t events;
+	uint64_t serialized;
+	uint64_t written;
+
+	// Not copyable
+	FileOutput(const FileOutput &);
+	FileOutput &operator=(const FileOutput &);
+};
+
+} // namespace sawmill
+
+#endif // ifndef __FILEOUTPUT_H
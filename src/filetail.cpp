@@ -0,0 +1,755 @@
+/****************************************************************************
+ * Project: SawMill
+ * Authors:
+ *          Bart Meuris <bart . meuris @ gmail . com>
+ *
+ * License: (to be discussed LGPL version 2.0?)
+ ****************************************************************************
+ * Module description:
+ *     File tail input: follows log files through rotation and truncation.
+ *
+ ***************************************************************************/
+
+#include "filetail.h"
+#include "sawlog.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+
+#define FILETAIL_CHUNK    (1024 * 1024) // Bytes per pread()
+#define FILETAIL_MAX_LINE (1024 * 1024) // Longer lines are cut
+#define FILETAIL_CHECK_MS 1000          // Look at all paths this often, in case an event was missed
+#define FILETAIL_SAVE_MS  1000
+#define FILETAIL_EVENTBUF 16384
+
+namespace sawmill {
+
+static uint64_t now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+FileTail::FileTail()
+	:files(), statefile(), saved(), inotifyfd(-1), filewatches(), dirwatches(), acksink(NULL), nextfile(0), more(false),
+	 dirty(false), nextcheck_ms(0), nextsave_ms(0), chunk(), ends()
+{
+}
+
+FileTail::~FileTail()
+{
+	// The sink may be gone already, keep what it acknowledged so far
+	acksink = NULL;
+	if (inotifyfd >= 0)
+		saveState();
+	for (size_t i = 0; i < files.size(); i++) {
+		closeFile(files[i]);
+	}
+	if (inotifyfd >= 0)
+		close(inotifyfd);
+}
+
+void FileTail::addFile(const std::string &path, const std::string &type)
+{
+	TailFile file;
+	file.path = path;
+	size_t slash = path.rfind('/');
+	file.name = (slash == std::string::npos) ? path : path.substr(slash + 1);
+	file.type = type;
+	file.fd = -1;
+	file.dev = 0;
+	file.ino = 0;
+	file.offset = 0;
+	file.readpos = 0;
+	file.wd = -1;
+	file.ready = false;
+	file.reopen = false;
+	files.push_back(file);
+}
+
+void FileTail::setStateFile(const std::string &path)
+{
+	statefile = path;
+}
+
+bool FileTail::start()
+{
+	inotifyfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotifyfd < 0) {
+		ERR("Could not set up inotify: %s", strerror(errno));
+		return false;
+	}
+	loadState();
+	chunk.resize(FILETAIL_CHUNK);
+
+	for (size_t i = 0; i < files.size(); i++) {
+		TailFile &file = files[i];
+		size_t slash = file.path.rfind('/');
+		std::string dir = (slash == std::string::npos) ? "." : file.path.substr(0, slash ? slash : 1);
+		int wd = inotify_add_watch(inotifyfd, dir.c_str(), IN_CREATE | IN_MOVED_TO | IN_ONLYDIR);
+		if (wd < 0) {
+			WARN("Could not watch directory %s, %s is only checked every %d ms: %s", dir.c_str(), file.path.c_str(),
+			     FILETAIL_CHECK_MS, strerror(errno));
+		} else {
+			dirwatches[wd].push_back(i);
+		}
+		if (!openFile(file, true))
+			DBG("%s does not exist yet", file.path.c_str());
+		file.ready = true;
+	}
+	uint64_t now = now_ms();
+	nextcheck_ms = now + FILETAIL_CHECK_MS;
+	nextsave_ms = now + FILETAIL_SAVE_MS;
+	NOTICE("Following %d files", (int)files.size());
+	return true;
+}
+
+void FileTail::loadState()
+{
+	if (statefile.empty())
+		return;
+	FILE *f = fopen(statefile.c_str(), "r");
+	if (!f) {
+		if (errno != ENOENT)
+			WARN("Could not read file positions from %s: %s", statefile.c_str(), strerror(errno));
+		return;
+	}
+	char line[PATH_MAX + 128];
+	while (fgets(line, sizeof(line), f)) {
+		unsigned long long dev, ino, offset;
+		int pathstart = 0;
+		if ((line[0] == '#') || (sscanf(line, "%llu %llu %llu %n", &dev, &ino, &offset, &pathstart) != 3) || !pathstart)
+			continue;
+		std::string path(line + pathstart);
+		while (!path.empty() && (path[path.size() - 1] == '\n'))
+			path.erase(path.size() - 1);
+		SavedPosition &pos = saved[path];
+		pos.dev = dev;
+		pos.ino = ino;
+		pos.offset = offset;
+	}
+	fclose(f);
+	DBG("Loaded %d file positions from %s", (int)saved.size(), statefile.c_str());
+}
+
+bool FileTail::saveState()
+{
+	if (acksink) {
+		uint64_t oldest = acksink->oldestPending();
+		for (size_t i = 0; i < files.size(); i++) {
+			ackLines(files[i], oldest);
+		}
+	}
+	if (statefile.empty() || !dirty)
+		return true;
+
+	std::string tmp = statefile + ".tmp";
+	FILE *f = fopen(tmp.c_str(), "w");
+	if (!f) {
+		ERR("Could not write file positions to %s: %s", tmp.c_str(), strerror(errno));
+		return false;
+	}
+	fprintf(f, "# sawmill file positions: device inode offset path\n");
+	for (size_t i = 0; i < files.size(); i++) {
+		const TailFile &file = files[i];
+		if (file.fd >= 0) {
+			fprintf(f, "%llu %llu %llu %s\n", (unsigned long long)file.dev, (unsigned long long)file.ino,
+			        (unsigned long long)file.offset, file.path.c_str());
+		}
+	}
+	// Positions of files that didn't show up again yet
+	for (std::map<std::string, SavedPosition>::const_iterator it = saved.begin(); it != saved.end(); ++it) {
+		fprintf(f, "%llu %llu %llu %s\n", (unsigned long long)it->second.dev, (unsigned long long)it->second.ino,
+		        (unsigned long long)it->second.offset, it->first.c_str());
+	}
+	bool ok = (fflush(f) == 0) && (fsync(fileno(f)) == 0);
+	ok = (fclose(f) == 0) && ok;
+	if (ok)
+		ok = (rename(tmp.c_str(), statefile.c_str()) == 0);
+	if (!ok) {
+		ERR("Could not write file positions to %s: %s", statefile.c_str(), strerror(errno));
+		unlink(tmp.c_str());
+		return false;
+	}
+	// Make the rename itself durable
+	size_t slash = statefile.rfind('/');
+	std::string dir = (slash == std::string::npos) ? "." : statefile.substr(0, slash ? slash : 1);
+	int dirfd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dirfd >= 0) {
+		fsync(dirfd);
+		close(dirfd);
+	}
+	dirty = false;
+	return true;
+}
+
+bool FileTail::openFile(TailFile &file, bool atend)
+{
+	int fd = open(file.path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			WARN("Could not open %s: %s", file.path.c_str(), strerror(errno));
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		WARN("Could not stat %s: %s", file.path.c_str(), strerror(errno));
+		close(fd);
+		return false;
+	}
+	file.fd = fd;
+	file.dev = st.st_dev;
+	file.ino = st.st_ino;
+
+	uint64_t start = 0;
+	std::map<std::string, SavedPosition>::iterator it = saved.find(file.path);
+	if (it != saved.end()) {
+		if ((it->second.dev == (uint64_t)st.st_dev) && (it->second.ino == (uint64_t)st.st_ino)) {
+			if (it->second.offset <= (uint64_t)st.st_size) {
+				start = it->second.offset;
+			} else {
+				WARN("%s was truncated while not running, reading it from the start", file.path.c_str());
+			}
+		} else {
+			// Rotated while not running, the new file is all new
+			DBG("%s is not the file its position was saved for", file.path.c_str());
+		}
+		saved.erase(it);
+	} else if (atend) {
+		start = st.st_size;
+	}
+	file.offset = start;
+	file.readpos = start;
+	file.partial.clear();
+	file.acks.clear();
+
+	file.wd = inotify_add_watch(inotifyfd, file.path.c_str(), IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF | IN_ATTRIB);
+	if (file.wd < 0) {
+		WARN("Could not watch %s, it is only checked every %d ms: %s", file.path.c_str(), FILETAIL_CHECK_MS, strerror(errno));
+	} else {
+		filewatches[file.wd] = &file - &files[0];
+	}
+	dirty = true;
+	DBG("Following %s from offset %llu", file.path.c_str(), (unsigned long long)start);
+	return true;
+}
+
+void FileTail::closeFile(TailFile &file)
+{
+	if (file.wd >= 0) {
+		inotify_rm_watch(inotifyfd, file.wd);
+		filewatches.erase(file.wd);
+		file.wd = -1;
+	}
+	if (file.fd >= 0) {
+		close(file.fd);
+		file.fd = -1;
+	}
+}
+
+void FileTail::handleEvents()
+{
+	char buf[FILETAIL_EVENTBUF] __attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t len;
+
+	while ((len = ::read(inotifyfd, buf, sizeof(buf))) > 0) {
+		const struct inotify_event *ev;
+		for (const char *p = buf; p < buf + len; p += sizeof(struct inotify_event) + ev->len) {
+			ev = reinterpret_cast<const struct inotify_event *>(p);
+			if (ev->mask & IN_Q_OVERFLOW) {
+				WARN("Missed file events, checking all files");
+				for (size_t i = 0; i < files.size(); i++) {
+					files[i].ready = true;
+					files[i].reopen = true;
+				}
+				continue;
+			}
+			std::map<int, size_t>::iterator fit = filewatches.find(ev->wd);
+			if (fit != filewatches.end()) {
+				TailFile &file = files[fit->second];
+				file.ready = true;
+				if (ev->mask & (IN_MOVE_SELF | IN_DELETE_SELF | IN_ATTRIB))
+					file.reopen = true;
+				if (ev->mask & IN_IGNORED) {
+					// Deleted, the directory watch sees it coming back
+					filewatches.erase(fit);
+					file.wd = -1;
+				}
+				continue;
+			}
+			std::map<int, std::vector<size_t> >::iterator dit = dirwatches.find(ev->wd);
+			if ((dit == dirwatches.end()) || !ev->len)
+				continue;
+			for (size_t i = 0; i < dit->second.size(); i++) {
+				TailFile &file = files[dit->second[i]];
+				if (file.name == ev->name) {
+					file.ready = true;
+					file.reopen = true;
+				}
+			}
+		}
+	}
+}
+
+size_t FileTail::read(EventSink &sink, size_t max)
+{
+	if (inotifyfd < 0)
+		return 0;
+	handleEvents();
+
+	uint64_t now = now_ms();
+	if (now >= nextcheck_ms) {
+		for (size_t i = 0; i < files.size(); i++) {
+			files[i].ready = true;
+			files[i].reopen = true;
+		}
+		nextcheck_ms = now + FILETAIL_CHECK_MS;
+	}
+
+	size_t count = 0;
+	more = false;
+	acksink = &sink;
+	uint64_t oldest = sink.oldestPending();
+	for (size_t i = 0; i < files.size(); i++) {
+		TailFile &file = files[(nextfile + i) % files.size()];
+		ackLines(file, oldest);
+		if (file.ready && (count < max))
+			count += readFile(file, sink, max - count);
+		if (file.ready)
+			more = true;
+	}
+	if (!files.empty())
+		nextfile = (nextfile + 1) % files.size();
+
+	if (dirty && (now >= nextsave_ms)) {
+		saveState();
+		nextsave_ms = now + FILETAIL_SAVE_MS;
+	}
+	return count;
+}
+
+long FileTail::timeout() const
+{
+	if (more)
+		return 0;
+	uint64_t now = now_ms();
+	uint64_t next = nextcheck_ms;
+	if (dirty && (nextsave_ms < next))
+		next = nextsave_ms;
+	return (next > now) ? (long)(next - now) : 0;
+}
+
+size_t FileTail::readFile(TailFile &file, EventSink &sink, size_t max)
+{
+	if ((file.fd < 0) && !openFile(file, false)) {
+		file.ready = false;
+		file.reopen = false;
+		return 0;
+	}
+
+	size_t count = 0;
+	while (count < max) {
+		struct stat st;
+		if (fstat(file.fd, &st) < 0) {
+			ERR("Could not stat %s: %s", file.path.c_str(), strerror(errno));
+			file.ready = false;
+			break;
+		}
+		if ((uint64_t)st.st_size < file.readpos) {
+			WARN("%s was truncated, reading it from the start", file.path.c_str());
+			file.offset = 0;
+			file.readpos = 0;
+			file.partial.clear();
+			file.acks.clear();
+			dirty = true;
+		}
+		if ((uint64_t)st.st_size == file.readpos) {
+			// At the end, see if the path has a new file by now
+			if (!file.reopen) {
+				file.ready = false;
+				break;
+			}
+			file.reopen = false;
+			struct stat pathst;
+			if ((stat(file.path.c_str(), &pathst) < 0) || ((pathst.st_dev == file.dev) && (pathst.st_ino == file.ino))) {
+				file.ready = false;
+				break;
+			}
+			// Rotated: the last line of the old file won't get its end anymore
+			if (!file.partial.empty()) {
+				count += submitLine(file, sink, file.partial.data(), file.partial.size(), file.readpos);
+				file.partial.clear();
+			}
+			DBG("%s was rotated", file.path.c_str());
+			closeFile(file);
+			if (!openFile(file, false)) {
+				file.ready = false;
+				break;
+			}
+			continue;
+		}
+
+		size_t want = st.st_size - file.readpos;
+		if (want > chunk.size())
+			want = chunk.size();
+		ssize_t len = pread(file.fd, &chunk[0], want, file.readpos);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			ERR("Could not read %s: %s", file.path.c_str(), strerror(errno));
+			file.ready = false;
+			break;
+		}
+		if (len == 0) {
+			file.ready = false;
+			break;
+		}
+		count += submitLines(file, sink, len, max - count);
+	}
+	return count;
+}
+
+size_t FileTail::submitLines(TailFile &file, EventSink &sink, size_t len, size_t max)
+{
+	const char *data = &chunk[0];
+	size_t count = 0;
+	size_t pos = 0;
+	size_t i;
+
+	ends.clear();
+	findLineEnds(data, len, ends);
+	for (i = 0; (i < ends.size()) && (count < max); i++) {
+		size_t end = ends[i];
+		if (file.partial.empty()) {
+			count += submitLine(file, sink, data + pos, end - pos, file.readpos + end + 1);
+		} else {
+			file.partial.append(data + pos, end - pos);
+			count += submitLine(file, sink, file.partial.data(), file.partial.size(), file.readpos + end + 1);
+			file.partial.clear();
+		}
+		pos = end + 1;
+	}
+	if (i < ends.size()) {
+		// Out of room, the rest is read again next time
+		file.readpos += pos;
+	} else {
+		file.partial.append(data + pos, len - pos);
+		file.readpos += len;
+		if (file.partial.size() > FILETAIL_MAX_LINE) {
+			WARN("Line of more than %d bytes in %s cut", FILETAIL_MAX_LINE, file.path.c_str());
+			count += submitLine(file, sink, file.partial.data(), file.partial.size(), file.readpos);
+			file.partial.clear();
+		}
+	}
+	ackLines(file, sink.oldestPending());
+	return count;
+}
+
+size_t FileTail::submitLine(TailFile &file, EventSink &sink, const char *line, size_t len, uint64_t end)
+{
+	size_t count = 0;
+	if (len && (line[len - 1] == '\r'))
+		len--;
+	if (len) {
+		LogEvent *event = sink.newEvent();
+		event->mutable_source()->assign(file.path);
+		if (!file.type.empty())
+			event->mutable_type()->assign(file.type);
+		event->mutable_message()->assign(line, len);
+		sink.submit(event);
+		count = 1;
+	}
+	// The file is done with up to 'end' once the sink is done with all events up to this one
+	uint64_t seq = sink.submitted();
+	if (!file.acks.empty() && (file.acks.back().first == seq)) {
+		file.acks.back().second = end;
+	} else {
+		file.acks.push_back(std::make_pair(seq, end));
+	}
+	return count;
+}
+
+void FileTail::ackLines(TailFile &file, uint64_t oldest)
+{
+	while (!file.acks.empty() && (file.acks.front().first <= oldest)) {
+		file.offset = file.acks.front().second;
+		file.acks.pop_front();
+		dirty = true;
+	}
+}
+
+void FileTail::findLineEnds(const char *buf, size_t len, std::vector<uint32_t> &ends)
+{
+	size_t i = 0;
+#ifdef __SSE2__
+	// 32 bytes at a time into one bit mask, then one push per bit
+	const __m128i newline = _mm_set1_epi8('\n');
+	for (; i + 32 <= len; i += 32) {
+		__m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i *>(buf + i));
+		__m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i *>(buf + i + 16));
+		uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(lo, newline)) |
+		                ((uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(hi, newline)) << 16);
+		while (mask) {
+			ends.push_back(i + __builtin_ctz(mask));
+			mask &= mask - 1;
+		}
+	}
+#endif
+	for (; i < len; i++) {
+		if (buf[i] == '\n')
+			ends.push_back(i);
+	}
+}
+
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Test and benchmark
+/////////////////////////////////////////////////////////////////////////////
+
+#ifdef DEBUG_FILETAIL_CPP
+
+#include <cstdlib>
+#include "eventbatch.h"
+#include "multiline.h"
+
+#define BENCH_LINES 2000000
+
+using namespace sawmill;
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+class CountingSink : public EventSink
+{
+public:
+	CountingSink() :count(0), bytes(0), last(), pool() {}
+	LogEvent *newEvent() { return pool.get(); }
+	void submit(LogEvent *event)
+	{
+		count++;
+		bytes += event->message().size();
+		last = event->message();
+		pool.put(event);
+	}
+	long count;
+	long bytes;
+	std::string last;
+	EventPool pool;
+};
+
+// Keeps the events until they are marked done, like the dispatcher does while they are filtered
+class HoldingSink : public EventSink
+{
+public:
+	HoldingSink() :next(0), done(0), pool() {}
+	LogEvent *newEvent() { return pool.get(); }
+	void submit(LogEvent *event)
+	{
+		next++;
+		pool.put(event);
+	}
+	uint64_t submitted() const { return next; }
+	uint64_t oldestPending() const { return done; }
+	uint64_t next;
+	uint64_t done;
+	EventPool pool;
+};
+
+static void append(const std::string &path, int first, int count, const char *mode = "a")
+{
+	FILE *f = fopen(path.c_str(), mode);
+	for (int i = first; i < first + count; i++) {
+		fprintf(f, "Oct 19 12:00:00 host app[%d]: line %d of the test\n", i % 1000, i);
+	}
+	fclose(f);
+}
+
+static long drain(FileTail &tail, CountingSink &sink)
+{
+	long before = sink.count;
+	while (tail.read(sink, 4096) || (tail.timeout() == 0)) {
+	}
+	return sink.count - before;
+}
+
+static int check(const char *what, long got, long expected)
+{
+	printf("%-40s %6ld lines (expected %6ld) -> %s\n", what, got, expected, (got == expected) ? "OK" : "FAILED");
+	return (got == expected) ? 0 : 1;
+}
+
+int main()
+{
+	char dir[] = "/tmp/sawmill-tail-XXXXXX";
+	if (!mkdtemp(dir))
+		return 1;
+	std::string path = std::string(dir) + "/test.log";
+	std::string state = std::string(dir) + "/positions";
+	int rc = 0;
+
+	append(path, 0, 100, "w");
+	{
+		FileTail tail;
+		CountingSink sink;
+		tail.addFile(path, "test");
+		tail.setStateFile(state);
+		tail.start();
+		rc |= check("Existing lines skipped", drain(tail, sink), 0);
+		append(path, 100, 1000);
+		rc |= check("Appended", drain(tail, sink), 1000);
+
+		// Partial line only comes out once it is complete
+		FILE *f = fopen(path.c_str(), "a");
+		fputs("half a li", f);
+		fflush(f);
+		rc |= check("Partial line held back", drain(tail, sink), 0);
+		fputs("ne\n", f);
+		fclose(f);
+		rc |= check("Partial line completed", drain(tail, sink), 1);
+		rc |= check(sink.last.c_str(), sink.last == "half a line", 1);
+
+		// Rotation: the rest of the old file, then the new one from the start
+		append(path, 1100, 50);
+		rename(path.c_str(), (path + ".1").c_str());
+		append(path + ".1", 1150, 50);
+		append(path, 2000, 10, "w");
+		rc |= check("Rotated", drain(tail, sink), 110);
+
+		// Truncation
+		truncate(path.c_str(), 0);
+		drain(tail, sink);
+		append(path, 3000, 5);
+		rc |= check("Truncated", drain(tail, sink), 5);
+		tail.saveState();
+	}
+	{
+		// Continues where it was
+		append(path, 4000, 20);
+		FileTail tail;
+		CountingSink sink;
+		tail.addFile(path, "test");
+		tail.setStateFile(state);
+		tail.start();
+		rc |= check("Restarted", drain(tail, sink), 20);
+	}
+	{
+		// Only the lines the sink is done with count as read
+		FileTail tail;
+		HoldingSink sink;
+		tail.addFile(path, "test");
+		tail.setStateFile(state);
+		tail.start();
+		append(path, 5000, 100);
+		while (tail.read(sink, 4096) || (tail.timeout() == 0)) {
+		}
+		rc |= check("Submitted to a holding sink", sink.next, 100);
+		sink.done = 40;
+		tail.saveState();
+	}
+	{
+		FileTail tail;
+		CountingSink sink;
+		tail.addFile(path, "test");
+		tail.setStateFile(state);
+		tail.start();
+		rc |= check("Lines not done with read again", drain(tail, sink), 60);
+	}
+	{
+		// Through the multiline assembler: lines count as read once their record is done with
+		FileTail tail;
+		HoldingSink sink;
+		MultilineInput ml(&tail);
+		MultilineRules rules;
+		rules.indent = true;
+		ml.setRules(rules);
+		tail.addFile(path, "test");
+		tail.setStateFile(state);
+		tail.start();
+		FILE *f = fopen(path.c_str(), "a");
+		for (int i = 0; i < 10; i++) {
+			fprintf(f, "Oct 19 12:00:00 host app[1]: record %d\n\tat first\n\tat second\n", i);
+		}
+		fclose(f);
+		while (ml.read(sink, 4096) || (tail.timeout() == 0)) {
+		}
+		rc |= check("Records submitted, the last one open", sink.next, 9);
+		sink.done = 4;
+		tail.saveState();
+	}
+	{
+		FileTail tail;
+		CountingSink sink;
+		tail.addFile(path, "test");
+		tail.setStateFile(state);
+		tail.start();
+		rc |= check("Lines of records not done with read again", drain(tail, sink), 18);
+	}
+
+	// Newline search: vectorized against memchr() per line
+	std::string data;
+	for (int i = 0; i < 20000; i++) {
+		char line[128];
+		snprintf(line, sizeof(line), "Oct 19 12:00:00 host app[%d]: request %d served in %d ms\n", i % 1000, i, i % 97);
+		data += line;
+	}
+	std::vector<uint32_t> ends;
+	const int rounds = 200;
+	uint64_t start = now_ns();
+	for (int r = 0; r < rounds; r++) {
+		ends.clear();
+		FileTail::findLineEnds(data.data(), data.size(), ends);
+	}
+	uint64_t vec = now_ns() - start;
+	size_t found = ends.size();
+	start = now_ns();
+	for (int r = 0; r < rounds; r++) {
+		ends.clear();
+		const char *p = data.data(), *end = data.data() + data.size();
+		while ((p = (const char *)memchr(p, '\n', end - p))) {
+			ends.push_back(p - data.data());
+			p++;
+		}
+	}
+	uint64_t mc = now_ns() - start;
+	printf("Line ends: vectorized %.2f GB/s, memchr %.2f GB/s (%d/%d lines)\n",
+	       (double)data.size() * rounds / vec, (double)data.size() * rounds / mc, (int)found, (int)ends.size());
+	rc |= (found == ends.size()) ? 0 : 1;
+
+	// Throughput from the file into events
+	std::string bench = std::string(dir) + "/bench.log";
+	append(bench, 0, 0, "w");
+	FileTail tail;
+	CountingSink sink;
+	tail.addFile(bench);
+	tail.start();
+	append(bench, 0, BENCH_LINES);
+	start = now_ns();
+	drain(tail, sink);
+	uint64_t elapsed = now_ns() - start;
+	printf("Tail: %ld lines, %.0f lines/s, %.0f MB/s\n", sink.count, sink.count * 1e9 / elapsed, sink.bytes * 1e3 / elapsed);
+	rc |= check("Benchmark", sink.count, BENCH_LINES);
+
+	unlink(bench.c_str());
+	unlink(path.c_str());
+	unlink((path + ".1").c_str());
+	unlink(state.c_str());
+	rmdir(dir);
+	return rc;
+}
+
+#endif // DEBUG_FILETAIL_CPP
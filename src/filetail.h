@@ -0,0 +1,115 @@
+#ifndef __FILETAIL_H
+# define __FILETAIL_H
+
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <sys/types.h>
+#include "eventinput.h"
+
+namespace sawmill {
+
+/**
+ * Follows log files and submits every line as an event, with the path as source.
+ *
+ * Files are watched with inotify, together with their directory to see them being recreated
+ * after a rotation. A rotated file is read to its end before the new one is opened, and a
+ * truncated file is read again from the start. New data is read with pread() in large chunks,
+ * and all line ends of a chunk are found in one vectorized pass.
+ *
+ * The position after the last line the sink is done with (see EventSink::oldestPending()) is
+ * kept per file, and written to the state file every second and at exit, by writing a new file
+ * and renaming it over the old one. Lines that were submitted but not done with are read again.
+ * After a restart a file continues from there if it is still the same file. Files without a
+ * saved position start at their end when the tail starts, files that show up later are read
+ * from the start.
+ */
+class FileTail : public EventInput
+{
+public:
+	FileTail();
+	~FileTail();
+
+	/**
+	 * Follow 'path', its events get 'type' when it is not empty. Call before start().
+	 */
+	void addFile(const std::string &path, const std::string &type = "");
+	/**
+	 * Keep the read positions in 'path', loaded by start(). Empty (the default) to not keep them.
+	 */
+	void setStateFile(const std::string &path);
+	size_t fileCount() const { return files.size(); }
+
+	bool start();
+	/**
+	 * Write the positions to the state file now, if they changed.
+	 */
+	bool saveState();
+
+	// EventInput
+	int fd() const { return inotifyfd; }
+	long timeout() const;
+	size_t read(EventSink &sink, size_t max);
+
+	/**
+	 * Append the offset of every '\n' in 'buf' to 'ends'.
+	 */
+	static void findLineEnds(const char *buf, size_t len, std::vector<uint32_t> &ends);
+private:
+	struct TailFile {
+		std::string path;
+		std::string name; // Without the directory, to match the events of the directory
+		std::string type;
+		int fd;           // -1 while the file doesn't exist
+		dev_t dev;
+		ino_t ino;
+		uint64_t offset;     // After the last line the sink is done with, what the state file keeps
+		uint64_t readpos;    // Where the next read starts, after the lines submitted and 'partial'
+		std::deque<std::pair<uint64_t, uint64_t> > acks; // Sink event number and file offset after a line
+		std::string partial; // Start of a line without its end yet
+		int wd;              // inotify watch of the file, -1 if none
+		bool ready;          // There might be something to read
+		bool reopen;         // The path might have a new file
+	};
+	struct SavedPosition {
+		dev_t dev;
+		ino_t ino;
+		uint64_t offset;
+	};
+
+	void loadState();
+	bool openFile(TailFile &file, bool atend);
+	void closeFile(TailFile &file);
+	void handleEvents();
+	size_t readFile(TailFile &file, EventSink &sink, size_t max);
+	size_t submitLines(TailFile &file, EventSink &sink, size_t len, size_t max);
+	size_t submitLine(TailFile &file, EventSink &sink, const char *line, size_t len, uint64_t end);
+	void ackLines(TailFile &file, uint64_t oldest);
+
+	std::vector<TailFile> files;
+	std::string statefile;
+	std::map<std::string, SavedPosition> saved; // By path, from the state file
+	int inotifyfd;
+	std::map<int, size_t> filewatches;              // Watch descriptor to file index
+	std::map<int, std::vector<size_t> > dirwatches; // Watch descriptor to the files in the directory
+	EventSink *acksink; // Of the last read(), asked which lines it is done with
+	size_t nextfile;  // Round robin start, so one busy file can't starve the others
+	bool more;        // read() stopped at 'max' with input left
+	bool dirty;       // Positions changed since the last saveState()
+	uint64_t nextcheck_ms;
+	uint64_t nextsave_ms;
+
+	// Reused for every read
+	std::vector<char> chunk;
+	std::vector<uint32_t> ends;
+
+	// Not copyable
+	FileTail(const FileTail &);
+	FileTail &operator=(const FileTail &);
+};
+
+} // namespace sawmill
+
+#endif // ifndef __FILETAIL_H
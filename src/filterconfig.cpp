@@ -0,0 +1,165 @@
+/****************************************************************************
+ * Project: SawMill
+ * Authors:
+ *          Bart Meuris <bart . meuris @ gmail . com>
+ *
+ * License: (to be discussed LGPL version 2.0?)
+ ****************************************************************************
+ * Module description:
+ *     Storage of the filter configuration by filterId, and generation and
+ *     application of config deltas so a reload doesn't require pushing the
+ *     complete FilterConfig to every slave.
+ *
+ ***************************************************************************/
+
+#include "filterconfig.h"
+#include <string>
+
+namespace sawmill {
+
+FilterConfigStore::FilterConfigStore(size_t history)
+	:version(-1), filters(), previous(), maxhistory(history)
+{
+}
+
+int FilterConfigStore::getVersion() const
+{
+	return version;
+}
+
+const FilterConfigStore::FilterMap &FilterConfigStore::getFilters() const
+{
+	return filters;
+}
+
+const Filter *FilterConfigStore::getFilter(int filterId) const
+{
+	FilterMap::const_iterator it = filters.find(filterId);
+	if (it == filters.end())
+		return NULL;
+	return &it->second;
+}
+
+void FilterConfigStore::toConfig(FilterConfig &config) const
+{
+	config.Clear();
+	config.set_version(version);
+	for (FilterMap::const_iterator it = filters.begin(); it != filters.end(); ++it) {
+		config.add_filter()->CopyFrom(it->second);
+	}
+}
+
+void FilterConfigStore::update(const FilterConfig &config)
+{
+	if (version >= 0) {
+		previous.push_back(FilterConfig());
+		toConfig(previous.back());
+		while (previous.size() > maxhistory) {
+			previous.pop_front();
+		}
+	}
+	applyFull(config, NULL);
+}
+
+bool FilterConfigStore::fillConfigMessage(int slaveVersion, FilterMessage &msg) const
+{
+	msg.set_command(FilterMessage::CONFIG);
+	msg.clear_config();
+	msg.clear_configdelta();
+
+	if (slaveVersion >= 0) {
+		for (std::deque<FilterConfig>::const_iterator it = previous.begin(); it != previous.end(); ++it) {
+			if (it->version() != slaveVersion)
+				continue;
+			FilterConfig current;
+			toConfig(current);
+			makeDelta(*it, current, *msg.mutable_configdelta());
+			return true;
+		}
+	}
+	// Slave is unknown or too far behind, send everything
+	toConfig(*msg.mutable_config());
+	return false;
+}
+
+bool FilterConfigStore::apply(const FilterMessage &msg, std::vector<int> *touched)
+{
+	if (msg.has_config()) {
+		applyFull(msg.config(), touched);
+		return true;
+	}
+	if (msg.has_configdelta()) {
+		return applyDelta(msg.configdelta(), touched);
+	}
+	return false;
+}
+
+void FilterConfigStore::applyFull(const FilterConfig &config, std::vector<int> *touched)
+{
+	FilterMap newfilters;
+	for (int i = 0; i < config.filter_size(); i++) {
+		const Filter &f = config.filter(i);
+		newfilters[f.filterid()].CopyFrom(f);
+	}
+	if (touched) {
+		// Report only what differs, so warm state of unchanged filters can be kept
+		for (FilterMap::const_iterator it = filters.begin(); it != filters.end(); ++it) {
+			FilterMap::const_iterator nit = newfilters.find(it->first);
+			if ((nit == newfilters.end()) || (nit->second.SerializeAsString() != it->second.SerializeAsString()))
+				touched->push_back(it->first);
+		}
+		for (FilterMap::const_iterator nit = newfilters.begin(); nit != newfilters.end(); ++nit) {
+			if (filters.find(nit->first) == filters.end())
+				touched->push_back(nit->first);
+		}
+	}
+	filters.swap(newfilters);
+	version = config.version();
+}
+
+bool FilterConfigStore::applyDelta(const FilterConfigDelta &delta, std::vector<int> *touched)
+{
+	if ((version < 0) || (delta.baseversion() != version)) {
+		return false;
+	}
+	for (int i = 0; i < delta.removedid_size(); i++) {
+		if (filters.erase(delta.removedid(i)) && touched)
+			touched->push_back(delta.removedid(i));
+	}
+	for (int i = 0; i < delta.filter_size(); i++) {
+		const Filter &f = delta.filter(i);
+		filters[f.filterid()].CopyFrom(f);
+		if (touched)
+			touched->push_back(f.filterid());
+	}
+	version = delta.version();
+	return true;
+}
+
+void FilterConfigStore::makeDelta(const FilterConfig &from, const FilterConfig &to, FilterConfigDelta &delta)
+{
+	std::map<int, std::string> old;
+	std::map<int, bool> seen;
+
+	delta.Clear();
+	delta.set_baseversion(from.version());
+	delta.set_version(to.version());
+
+	for (int i = 0; i < from.filter_size(); i++) {
+		from.filter(i).SerializeToString(&old[from.filter(i).filterid()]);
+	}
+	for (int i = 0; i < to.filter_size(); i++) {
+		const Filter &f = to.filter(i);
+		std::map<int, std::string>::const_iterator it = old.find(f.filterid());
+		seen[f.filterid()] = true;
+		if ((it == old.end()) || (it->second != f.SerializeAsString())) {
+			delta.add_filter()->CopyFrom(f);
+		}
+	}
+	for (std::map<int, std::string>::const_iterator it = old.begin(); it != old.end(); ++it) {
+		if (seen.find(it->first) == seen.end())
+			delta.add_removedid(it->first);
+	}
+}
+
+}
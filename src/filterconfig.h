@@ -0,0 +1,62 @@
+#ifndef __FILTERCONFIG_H
+# define __FILTERCONFIG_H
+
+#include <map>
+#include <deque>
+#include <vector>
+#include "command.pb.h"
+
+namespace sawmill {
+
+/**
+ * Keeps the filter configuration indexed by filterId, and takes care of distributing it as
+ * full snapshots or deltas.
+ *
+ * The dispatcher uses update() on every reload and fillConfigMessage() to build the CONFIG
+ * message for a slave, the slaves use apply() on every received CONFIG message.
+ */
+class FilterConfigStore
+{
+	public:
+		typedef std::map<int, Filter> FilterMap;
+
+		explicit FilterConfigStore(size_t history = 4);
+
+		int getVersion() const;
+		const FilterMap &getFilters() const;
+		const Filter *getFilter(int filterId) const;
+		void toConfig(FilterConfig &config) const;
+
+		/**
+		 * Dispatcher side: replace the current config with a new version. The previous versions
+		 * are kept so deltas can still be generated for slaves that lag behind.
+		 */
+		void update(const FilterConfig &config);
+
+		/**
+		 * Dispatcher side: fill in the CONFIG message for a slave running slaveVersion.
+		 * Returns true if a delta was used, false if a full snapshot was needed.
+		 */
+		bool fillConfigMessage(int slaveVersion, FilterMessage &msg) const;
+
+		/**
+		 * Slave side: apply a CONFIG message (full config or delta). Filters that are not part of
+		 * a delta are left untouched. Returns false when a delta does not apply on the current
+		 * version, the store is unchanged in that case and a full config must be requested.
+		 * The ID's of all added, changed and removed filters are appended to 'touched'.
+		 */
+		bool apply(const FilterMessage &msg, std::vector<int> *touched = NULL);
+
+		static void makeDelta(const FilterConfig &from, const FilterConfig &to, FilterConfigDelta &delta);
+	private:
+		void applyFull(const FilterConfig &config, std::vector<int> *touched);
+		bool applyDelta(const FilterConfigDelta &delta, std::vector<int> *touched);
+
+		int version;
+		FilterMap filters;
+		std::deque<FilterConfig> previous;
+		size_t maxhistory;
+};
+
+}
+#endif // defined __FILTERCONFIG_H
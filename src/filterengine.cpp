@@ -0,0 +1,626 @@
+/****************************************************************************
+ * Project: SawMill
+ * Authors:
+ *          Bart Meuris <bart . meuris @ gmail . com>
+ *
+ * License: (to be discussed LGPL version 2.0?)
+ ****************************************************************************
+ * Module description:
+ *     In-process filter engine: compiles the FilterSteps of the loaded
+ *     config and runs them over batches of LogEvents.
+ *
+ ***************************************************************************/
+
+#include "filterengine.h"
+#include "fieldvalue.h"
+#include "sawlog.h"
+#include <algorithm>
+#include <iomanip>
+#include <time.h>
+#include <boost/regex.hpp>
+
+namespace sawmill {
+
+struct FilterEngine::CompiledStep
+{
+	int stepnumber;
+	std::string pluginname;
+	BuiltinPlugin builtin;
+	FilterPlugin *plugin;
+	bool remote; // The plugin runs on another slave
+
+	// Guards
+	TagSet requiretags;
+	std::vector<const Field *> requirefield;
+	std::vector<uint32_t> requirekey;
+	bool hasmatch;
+	boost::regex match;
+	std::string matchliteral; // Literal every match contains, empty if there is none
+	bool matchexact;          // The regex is just matchliteral
+	uint32_t matchid;         // ID of matchliteral in the RegexSet
+
+	// Parameters of builtin plugins
+	std::vector<const Field *> params;
+	std::vector<uint32_t> paramid; // Interned field key or tag of each parameter, for the field and tag builtins
+	std::vector<Field::Type> paramtype; // Type to convert each field to, for convert
+
+	// Profiling
+	uint64_t events;
+	uint64_t skipped;
+	uint64_t nanoseconds;
+
+	CompiledStep()
+		:stepnumber(0), pluginname(), builtin(BUILTIN_NONE), plugin(NULL), remote(false), requiretags(), requirefield(),
+		 requirekey(), hasmatch(false), match(), matchliteral(), matchexact(false), matchid(RegexSet::NONE),
+		 params(), paramid(), paramtype(), events(0), skipped(0), nanoseconds(0)
+	{}
+	~CompiledStep()
+	{
+		delete plugin;
+	}
+};
+
+struct FilterEngine::CompiledFilter
+{
+	int id;
+	uint32_t type;  // Interned type
+	size_t index;   // Position in the filter list of the type
+	Filter source; // Kept for change detection, and the guards/params point into it
+	std::string serialized;
+	std::vector<CompiledStep *> steps;
+
+	~CompiledFilter()
+	{
+		for (size_t i = 0; i < steps.size(); i++) {
+			delete steps[i];
+		}
+	}
+};
+
+static inline uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+FilterEngine::FilterEngine()
+	:version(-1), profiling(false), pipelining(false), localplugins(), filters(), bytype(), patterns(), typenames(), typeids(), starts(), startat(), late(),
+	 grouped(), active(), indexed()
+{
+}
+
+FilterEngine::~FilterEngine()
+{
+	clear();
+}
+
+void FilterEngine::clear()
+{
+	for (std::map<int, CompiledFilter *>::iterator it = filters.begin(); it != filters.end(); ++it) {
+		delete it->second;
+	}
+	filters.clear();
+	bytype.clear();
+}
+
+int FilterEngine::getVersion() const
+{
+	return version;
+}
+
+void FilterEngine::setPipelining(const std::vector<std::string> &plugins)
+{
+	pipelining = true;
+	localplugins.clear();
+	localplugins.insert(plugins.begin(), plugins.end());
+}
+
+bool FilterEngine::compileStep(const FilterStep &src, CompiledStep &step) const
+{
+	PluginRegistry &registry = PluginRegistry::instance();
+
+	step.stepnumber = src.stepnumber();
+	step.pluginname = src.plugin();
+	if (pipelining && (localplugins.find(src.plugin()) == localplugins.end())) {
+		// Only the guards are needed, to know whether the event has to go to the plugin
+		step.remote = true;
+	} else if (!registry.has(src.plugin())) {
+		ERR("Unknown plugin '%s' in step %d", src.plugin().c_str(), src.stepnumber());
+		return false;
+	}
+	step.builtin = step.remote ? BUILTIN_NONE : registry.builtin(src.plugin());
+	if ((step.builtin == BUILTIN_NONE) && !step.remote) {
+		step.plugin = registry.create(src.plugin());
+		if ((step.plugin == NULL) || !step.plugin->init(src)) {
+			ERR("Could not initialize plugin '%s' in step %d", src.plugin().c_str(), src.stepnumber());
+			return false;
+		}
+	}
+
+	for (int i = 0; i < src.requiretag_size(); i++) {
+		step.requiretags.add(StringInterner::tags().intern(src.requiretag(i)));
+	}
+	for (int i = 0; i < src.requirefield_size(); i++) {
+		step.requirefield.push_back(&src.requirefield(i));
+		step.requirekey.push_back(StringInterner::keys().intern(src.requirefield(i).key()));
+	}
+	if (src.has_requirematch()) {
+		try {
+			step.match.assign(src.requirematch());
+			step.hasmatch = true;
+			RegexSet::analyze(src.requirematch(), step.matchliteral, step.matchexact);
+		} catch (boost::regex_error &e) {
+			ERR("Invalid requireMatch regex '%s' in step %d: %s", src.requirematch().c_str(), src.stepnumber(), e.what());
+			return false;
+		}
+	}
+	for (int i = 0; i < src.parameter_size(); i++) {
+		step.params.push_back(&src.parameter(i));
+		// setfield and convert take the field name as key, removefield and the tag plugins as value
+		if ((step.builtin == BUILTIN_SETFIELD) || (step.builtin == BUILTIN_CONVERT))
+			step.paramid.push_back(StringInterner::keys().intern(src.parameter(i).key()));
+		else if (step.builtin == BUILTIN_REMOVEFIELD)
+			step.paramid.push_back(StringInterner::keys().intern(src.parameter(i).value()));
+		else if ((step.builtin == BUILTIN_ADDTAG) || (step.builtin == BUILTIN_REMOVETAG))
+			step.paramid.push_back(StringInterner::tags().intern(src.parameter(i).value()));
+		if (step.builtin == BUILTIN_CONVERT) {
+			Field::Type type;
+			if (!FieldValue::typeByName(src.parameter(i).value(), type)) {
+				ERR("Unknown type '%s' for field '%s' in step %d", src.parameter(i).value().c_str(),
+				    src.parameter(i).key().c_str(), src.stepnumber());
+				return false;
+			}
+			step.paramtype.push_back(type);
+		}
+	}
+	return true;
+}
+
+bool FilterEngine::load(const FilterConfigStore &store)
+{
+	bool ok = true;
+	std::map<int, CompiledFilter *> newfilters;
+	const FilterConfigStore::FilterMap &src = store.getFilters();
+
+	for (FilterConfigStore::FilterMap::const_iterator it = src.begin(); it != src.end(); ++it) {
+		std::string serialized = it->second.SerializeAsString();
+
+		// Keep the compiled filter (and its plugin state) if it did not change
+		std::map<int, CompiledFilter *>::iterator old = filters.find(it->first);
+		if ((old != filters.end()) && (old->second->serialized == serialized)) {
+			newfilters[it->first] = old->second;
+			filters.erase(old);
+			continue;
+		}
+
+		CompiledFilter *cf = new CompiledFilter();
+		cf->id = it->first;
+		cf->source.CopyFrom(it->second);
+		cf->serialized.swap(serialized);
+		bool valid = true;
+		for (int i = 0; i < cf->source.step_size(); i++) {
+			CompiledStep *step = new CompiledStep();
+			cf->steps.push_back(step);
+			if (!compileStep(cf->source.step(i), *step)) {
+				valid = false;
+			}
+		}
+		if (!valid) {
+			ERR("Filter %d (type '%s') disabled: could not be compiled", cf->id, cf->source.type().c_str());
+			delete cf;
+			ok = false;
+			continue;
+		}
+		newfilters[it->first] = cf;
+	}
+
+	// Whatever is left was removed or changed
+	clear();
+	filters.swap(newfilters);
+	patterns.clear();
+	for (std::map<int, CompiledFilter *>::iterator it = filters.begin(); it != filters.end(); ++it) {
+		uint32_t type = StringInterner::types().intern(it->second->source.type());
+		if (type >= bytype.size())
+			bytype.resize(type + 1);
+		it->second->type = type;
+		it->second->index = bytype[type].size();
+		bytype[type].push_back(it->second);
+		for (size_t s = 0; s < it->second->steps.size(); s++) {
+			CompiledStep &step = *it->second->steps[s];
+			step.matchid = patterns.add(step.matchliteral);
+		}
+	}
+	patterns.compile();
+	version = store.getVersion();
+	return ok;
+}
+
+bool FilterEngine::checkGuards(const CompiledStep &step, IndexedEvent &ie) const
+{
+	const LogEvent &event = ie.event();
+	if (!step.requiretags.empty() && !ie.hasTags(step.requiretags))
+		return false;
+	for (size_t i = 0; i < step.requirekey.size(); i++) {
+		int pos = ie.find(step.requirekey[i]);
+		if (pos < 0)
+			return false;
+		const Field &req = *step.requirefield[i];
+		if ((req.has_value() || req.has_type()) && !FieldValue::equals(event.field(pos), req))
+			return false;
+	}
+	if (step.hasmatch) {
+		if ((step.matchid != RegexSet::NONE) && !ie.matches(patterns, step.matchid))
+			return false;
+		if (!step.matchexact && !boost::regex_search(event.message(), step.match))
+			return false;
+	}
+	return true;
+}
+
+StepResult FilterEngine::runStep(CompiledStep &step, IndexedEvent &ie)
+{
+	LogEvent &event = ie.event();
+	if (step.remote)
+		return STEP_CONTINUE;
+	switch (step.builtin) {
+	case BUILTIN_ADDTAG:
+		for (size_t i = 0; i < step.paramid.size(); i++) {
+			ie.addTag(step.paramid[i]);
+		}
+		return STEP_OK;
+	case BUILTIN_REMOVETAG:
+		for (size_t i = 0; i < step.paramid.size(); i++) {
+			ie.removeTag(step.paramid[i]);
+		}
+		return STEP_OK;
+	case BUILTIN_SETFIELD:
+		for (size_t i = 0; i < step.params.size(); i++) {
+			ie.setField(step.paramid[i], *step.params[i]);
+		}
+		return STEP_OK;
+	case BUILTIN_REMOVEFIELD:
+		for (size_t i = 0; i < step.params.size(); i++) {
+			ie.removeField(step.paramid[i]);
+		}
+		return STEP_OK;
+	case BUILTIN_SETTYPE:
+		if (!step.params.empty())
+			event.set_type(step.params[0]->value());
+		return STEP_OK;
+	case BUILTIN_DROP:
+		return STEP_DROP;
+	case BUILTIN_CONVERT:
+		// Values that don't parse stay plain strings
+		for (size_t i = 0; i < step.params.size(); i++) {
+			Field *f = ie.field(step.paramid[i]);
+			if (f)
+				FieldValue::convert(*f, step.paramtype[i]);
+		}
+		return STEP_OK;
+	case BUILTIN_NONE:
+		break;
+	}
+	// External plugins change the event directly
+	StepResult res = step.plugin->process(event);
+	ie.invalidate();
+	return res;
+}
+
+StepResult FilterEngine::runFilter(int filterId, LogEvent &event, int first)
+{
+	std::map<int, CompiledFilter *>::iterator it = filters.find(filterId);
+	if (it == filters.end())
+		return STEP_FAILED;
+	CompiledFilter &cf = *it->second;
+	IndexedEvent ie(&event);
+	for (size_t s = first; s < cf.steps.size(); s++) {
+		CompiledStep &step = *cf.steps[s];
+		if (!checkGuards(step, ie))
+			continue;
+		StepResult res = runStep(step, ie);
+		if (res != STEP_OK)
+			return res;
+	}
+	return STEP_OK;
+}
+
+void FilterEngine::process(EventList &events, std::vector<StepResult> &results)
+{
+	starts.assign(events.size(), Position());
+	process(events, results, starts);
+}
+
+void FilterEngine::process(EventList &events, std::vector<StepResult> &results, std::vector<Position> &positions)
+{
+	results.assign(events.size(), STEP_OK);
+	if (indexed.size() < (size_t)events.size())
+		indexed.resize(events.size());
+	startat.resize(events.size());
+
+	// Route by interned type ID, looking up the whole batch under one read lock
+	typenames.resize(events.size());
+	typeids.resize(events.size());
+	for (int i = 0; i < events.size(); i++) {
+		typenames[i] = &events.Get(i).type();
+	}
+	if (events.size() > 0)
+		StringInterner::types().find(&typenames[0], events.size(), &typeids[0]);
+
+	// Group the events by the filters for their type, keeping their order within a group
+	grouped.clear();
+	for (int i = 0; i < events.size(); i++) {
+		const FilterList *list = NULL;
+		if (positions[i].filterId < 0) {
+			uint32_t type = typeids[i];
+			if ((type < bytype.size()) && !bytype[type].empty())
+				list = &bytype[type];
+			startat[i] = std::make_pair(0, 0);
+		} else {
+			// Resumed: continue in the filters of the type of that filter
+			std::map<int, CompiledFilter *>::const_iterator it = filters.find(positions[i].filterId);
+			if (it == filters.end()) {
+				results[i] = STEP_FAILED;
+				continue;
+			}
+			list = &bytype[it->second->type];
+			startat[i] = std::make_pair(it->second->index, positions[i].step);
+		}
+		if (list) {
+			grouped.push_back(std::make_pair(list, i));
+			indexed[i].reset(events.Mutable(i));
+		}
+	}
+	std::sort(grouped.begin(), grouped.end());
+
+	size_t start = 0;
+	while (start < grouped.size()) {
+		const FilterList &list = *grouped[start].first;
+		size_t end = start;
+		while ((end < grouped.size()) && (grouped[end].first == &list)) {
+			end++;
+		}
+
+		for (size_t f = 0; f < list.size(); f++) {
+			// Events still going through this filter, resumed events join at their step
+			active.clear();
+			late.clear();
+			for (size_t g = start; g < end; g++) {
+				int idx = grouped[g].second;
+				if ((results[idx] != STEP_OK) || (startat[idx].first > f))
+					continue;
+				if ((startat[idx].first == f) && (startat[idx].second > 0))
+					late.push_back(std::make_pair(startat[idx].second, idx));
+				else
+					active.push_back(idx);
+			}
+			std::sort(late.begin(), late.end());
+			size_t l = 0;
+			for (size_t s = 0; (s < list[f]->steps.size()) && (!active.empty() || (l < late.size())); s++) {
+				while ((l < late.size()) && (late[l].first == (int)s)) {
+					active.push_back(late[l++].second);
+				}
+				CompiledStep &step = *list[f]->steps[s];
+				uint64_t t0 = profiling ? now_ns() : 0;
+				size_t keep = 0;
+				for (size_t a = 0; a < active.size(); a++) {
+					int idx = active[a];
+					IndexedEvent &event = indexed[idx];
+					if (!checkGuards(step, event)) {
+						step.skipped++;
+						active[keep++] = idx;
+						continue;
+					}
+					step.events++;
+					StepResult res = runStep(step, event);
+					if (res == STEP_OK) {
+						active[keep++] = idx;
+					} else if (res == STEP_DROP) {
+						results[idx] = STEP_DROP;
+					} else if (res == STEP_CONTINUE) {
+						results[idx] = STEP_CONTINUE;
+						positions[idx] = Position(list[f]->id, s);
+					}
+					// STEP_STOP and STEP_FAILED: the event leaves this filter
+				}
+				active.resize(keep);
+				if (profiling)
+					step.nanoseconds += now_ns() - t0;
+			}
+		}
+		start = end;
+	}
+}
+
+const std::string *FilterEngine::pluginAt(const Position &pos) const
+{
+	std::map<int, CompiledFilter *>::const_iterator it = filters.find(pos.filterId);
+	if ((it == filters.end()) || (pos.step < 0) || ((size_t)pos.step >= it->second->steps.size()))
+		return NULL;
+	return &it->second->steps[pos.step]->pluginname;
+}
+
+void FilterEngine::setProfiling(bool enable)
+{
+	profiling = enable;
+}
+
+void FilterEngine::resetProfile()
+{
+	for (std::map<int, CompiledFilter *>::iterator it = filters.begin(); it != filters.end(); ++it) {
+		for (size_t s = 0; s < it->second->steps.size(); s++) {
+			CompiledStep &step = *it->second->steps[s];
+			step.events = step.skipped = step.nanoseconds = 0;
+		}
+	}
+}
+
+void FilterEngine::getProfile(std::vector<StepProfile> &profile) const
+{
+	for (std::map<int, CompiledFilter *>::const_iterator it = filters.begin(); it != filters.end(); ++it) {
+		for (size_t s = 0; s < it->second->steps.size(); s++) {
+			const CompiledStep &step = *it->second->steps[s];
+			StepProfile p;
+			p.filterId = it->first;
+			p.stepnumber = step.stepnumber;
+			p.plugin = step.pluginname;
+			p.events = step.events;
+			p.skipped = step.skipped;
+			p.nanoseconds = step.nanoseconds;
+			profile.push_back(p);
+		}
+	}
+}
+
+void FilterEngine::dumpProfile(std::ostream &out) const
+{
+	std::vector<StepProfile> profile;
+	getProfile(profile);
+
+	out << "filter step plugin          events     skipped    ns/event" << std::endl;
+	for (size_t i = 0; i < profile.size(); i++) {
+		const StepProfile &p = profile[i];
+		uint64_t total = p.events + p.skipped;
+		out << std::setw(6) << p.filterId << " "
+		    << std::setw(4) << p.stepnumber << " "
+		    << std::left << std::setw(15) << p.plugin << std::right << " "
+		    << std::setw(10) << p.events << " "
+		    << std::setw(10) << p.skipped << " "
+		    << std::setw(11) << std::fixed << std::setprecision(1)
+		    << (total ? (double)p.nanoseconds / total : 0.0) << std::endl;
+	}
+}
+
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Benchmark
+/////////////////////////////////////////////////////////////////////////////
+
+#ifdef DEBUG_FILTERENGINE_CPP
+
+#include <cstdio>
+
+#define BENCH_BATCHES    2000
+#define BENCH_BATCHSIZE  256
+#define BENCH_OTHERTYPES 500 // Filters for other types, routing should not get slower from them
+
+using namespace sawmill;
+
+static void add_step(Filter *f, const char *plugin, const char *key, const char *value)
+{
+	FilterStep *s = f->add_step();
+	s->set_plugin(plugin);
+	s->set_stepnumber(f->step_size() - 1);
+	if (key) {
+		Field *p = s->add_parameter();
+		p->set_key(key);
+		p->set_value(value);
+	}
+}
+
+int main()
+{
+	FilterConfig config;
+	config.set_version(0);
+	Filter *f = config.add_filter();
+	f->set_filterid(1);
+	f->set_type("apache");
+	add_step(f, "addtag", "tag", "web");
+	add_step(f, "setfield", "vhost", "www.example.com");
+	add_step(f, "setfield", "status", "404");
+	f->mutable_step(2)->set_requirematch(" 404 ");
+	add_step(f, "addtag", "tag", "notfound");
+	f->mutable_step(3)->add_requirefield()->set_key("status");
+	add_step(f, "removefield", "field", "vhost");
+	f->mutable_step(4)->add_requiretag("web");
+	for (int t = 0; t < BENCH_OTHERTYPES; t++) {
+		char type[32];
+		snprintf(type, sizeof(type), "other-%d", t);
+		Filter *o = config.add_filter();
+		o->set_filterid(t + 2);
+		o->set_type(type);
+		add_step(o, "addtag", "tag", "other");
+	}
+
+	FilterConfigStore store;
+	store.update(config);
+	FilterEngine engine;
+	engine.load(store);
+	engine.setProfiling(true);
+
+	FilterEngine::EventList events;
+	std::vector<StepResult> results;
+	uint64_t t0 = now_ns();
+	for (int b = 0; b < BENCH_BATCHES; b++) {
+		events.Clear();
+		for (int i = 0; i < BENCH_BATCHSIZE; i++) {
+			LogEvent *e = events.Add();
+			e->set_type((i % 8) ? "apache" : "unknown");
+			e->set_source("/var/log/apache2/access.log");
+			e->set_message((i % 3) ? "127.0.0.1 - - \"GET / HTTP/1.1\" 200 1234" : "127.0.0.1 - - \"GET /x HTTP/1.1\" 404 0");
+		}
+		engine.process(events, results);
+	}
+	uint64_t total = now_ns() - t0;
+	std::vector<FilterEngine::StepProfile> profile;
+	engine.getProfile(profile);
+	for (size_t i = 0; i < profile.size(); i++) {
+		if (profile[i].filterId == 1)
+			std::cout << "step " << profile[i].stepnumber << " " << profile[i].plugin << ": " << profile[i].events
+			          << " events, " << profile[i].skipped << " skipped" << std::endl;
+	}
+	std::cout << "total: " << (double)total / (BENCH_BATCHES * BENCH_BATCHSIZE) << " ns/event" << std::endl;
+
+	// Pipelining: the front engine hands the setfield/removefield steps to the back engine, which
+	// resumes there. The result has to be the same as running everything in one engine.
+	std::vector<std::string> frontplugins(1, "addtag");
+	std::vector<std::string> backplugins;
+	backplugins.push_back("setfield");
+	backplugins.push_back("removefield");
+	FilterEngine front, back;
+	front.setPipelining(frontplugins);
+	back.setPipelining(backplugins);
+	front.load(store);
+	back.load(store);
+	FilterEngine::EventList expected, batch, next;
+	std::vector<FilterEngine::Position> positions(events.size()), nextpositions;
+	std::vector<int> where, nextwhere;
+	expected.Swap(&events);
+	for (int i = 0; i < expected.size(); i++) {
+		LogEvent *e = batch.Add();
+		e->set_type(expected.Get(i).type());
+		e->set_source(expected.Get(i).source());
+		e->set_message(expected.Get(i).message());
+		events.Add();
+		where.push_back(i);
+	}
+	// Only the events that stopped at a remote step go to the next stage
+	int hops = 0;
+	for (FilterEngine *stage = &front; batch.size() > 0; stage = (stage == &front) ? &back : &front) {
+		stage->process(batch, results, positions);
+		next.Clear();
+		nextwhere.clear();
+		nextpositions.clear();
+		for (int i = 0; i < batch.size(); i++) {
+			if (results[i] == STEP_CONTINUE) {
+				next.Add()->Swap(batch.Mutable(i));
+				nextwhere.push_back(where[i]);
+				nextpositions.push_back(positions[i]);
+			} else {
+				events.Mutable(where[i])->Swap(batch.Mutable(i));
+			}
+		}
+		batch.Swap(&next);
+		where.swap(nextwhere);
+		positions.swap(nextpositions);
+		hops += (batch.size() > 0);
+	}
+	bool same = true;
+	for (int i = 0; i < events.size(); i++) {
+		same &= (events.Get(i).SerializeAsString() == expected.Get(i).SerializeAsString());
+	}
+	std::cout << "pipelined: " << hops << " handoffs, " << (same ? "same result" : "DIFFERENT result") << std::endl;
+	return 0;
+}
+#endif
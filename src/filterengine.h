@@ -0,0 +1,135 @@
+#ifndef __FILTERENGINE_H
+# define __FILTERENGINE_H
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <stdint.h>
+#include "plugin.h"
+#include "filterconfig.h"
+#include "indexedevent.h"
+#include "regexset.h"
+
+namespace sawmill {
+
+/**
+ * Runs the filter steps of the loaded configuration on batches of events, in-process.
+ *
+ * The filters are indexed by interned type ID when a config is loaded, so routing an event
+ * is a single lookup whatever the number of filters. Events are grouped by type and each step is run over all events of the batch before moving
+ * on to the next step, so the step state and plugin code stay hot. The requireTag,
+ * requireField and requireMatch guards of a step are checked before the plugin is called.
+ * Field keys and tags are interned when a step is compiled and looked up through an
+ * IndexedEvent, a requireTag guard is a TagSet mask test. The requireMatch patterns of all
+ * steps go into one RegexSet, so the message is scanned once for all of them and only the
+ * regexes whose literal was found still have to run.
+ *
+ * With pipelining, events stop at the steps whose plugin runs elsewhere, and process() can
+ * resume them at that position in the engine of another slave.
+ */
+class FilterEngine
+{
+public:
+	typedef google::protobuf::RepeatedPtrField<LogEvent> EventList;
+
+	struct StepProfile {
+		int filterId;
+		int stepnumber;
+		std::string plugin;
+		uint64_t events;      // Events the plugin ran on
+		uint64_t skipped;     // Events skipped by the guards
+		uint64_t nanoseconds; // Time spent in guards and plugin
+	};
+
+	/**
+	 * Where an event is in the filters of its type: the filter and the index of the step.
+	 */
+	struct Position {
+		int filterId; // -1 for the start of the first filter of the event's type
+		int step;     // Past the last step of the filter: at the start of the next filter
+
+		Position() :filterId(-1), step(0) {}
+		Position(int id, int s) :filterId(id), step(s) {}
+	};
+
+	FilterEngine();
+	~FilterEngine();
+
+	/**
+	 * Only run the steps with these plugins, the other steps are remote: events stop there with
+	 * STEP_CONTINUE, so they can be handed off to a slave that has the plugin. Set before the
+	 * first load().
+	 */
+	void setPipelining(const std::vector<std::string> &localplugins);
+
+	/**
+	 * Load (or reload) the filters from the store. Filters that did not change keep their
+	 * plugin instances and state. Returns false if a filter could not be compiled, that filter
+	 * is disabled and the others are loaded anyway.
+	 */
+	bool load(const FilterConfigStore &store);
+	int getVersion() const;
+
+	/**
+	 * Run the filters for their type over a batch of events. 'results' gets one entry per event,
+	 * STEP_DROP for the events that should be dropped, STEP_OK for the others.
+	 */
+	void process(EventList &events, std::vector<StepResult> &results);
+	/**
+	 * Same, but every event starts at its entry in 'positions'. Events that reach a remote step
+	 * get STEP_CONTINUE and the position of that step, events that can't be resumed because
+	 * their filter is gone get STEP_FAILED.
+	 */
+	void process(EventList &events, std::vector<StepResult> &results, std::vector<Position> &positions);
+	/**
+	 * Plugin of the step at 'pos', NULL if there is no such step.
+	 */
+	const std::string *pluginAt(const Position &pos) const;
+
+	/**
+	 * Run a single filter on an event, starting at step index 'first'.
+	 */
+	StepResult runFilter(int filterId, LogEvent &event, int first = 0);
+
+	void setProfiling(bool enable);
+	void resetProfile();
+	void getProfile(std::vector<StepProfile> &profile) const;
+	void dumpProfile(std::ostream &out) const;
+private:
+	struct CompiledStep;
+	struct CompiledFilter;
+	typedef std::vector<CompiledFilter *> FilterList;
+
+	bool compileStep(const FilterStep &src, CompiledStep &step) const;
+	bool checkGuards(const CompiledStep &step, IndexedEvent &event) const;
+	static StepResult runStep(CompiledStep &step, IndexedEvent &event);
+	void clear();
+
+	int version;
+	bool profiling;
+	bool pipelining;
+	std::set<std::string> localplugins;
+	std::map<int, CompiledFilter *> filters;
+	std::vector<FilterList> bytype; // Filters per interned type ID, empty for types without filters
+	RegexSet patterns; // Literals of the requireMatch patterns of all loaded filters
+
+	// Scratch space for process(), kept to avoid reallocating for every batch
+	std::vector<const std::string *> typenames;
+	std::vector<uint32_t> typeids;
+	std::vector<Position> starts;
+	std::vector<std::pair<size_t, int> > startat; // Filter index in the type's list and step, per event
+	std::vector<std::pair<int, int> > late;       // Step and event joining the current filter after its first step
+	std::vector<std::pair<const FilterList *, int> > grouped;
+	std::vector<int> active;
+	std::vector<IndexedEvent> indexed;
+
+	// Not copyable
+	FilterEngine(const FilterEngine &);
+	FilterEngine &operator=(const FilterEngine &);
+};
+
+} // namespace sawmill
+
+#endif // ifndef __FILTERENGINE_H
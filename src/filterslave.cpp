@@ -0,0 +1,457 @@
+/****************************************************************************
+ * Project: SawMill
+ * Authors:
+ *          Bart Meuris <bart . meuris @ gmail . com>
+ *
+ * License: (to be discussed LGPL version 2.0?)
+ ****************************************************************************
+ * Module description:
+ *     Filter slave side of the FilterMessage protocol.
+ *
+ ***************************************************************************/
+
+#include "filterslave.h"
+#include "lookuptable.h"
+#include "zmqutil.h"
+#include "sawlog.h"
+#include <climits>
+#include <unistd.h>
+
+#define SLAVE_POLL_MS 1000
+// How long a reply waits for room in a full ring before it goes over 0MQ
+#define SLAVE_RING_WAIT_MS  1000
+#define SLAVE_RING_RETRY_US 50
+// How long a handoff waits for a busy peer before the events go back to the dispatcher
+#define SLAVE_HANDOFF_WAIT_MS 100
+
+namespace sawmill {
+
+FilterSlave::FilterSlave(zmq::context_t &ctx, const std::string &ep, const std::string &id, pid_t parentpid)
+	:context(ctx), endpoint(ep), identity(id), parent(parentpid), slaveid(-1), plugins(), channel(NULL), credits(SLAVE_DEFAULT_CREDITS), store(), engine(),
+	 handoffendpoint(), peers(), byplugin(), nextpeer(0), events(), results(), positions(), indexes(), handedoff(),
+	 requeued(), outgoing(), retry(), retryresults(), retrypositions(), retryindex(), handoff()
+{
+	// Other slaves can only reach us on the same host (or in the same process)
+	if ((endpoint.compare(0, 6, "ipc://") == 0) || (endpoint.compare(0, 9, "inproc://") == 0))
+		handoffendpoint = endpoint + "-" + identity;
+}
+
+FilterSlave::~FilterSlave()
+{
+	closePeers();
+}
+
+void FilterSlave::setPlugins(const std::vector<std::string> &names)
+{
+	plugins = names;
+}
+
+void FilterSlave::setChannel(ShmChannel *shm)
+{
+	channel = shm;
+}
+
+void FilterSlave::setCredits(int count)
+{
+	credits = (count > 0) ? count : 1;
+}
+
+void FilterSlave::closePeers()
+{
+	for (std::map<std::string, Peer>::iterator it = peers.begin(); it != peers.end(); ++it) {
+		delete it->second.socket;
+	}
+	peers.clear();
+	byplugin.clear();
+}
+
+int FilterSlave::run()
+{
+	if (plugins.empty())
+		PluginRegistry::instance().getNames(plugins);
+	engine.setPipelining(plugins);
+
+	zmq::socket_t socket(context, ZMQ_DEALER);
+	int linger = 0;
+	socket.setsockopt(ZMQ_LINGER, &linger, sizeof(linger));
+	socket.setsockopt(ZMQ_IDENTITY, identity.data(), identity.size());
+	socket.connect(endpoint.c_str());
+
+	// Events handed off by the other slaves
+	zmq::socket_t pull(context, ZMQ_PULL);
+	pull.setsockopt(ZMQ_LINGER, &linger, sizeof(linger));
+	if (!handoffendpoint.empty()) {
+		try {
+			pull.bind(handoffendpoint.c_str());
+		} catch (zmq::error_t &e) {
+			WARN("Slave %s: could not bind %s, not accepting handoffs: %s", identity.c_str(), handoffendpoint.c_str(), e.what());
+			handoffendpoint.clear();
+		}
+	}
+
+	// Announce ourselves with the list of plugins we can run. Always over 0MQ, so the dispatcher
+	// can route messages that don't fit the ring.
+	FilterMessage msg, reply;
+	msg.set_command(FilterMessage::HELLO);
+	for (size_t i = 0; i < plugins.size(); i++) {
+		msg.add_plugin(plugins[i]);
+	}
+	if (!handoffendpoint.empty())
+		msg.set_endpoint(handoffendpoint);
+	msg.set_credits(credits);
+	zmq_send_message(socket, msg);
+
+	for (;;) {
+		if (channel && channel->broken()) {
+			WARN("Slave %s: shared memory channel is broken, using 0MQ", identity.c_str());
+			channel = NULL;
+		}
+		// The ring last, only when there is one. The handoff socket never gets anything when it
+		// could not be bound.
+		zmq::pollitem_t items[] = {
+			{ socket, 0, ZMQ_POLLIN, 0 },
+			{ pull, 0, ZMQ_POLLIN, 0 },
+			{ NULL, channel ? channel->down->fd() : -1, ZMQ_POLLIN, 0 },
+		};
+		int count = channel ? 3 : 2;
+
+		bool waiting = channel && channel->down->prepareWait();
+		zmq_poll_ms(items, count, (channel && !waiting) ? 0 : SLAVE_POLL_MS);
+		if (waiting)
+			channel->down->finishWait();
+
+		bool received = false;
+		if (items[1].revents & ZMQ_POLLIN) {
+			received = true;
+			if (zmq_recv_message(pull, msg, ZMQ_DONTWAIT) && (msg.command() == FilterMessage::CONTINUE)) {
+				reply.Clear();
+				handleContinue(msg, reply);
+				sendReply(socket, reply);
+			} else {
+				ERR("Slave %s: invalid handoff received", identity.c_str());
+			}
+		}
+		while (channel && !channel->down->empty()) {
+			received = true;
+			if (!channel->down->read(msg)) {
+				if (!channel->broken())
+					ERR("Slave %s: invalid message received", identity.c_str());
+				continue;
+			}
+			int rc = handleMessage(socket, msg, reply);
+			if (rc >= 0)
+				return rc;
+		}
+		if (items[0].revents & ZMQ_POLLIN) {
+			received = true;
+			if (!zmq_recv_message(socket, msg)) {
+				ERR("Slave %s: invalid message received", identity.c_str());
+				continue;
+			}
+			int rc = handleMessage(socket, msg, reply);
+			if (rc >= 0)
+				return rc;
+		}
+		if (!received && parent && (getppid() != parent)) {
+			ERR("Slave %s: dispatcher process is gone, exiting", identity.c_str());
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int FilterSlave::handleMessage(zmq::socket_t &socket, FilterMessage &msg, FilterMessage &reply)
+{
+	reply.Clear();
+	switch (msg.command()) {
+	case FilterMessage::HELLO:
+		handleHello(msg);
+		return -1;
+	case FilterMessage::CONFIG:
+		handleConfig(msg, reply);
+		break;
+	case FilterMessage::PROCESS:
+		handleProcess(msg, reply);
+		break;
+	case FilterMessage::BYE:
+		DBG("Slave %s: BYE received", identity.c_str());
+		closePeers();
+		return 0;
+	default:
+		WARN("Slave %s: unexpected command %d", identity.c_str(), msg.command());
+		return -1;
+	}
+	sendReply(socket, reply);
+	return -1;
+}
+
+void FilterSlave::sendReply(zmq::socket_t &socket, const FilterMessage &msg)
+{
+	if (channel) {
+		// The dispatcher empties the ring on every poll, wait for it a while when it is full
+		for (int waited = 0; waited < SLAVE_RING_WAIT_MS * 1000; waited += SLAVE_RING_RETRY_US) {
+			ShmRing::WriteResult result = channel->up->write(msg);
+			if (result == ShmRing::WRITE_OK)
+				return;
+			if (result != ShmRing::WRITE_FULL)
+				break;
+			usleep(SLAVE_RING_RETRY_US);
+		}
+		// It must not overtake the replies still in the ring
+		for (int waited = 0; (waited < SLAVE_RING_WAIT_MS * 1000) && !channel->up->broken() && !channel->up->drained();
+		     waited += SLAVE_RING_RETRY_US) {
+			usleep(SLAVE_RING_RETRY_US);
+		}
+		DBG("Slave %s: reply of %d bytes sent over 0MQ", identity.c_str(), (int)msg.ByteSizeLong());
+	}
+	zmq_send_message(socket, msg);
+}
+
+void FilterSlave::handleHello(const FilterMessage &msg)
+{
+	if (msg.has_slaveid() && (slaveid != msg.slaveid())) {
+		slaveid = msg.slaveid();
+		DBG("Slave %s: registered as slave %d", identity.c_str(), slaveid);
+	}
+
+	// Keep the sockets of the peers we already know, close those of the peers that are gone
+	std::map<std::string, Peer> known;
+	known.swap(peers);
+	byplugin.clear();
+	for (int i = 0; i < msg.peer_size(); i++) {
+		const SlavePeer &sp = msg.peer(i);
+		if ((sp.slaveid() == slaveid) || sp.endpoint().empty() || (sp.endpoint() == handoffendpoint))
+			continue;
+		if (peers.find(sp.endpoint()) != peers.end())
+			continue;
+
+		Peer peer;
+		std::map<std::string, Peer>::iterator it = known.find(sp.endpoint());
+		if (it != known.end()) {
+			peer = it->second;
+			known.erase(it);
+		} else {
+			peer.endpoint = sp.endpoint();
+			peer.socket = new zmq::socket_t(context, ZMQ_PUSH);
+			int linger = 0;
+			peer.socket->setsockopt(ZMQ_LINGER, &linger, sizeof(linger));
+			try {
+				peer.socket->connect(peer.endpoint.c_str());
+			} catch (zmq::error_t &e) {
+				WARN("Slave %s: could not connect to slave %d at %s: %s", identity.c_str(), sp.slaveid(), peer.endpoint.c_str(), e.what());
+				delete peer.socket;
+				continue;
+			}
+		}
+		peer.slaveid = sp.slaveid();
+		Peer &added = peers[peer.endpoint] = peer;
+		for (int p = 0; p < sp.plugin_size(); p++) {
+			byplugin[sp.plugin(p)].push_back(&added);
+		}
+	}
+	for (std::map<std::string, Peer>::iterator it = known.begin(); it != known.end(); ++it) {
+		delete it->second.socket;
+	}
+	DBG("Slave %s: %d peers", identity.c_str(), (int)peers.size());
+}
+
+void FilterSlave::handleConfig(const FilterMessage &msg, FilterMessage &reply)
+{
+	reply.set_command(FilterMessage::CONFIG);
+	if (store.apply(msg)) {
+		LookupSource::refresh(store.getVersion());
+		reply.set_status(engine.load(store) ? FilterMessage::OK : FilterMessage::KO);
+	} else {
+		// Delta for another version than ours, need the complete config
+		reply.set_status(FilterMessage::RESYNC);
+	}
+	reply.set_configversion(store.getVersion());
+}
+
+void FilterSlave::handleProcess(FilterMessage &msg, FilterMessage &reply)
+{
+	reply.set_command(FilterMessage::PROCESS);
+	reply.set_status(FilterMessage::OK);
+	reply.set_batchid(msg.batchid());
+
+	if (msg.has_event()) {
+		// Single event, as sent by older dispatchers
+		events.Clear();
+		events.Add()->Swap(msg.mutable_event());
+		engine.process(events, results);
+		if (results[0] != STEP_DROP) {
+			reply.mutable_event()->Swap(events.Mutable(0));
+		}
+		return;
+	}
+
+	events.Swap(msg.mutable_events());
+	positions.assign(events.size(), FilterEngine::Position());
+	indexes.resize(events.size());
+	for (int i = 0; i < events.size(); i++) {
+		indexes[i] = i;
+	}
+	runEvents(msg.batchid());
+	fillResults(reply);
+}
+
+void FilterSlave::handleContinue(FilterMessage &msg, FilterMessage &reply)
+{
+	reply.set_command(FilterMessage::CONTINUE);
+	reply.set_status(FilterMessage::OK);
+	reply.set_batchid(msg.batchid());
+
+	if (msg.configversion() != store.getVersion()) {
+		// The filter ID's and steps may mean something else here, the dispatcher has to start over
+		DBG("Slave %s: handoff for config v%d while running v%d", identity.c_str(), msg.configversion(), store.getVersion());
+		reply.set_status(FilterMessage::RESYNC);
+		for (int i = 0; i < msg.result_size(); i++) {
+			EventResult *result = reply.add_result();
+			result->set_action(EventResult::CONTINUE);
+			result->set_index(msg.result(i).index());
+		}
+		return;
+	}
+
+	events.Swap(msg.mutable_events());
+	positions.resize(events.size());
+	indexes.resize(events.size());
+	for (int i = 0; i < events.size(); i++) {
+		if (i < msg.result_size()) {
+			const EventResult &result = msg.result(i);
+			positions[i] = FilterEngine::Position(result.filter_id(), result.filter_step());
+			indexes[i] = result.index();
+		} else {
+			positions[i] = FilterEngine::Position();
+			indexes[i] = -1;
+		}
+	}
+	runEvents(msg.batchid());
+	fillResults(reply);
+}
+
+FilterSlave::Peer *FilterSlave::peerFor(const FilterEngine::Position &pos)
+{
+	const std::string *plugin = engine.pluginAt(pos);
+	if (!plugin)
+		return NULL;
+	std::map<std::string, std::vector<Peer *> >::iterator it = byplugin.find(*plugin);
+	if ((it == byplugin.end()) || it->second.empty())
+		return NULL;
+	return it->second[nextpeer++ % it->second.size()];
+}
+
+void FilterSlave::runEvents(int batchid)
+{
+	engine.process(events, results, positions);
+	handedoff.assign(events.size(), false);
+	requeued.assign(events.size(), false);
+
+	for (;;) {
+		// Group the events that stopped at a remote step by the peer that will continue them
+		outgoing.clear();
+		retryindex.clear();
+		for (int i = 0; i < events.size(); i++) {
+			if ((results[i] != STEP_CONTINUE) || handedoff[i] || requeued[i])
+				continue;
+			Peer *peer = peerFor(positions[i]);
+			if (peer)
+				outgoing[peer].push_back(i);
+			else
+				retryindex.push_back(i);
+		}
+		for (std::map<Peer *, std::vector<int> >::iterator it = outgoing.begin(); it != outgoing.end(); ++it) {
+			handOff(it->first, it->second, batchid);
+		}
+		if (retryindex.empty())
+			break;
+
+		// No slave runs those steps at all: skip the rest of the filter, as for an unknown plugin
+		retry.Clear();
+		retrypositions.resize(retryindex.size());
+		for (size_t r = 0; r < retryindex.size(); r++) {
+			int i = retryindex[r];
+			retry.Add()->Swap(events.Mutable(i));
+			retrypositions[r] = FilterEngine::Position(positions[i].filterId, INT_MAX);
+		}
+		engine.process(retry, retryresults, retrypositions);
+		for (size_t r = 0; r < retryindex.size(); r++) {
+			int i = retryindex[r];
+			events.Mutable(i)->Swap(retry.Mutable(r));
+			results[i] = retryresults[r];
+			positions[i] = retrypositions[r];
+		}
+	}
+}
+
+void FilterSlave::handOff(Peer *peer, const std::vector<int> &which, int batchid)
+{
+	handoff.Clear();
+	handoff.set_command(FilterMessage::CONTINUE);
+	handoff.set_batchid(batchid);
+	handoff.set_configversion(store.getVersion());
+	for (size_t k = 0; k < which.size(); k++) {
+		int i = which[k];
+		handoff.add_events()->Swap(events.Mutable(i));
+		EventResult *result = handoff.add_result();
+		result->set_action(EventResult::CONTINUE);
+		result->set_filter_id(positions[i].filterId);
+		result->set_filter_step(positions[i].step);
+		result->set_index(indexes[i]);
+	}
+
+	// A peer at its high water mark is busy, not gone: wait a little for it. Waiting longer could
+	// deadlock two slaves that hand off to each other.
+	bool sent = false;
+	try {
+		sent = zmq_send_message(*peer->socket, handoff, ZMQ_DONTWAIT);
+		if (!sent) {
+			zmq::pollitem_t items[] = { { *peer->socket, 0, ZMQ_POLLOUT, 0 } };
+			if (zmq_poll_ms(items, 1, SLAVE_HANDOFF_WAIT_MS) > 0)
+				sent = zmq_send_message(*peer->socket, handoff, ZMQ_DONTWAIT);
+		}
+	} catch (zmq::error_t &e) {
+		WARN("Slave %s: handoff to slave %d failed: %s", identity.c_str(), peer->slaveid, e.what());
+	}
+	if (sent) {
+		for (size_t k = 0; k < which.size(); k++) {
+			handedoff[which[k]] = true;
+		}
+		return;
+	}
+
+	// Peer not keeping up, take the events back. The dispatcher queues them again, so they are
+	// filtered completely later instead of skipping the rest of their filter now.
+	DBG("Slave %s: could not hand off %d events to slave %d, returning them", identity.c_str(), (int)which.size(), peer->slaveid);
+	for (size_t k = 0; k < which.size(); k++) {
+		events.Mutable(which[k])->Swap(handoff.mutable_events(k));
+		requeued[which[k]] = true;
+	}
+}
+
+void FilterSlave::fillResults(FilterMessage &reply)
+{
+	for (int i = 0; i < events.size(); i++) {
+		EventResult *result = reply.add_result();
+		result->set_index(indexes[i]);
+		switch (results[i]) {
+		case STEP_DROP:
+			result->set_action(EventResult::DROP);
+			break;
+		case STEP_FAILED:
+			result->set_action(EventResult::FAILED);
+			break;
+		case STEP_CONTINUE:
+			result->set_action(requeued[i] ? EventResult::REQUEUE : EventResult::CONTINUE);
+			result->set_filter_id(positions[i].filterId);
+			result->set_filter_step(positions[i].step);
+			break;
+		default:
+			result->set_action(EventResult::PASS);
+			reply.add_events()->Swap(events.Mutable(i));
+			break;
+		}
+	}
+}
+
+}
@@ -0,0 +1,118 @@
+#ifndef __FILTERSLAVE_H
+# define __FILTERSLAVE_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+#include <zmq.hpp>
+#include "filterconfig.h"
+#include "filterengine.h"
+#include "shmring.h"
+
+#define SLAVE_DEFAULT_CREDITS 2 // One batch being processed, the next one already there
+
+namespace sawmill {
+
+/**
+ * Filter slave: connects to the dispatcher, announces its plugins with HELLO, and runs the
+ * events it receives with PROCESS through its own FilterEngine.
+ *
+ * Runs in a forked process for ipc:// and tcp:// endpoints, and as a thread sharing the
+ * dispatcher's context for inproc:// endpoints.
+ *
+ * Events that reach a step with a plugin the slave doesn't run are sent with CONTINUE straight
+ * to a peer slave that has it, which resumes them and reports their results to the dispatcher.
+ * Steps that no peer can run are skipped together with the rest of their filter. Events for a
+ * peer that stays busy are returned to the dispatcher with REQUEUE, to be filtered again. Handoffs are
+ * accepted on the dispatcher endpoint with "-<identity>" appended, for ipc:// and inproc://.
+ *
+ * With a ShmChannel, the messages with the dispatcher go through shared memory, except for
+ * the HELLO and messages too big for the ring.
+ */
+class FilterSlave
+{
+public:
+	/**
+	 * When 'parent' is set, the slave exits as soon as that process is gone.
+	 */
+	FilterSlave(zmq::context_t &context, const std::string &endpoint, const std::string &identity, pid_t parent = 0);
+	~FilterSlave();
+
+	/**
+	 * Only run (and announce) these plugins instead of all registered ones, call before run().
+	 */
+	void setPlugins(const std::vector<std::string> &plugins);
+	/**
+	 * Talk to the dispatcher over this channel, call before run(). The channel is not owned.
+	 */
+	void setChannel(ShmChannel *channel);
+	/**
+	 * Number of PROCESS batches the dispatcher may send before getting the reply of the first,
+	 * announced in HELLO. Call before run().
+	 */
+	void setCredits(int credits);
+
+	/**
+	 * Runs until BYE is received or the dispatcher is gone. Returns the exit code.
+	 */
+	int run();
+private:
+	struct Peer {
+		int slaveid;
+		std::string endpoint;
+		zmq::socket_t *socket;
+	};
+
+	int handleMessage(zmq::socket_t &socket, FilterMessage &msg, FilterMessage &reply);
+	void sendReply(zmq::socket_t &socket, const FilterMessage &msg);
+	void handleHello(const FilterMessage &msg);
+	void handleConfig(const FilterMessage &msg, FilterMessage &reply);
+	void handleProcess(FilterMessage &msg, FilterMessage &reply);
+	void handleContinue(FilterMessage &msg, FilterMessage &reply);
+	void runEvents(int batchid);
+	Peer *peerFor(const FilterEngine::Position &pos);
+	void handOff(Peer *peer, const std::vector<int> &which, int batchid);
+	void fillResults(FilterMessage &reply);
+	void closePeers();
+
+	zmq::context_t &context;
+	std::string endpoint;
+	std::string identity;
+	pid_t parent;
+	int slaveid;
+	std::vector<std::string> plugins;
+	ShmChannel *channel;
+	int credits;
+	FilterConfigStore store;
+	FilterEngine engine;
+
+	// Handoffs
+	std::string handoffendpoint;
+	std::map<std::string, Peer> peers; // By endpoint
+	std::map<std::string, std::vector<Peer *> > byplugin;
+	size_t nextpeer;
+
+	// Reused for every batch: the events, where they are in the filters and their index in the
+	// batch the dispatcher sent
+	FilterEngine::EventList events;
+	std::vector<StepResult> results;
+	std::vector<FilterEngine::Position> positions;
+	std::vector<int> indexes;
+	std::vector<bool> handedoff;
+	std::vector<bool> requeued;       // Could not be handed off, returned with REQUEUE
+	std::map<Peer *, std::vector<int> > outgoing;
+	FilterEngine::EventList retry;
+	std::vector<StepResult> retryresults;
+	std::vector<FilterEngine::Position> retrypositions;
+	std::vector<int> retryindex;
+	FilterMessage handoff;
+
+	// Not copyable
+	FilterSlave(const FilterSlave &);
+	FilterSlave &operator=(const FilterSlave &);
+};
+
+} // namespace sawmill
+
+#endif // ifndef __FILTERSLAVE_H
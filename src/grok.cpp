@@ -0,0 +1,1149 @@
+/****************************************************************************
+ * Project: SawMill
+ * Authors:
+ *          Bart Meuris <bart . meuris @ gmail . com>
+ *
+ * License: (to be discussed LGPL version 2.0?)
+ ****************************************************************************
+ * Module description:
+ *     Grok plugin: named pattern expressions compiled into specialized matchers.
+ *
+ ***************************************************************************/
+
+#include "grok.h"
+#include "fieldvalue.h"
+#include "sawlog.h"
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <arpa/inet.h>
+
+#define GROK_MAX_DEPTH 16    // Nesting of pattern definitions
+#define GROK_MAX_STEPS 10000 // Backtracking steps per match
+
+namespace sawmill {
+
+/**
+ * Scanners of the patterns. Runs match any number (from a minimum) of the characters of a set, so
+ * they can end wherever the rest of the expression matches. The others have a fixed structure and
+ * take the longest text that fits it.
+ */
+enum Scanner {
+	RUN_WORD,
+	RUN_NOTSPACE,
+	RUN_SPACE,
+	RUN_SPACES,
+	RUN_DATA,       // The only lazy one: as short as possible
+	RUN_GREEDYDATA,
+	RUN_USER,
+	RUN_DIGITS,
+	RUN_URIPATH,
+	SCAN_INT,
+	SCAN_POSINT,
+	SCAN_NUMBER,
+	SCAN_QUOTED,
+	SCAN_IPV4,
+	SCAN_IPV6,
+	SCAN_IP,
+	SCAN_HOSTNAME,
+	SCAN_IPORHOST,
+	SCAN_HTTPDATE,
+	SCAN_ISO8601,
+	SCAN_SYSLOGTS,
+	SCAN_UUID,
+	SCAN_URIPARAM,
+	SCAN_URIPATHPARAM
+};
+
+#define RE_NUMBER   "[+-]?(?:[0-9]+(?:\\.[0-9]+)?|\\.[0-9]+)"
+#define RE_QUOTED   "\"(?:[^\"\\\\]|\\\\.)*\"|'(?:[^'\\\\]|\\\\.)*'"
+#define RE_OCTET    "(?:25[0-5]|2[0-4][0-9]|1[0-9][0-9]|[1-9]?[0-9])"
+#define RE_IPV4     "(?:" RE_OCTET "\\.){3}" RE_OCTET
+#define RE_IPV6     "(?:[0-9A-Fa-f]{0,4}:){2,7}(?:[0-9A-Fa-f]{1,4}|(?:[0-9]{1,3}\\.){3}[0-9]{1,3})?"
+#define RE_IP       RE_IPV6 "|" RE_IPV4
+#define RE_HOSTNAME "[0-9A-Za-z][0-9A-Za-z.-]*"
+#define RE_URIPATH  "/[A-Za-z0-9$.+!*'(){},~:;=@#%&_/-]*"
+#define RE_URIPARAM "\\?[A-Za-z0-9$.+!*'|(){},~@#%&/=:;_?\\[\\]<>-]*"
+
+/**
+ * The patterns with a scanner, and the regex for the same text (used when an expression can't be
+ * specialized).
+ */
+static const struct {
+	const char *name;
+	Scanner scanner;
+	const char *regex;
+} elements[] = {
+	{ "INT",               SCAN_INT,          "[+-]?[0-9]+" },
+	{ "POSINT",            SCAN_POSINT,       "[1-9][0-9]*" },
+	{ "NONNEGINT",         RUN_DIGITS,        "[0-9]+" },
+	{ "NUMBER",            SCAN_NUMBER,       RE_NUMBER },
+	{ "BASE10NUM",         SCAN_NUMBER,       RE_NUMBER },
+	{ "WORD",              RUN_WORD,          "\\w+" },
+	{ "NOTSPACE",          RUN_NOTSPACE,      "\\S+" },
+	{ "SPACE",             RUN_SPACE,         "\\s*" },
+	{ "DATA",              RUN_DATA,          ".*?" },
+	{ "GREEDYDATA",        RUN_GREEDYDATA,    ".*" },
+	{ "QUOTEDSTRING",      SCAN_QUOTED,       RE_QUOTED },
+	{ "QS",                SCAN_QUOTED,       RE_QUOTED },
+	{ "IPV4",              SCAN_IPV4,         RE_IPV4 },
+	{ "IPV6",              SCAN_IPV6,         RE_IPV6 },
+	{ "IP",                SCAN_IP,           RE_IP },
+	{ "HOSTNAME",          SCAN_HOSTNAME,     RE_HOSTNAME },
+	{ "IPORHOST",          SCAN_IPORHOST,     RE_IP "|" RE_HOSTNAME },
+	{ "USER",              RUN_USER,          "[a-zA-Z0-9._-]+" },
+	{ "USERNAME",          RUN_USER,          "[a-zA-Z0-9._-]+" },
+	{ "HTTPDATE",          SCAN_HTTPDATE,     "[0-9]{2}/[A-Za-z]{3}/[0-9]{4}:[0-9]{2}:[0-9]{2}:[0-9]{2} [+-][0-9]{4}" },
+	{ "TIMESTAMP_ISO8601", SCAN_ISO8601,      "[0-9]{4}-[0-9]{2}-[0-9]{2}[T ][0-9]{2}:[0-9]{2}(?::[0-9]{2}(?:[.,][0-9]+)?)?(?:Z|[+-][0-9]{2}:?[0-9]{2})?" },
+	{ "SYSLOGTIMESTAMP",   SCAN_SYSLOGTS,     "[A-Z][a-z]{2} +[0-9]{1,2} [0-9]{2}:[0-9]{2}:[0-9]{2}" },
+	{ "UUID",              SCAN_UUID,         "[A-Fa-f0-9]{8}-[A-Fa-f0-9]{4}-[A-Fa-f0-9]{4}-[A-Fa-f0-9]{4}-[A-Fa-f0-9]{12}" },
+	{ "URIPATH",           RUN_URIPATH,       RE_URIPATH },
+	{ "URIPARAM",          SCAN_URIPARAM,     RE_URIPARAM },
+	{ "URIPATHPARAM",      SCAN_URIPATHPARAM, RE_URIPATH "(?:" RE_URIPARAM ")?" },
+	{ NULL,                RUN_SPACES,        "\\s+" }, // \s+ in an expression
+};
+
+/**
+ * Patterns made of other patterns.
+ */
+static const struct {
+	const char *name;
+	const char *expr;
+} composites[] = {
+	{ "COMMONAPACHELOG",   "%{IPORHOST:clientip} %{USER:ident} %{USER:auth} \\[%{HTTPDATE:timestamp}\\] "
+	                       "\"%{WORD:verb} %{NOTSPACE:request} HTTP/%{NUMBER:httpversion}\" %{INT:response} %{NOTSPACE:bytes}" },
+	{ "COMBINEDAPACHELOG", "%{COMMONAPACHELOG} %{QS:referrer} %{QS:agent}" },
+	{ "SYSLOGLINE",        "%{SYSLOGTIMESTAMP:timestamp} %{IPORHOST:logsource} %{DATA:program}: %{GREEDYDATA:message}" },
+};
+
+#define ELEMENT_COUNT   (sizeof(elements) / sizeof(elements[0]))
+#define COMPOSITE_COUNT (sizeof(composites) / sizeof(composites[0]))
+
+/////////////////////////////////////////////////////////////////////////////
+// Scanners
+/////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Character sets of the runs, built once.
+ */
+struct RunSets {
+	bool set[RUN_URIPATH + 1][256];
+	bool uriparam[256];
+
+	RunSets()
+	{
+		memset(set, 0, sizeof(set));
+		for (int c = 0; c < 256; c++) {
+			bool space = (c == ' ') || (c == '\t') || (c == '\n') || (c == '\v') || (c == '\f') || (c == '\r');
+			bool alnum = ((c >= '0') && (c <= '9')) || ((c >= 'A') && (c <= 'Z')) || ((c >= 'a') && (c <= 'z'));
+			set[RUN_WORD][c] = alnum || (c == '_');
+			set[RUN_NOTSPACE][c] = !space;
+			set[RUN_SPACE][c] = set[RUN_SPACES][c] = space;
+			set[RUN_DATA][c] = set[RUN_GREEDYDATA][c] = true;
+			set[RUN_USER][c] = alnum || (c == '.') || (c == '_') || (c == '-');
+			set[RUN_DIGITS][c] = (c >= '0') && (c <= '9');
+			set[RUN_URIPATH][c] = alnum || (c && strchr("$.+!*'(){},~:;=@#%&_/-", c));
+			uriparam[c] = alnum || (c && strchr("$.+!*'|(){},~@#%&/=:;_?[]<>-", c));
+		}
+	}
+};
+
+static const RunSets &runSets()
+{
+	static const RunSets sets;
+	return sets;
+}
+
+static inline bool isRun(Scanner s)
+{
+	return s <= RUN_URIPATH;
+}
+
+static inline size_t runMin(Scanner s)
+{
+	return ((s == RUN_SPACE) || (s == RUN_DATA) || (s == RUN_GREEDYDATA)) ? 0 : 1;
+}
+
+static size_t runLength(Scanner s, const char *p, const char *end)
+{
+	if ((s == RUN_DATA) || (s == RUN_GREEDYDATA))
+		return end - p;
+	if ((s == RUN_URIPATH) && ((p == end) || (*p != '/')))
+		return 0;
+	const bool *set = runSets().set[s];
+	const char *q = p;
+	while ((q < end) && set[(unsigned char)*q])
+		q++;
+	return q - p;
+}
+
+static inline bool isDigit(char c)
+{
+	return (c >= '0') && (c <= '9');
+}
+
+static inline bool isHex(char c)
+{
+	return isDigit(c) || ((c >= 'a') && (c <= 'f')) || ((c >= 'A') && (c <= 'F'));
+}
+
+static inline bool isAlnum(char c)
+{
+	return isDigit(c) || ((c >= 'a') && (c <= 'z')) || ((c >= 'A') && (c <= 'Z'));
+}
+
+/**
+ * 'n' digits at 'p'.
+ */
+static inline bool digits(const char *p, const char *end, size_t n)
+{
+	if ((size_t)(end - p) < n)
+		return false;
+	for (size_t i = 0; i < n; i++) {
+		if (!isDigit(p[i]))
+			return false;
+	}
+	return true;
+}
+
+static long scanIpv4(const char *p, const char *end)
+{
+	const char *q = p;
+	for (int octet = 0; octet < 4; octet++) {
+		if (octet) {
+			if ((q == end) || (*q != '.'))
+				return -1;
+			q++;
+		}
+		if ((q == end) || !isDigit(*q))
+			return -1;
+		// No leading zeros, at most 255: take fewer digits when three are too many
+		int value = *q++ - '0';
+		if (value) {
+			for (int i = 0; (i < 2) && (q < end) && isDigit(*q) && (value * 10 + (*q - '0') <= 255); i++)
+				value = value * 10 + (*q++ - '0');
+		}
+	}
+	return q - p;
+}
+
+static long scanIpv6(const char *p, const char *end)
+{
+	const char *q = p;
+	int colons = 0;
+	while ((q < end) && (isHex(*q) || (*q == ':') || (*q == '.'))) {
+		colons += (*q == ':');
+		q++;
+	}
+	char buf[INET6_ADDRSTRLEN];
+	struct in6_addr addr;
+	if ((colons < 2) || ((size_t)(q - p) >= sizeof(buf)))
+		return -1;
+	memcpy(buf, p, q - p);
+	buf[q - p] = '\0';
+	return (inet_pton(AF_INET6, buf, &addr) == 1) ? q - p : -1;
+}
+
+static long scanHostname(const char *p, const char *end)
+{
+	if ((p == end) || !isAlnum(*p))
+		return -1;
+	const char *q = p + 1;
+	while ((q < end) && (isAlnum(*q) || (*q == '.') || (*q == '-')))
+		q++;
+	return q - p;
+}
+
+static long scan(Scanner s, const char *p, const char *end)
+{
+	const char *q = p;
+	switch (s) {
+	case SCAN_INT:
+		if ((q < end) && ((*q == '+') || (*q == '-')))
+			q++;
+		if ((q == end) || !isDigit(*q))
+			return -1;
+		while ((q < end) && isDigit(*q))
+			q++;
+		return q - p;
+	case SCAN_POSINT:
+		if ((q == end) || (*q < '1') || (*q > '9'))
+			return -1;
+		while ((q < end) && isDigit(*q))
+			q++;
+		return q - p;
+	case SCAN_NUMBER:
+		if ((q < end) && ((*q == '+') || (*q == '-')))
+			q++;
+		if ((q < end) && isDigit(*q)) {
+			while ((q < end) && isDigit(*q))
+				q++;
+			if ((end - q >= 2) && (*q == '.') && isDigit(q[1])) {
+				q += 2;
+				while ((q < end) && isDigit(*q))
+					q++;
+			}
+			return q - p;
+		}
+		if ((end - q >= 2) && (*q == '.') && isDigit(q[1])) {
+			q += 2;
+			while ((q < end) && isDigit(*q))
+				q++;
+			return q - p;
+		}
+		return -1;
+	case SCAN_QUOTED: {
+		if ((q == end) || ((*q != '"') && (*q != '\'')))
+			return -1;
+		char quote = *q++;
+		while (q < end) {
+			if (*q == '\\') {
+				if (end - q < 2)
+					return -1;
+				q += 2;
+			} else if (*q++ == quote) {
+				return q - p;
+			}
+		}
+		return -1;
+	}
+	case SCAN_IPV4:
+		return scanIpv4(p, end);
+	case SCAN_IPV6:
+		return scanIpv6(p, end);
+	case SCAN_IP: {
+		long n = scanIpv6(p, end);
+		return (n >= 0) ? n : scanIpv4(p, end);
+	}
+	case SCAN_HOSTNAME:
+		return scanHostname(p, end);
+	case SCAN_IPORHOST: {
+		// The longest of the two, an address followed by more host name characters is a host name
+		long ip = scanIpv6(p, end);
+		if (ip < 0)
+			ip = scanIpv4(p, end);
+		return std::max(ip, scanHostname(p, end));
+	}
+	case SCAN_HTTPDATE:
+		// 10/Oct/2013:13:55:36 -0700
+		if ((end - p < 26) || !digits(p, end, 2) || (p[2] != '/') || !isAlnum(p[3]) || !isAlnum(p[4]) || !isAlnum(p[5]) ||
+		    (p[6] != '/') || !digits(p + 7, end, 4) || (p[11] != ':') || !digits(p + 12, end, 2) || (p[14] != ':') ||
+		    !digits(p + 15, end, 2) || (p[17] != ':') || !digits(p + 18, end, 2) || (p[20] != ' ') ||
+		    ((p[21] != '+') && (p[21] != '-')) || !digits(p + 22, end, 4))
+			return -1;
+		return 26;
+	case SCAN_ISO8601:
+		// 2013-10-10T13:55[:36[.123]][Z|+02[:]00]
+		if ((end - p < 16) || !digits(p, end, 4) || (p[4] != '-') || !digits(p + 5, end, 2) || (p[7] != '-') ||
+		    !digits(p + 8, end, 2) || ((p[10] != 'T') && (p[10] != ' ')) || !digits(p + 11, end, 2) || (p[13] != ':') ||
+		    !digits(p + 14, end, 2))
+			return -1;
+		q = p + 16;
+		if ((end - q >= 3) && (*q == ':') && digits(q + 1, end, 2)) {
+			q += 3;
+			if ((end - q >= 2) && ((*q == '.') || (*q == ',')) && isDigit(q[1])) {
+				q += 2;
+				while ((q < end) && isDigit(*q))
+					q++;
+			}
+		}
+		if ((q < end) && (*q == 'Z')) {
+			q++;
+		} else if ((end - q >= 5) && ((*q == '+') || (*q == '-')) && digits(q + 1, end, 2)) {
+			if (digits(q + 3, end, 2))
+				q += 5;
+			else if ((end - q >= 6) && (q[3] == ':') && digits(q + 4, end, 2))
+				q += 6;
+		}
+		return q - p;
+	case SCAN_SYSLOGTS:
+		// Oct  1 13:55:36
+		if ((end - q < 3) || (q[0] < 'A') || (q[0] > 'Z') || (q[1] < 'a') || (q[1] > 'z') || (q[2] < 'a') || (q[2] > 'z'))
+			return -1;
+		q += 3;
+		if ((q == end) || (*q != ' '))
+			return -1;
+		while ((q < end) && (*q == ' '))
+			q++;
+		if ((q == end) || !isDigit(*q))
+			return -1;
+		q++;
+		if ((q < end) && isDigit(*q))
+			q++;
+		if ((end - q < 9) || (q[0] != ' ') || !digits(q + 1, end, 2) || (q[3] != ':') || !digits(q + 4, end, 2) ||
+		    (q[6] != ':') || !digits(q + 7, end, 2))
+			return -1;
+		return q + 9 - p;
+	case SCAN_UUID: {
+		static const int groups[] = { 8, 4, 4, 4, 12 };
+		for (int g = 0; g < 5; g++) {
+			if (g) {
+				if ((q == end) || (*q != '-'))
+					return -1;
+				q++;
+			}
+			for (int i = 0; i < groups[g]; i++, q++) {
+				if ((q == end) || !isHex(*q))
+					return -1;
+			}
+		}
+		return q - p;
+	}
+	case SCAN_URIPARAM: {
+		const bool *set = runSets().uriparam;
+		if ((q == end) || (*q != '?'))
+			return -1;
+		q++;
+		while ((q < end) && set[(unsigned char)*q])
+			q++;
+		return q - p;
+	}
+	case SCAN_URIPATHPARAM: {
+		size_t n = runLength(RUN_URIPATH, p, end);
+		if (!n)
+			return -1;
+		long param = scan(SCAN_URIPARAM, p + n, end);
+		return n + ((param > 0) ? param : 0);
+	}
+	default:
+		break;
+	}
+	return -1;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// GrokPattern
+/////////////////////////////////////////////////////////////////////////////
+
+GrokPattern::GrokPattern()
+	:tokens(), anchorstart(false), anchorend(false), specialized(true), names(), types(), regextext(), groups(0),
+	 groupof(), re()
+{
+}
+
+bool GrokPattern::compile(const std::string &expr, const std::map<std::string, std::string> &defines, std::string &error)
+{
+	tokens.clear();
+	anchorstart = anchorend = false;
+	specialized = true;
+	names.clear();
+	types.clear();
+	regextext.clear();
+	groups = 0;
+	groupof.clear();
+	if (!parse(expr, defines, 0, error))
+		return false;
+	try {
+		re.assign(regextext, boost::regex::perl);
+	} catch (boost::regex_error &e) {
+		error = std::string("invalid regex: ") + e.what();
+		return false;
+	}
+	return true;
+}
+
+void GrokPattern::addLiteral(char c)
+{
+	if (tokens.empty() || (tokens.back().kind != TOKEN_LITERAL)) {
+		Token t;
+		t.kind = TOKEN_LITERAL;
+		t.element = -1;
+		t.capture = -1;
+		tokens.push_back(t);
+	}
+	tokens.back().literal += c;
+	if (strchr("\\^$.|?*+()[]{}", c))
+		regextext += '\\';
+	regextext += c;
+}
+
+int GrokPattern::addCapture(const std::string &name, const std::string &type, std::string &error)
+{
+	Field::Type t = Field::STRING;
+	if (type == "int") {
+		t = Field::INT;
+	} else if (type == "float") {
+		t = Field::DOUBLE;
+	} else if (!type.empty()) {
+		error = "unknown capture type '" + type + "', use int or float";
+		return -1;
+	}
+	names.push_back(name);
+	types.push_back(t);
+	groupof.push_back(++groups);
+	return names.size() - 1;
+}
+
+bool GrokPattern::parse(const std::string &expr, const std::map<std::string, std::string> &defines, int depth, std::string &error)
+{
+	size_t i = 0, n = expr.size();
+	bool inclass = false; // In a [...] of plain regex
+	if (!depth && (n > 0) && (expr[0] == '^')) {
+		anchorstart = true;
+		regextext += '^';
+		i++;
+	}
+	for (; i < n; i++) {
+		char c = expr[i];
+		if ((c == '%') && (i + 1 < n) && (expr[i + 1] == '{')) {
+			size_t close = expr.find('}', i + 2);
+			if (close == std::string::npos) {
+				error = "unterminated %{ in '" + expr + "'";
+				return false;
+			}
+			// %{NAME[:capture[:type]]}
+			std::string spec = expr.substr(i + 2, close - i - 2), name, capture, type;
+			size_t colon = spec.find(':');
+			name = spec.substr(0, colon);
+			if (colon != std::string::npos) {
+				capture = spec.substr(colon + 1);
+				size_t colon2 = capture.find(':');
+				if (colon2 != std::string::npos) {
+					type = capture.substr(colon2 + 1);
+					capture.erase(colon2);
+				}
+			}
+			i = close;
+
+			const char *sub = NULL;
+			std::map<std::string, std::string>::const_iterator def = defines.find(name);
+			if (def != defines.end())
+				sub = def->second.c_str();
+			for (size_t k = 0; !sub && (k < COMPOSITE_COUNT); k++) {
+				if (name == composites[k].name)
+					sub = composites[k].expr;
+			}
+			int element = -1;
+			for (size_t e = 0; !sub && (element < 0) && (e < ELEMENT_COUNT); e++) {
+				if (elements[e].name && (name == elements[e].name))
+					element = e;
+			}
+			if (!sub && (element < 0)) {
+				error = "unknown pattern '" + name + "'";
+				return false;
+			}
+			int cap = -1;
+			if (!capture.empty() && ((cap = addCapture(capture, type, error)) < 0))
+				return false;
+			regextext += (cap >= 0) ? "(" : "(?:";
+			Token t;
+			t.element = element;
+			t.capture = cap;
+			if (sub) {
+				if (depth >= GROK_MAX_DEPTH) {
+					error = "pattern definitions nested too deep at '" + name + "'";
+					return false;
+				}
+				if (cap >= 0) {
+					t.kind = TOKEN_GROUP_START;
+					tokens.push_back(t);
+				}
+				if (!parse(sub, defines, depth + 1, error))
+					return false;
+				if (cap >= 0) {
+					t.kind = TOKEN_GROUP_END;
+					tokens.push_back(t);
+				}
+			} else {
+				t.kind = TOKEN_ELEMENT;
+				tokens.push_back(t);
+				regextext += elements[element].regex;
+			}
+			regextext += ')';
+			continue;
+		}
+		if ((c == '$') && !depth && (i + 1 == n)) {
+			anchorend = true;
+			regextext += '$';
+			continue;
+		}
+		if ((c == '\\') && (i + 1 < n)) {
+			char e = expr[++i];
+			if ((e == 's') && (i + 1 < n) && ((expr[i + 1] == '+') || (expr[i + 1] == '*')) && !inclass) {
+				Token t;
+				t.kind = TOKEN_ELEMENT;
+				t.element = -1;
+				for (size_t el = 0; el < ELEMENT_COUNT; el++) {
+					if (elements[el].scanner == ((expr[i + 1] == '+') ? RUN_SPACES : RUN_SPACE))
+						t.element = el;
+				}
+				t.capture = -1;
+				if (t.element >= 0) {
+					tokens.push_back(t);
+				} else {
+					specialized = false;
+				}
+				regextext += "\\s";
+				regextext += expr[++i];
+			} else if (!isAlnum(e) && !inclass) {
+				addLiteral(e);
+			} else {
+				// \d, \w, \b, ... and everything in [...]: plain regex
+				specialized = false;
+				regextext += c;
+				regextext += e;
+			}
+			continue;
+		}
+		if (inclass || strchr(".[](){}*+?|^$", c)) {
+			specialized = false;
+			if ((c == '(') && !inclass && !((i + 1 < n) && (expr[i + 1] == '?')))
+				groups++;
+			if (c == '[')
+				inclass = true;
+			else if (c == ']')
+				inclass = false;
+			regextext += c;
+			continue;
+		}
+		addLiteral(c);
+	}
+	if (inclass) {
+		error = "unterminated [ in '" + expr + "'";
+		return false;
+	}
+	return true;
+}
+
+bool GrokPattern::match(const char *text, size_t len, std::vector<Span> &spans) const
+{
+	static const Span none = { NULL, 0 };
+	spans.assign(names.size(), none);
+	const char *end = text + len;
+	if (!specialized) {
+		boost::cmatch m;
+		if (!boost::regex_search(text, end, m, re))
+			return false;
+		for (size_t i = 0; i < names.size(); i++) {
+			const boost::csub_match &sub = m[groupof[i]];
+			if (sub.matched) {
+				spans[i].text = sub.first;
+				spans[i].len = sub.second - sub.first;
+			}
+		}
+		return true;
+	}
+	int budget = GROK_MAX_STEPS;
+	if (anchorstart)
+		return matchAt(0, text, end, spans.data(), budget);
+	// Not anchored: the first position the expression matches at, found with its leading literal
+	const std::string *lead = (!tokens.empty() && (tokens[0].kind == TOKEN_LITERAL)) ? &tokens[0].literal : NULL;
+	for (const char *p = text; p <= end; p++) {
+		if (lead) {
+			p = static_cast<const char *>(memmem(p, end - p, lead->data(), lead->size()));
+			if (!p)
+				return false;
+		}
+		if (matchAt(0, p, end, spans.data(), budget))
+			return true;
+		if (budget <= 0)
+			return false;
+	}
+	return false;
+}
+
+bool GrokPattern::matchAt(size_t tok, const char *p, const char *end, Span *spans, int &budget) const
+{
+	for (; tok < tokens.size(); tok++) {
+		const Token &t = tokens[tok];
+		switch (t.kind) {
+		case TOKEN_LITERAL:
+			if (((size_t)(end - p) < t.literal.size()) || (memcmp(p, t.literal.data(), t.literal.size()) != 0))
+				return false;
+			p += t.literal.size();
+			break;
+		case TOKEN_GROUP_START:
+			spans[t.capture].text = p;
+			break;
+		case TOKEN_GROUP_END:
+			spans[t.capture].len = p - spans[t.capture].text;
+			break;
+		case TOKEN_ELEMENT: {
+			Scanner s = elements[t.element].scanner;
+			if (!isRun(s)) {
+				long n = scan(s, p, end);
+				if (n < 0)
+					return false;
+				if (t.capture >= 0) {
+					spans[t.capture].text = p;
+					spans[t.capture].len = n;
+				}
+				p += n;
+				break;
+			}
+
+			// A run: every length from the minimum to what the run covers can match
+			size_t min = runMin(s), max = runLength(s, p, end);
+			if (max < min)
+				return false;
+			bool lazy = (s == RUN_DATA);
+			size_t next = tok + 1;
+			while ((next < tokens.size()) && (tokens[next].kind != TOKEN_LITERAL) && (tokens[next].kind != TOKEN_ELEMENT))
+				next++;
+			if (next == tokens.size()) {
+				// Last one: up to the end if anchored there
+				size_t n = anchorend ? (size_t)(end - p) : (lazy ? min : max);
+				if (n > max)
+					return false;
+				return tryLength(tok, p, n, end, spans, budget);
+			}
+			const std::string *lit = (tokens[next].kind == TOKEN_LITERAL) ? &tokens[next].literal : NULL;
+			if (lit && lazy) {
+				// Only where the literal after the run is
+				const char *limit = std::min(end, p + max + lit->size());
+				for (const char *q = p + min; (q = static_cast<const char *>(memmem(q, limit - q, lit->data(), lit->size()))); q++) {
+					if (tryLength(tok, p, q - p, end, spans, budget))
+						return true;
+					if (budget < 0)
+						return false;
+				}
+				return false;
+			}
+			for (size_t i = 0; i <= max - min; i++) {
+				size_t n = lazy ? min + i : max - i;
+				if (lit && (((size_t)(end - p - n) < lit->size()) || (p[n] != (*lit)[0]) ||
+				            (memcmp(p + n, lit->data(), lit->size()) != 0)))
+					continue;
+				if (tryLength(tok, p, n, end, spans, budget))
+					return true;
+				if (budget < 0)
+					return false;
+			}
+			return false;
+		}
+		}
+	}
+	return !anchorend || (p == end);
+}
+
+bool GrokPattern::tryLength(size_t tok, const char *p, size_t n, const char *end, Span *spans, int &budget) const
+{
+	if (--budget < 0)
+		return false;
+	int capture = tokens[tok].capture;
+	if (capture >= 0) {
+		spans[capture].text = p;
+		spans[capture].len = n;
+	}
+	return matchAt(tok + 1, p + n, end, spans, budget);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// GrokPlugin
+/////////////////////////////////////////////////////////////////////////////
+
+static bool parseSpanInt(const char *p, size_t len, int64_t &value)
+{
+	const char *end = p + len;
+	bool neg = (p < end) && (*p == '-');
+	if ((p < end) && ((*p == '-') || (*p == '+')))
+		p++;
+	if (p == end)
+		return false;
+	uint64_t v = 0;
+	for (; p < end; p++) {
+		if (!isDigit(*p) || (v > (uint64_t)INT64_MAX / 10))
+			return false;
+		v = v * 10 + (*p - '0');
+	}
+	if (v > (uint64_t)INT64_MAX + neg)
+		return false;
+	value = neg ? (int64_t)(0 - v) : (int64_t)v;
+	return true;
+}
+
+static bool parseSpanDouble(const char *p, size_t len, double &value)
+{
+	char buf[64];
+	if (!len || (len >= sizeof(buf)))
+		return false;
+	memcpy(buf, p, len);
+	buf[len] = '\0';
+	char *rest;
+	errno = 0;
+	double v = strtod(buf, &rest);
+	if ((*rest != '\0') || (errno == ERANGE))
+		return false;
+	value = v;
+	return true;
+}
+
+GrokPlugin::GrokPlugin()
+	:field(), patterns(), spans()
+{
+}
+
+bool GrokPlugin::init(const FilterStep &step)
+{
+	std::map<std::string, std::string> defines;
+	for (int i = 0; i < step.parameter_size(); i++) {
+		const Field &p = step.parameter(i);
+		if (p.key() == "define") {
+			size_t space = p.value().find(' ');
+			if ((space == std::string::npos) || !space) {
+				ERR("grok: define '%s' is not 'NAME expression'", p.value().c_str());
+				return false;
+			}
+			defines[p.value().substr(0, space)] = p.value().substr(space + 1);
+		}
+	}
+	for (int i = 0; i < step.parameter_size(); i++) {
+		const Field &p = step.parameter(i);
+		if (p.key() == "pattern") {
+			std::string error;
+			patterns.push_back(GrokPattern());
+			if (!patterns.back().compile(p.value(), defines, error)) {
+				ERR("grok: pattern '%s': %s", p.value().c_str(), error.c_str());
+				return false;
+			}
+			if (!patterns.back().isSpecialized())
+				NOTICE("grok: pattern '%s' has regex syntax, it runs as a regex", p.value().c_str());
+		} else if (p.key() == "field") {
+			field = p.value();
+		} else if (p.key() != "define") {
+			WARN("grok: unknown parameter '%s' ignored", p.key().c_str());
+		}
+	}
+	if (patterns.empty()) {
+		ERR("grok: no pattern in step %d", step.stepnumber());
+		return false;
+	}
+	return true;
+}
+
+void GrokPlugin::setField(LogEvent &event, const GrokPattern &pattern, size_t capture, const GrokPattern::Span &span)
+{
+	const std::string &key = pattern.captureName(capture);
+	Field *f = NULL;
+	for (int i = 0; (i < event.field_size()) && !f; i++) {
+		if (event.field(i).key() == key)
+			f = event.mutable_field(i);
+	}
+	if (!f) {
+		f = event.add_field();
+		f->set_key(key);
+	}
+	// Straight from the text into the field
+	f->set_value(span.text, span.len);
+	FieldValue::clearType(*f);
+	int64_t i;
+	double d;
+	switch (pattern.captureType(capture)) {
+	case Field::INT:
+		if (parseSpanInt(span.text, span.len, i)) {
+			f->set_type(Field::INT);
+			f->set_int_value(i);
+		}
+		break;
+	case Field::DOUBLE:
+		if (parseSpanDouble(span.text, span.len, d)) {
+			f->set_type(Field::DOUBLE);
+			f->set_double_value(d);
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+StepResult GrokPlugin::process(LogEvent &event)
+{
+	const std::string *text = NULL;
+	if (field.empty()) {
+		text = &event.message();
+	} else {
+		for (int i = 0; (i < event.field_size()) && !text; i++) {
+			if (event.field(i).key() == field)
+				text = &event.field(i).value();
+		}
+	}
+	if (!text)
+		return STEP_FAILED;
+
+	for (size_t p = 0; p < patterns.size(); p++) {
+		const GrokPattern &pattern = patterns[p];
+		if (!pattern.match(text->data(), text->size(), spans))
+			continue;
+		// The spans point into the parsed text: captures that replace it go last
+		for (int pass = 0; pass < (field.empty() ? 1 : 2); pass++) {
+			for (size_t c = 0; c < spans.size(); c++) {
+				if (spans[c].len && ((pattern.captureName(c) == field) == (pass == 1)))
+					setField(event, pattern, c, spans[c]);
+			}
+		}
+		return STEP_OK;
+	}
+	return STEP_FAILED;
+}
+
+SAWMILL_REGISTER_PLUGIN("grok", GrokPlugin);
+
+} // namespace sawmill
+
+/////////////////////////////////////////////////////////////////////////////
+// Tests, and a benchmark against chained regexes
+/////////////////////////////////////////////////////////////////////////////
+
+#ifdef DEBUG_GROK_CPP
+
+#include <cstdio>
+#include <time.h>
+#include "testcheck.h"
+
+#define BENCH_EVENTS 300000
+
+using namespace sawmill;
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static std::string captured(const GrokPattern &p, const std::vector<GrokPattern::Span> &spans, const std::string &name)
+{
+	for (size_t i = 0; i < p.captureCount(); i++) {
+		if ((p.captureName(i) == name) && spans[i].text)
+			return std::string(spans[i].text, spans[i].len);
+	}
+	return "<none>";
+}
+
+/**
+ * Match with the specialized matcher and with its regex, the captures have to be the same.
+ */
+static int testPattern(const char *expr, const char *text, const char *name, const char *expected)
+{
+	std::map<std::string, std::string> defines;
+	std::string error;
+	GrokPattern p;
+	if (!p.compile(expr, defines, error))
+		return check(std::string(expr) + ": " + error, false);
+	std::vector<GrokPattern::Span> spans;
+	bool matched = p.match(text, strlen(text), spans);
+	std::string got = matched ? captured(p, spans, name) : "<no match>";
+
+	boost::regex re(p.regex());
+	boost::cmatch m;
+	std::string viaregex = "<no match>";
+	if (boost::regex_search(text, text + strlen(text), m, re)) {
+		viaregex = "<none>";
+		for (size_t i = 0, group = 1; i < p.captureCount(); i++, group++) {
+			if ((p.captureName(i) == name) && m[group].matched) {
+				viaregex = m[group].str();
+				break;
+			}
+		}
+	}
+	bool ok = (got == expected) && (viaregex == expected) && p.isSpecialized();
+	if (!ok)
+		printf("  '%s' on '%s': got '%s', regex '%s', expected '%s'\n", expr, text, got.c_str(), viaregex.c_str(), expected);
+	return check(std::string(expr), ok);
+}
+
+static void makeLine(std::string &line, unsigned i)
+{
+	static const char *verbs[] = { "GET", "POST", "HEAD" };
+	char buf[512];
+	snprintf(buf, sizeof(buf), "10.%u.%u.%u - frank [10/Oct/2013:13:%02u:%02u -0700] \"%s /apache_pb.gif?id=%u HTTP/1.1\" %d %u "
+	         "\"http://www.example.com/start.html\" \"Mozilla/4.08 [en] (Win98; I ;Nav)\"",
+	         (i >> 16) & 255, (i >> 8) & 255, i & 255, (i / 60) % 60, i % 60, verbs[i % 3], i, (i % 7) ? 200 : 404, 1000 + i % 9000);
+	line = buf;
+}
+
+static FilterStep grokStep(const char *pattern, const char *field = NULL)
+{
+	FilterStep step;
+	step.set_plugin("grok");
+	step.set_stepnumber(1);
+	Field *p = step.add_parameter();
+	p->set_key("pattern");
+	p->set_value(pattern);
+	if (field) {
+		p = step.add_parameter();
+		p->set_key("field");
+		p->set_value(field);
+	}
+	return step;
+}
+
+static const Field *findField(const LogEvent &event, const std::string &key)
+{
+	for (int i = 0; i < event.field_size(); i++) {
+		if (event.field(i).key() == key)
+			return &event.field(i);
+	}
+	return NULL;
+}
+
+int main()
+{
+	int rc = 0;
+
+	rc |= testPattern("%{INT:n}", "x -42 y", "n", "-42");
+	rc |= testPattern("%{POSINT:n}", "port 8080", "n", "8080");
+	rc |= testPattern("%{NUMBER:n}", "took 3.25s", "n", "3.25");
+	rc |= testPattern("%{NUMBER:n}\\.s", "took 3.s", "n", "3");
+	rc |= testPattern("%{WORD:w}", "  hello_world!", "w", "hello_world");
+	rc |= testPattern("%{NOTSPACE:a}:%{NOTSPACE:b}", "key:a:b", "a", "key:a");
+	rc |= testPattern("%{DATA:a}:%{GREEDYDATA:b}", "a:b:c", "a", "a");
+	rc |= testPattern("%{DATA:a}:%{GREEDYDATA:b}", "a:b:c", "b", "b:c");
+	rc |= testPattern("^%{GREEDYDATA:a}:%{DATA:b}$", "a:b:c", "a", "a:b");
+	rc |= testPattern("%{QS:q}", "say \"hi \\\"there\\\"\" now", "q", "\"hi \\\"there\\\"\"");
+	rc |= testPattern("%{IPV4:ip}", "from 192.168.1.254 to", "ip", "192.168.1.254");
+	rc |= testPattern("%{IP:ip} ", "from 2001:db8::8a2e:370:7334 to", "ip", "2001:db8::8a2e:370:7334");
+	rc |= testPattern("host=%{IPORHOST:h} ", "host=web-01.example.com up", "h", "web-01.example.com");
+	rc |= testPattern("^%{IPORHOST:h} ", "10.0.0.1 up", "h", "10.0.0.1");
+	rc |= testPattern("%{USER:u} ", "- alice.smith x", "u", "-");
+	rc |= testPattern("\\[%{HTTPDATE:t}\\]", "[10/Oct/2013:13:55:36 -0700]", "t", "10/Oct/2013:13:55:36 -0700");
+	rc |= testPattern("%{TIMESTAMP_ISO8601:t} ", "at 2013-10-10T13:55:36.123+02:00 x", "t", "2013-10-10T13:55:36.123+02:00");
+	rc |= testPattern("%{TIMESTAMP_ISO8601:t} ", "at 2013-10-10 13:55 x", "t", "2013-10-10 13:55");
+	rc |= testPattern("^%{SYSLOGTIMESTAMP:t} ", "Oct  1 13:55:36 host", "t", "Oct  1 13:55:36");
+	rc |= testPattern("%{UUID:id}", "id=123e4567-e89b-12d3-a456-426614174000", "id", "123e4567-e89b-12d3-a456-426614174000");
+	rc |= testPattern("%{URIPATHPARAM:u} ", "GET /a/b.html?x=1&y=2 HTTP", "u", "/a/b.html?x=1&y=2");
+	rc |= testPattern("user=%{WORD:u}\\s+id=%{INT:id}", "foo user=bob   id=42", "id", "42");
+	rc |= testPattern("^%{WORD:a}$", "abc def", "a", "<no match>");
+
+	// Apache combined log
+	std::string line;
+	makeLine(line, 1234567);
+	std::vector<GrokPattern::Span> spans;
+	std::map<std::string, std::string> defines;
+	std::string error;
+	GrokPattern apache;
+	rc |= check("Compile COMBINEDAPACHELOG", apache.compile("^%{COMBINEDAPACHELOG}$", defines, error) && apache.isSpecialized());
+	rc |= check("Match COMBINEDAPACHELOG", apache.match(line.data(), line.size(), spans) &&
+	            (captured(apache, spans, "clientip") == "10.18.214.135") && (captured(apache, spans, "verb") == "POST") &&
+	            (captured(apache, spans, "request") == "/apache_pb.gif?id=1234567") && (captured(apache, spans, "response") == "200") &&
+	            (captured(apache, spans, "agent") == "\"Mozilla/4.08 [en] (Win98; I ;Nav)\""));
+	GrokPattern whole;
+	rc |= check("Capture of a composite", whole.compile("%{COMMONAPACHELOG:common} ", defines, error) &&
+	            whole.match(line.data(), line.size(), spans) && (captured(whole, spans, "common") == line.substr(0, line.find(" \"http"))));
+
+	// Regex syntax falls back to the regex, with the same captures
+	GrokPattern fallback;
+	rc |= check("Regex syntax falls back", fallback.compile("(?:%{INT:n}|-) (a|b) %{WORD:w}", defines, error) &&
+	            !fallback.isSpecialized());
+	rc |= check("Fallback captures", fallback.match("x - b word", 10, spans) && (captured(fallback, spans, "n") == "<none>") &&
+	            (captured(fallback, spans, "w") == "word"));
+	defines["PORT"] = "%{POSINT}";
+	defines["HOSTPORT"] = "%{IPORHOST:host}:%{PORT:port:int}";
+	GrokPattern defined;
+	rc |= check("Defines", defined.compile("to %{HOSTPORT}", defines, error) && defined.isSpecialized() &&
+	            defined.match("conn to db.local:5432 ok", 24, spans) && (captured(defined, spans, "port") == "5432"));
+	rc |= check("Unknown pattern", !defined.compile("%{NOPE:x}", defines, error));
+	defines["LOOP"] = "%{LOOP}";
+	rc |= check("Recursive define", !defined.compile("%{LOOP}", defines, error));
+
+	// Plugin
+	{
+		GrokPlugin plugin;
+		rc |= check("Plugin init", plugin.init(grokStep("^%{COMMONAPACHELOG} %{QS:referrer} %{QS:agent}$")));
+		LogEvent event;
+		event.set_message(line);
+		rc |= check("Plugin parses", plugin.process(event) == STEP_OK);
+		const Field *f = findField(event, "clientip");
+		rc |= check("Plugin sets fields", f && (f->value() == "10.18.214.135") && !f->has_type());
+		event.set_message("not an access log line");
+		rc |= check("Plugin fails on other lines", plugin.process(event) == STEP_FAILED);
+
+		GrokPlugin typed;
+		typed.init(grokStep("%{NUMBER:bytes:int} bytes in %{NUMBER:secs:float}s"));
+		event.set_message("sent 1500 bytes in 0.25s");
+		typed.process(event);
+		f = findField(event, "bytes");
+		const Field *g = findField(event, "secs");
+		rc |= check("Typed captures", f && (f->type() == Field::INT) && (f->int_value() == 1500) && g &&
+		            (g->type() == Field::DOUBLE) && (g->double_value() == 0.25));
+
+		GrokPlugin infield;
+		infield.init(grokStep("^%{WORD:kv} %{WORD:rest}$", "kv"));
+		LogEvent ev2;
+		Field *kv = ev2.add_field();
+		kv->set_key("kv");
+		kv->set_value("first second");
+		rc |= check("Capture into the parsed field", (infield.process(ev2) == STEP_OK) && (findField(ev2, "kv")->value() == "first") &&
+		            (findField(ev2, "rest")->value() == "second"));
+	}
+
+	// Benchmark
+	std::vector<std::string> lines(BENCH_EVENTS);
+	for (int i = 0; i < BENCH_EVENTS; i++)
+		makeLine(lines[i], (unsigned)i * 7919);
+	LogEvent event;
+
+	// What it takes with chained regex steps, one per part of the line
+	static const struct { const char *regex; const char *fields[3]; } chain[] = {
+		{ "^(\\S+) (\\S+) (\\S+)", { "clientip", "ident", "auth" } },
+		{ "\\[([^\\]]+)\\]", { "timestamp", NULL, NULL } },
+		{ "\"(\\w+) (\\S+) HTTP/([0-9.]+)\"", { "verb", "request", "httpversion" } },
+		{ "\" ([0-9]+) (\\S+)", { "response", "bytes", NULL } },
+		{ "(\"[^\"]*\") (\"[^\"]*\")$", { "referrer", "agent", NULL } },
+	};
+	std::vector<boost::regex> chained;
+	for (size_t r = 0; r < sizeof(chain) / sizeof(chain[0]); r++)
+		chained.push_back(boost::regex(chain[r].regex));
+	size_t matched = 0;
+	uint64_t t0 = now_ns();
+	for (int i = 0; i < BENCH_EVENTS; i++) {
+		event.Clear();
+		event.set_message(lines[i]);
+		for (size_t r = 0; r < chained.size(); r++) {
+			boost::smatch m;
+			if (!boost::regex_search(event.message(), m, chained[r]))
+				continue;
+			for (int g = 0; (g < 3) && chain[r].fields[g]; g++) {
+				Field *f = event.add_field();
+				f->set_key(chain[r].fields[g]);
+				f->set_value(m[g + 1].str());
+			}
+			matched++;
+		}
+	}
+	uint64_t t1 = now_ns();
+
+	// The grok expression as one regex
+	GrokPattern asregex;
+	asregex.compile("^%{COMBINEDAPACHELOG}$", defines, error);
+	boost::regex one(asregex.regex());
+	size_t matched1 = 0;
+	for (int i = 0; i < BENCH_EVENTS; i++) {
+		event.Clear();
+		event.set_message(lines[i]);
+		boost::smatch m;
+		if (!boost::regex_search(event.message(), m, one))
+			continue;
+		for (size_t c = 0; c < asregex.captureCount(); c++) {
+			Field *f = event.add_field();
+			f->set_key(asregex.captureName(c));
+			f->set_value(&*m[c + 1].first, m[c + 1].length());
+		}
+		matched1++;
+	}
+	uint64_t t2 = now_ns();
+
+	GrokPlugin plugin;
+	plugin.init(grokStep("^%{COMBINEDAPACHELOG}$"));
+	size_t matched2 = 0;
+	for (int i = 0; i < BENCH_EVENTS; i++) {
+		event.Clear();
+		event.set_message(lines[i]);
+		matched2 += (plugin.process(event) == STEP_OK);
+	}
+	uint64_t t3 = now_ns();
+
+	rc |= check("Benchmark lines all match", (matched == (size_t)BENCH_EVENTS * 5) && (matched1 == (size_t)BENCH_EVENTS) &&
+	            (matched2 == (size_t)BENCH_EVENTS));
+	printf("Regex chain (5 regexes): %8.0f events/s\n", BENCH_EVENTS / ((t1 - t0) / 1e9));
+	printf("Grok as one regex:       %8.0f events/s\n", BENCH_EVENTS / ((t2 - t1) / 1e9));
+	printf("Grok compiled:           %8.0f events/s (%.1fx the chain)\n", BENCH_EVENTS / ((t3 - t2) / 1e9),
+	       (double)(t1 - t0) / (t3 - t2));
+
+	printf("%s\n", rc ? "FAILED" : "All tests passed");
+	return rc;
+}
+
+#endif // DEBUG_GROK_CPP
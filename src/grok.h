@@ -0,0 +1,119 @@
+#ifndef __GROK_H
+# define __GROK_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <boost/regex.hpp>
+#include "plugin.h"
+
+namespace sawmill {
+
+/**
+ * Grok expression compiled into a matcher specialized for it.
+ *
+ * An expression is literal text with named patterns: "%{IP:client} %{NUMBER:bytes:int}" matches an
+ * IP address into the field "client", a space and a number into "bytes", stored as an int (or
+ * ":float"). The patterns are hand written scanners (see the table in grok.cpp), the literal text
+ * between them is compared as is, "\s+" and "\s*" match spaces, and a leading "^" or trailing "$"
+ * anchors the match. Patterns that take any run of characters (DATA, GREEDYDATA, NOTSPACE, WORD,
+ * ...) end where the literal after them is found, so a match is one pass over the text with only
+ * the backtracking those runs need.
+ *
+ * Expressions (and pattern definitions) with regex syntax that the matcher doesn't handle, such as
+ * groups, alternatives or character classes, are expanded into one boost::regex instead.
+ */
+class GrokPattern
+{
+public:
+	/**
+	 * Part of the text a capture matched.
+	 */
+	struct Span {
+		const char *text;
+		size_t len;
+	};
+
+	GrokPattern();
+
+	/**
+	 * Compile 'expr', 'defines' are extra pattern definitions by name (grok expressions
+	 * themselves). Returns false with the reason in 'error'.
+	 */
+	bool compile(const std::string &expr, const std::map<std::string, std::string> &defines, std::string &error);
+
+	/**
+	 * Match the text, 'spans' gets the text of every capture. Captures that matched nothing have
+	 * a length of 0.
+	 */
+	bool match(const char *text, size_t len, std::vector<Span> &spans) const;
+
+	size_t captureCount() const { return names.size(); }
+	const std::string &captureName(size_t i) const { return names[i]; }
+	Field::Type captureType(size_t i) const { return types[i]; }
+	/**
+	 * Whether the specialized matcher is used, false if it fell back to the regex.
+	 */
+	bool isSpecialized() const { return specialized; }
+	/**
+	 * The expression expanded into a regex, with a group per capture.
+	 */
+	const std::string &regex() const { return regextext; }
+private:
+	enum TokenKind { TOKEN_LITERAL, TOKEN_ELEMENT, TOKEN_GROUP_START, TOKEN_GROUP_END };
+	struct Token {
+		TokenKind kind;
+		std::string literal;
+		int element;  // Index in the pattern table
+		int capture;  // -1 if the text is not kept
+	};
+
+	bool parse(const std::string &expr, const std::map<std::string, std::string> &defines, int depth, std::string &error);
+	void addLiteral(char c);
+	int addCapture(const std::string &name, const std::string &type, std::string &error);
+	bool matchAt(size_t tok, const char *p, const char *end, Span *spans, int &budget) const;
+	bool tryLength(size_t tok, const char *p, size_t n, const char *end, Span *spans, int &budget) const;
+
+	std::vector<Token> tokens;
+	bool anchorstart;
+	bool anchorend;
+	bool specialized;
+
+	std::vector<std::string> names;
+	std::vector<Field::Type> types;
+
+	// Regex fallback
+	std::string regextext;
+	int groups;                 // Groups in regextext so far
+	std::vector<int> groupof;   // Regex group per capture
+	boost::regex re;
+};
+
+/**
+ * Plugin "grok": parses the message (or a field) with grok expressions into fields.
+ *
+ * Parameters:
+ *   pattern: grok expression, can be given several times, the first one that matches is used
+ *   field:   parse the value of this field instead of the message
+ *   define:  "NAME expression", a pattern for the expressions to use as %{NAME}
+ *
+ * Captures that matched nothing are not set. Fails on events none of the expressions match.
+ */
+class GrokPlugin : public FilterPlugin
+{
+public:
+	GrokPlugin();
+	bool init(const FilterStep &step);
+	StepResult process(LogEvent &event);
+private:
+	void setField(LogEvent &event, const GrokPattern &pattern, size_t capture, const GrokPattern::Span &span);
+
+	std::string field;
+	std::vector<GrokPattern> patterns;
+	std::vector<GrokPattern::Span> spans;
+};
+
+} // namespace sawmill
+
+#endif // ifndef __GROK_H
@@ -0,0 +1,389 @@
+/****************************************************************************
+ * Project: SawMill
+ * Authors:
+ *          Bart Meuris <bart . meuris @ gmail . com>
+ *
+ * License: (to be discussed LGPL version 2.0?)
+ ****************************************************************************
+ * Module description:
+ *     Field index for LogEvents, so field lookups don't need a linear scan
+ *     with string compares.
+ *
+ ***************************************************************************/
+
+#include "indexedevent.h"
+#include "fieldvalue.h"
+#include "regexset.h"
+
+#define INDEX_MIN_SLOTS 16
+#define INDEX_HEADROOM  16 // Fields that can be added before the table has to grow
+
+namespace sawmill {
+
+static inline size_t slot_hash(uint32_t keyId)
+{
+	// Key ID's are dense, spread them over the table
+	return keyId * 2654435761U;
+}
+
+IndexedEvent::IndexedEvent()
+	:ev(NULL), built(false), indexed(0), knownkeys(0), keys(), positions(), tagsbuilt(false), tagcount(0), knowntags(0), tagset(),
+	 scanned(false), found(), names(), ids()
+{
+}
+
+IndexedEvent::IndexedEvent(LogEvent *event)
+	:ev(event), built(false), indexed(0), knownkeys(0), keys(), positions(), tagsbuilt(false), tagcount(0), knowntags(0), tagset(),
+	 scanned(false), found(), names(), ids()
+{
+}
+
+void IndexedEvent::reset(LogEvent *event)
+{
+	ev = event;
+	built = tagsbuilt = scanned = false;
+}
+
+void IndexedEvent::insert(uint32_t keyId, int pos)
+{
+	size_t mask = keys.size() - 1;
+	for (size_t i = slot_hash(keyId) & mask; ; i = (i + 1) & mask) {
+		if (keys[i] == keyId)
+			return; // Keep the first occurrence
+		if (keys[i] == StringInterner::NONE) {
+			keys[i] = keyId;
+			positions[i] = pos;
+			return;
+		}
+	}
+}
+
+void IndexedEvent::build()
+{
+	int count = ev->field_size();
+	size_t size = INDEX_MIN_SLOTS;
+	// Load factor at most 50%, including the fields added by setField() later on
+	while (size < ((size_t)count + INDEX_HEADROOM) * 2) {
+		size *= 2;
+	}
+	keys.assign(size, StringInterner::NONE);
+	positions.resize(size);
+
+	names.resize(count);
+	ids.resize(count);
+	for (int i = 0; i < count; i++) {
+		names[i] = &ev->field(i).key();
+	}
+	// Only the keys that are known: interning every key of every event would grow the dictionary
+	// without bounds
+	knownkeys = StringInterner::keys().find(names.data(), count, ids.data());
+	for (int i = 0; i < count; i++) {
+		if (ids[i] != StringInterner::NONE)
+			insert(ids[i], i);
+	}
+	indexed = count;
+	built = true;
+}
+
+int IndexedEvent::find(uint32_t keyId)
+{
+	if (keyId == StringInterner::NONE)
+		return -1;
+	// A key interned since the index was built could be one that was left out
+	if (!built || (indexed != ev->field_size()) || (keyId >= knownkeys))
+		build();
+	size_t mask = keys.size() - 1;
+	for (size_t i = slot_hash(keyId) & mask; ; i = (i + 1) & mask) {
+		if (keys[i] == keyId)
+			return positions[i];
+		if (keys[i] == StringInterner::NONE)
+			return -1;
+	}
+}
+
+int IndexedEvent::find(const std::string &key)
+{
+	uint32_t keyId = StringInterner::keys().find(key);
+	if (keyId != StringInterner::NONE)
+		return find(keyId);
+	// Keys that were never interned are not in the index
+	for (int i = 0; i < ev->field_size(); i++) {
+		if (ev->field(i).key() == key)
+			return i;
+	}
+	return -1;
+}
+
+Field *IndexedEvent::field(uint32_t keyId)
+{
+	int pos = find(keyId);
+	return (pos < 0) ? NULL : ev->mutable_field(pos);
+}
+
+Field *IndexedEvent::field(const std::string &key)
+{
+	int pos = find(key);
+	return (pos < 0) ? NULL : ev->mutable_field(pos);
+}
+
+Field *IndexedEvent::fieldFor(uint32_t keyId)
+{
+	int pos = find(keyId);
+	if (pos >= 0)
+		return ev->mutable_field(pos);
+	Field *f = ev->add_field();
+	f->mutable_key()->assign(StringInterner::keys().name(keyId));
+	indexed++;
+	if ((size_t)indexed * 2 > keys.size()) {
+		build();
+	} else {
+		insert(keyId, indexed - 1);
+	}
+	return f;
+}
+
+void IndexedEvent::setField(uint32_t keyId, const std::string &value)
+{
+	FieldValue::setString(*fieldFor(keyId), value);
+}
+
+void IndexedEvent::setField(uint32_t keyId, const Field &value)
+{
+	FieldValue::copyValue(value, *fieldFor(keyId));
+}
+
+void IndexedEvent::removeField(uint32_t keyId)
+{
+	if (find(keyId) < 0)
+		return;
+	const std::string &key = StringInterner::keys().name(keyId);
+	for (int f = ev->field_size() - 1; f >= 0; f--) {
+		if (ev->field(f).key() == key)
+			ev->mutable_field()->DeleteSubrange(f, 1);
+	}
+	// Positions after the removed fields shifted
+	built = false;
+}
+
+void IndexedEvent::removeField(const std::string &key)
+{
+	if (find(key) < 0)
+		return;
+	for (int f = ev->field_size() - 1; f >= 0; f--) {
+		if (ev->field(f).key() == key)
+			ev->mutable_field()->DeleteSubrange(f, 1);
+	}
+	built = false;
+}
+
+void IndexedEvent::buildTags()
+{
+	int count = ev->tag_size();
+	tagset.clear();
+	names.resize(count);
+	ids.resize(count);
+	for (int i = 0; i < count; i++) {
+		names[i] = &ev->tag(i);
+	}
+	knowntags = StringInterner::tags().find(names.data(), count, ids.data());
+	for (int i = 0; i < count; i++) {
+		if (ids[i] != StringInterner::NONE)
+			tagset.add(ids[i]);
+	}
+	tagcount = count;
+	tagsbuilt = true;
+}
+
+const TagSet &IndexedEvent::tags()
+{
+	if (!tagsbuilt || (tagcount != ev->tag_size()))
+		buildTags();
+	return tagset;
+}
+
+bool IndexedEvent::hasTag(uint32_t tagId)
+{
+	if (tagId == StringInterner::NONE)
+		return false;
+	// A tag interned since the set was built could be one that was left out
+	if (!tagsbuilt || (tagcount != ev->tag_size()) || (tagId >= knowntags))
+		buildTags();
+	return tagset.has(tagId);
+}
+
+bool IndexedEvent::hasTags(const TagSet &mask)
+{
+	if (!tagsbuilt || (tagcount != ev->tag_size()) || (mask.bound() > knowntags))
+		buildTags();
+	return tagset.containsAll(mask);
+}
+
+void IndexedEvent::addTag(uint32_t tagId)
+{
+	if (hasTag(tagId))
+		return;
+	ev->add_tag()->assign(StringInterner::tags().name(tagId));
+	tagset.add(tagId);
+	tagcount++;
+}
+
+void IndexedEvent::removeTag(uint32_t tagId)
+{
+	if (!hasTag(tagId))
+		return;
+	const std::string &tag = StringInterner::tags().name(tagId);
+	for (int t = ev->tag_size() - 1; t >= 0; t--) {
+		if (ev->tag(t) == tag)
+			ev->mutable_tag()->DeleteSubrange(t, 1);
+	}
+	tagset.remove(tagId);
+	tagcount = ev->tag_size();
+}
+
+bool IndexedEvent::matches(const RegexSet &set, uint32_t literalId)
+{
+	if (!scanned) {
+		set.scan(ev->message(), found);
+		scanned = true;
+	}
+	return RegexSet::has(found, literalId);
+}
+
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Benchmark: linear field lookups against the index
+/////////////////////////////////////////////////////////////////////////////
+
+#ifdef DEBUG_INDEXEDEVENT_CPP
+
+#include <cstdio>
+#include <time.h>
+#include "filterengine.h"
+
+#define BENCH_EVENTS     200000
+#define BENCH_FIELDS     60
+#define BENCH_LOOKUPS    12
+#define BENCH_BATCHSIZE  256
+
+using namespace sawmill;
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int linear_find(const LogEvent &event, const std::string &key)
+{
+	for (int i = 0; i < event.field_size(); i++) {
+		if (event.field(i).key() == key)
+			return i;
+	}
+	return -1;
+}
+
+static void fill(LogEvent &e)
+{
+	char buf[32];
+	e.Clear();
+	e.set_type("firewall");
+	e.set_message("accepted connection");
+	for (int f = 0; f < BENCH_FIELDS; f++) {
+		Field *field = e.add_field();
+		snprintf(buf, sizeof(buf), "attribute_%02d", f);
+		field->set_key(buf);
+		field->set_value("value");
+	}
+}
+
+int main()
+{
+	char buf[32];
+	std::vector<std::string> lookups;
+	std::vector<uint32_t> lookupids;
+	for (int l = 0; l < BENCH_LOOKUPS; l++) {
+		// Mostly fields towards the end, and a few that are missing
+		snprintf(buf, sizeof(buf), "attribute_%02d", BENCH_FIELDS - 1 - l * 7);
+		lookups.push_back(buf);
+		lookupids.push_back(StringInterner::keys().intern(lookups.back()));
+	}
+
+	LogEvent event;
+	fill(event);
+	IndexedEvent ie;
+	long found = 0;
+
+	// The keys of the event are not interned, the ones interned later are still found
+	{
+		size_t interned = StringInterner::keys().size();
+		ie.reset(&event);
+		bool ok = (ie.find(lookupids[0]) == BENCH_FIELDS - 1) && (ie.find("attribute_00") == 0) &&
+		          (StringInterner::keys().size() == interned);
+		ok = ok && (ie.find(StringInterner::keys().intern("attribute_01")) == 1) && ie.field("attribute_02");
+		ie.removeField("attribute_03");
+		ok = ok && (ie.find("attribute_03") < 0) && (event.field_size() == BENCH_FIELDS - 1);
+		printf("keys looked up, not interned: %s\n", ok ? "OK" : "FAILED");
+		if (!ok)
+			return 1;
+		fill(event);
+	}
+
+	uint64_t t0 = now_ns();
+	for (int e = 0; e < BENCH_EVENTS; e++) {
+		for (int l = 0; l < BENCH_LOOKUPS; l++) {
+			found += linear_find(event, lookups[l]);
+		}
+	}
+	uint64_t t1 = now_ns();
+	for (int e = 0; e < BENCH_EVENTS; e++) {
+		ie.reset(&event);
+		for (int l = 0; l < BENCH_LOOKUPS; l++) {
+			found -= ie.find(lookupids[l]);
+		}
+	}
+	uint64_t t2 = now_ns();
+	printf("%d lookups on %d fields: linear %.1f ns/event, indexed %.1f ns/event (index built per event, results %s)\n",
+	       BENCH_LOOKUPS, BENCH_FIELDS, (double)(t1 - t0) / BENCH_EVENTS, (double)(t2 - t1) / BENCH_EVENTS,
+	       found == 0 ? "equal" : "DIFFER");
+
+	// Lookup heavy filter chain: every step has requireField guards and sets a field
+	FilterConfig config;
+	config.set_version(0);
+	Filter *f = config.add_filter();
+	f->set_filterid(1);
+	f->set_type("firewall");
+	for (int l = 0; l < BENCH_LOOKUPS; l++) {
+		FilterStep *s = f->add_step();
+		s->set_plugin("setfield");
+		s->set_stepnumber(l);
+		s->add_requirefield()->set_key(lookups[l]);
+		s->add_requirefield()->set_key(lookups[(l + 1) % BENCH_LOOKUPS]);
+		Field *p = s->add_parameter();
+		snprintf(buf, sizeof(buf), "result_%02d", l);
+		p->set_key(buf);
+		p->set_value("yes");
+	}
+	FilterConfigStore store;
+	store.update(config);
+	FilterEngine engine;
+	engine.load(store);
+
+	FilterEngine::EventList events;
+	std::vector<StepResult> results;
+	uint64_t total = 0;
+	for (int b = 0; b < BENCH_EVENTS / BENCH_BATCHSIZE; b++) {
+		events.Clear();
+		for (int i = 0; i < BENCH_BATCHSIZE; i++) {
+			fill(*events.Add());
+		}
+		uint64_t t = now_ns();
+		engine.process(events, results);
+		total += now_ns() - t;
+	}
+	printf("filter chain of %d steps with requireField guards: %.1f ns/event, %d fields after processing\n",
+	       BENCH_LOOKUPS, (double)total / (BENCH_EVENTS / BENCH_BATCHSIZE * BENCH_BATCHSIZE), events.Get(0).field_size());
+	return 0;
+}
+#endif
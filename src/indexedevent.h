@@ -0,0 +1,116 @@
+#ifndef __INDEXEDEVENT_H
+# define __INDEXEDEVENT_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "logevent.pb.h"
+#include "interner.h"
+#include "tagset.h"
+
+namespace sawmill {
+
+class RegexSet;
+
+/**
+ * Wrapper around a LogEvent with an index from interned field key ID's to field positions,
+ * the set of its interned tags and the literals of a RegexSet found in its message.
+ *
+ * The index is a small open-addressing table, built on the first lookup. Changes made through
+ * the wrapper keep it up to date, after changing the event directly call invalidate(). The
+ * index always points to the first field with a key, like a linear scan would. The TagSet and
+ * the RegexSet matches are built the same way, on the first check.
+ *
+ * The keys and tags of the event are looked up, not interned: the ones that are not in the
+ * dictionary are left out of the index and the TagSet, and a lookup of one that was interned
+ * after they were built builds them again.
+ */
+class IndexedEvent
+{
+public:
+	IndexedEvent();
+	explicit IndexedEvent(LogEvent *event);
+
+	/**
+	 * Wrap another event, the index is rebuilt on the next lookup.
+	 */
+	void reset(LogEvent *event);
+	void invalidate() { built = tagsbuilt = scanned = false; }
+	LogEvent &event() { return *ev; }
+	const LogEvent &event() const { return *ev; }
+
+	/**
+	 * Position of the first field with this key, -1 if the event doesn't have it.
+	 */
+	int find(uint32_t keyId);
+	int find(const std::string &key);
+
+	Field *field(uint32_t keyId);
+	Field *field(const std::string &key);
+
+	/**
+	 * Set the value of the first field with this key, adding the field if needed.
+	 */
+	void setField(uint32_t keyId, const std::string &value);
+	void setField(const std::string &key, const std::string &value) { setField(StringInterner::keys().intern(key), value); }
+	/**
+	 * Same, with the value and its type copied from 'value'.
+	 */
+	void setField(uint32_t keyId, const Field &value);
+
+	/**
+	 * Remove all fields with this key.
+	 */
+	void removeField(uint32_t keyId);
+	void removeField(const std::string &key);
+
+	/**
+	 * The interned tags of the event. Tags interned after the set was built are not in it, use
+	 * hasTag() or hasTags() to check for those.
+	 */
+	const TagSet &tags();
+	bool hasTag(uint32_t tagId);
+	/**
+	 * True if the event has all tags of 'mask'.
+	 */
+	bool hasTags(const TagSet &mask);
+	/**
+	 * Add the tag if the event doesn't have it yet.
+	 */
+	void addTag(uint32_t tagId);
+	/**
+	 * Remove all occurrences of the tag.
+	 */
+	void removeTag(uint32_t tagId);
+
+	/**
+	 * True if literal 'literalId' of the set occurs in the message. The message is scanned for
+	 * all literals of the set on the first call, always pass the same set.
+	 */
+	bool matches(const RegexSet &set, uint32_t literalId);
+private:
+	void build();
+	void buildTags();
+	Field *fieldFor(uint32_t keyId);
+	void insert(uint32_t keyId, int pos);
+
+	LogEvent *ev;
+	bool built;
+	int indexed; // Number of fields in the index, to notice fields added behind our back
+	size_t knownkeys; // Size of the key dictionary when the index was built
+	std::vector<uint32_t> keys;      // Key ID per slot, StringInterner::NONE for an empty slot
+	std::vector<int> positions;
+	bool tagsbuilt;
+	int tagcount; // Number of tags in the set, to notice tags added behind our back
+	size_t knowntags; // Size of the tag dictionary when the set was built
+	TagSet tagset;
+	bool scanned;
+	std::vector<uint64_t> found; // RegexSet literals found in the message
+	// Scratch space for build() and buildTags()
+	std::vector<const std::string *> names;
+	std::vector<uint32_t> ids;
+};
+
+} // namespace sawmill
+
+#endif // ifndef __INDEXEDEVENT_H
@@ -0,0 +1,182 @@
+/****************************************************************************
+ * Project: SawMill
+ * Authors:
+ *          Bart Meuris <bart . meuris @ gmail . com>
+ *
+ * License: (to be discussed LGPL version 2.0?)
+ ****************************************************************************
+ * Module description:
+ *     String interning: global dictionaries for types, sources, field keys
+ *     and tags, so they can be compared and indexed as integers.
+ *
+ ***************************************************************************/
+
+#include "interner.h"
+#include <string.h>
+
+#define INTERNER_INITIAL_SLOTS 256
+
+namespace sawmill {
+
+const uint32_t StringInterner::NONE;
+
+StringInterner::StringInterner()
+	:names(), hashes(), slots(INTERNER_INITIAL_SLOTS, 0)
+{
+	pthread_rwlock_init(&lock, NULL);
+}
+
+StringInterner::~StringInterner()
+{
+	pthread_rwlock_destroy(&lock);
+}
+
+uint64_t StringInterner::hash(const char *str, size_t len)
+{
+	// FNV-1a
+	uint64_t h = 14695981039346656037ULL;
+	for (size_t i = 0; i < len; i++) {
+		h ^= (unsigned char)str[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+uint32_t StringInterner::lookup(const char *str, size_t len, uint64_t h) const
+{
+	size_t mask = slots.size() - 1;
+	for (size_t i = h & mask; ; i = (i + 1) & mask) {
+		uint32_t slot = slots[i];
+		if (slot == 0)
+			return NONE;
+		const std::string &n = names[slot - 1];
+		if ((hashes[slot - 1] == h) && (n.size() == len) && (memcmp(n.data(), str, len) == 0))
+			return slot - 1;
+	}
+}
+
+void StringInterner::rehash()
+{
+	std::vector<uint32_t> bigger(slots.size() * 2, 0);
+	size_t mask = bigger.size() - 1;
+	for (uint32_t id = 0; id < names.size(); id++) {
+		size_t i = hashes[id] & mask;
+		while (bigger[i] != 0) {
+			i = (i + 1) & mask;
+		}
+		bigger[i] = id + 1;
+	}
+	slots.swap(bigger);
+}
+
+uint32_t StringInterner::find(const char *str, size_t len) const
+{
+	uint64_t h = hash(str, len);
+	pthread_rwlock_rdlock(&lock);
+	uint32_t id = lookup(str, len, h);
+	pthread_rwlock_unlock(&lock);
+	return id;
+}
+
+size_t StringInterner::find(const std::string *const *strs, size_t count, uint32_t *ids) const
+{
+	pthread_rwlock_rdlock(&lock);
+	for (size_t i = 0; i < count; i++) {
+		ids[i] = lookup(strs[i]->data(), strs[i]->size(), hash(strs[i]->data(), strs[i]->size()));
+	}
+	size_t n = names.size();
+	pthread_rwlock_unlock(&lock);
+	return n;
+}
+
+uint32_t StringInterner::intern(const char *str, size_t len)
+{
+	uint64_t h = hash(str, len);
+	pthread_rwlock_rdlock(&lock);
+	uint32_t id = lookup(str, len, h);
+	pthread_rwlock_unlock(&lock);
+	if (id != NONE)
+		return id;
+
+	pthread_rwlock_wrlock(&lock);
+	// Someone else could have added it in the meantime
+	id = lookup(str, len, h);
+	if (id == NONE) {
+		id = names.size();
+		names.push_back(std::string(str, len));
+		hashes.push_back(h);
+		// Keep the load factor below 50%
+		if (names.size() * 2 > slots.size()) {
+			rehash();
+		} else {
+			size_t mask = slots.size() - 1;
+			size_t i = h & mask;
+			while (slots[i] != 0) {
+				i = (i + 1) & mask;
+			}
+			slots[i] = id + 1;
+		}
+	}
+	pthread_rwlock_unlock(&lock);
+	return id;
+}
+
+void StringInterner::intern(const std::string *const *strs, size_t count, uint32_t *ids)
+{
+	size_t missing = 0;
+	pthread_rwlock_rdlock(&lock);
+	for (size_t i = 0; i < count; i++) {
+		ids[i] = lookup(strs[i]->data(), strs[i]->size(), hash(strs[i]->data(), strs[i]->size()));
+		missing += (ids[i] == NONE);
+	}
+	pthread_rwlock_unlock(&lock);
+	for (size_t i = 0; missing && (i < count); i++) {
+		if (ids[i] == NONE) {
+			ids[i] = intern(*strs[i]);
+			missing--;
+		}
+	}
+}
+
+const std::string &StringInterner::name(uint32_t id) const
+{
+	pthread_rwlock_rdlock(&lock);
+	// Elements of a deque don't move when it grows, so the reference stays valid
+	const std::string &n = names[id];
+	pthread_rwlock_unlock(&lock);
+	return n;
+}
+
+size_t StringInterner::size() const
+{
+	pthread_rwlock_rdlock(&lock);
+	size_t n = names.size();
+	pthread_rwlock_unlock(&lock);
+	return n;
+}
+
+StringInterner &StringInterner::types()
+{
+	static StringInterner dict;
+	return dict;
+}
+
+StringInterner &StringInterner::sources()
+{
+	static StringInterner dict;
+	return dict;
+}
+
+StringInterner &StringInterner::keys()
+{
+	static StringInterner dict;
+	return dict;
+}
+
+StringInterner &StringInterner::tags()
+{
+	static StringInterner dict;
+	return dict;
+}
+
+}
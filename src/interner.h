@@ -0,0 +1,73 @@
+#ifndef __INTERNER_H
+# define __INTERNER_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <stdint.h>
+#include <pthread.h>
+
+namespace sawmill {
+
+/**
+ * Dictionary that maps strings to small, dense ID's. ID's are never reused or removed, so they
+ * can be cached in compiled filters and stored in events.
+ *
+ * Lookups can run concurrently, adding a new string takes a write lock.
+ */
+class StringInterner
+{
+public:
+	static const uint32_t NONE = 0xFFFFFFFF;
+
+	StringInterner();
+	~StringInterner();
+
+	/**
+	 * Returns the ID of the string, adding it if needed.
+	 */
+	uint32_t intern(const char *str, size_t len);
+	uint32_t intern(const std::string &str) { return intern(str.data(), str.size()); }
+	/**
+	 * Intern 'count' strings at once, taking the lock once when they are all known already.
+	 */
+	void intern(const std::string *const *strs, size_t count, uint32_t *ids);
+
+	/**
+	 * Returns the ID of the string, NONE if it was never interned.
+	 */
+	uint32_t find(const char *str, size_t len) const;
+	uint32_t find(const std::string &str) const { return find(str.data(), str.size()); }
+	/**
+	 * Find 'count' strings at once under a single read lock, NONE for the unknown ones. Returns
+	 * the size of the dictionary at the time: a string with a lower ID than that was found.
+	 */
+	size_t find(const std::string *const *strs, size_t count, uint32_t *ids) const;
+
+	const std::string &name(uint32_t id) const;
+	size_t size() const;
+
+	// The global dictionaries
+	static StringInterner &types();
+	static StringInterner &sources();
+	static StringInterner &keys();
+	static StringInterner &tags();
+
+	static uint64_t hash(const char *str, size_t len);
+private:
+	uint32_t lookup(const char *str, size_t len, uint64_t h) const;
+	void rehash();
+
+	std::deque<std::string> names;
+	std::vector<uint64_t> hashes;
+	std::vector<uint32_t> slots; // ID + 1, 0 for an empty slot
+	mutable pthread_rwlock_t lock;
+
+	// Not copyable
+	StringInterner(const StringInterner &);
+	StringInterner &operator=(const StringInterner &);
+};
+
+} // namespace sawmill
+
+#endif // ifndef __INTERNER_H
@@ -343,7 +343,7 @@ private:
 						out.put(c); outlen++;
 						prev = c;
 						c = get();
-					} while ( ( c != EOF ) && ( prev != '*' ) && ( c != '/' ) );
+					} while ( ( c != EOF ) && !( ( prev == '*' ) && ( c == '/' ) ) );
 					if (c == '/') {
 						out.put(c); outlen++;
 					}
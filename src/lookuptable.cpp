@@ -0,0 +1,1168 @@
+/****************************************************************************
+ * Project: SawMill
+ * Authors:
+ *          Bart Meuris <bart . meuris @ gmail . com>
+ *
+ * License: (to be discussed LGPL version 2.0?)
+ ****************************************************************************
+ * Module description:
+ *     Memory mapped lookup tables and the plugin that enriches events with
+ *     them.
+ *
+ ***************************************************************************/
+
+#include "lookuptable.h"
+#include "fieldvalue.h"
+#include "interner.h"
+#include "sawlog.h"
+#include "splitter.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define LOOKUP_VERSION          1
+#define LOOKUP_BUCKET_KEYS      4       // Keys per perfect hash bucket, on average
+#define LOOKUP_MAX_DISPLACEMENT 1000000 // Tried per bucket before the hash gets more slots
+
+namespace sawmill {
+
+/////////////////////////////////////////////////////////////////////////////
+// 128 bit addresses as hi/lo pairs
+
+static inline bool addressLess(uint64_t ahi, uint64_t alo, uint64_t bhi, uint64_t blo)
+{
+	return (ahi < bhi) || ((ahi == bhi) && (alo < blo));
+}
+
+static inline bool addressMax(uint64_t hi, uint64_t lo)
+{
+	return (hi == ~0ULL) && (lo == ~0ULL);
+}
+
+static inline void addressAdd(uint64_t &hi, uint64_t &lo, int delta)
+{
+	if (delta > 0) {
+		if (++lo == 0)
+			hi++;
+	} else {
+		if (lo-- == 0)
+			hi--;
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+LookupTable::LookupTable()
+	:map(NULL), size(0), header(NULL), stride(0), displacements(NULL), slots(NULL)
+{
+}
+
+LookupTable::~LookupTable()
+{
+	if (map)
+		munmap(const_cast<char *>(map), size);
+}
+
+std::shared_ptr<const LookupTable> LookupTable::open(const std::string &path, std::string &error)
+{
+	int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if ((fd < 0) || (fstat(fd, &st) != 0)) {
+		error = "could not open " + path + ": " + strerror(errno);
+		if (fd >= 0)
+			::close(fd);
+		return NULL;
+	}
+	std::shared_ptr<LookupTable> table(new LookupTable());
+	if ((size_t)st.st_size >= sizeof(LookupHeader)) {
+		void *m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (m != MAP_FAILED) {
+			table->map = static_cast<const char *>(m);
+			table->size = st.st_size;
+			// Lookups hit the entries all over the place
+			madvise(m, st.st_size, MADV_RANDOM);
+		}
+	}
+	::close(fd);
+	const LookupHeader *h = reinterpret_cast<const LookupHeader *>(table->map);
+	if (!h || (memcmp(h->magic, LOOKUP_MAGIC, sizeof(h->magic)) != 0) || (h->version != LOOKUP_VERSION) ||
+	    ((h->kind != LOOKUP_EXACT) && (h->kind != LOOKUP_RANGE))) {
+		error = path + " is not a lookup table this version can read";
+		return NULL;
+	}
+	table->header = h;
+	table->stride = ((h->kind == LOOKUP_EXACT) ? sizeof(LookupExactEntry) : sizeof(LookupRangeEntry)) +
+	                (size_t)h->columns * sizeof(LookupString);
+	uint64_t size = table->size;
+	bool valid = (h->names % 8 == 0) && (h->entry % 8 == 0) && (h->hash % 4 == 0) &&
+	             (h->names + (uint64_t)h->columns * sizeof(LookupString) <= size) &&
+	             (h->entry + (uint64_t)h->entries * table->stride <= size) && (h->strings <= size);
+	if (valid && (h->kind == LOOKUP_EXACT)) {
+		valid = h->buckets && (h->slots >= h->entries) && (h->hash + ((uint64_t)h->buckets + h->slots) * 4 <= size);
+		table->displacements = reinterpret_cast<const uint32_t *>(table->map + h->hash);
+		table->slots = table->displacements + h->buckets;
+	}
+	if (!valid) {
+		error = path + " is truncated or damaged";
+		return NULL;
+	}
+	return table;
+}
+
+uint32_t LookupTable::column(const std::string &name) const
+{
+	for (uint32_t c = 0; c < header->columns; c++) {
+		if (columnName(c) == name)
+			return c;
+	}
+	return NONE;
+}
+
+std::string LookupTable::columnName(uint32_t column) const
+{
+	const char *t;
+	size_t len;
+	text(reinterpret_cast<const LookupString *>(map + header->names)[column], t, len);
+	return std::string(t, len);
+}
+
+inline const LookupString *LookupTable::values(uint32_t entry) const
+{
+	// The values follow the fixed part of the entry
+	return reinterpret_cast<const LookupString *>(map + header->entry + (uint64_t)entry * stride + stride -
+	                                              header->columns * sizeof(LookupString));
+}
+
+inline void LookupTable::text(const LookupString &s, const char *&t, size_t &len) const
+{
+	// Only strings that are in the pool, whatever the file says
+	if ((uint64_t)s.offset + s.length > size - header->strings) {
+		t = "";
+		len = 0;
+		return;
+	}
+	t = map + header->strings + s.offset;
+	len = s.length;
+}
+
+uint32_t LookupTable::slotOf(uint64_t hash, uint32_t displacement, uint32_t slots)
+{
+	// splitmix64 finalizer over the key hash and the displacement of its bucket
+	uint64_t x = hash ^ ((uint64_t)displacement * 0x9E3779B97F4A7C15ULL);
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	x ^= x >> 31;
+	return (uint32_t)(x % slots);
+}
+
+uint32_t LookupTable::find(const char *key, size_t len) const
+{
+	if (header->kind == LOOKUP_EXACT) {
+		uint64_t h = StringInterner::hash(key, len);
+		uint32_t e = slots[slotOf(h, displacements[h % header->buckets], header->slots)];
+		if (e >= header->entries)
+			return NONE;
+		// The slot of a key that is not in the table holds some other key
+		const LookupExactEntry *entry = reinterpret_cast<const LookupExactEntry *>(map + header->entry + (uint64_t)e * stride);
+		const char *t;
+		size_t n;
+		text(entry->key, t, n);
+		return ((n == len) && (memcmp(t, key, len) == 0)) ? e : NONE;
+	}
+
+	uint64_t hi, lo;
+	if (!parseAddress(key, len, hi, lo))
+		return NONE;
+	// Last range that starts at or before the address
+	const char *base = map + header->entry;
+	uint32_t l = 0, r = header->entries;
+	while (l < r) {
+		uint32_t mid = l + (r - l) / 2;
+		const LookupRangeEntry *e = reinterpret_cast<const LookupRangeEntry *>(base + (uint64_t)mid * stride);
+		if (addressLess(hi, lo, e->starthi, e->startlo))
+			r = mid;
+		else
+			l = mid + 1;
+	}
+	if (!l)
+		return NONE;
+	const LookupRangeEntry *e = reinterpret_cast<const LookupRangeEntry *>(base + (uint64_t)(l - 1) * stride);
+	return addressLess(e->endhi, e->endlo, hi, lo) ? NONE : l - 1;
+}
+
+void LookupTable::value(uint32_t entry, uint32_t column, const char *&t, size_t &len) const
+{
+	if ((entry >= header->entries) || (column >= header->columns)) {
+		t = "";
+		len = 0;
+		return;
+	}
+	text(values(entry)[column], t, len);
+}
+
+bool LookupTable::parseAddress(const char *text, size_t len, uint64_t &hi, uint64_t &lo)
+{
+	char buf[INET6_ADDRSTRLEN];
+	if (!len || (len >= sizeof(buf)))
+		return false;
+	memcpy(buf, text, len);
+	buf[len] = 0;
+	if (memchr(buf, ':', len)) {
+		unsigned char a[16];
+		if (inet_pton(AF_INET6, buf, a) != 1)
+			return false;
+		hi = lo = 0;
+		for (int i = 0; i < 8; i++) {
+			hi = (hi << 8) | a[i];
+			lo = (lo << 8) | a[i + 8];
+		}
+		return true;
+	}
+	struct in_addr a4;
+	if (inet_pton(AF_INET, buf, &a4) != 1)
+		return false;
+	hi = 0;
+	lo = 0x0000FFFF00000000ULL | ntohl(a4.s_addr);
+	return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+LookupTableBuilder::LookupTableBuilder(LookupKind kind)
+	:tablekind(kind), columns(), keys(), ranges(), rows(), pool(), pooled()
+{
+}
+
+void LookupTableBuilder::setColumns(const std::vector<std::string> &names)
+{
+	columns = names;
+}
+
+uint32_t LookupTableBuilder::addString(const std::string &s)
+{
+	// The same values come back a lot (sites, owners, ...), store them once
+	std::unordered_map<std::string, uint32_t>::const_iterator it = pooled.find(s);
+	if (it != pooled.end())
+		return it->second;
+	uint32_t offset = pool.size();
+	pool += s;
+	pooled[s] = offset;
+	return offset;
+}
+
+bool LookupTableBuilder::add(const std::string &key, const std::vector<std::string> &values, std::string &error)
+{
+	if (values.size() != columns.size()) {
+		char msg[64];
+		snprintf(msg, sizeof(msg), "%lu values for %lu columns", (unsigned long)values.size(), (unsigned long)columns.size());
+		error = msg;
+		return false;
+	}
+	if (tablekind == LOOKUP_RANGE) {
+		Range r;
+		size_t sep = key.find_first_of("/-");
+		if (!LookupTable::parseAddress(key.data(), (sep == std::string::npos) ? key.size() : sep, r.starthi, r.startlo)) {
+			error = "invalid address in '" + key + "'";
+			return false;
+		}
+		r.endhi = r.starthi;
+		r.endlo = r.startlo;
+		if ((sep != std::string::npos) && (key[sep] == '-')) {
+			if (!LookupTable::parseAddress(key.data() + sep + 1, key.size() - sep - 1, r.endhi, r.endlo) ||
+			    addressLess(r.endhi, r.endlo, r.starthi, r.startlo)) {
+				error = "invalid range '" + key + "'";
+				return false;
+			}
+		} else if (sep != std::string::npos) {
+			bool v4 = (key.find(':') == std::string::npos);
+			char *end;
+			long prefix = strtol(key.c_str() + sep + 1, &end, 10);
+			if ((sep + 1 == key.size()) || *end || (prefix < 0) || (prefix > (v4 ? 32 : 128))) {
+				error = "invalid prefix length in '" + key + "'";
+				return false;
+			}
+			if (v4)
+				prefix += 96;
+			uint64_t maskhi = (prefix >= 64) ? ~0ULL : (prefix ? ~0ULL << (64 - prefix) : 0);
+			uint64_t masklo = (prefix <= 64) ? 0 : ((prefix == 128) ? ~0ULL : ~0ULL << (128 - prefix));
+			r.starthi &= maskhi;
+			r.startlo &= masklo;
+			r.endhi = r.starthi | ~maskhi;
+			r.endlo = r.startlo | ~masklo;
+		}
+		r.row = rows.size();
+		ranges.push_back(r);
+	} else {
+		keys.push_back(key);
+	}
+	rows.push_back(std::vector<LookupString>(values.size()));
+	for (size_t i = 0; i < values.size(); i++) {
+		rows.back()[i].offset = addString(values[i]);
+		rows.back()[i].length = values[i].size();
+	}
+	return true;
+}
+
+bool LookupTableBuilder::buildHash(std::vector<uint32_t> &displacements, std::vector<uint32_t> &slots) const
+{
+	// Hash and displace: every bucket of keys gets the first displacement that puts all its
+	// keys in free slots, the biggest buckets go first while most slots are free
+	uint32_t n = keys.size();
+	uint32_t buckets = n / LOOKUP_BUCKET_KEYS + 1;
+	std::vector<uint64_t> hashes(n);
+	std::vector<std::vector<uint32_t> > members(buckets);
+	for (uint32_t i = 0; i < n; i++) {
+		hashes[i] = StringInterner::hash(keys[i].data(), keys[i].size());
+		members[hashes[i] % buckets].push_back(i);
+	}
+	std::vector<uint32_t> order(buckets);
+	for (uint32_t b = 0; b < buckets; b++)
+		order[b] = b;
+	std::sort(order.begin(), order.end(), [&members](uint32_t a, uint32_t b) {
+		return members[a].size() > members[b].size();
+	});
+
+	for (uint32_t slotcount = n + n / 4 + 1; ; slotcount += slotcount / 2) {
+		displacements.assign(buckets, 0);
+		slots.assign(slotcount, (uint32_t)LookupTable::NONE);
+		std::vector<uint32_t> picked;
+		bool ok = true;
+		for (uint32_t o = 0; (o < buckets) && ok && !members[order[o]].empty(); o++) {
+			const std::vector<uint32_t> &keys = members[order[o]];
+			ok = false;
+			for (uint32_t d = 0; (d < LOOKUP_MAX_DISPLACEMENT) && !ok; d++) {
+				picked.clear();
+				for (size_t k = 0; k < keys.size(); k++) {
+					uint32_t s = LookupTable::slotOf(hashes[keys[k]], d, slotcount);
+					if ((slots[s] != LookupTable::NONE) || (std::find(picked.begin(), picked.end(), s) != picked.end()))
+						break;
+					picked.push_back(s);
+				}
+				if (picked.size() == keys.size()) {
+					for (size_t k = 0; k < keys.size(); k++)
+						slots[picked[k]] = keys[k];
+					displacements[order[o]] = d;
+					ok = true;
+				}
+			}
+		}
+		if (ok)
+			return true;
+		if (slotcount > 4 * n + 16)
+			return false;
+		DBG("Lookup table: no perfect hash with %u slots for %u keys, trying more", slotcount, n);
+	}
+}
+
+bool LookupTableBuilder::flattenRanges(std::vector<Range> &out, std::string &error) const
+{
+	// Outer ranges first, then the ranges nested in them: a stack of the ranges the cursor is in,
+	// an address belongs to the innermost one
+	std::vector<Range> sorted(ranges);
+	std::sort(sorted.begin(), sorted.end(), [](const Range &a, const Range &b) {
+		if ((a.starthi != b.starthi) || (a.startlo != b.startlo))
+			return addressLess(a.starthi, a.startlo, b.starthi, b.startlo);
+		return addressLess(b.endhi, b.endlo, a.endhi, a.endlo);
+	});
+	std::vector<Range> stack;
+	uint64_t curhi = 0, curlo = 0;
+	bool full = false; // The cursor went past the last address
+	out.clear();
+
+	for (size_t i = 0; i <= sorted.size(); i++) {
+		// Close the ranges that end before this one (all of them at the end)
+		while (!stack.empty() && ((i == sorted.size()) ||
+		       addressLess(stack.back().endhi, stack.back().endlo, sorted[i].starthi, sorted[i].startlo))) {
+			Range r = stack.back();
+			stack.pop_back();
+			if (!full && !addressLess(r.endhi, r.endlo, curhi, curlo)) {
+				Range seg = { curhi, curlo, r.endhi, r.endlo, r.row };
+				out.push_back(seg);
+				full = addressMax(r.endhi, r.endlo);
+				curhi = r.endhi;
+				curlo = r.endlo;
+				addressAdd(curhi, curlo, 1);
+			}
+		}
+		if (i == sorted.size())
+			break;
+		const Range &r = sorted[i];
+		if (!stack.empty()) {
+			const Range &outer = stack.back();
+			if (addressLess(outer.endhi, outer.endlo, r.endhi, r.endlo) ||
+			    ((outer.starthi == r.starthi) && (outer.startlo == r.startlo) && (outer.endhi == r.endhi) && (outer.endlo == r.endlo))) {
+				char msg[96];
+				snprintf(msg, sizeof(msg), "the ranges of entries %u and %u overlap", outer.row + 1, r.row + 1);
+				error = msg;
+				return false;
+			}
+			// The part of the outer range before this one
+			if (addressLess(curhi, curlo, r.starthi, r.startlo)) {
+				Range seg = { curhi, curlo, r.starthi, r.startlo, outer.row };
+				addressAdd(seg.endhi, seg.endlo, -1);
+				out.push_back(seg);
+			}
+		}
+		curhi = r.starthi;
+		curlo = r.startlo;
+		stack.push_back(r);
+	}
+	return true;
+}
+
+static bool writeAll(FILE *f, const void *data, size_t len)
+{
+	return !len || (fwrite(data, len, 1, f) == 1);
+}
+
+bool LookupTableBuilder::write(const std::string &path, std::string &error)
+{
+	std::vector<uint32_t> displacements, slots;
+	std::vector<Range> flat;
+	uint32_t entries;
+	if (tablekind == LOOKUP_EXACT) {
+		std::vector<uint32_t> sorted(keys.size());
+		for (uint32_t i = 0; i < sorted.size(); i++)
+			sorted[i] = i;
+		std::sort(sorted.begin(), sorted.end(), [this](uint32_t a, uint32_t b) { return keys[a] < keys[b]; });
+		for (size_t i = 1; i < sorted.size(); i++) {
+			if (keys[sorted[i]] == keys[sorted[i - 1]]) {
+				error = "duplicate key '" + keys[sorted[i]] + "'";
+				return false;
+			}
+		}
+		if (!buildHash(displacements, slots)) {
+			error = "could not find a perfect hash for the keys";
+			return false;
+		}
+		entries = keys.size();
+	} else {
+		if (!flattenRanges(flat, error))
+			return false;
+		entries = flat.size();
+	}
+	std::vector<uint32_t> keyoffsets(keys.size()), nameoffsets(columns.size());
+	for (size_t i = 0; i < keys.size(); i++)
+		keyoffsets[i] = addString(keys[i]);
+	for (size_t i = 0; i < columns.size(); i++)
+		nameoffsets[i] = addString(columns[i]);
+	if (pool.size() > 0xFFFFFFFFULL) {
+		error = "more than 4GB of strings";
+		return false;
+	}
+
+	LookupHeader h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, LOOKUP_MAGIC, sizeof(h.magic));
+	h.version = LOOKUP_VERSION;
+	h.kind = tablekind;
+	h.columns = columns.size();
+	h.entries = entries;
+	h.buckets = displacements.size();
+	h.slots = slots.size();
+	size_t stride = ((tablekind == LOOKUP_EXACT) ? sizeof(LookupExactEntry) : sizeof(LookupRangeEntry)) +
+	                columns.size() * sizeof(LookupString);
+	h.names = sizeof(LookupHeader);
+	h.entry = h.names + columns.size() * sizeof(LookupString);
+	h.hash = h.entry + (uint64_t)entries * stride;
+	h.strings = h.hash + (displacements.size() + slots.size()) * sizeof(uint32_t);
+
+	std::string tmppath = path + ".tmp";
+	FILE *f = fopen(tmppath.c_str(), "wb");
+	if (!f) {
+		error = "could not create " + tmppath + ": " + strerror(errno);
+		return false;
+	}
+	bool ok = writeAll(f, &h, sizeof(h));
+	for (size_t c = 0; c < columns.size(); c++) {
+		LookupString s = { nameoffsets[c], (uint32_t)columns[c].size() };
+		ok = ok && writeAll(f, &s, sizeof(s));
+	}
+	for (uint32_t e = 0; ok && (e < entries); e++) {
+		uint32_t row;
+		if (tablekind == LOOKUP_EXACT) {
+			LookupExactEntry entry = { { keyoffsets[e], (uint32_t)keys[e].size() } };
+			ok = writeAll(f, &entry, sizeof(entry));
+			row = e;
+		} else {
+			LookupRangeEntry entry = { flat[e].starthi, flat[e].startlo, flat[e].endhi, flat[e].endlo };
+			ok = writeAll(f, &entry, sizeof(entry));
+			row = flat[e].row;
+		}
+		if (columns.size())
+			ok = ok && writeAll(f, rows[row].data(), columns.size() * sizeof(LookupString));
+	}
+	ok = ok && writeAll(f, displacements.data(), displacements.size() * sizeof(uint32_t));
+	ok = ok && writeAll(f, slots.data(), slots.size() * sizeof(uint32_t));
+	ok = ok && writeAll(f, pool.data(), pool.size());
+	ok = (fflush(f) == 0) && ok && (fsync(fileno(f)) == 0);
+	ok = (fclose(f) == 0) && ok;
+	// Replace the table in one go, it can be mapped by the running workers
+	if (!ok || (rename(tmppath.c_str(), path.c_str()) != 0)) {
+		error = "could not write " + path + ": " + strerror(errno);
+		unlink(tmppath.c_str());
+		return false;
+	}
+	return true;
+}
+
+bool LookupTableBuilder::fromCsv(const std::string &csv, LookupKind kind, const std::string &path, std::string &error)
+{
+	std::ifstream in(csv.c_str());
+	if (!in) {
+		error = "could not open " + csv;
+		return false;
+	}
+	LookupTableBuilder builder(kind);
+	FieldSplitter splitter;
+	splitter.setCsv(',', '"');
+	std::vector<FieldSplitter::Pair> pairs;
+	std::vector<std::string> values;
+	std::string line;
+	bool header = true;
+	for (unsigned long lineno = 1; std::getline(in, line); lineno++) {
+		if (!line.empty() && (line[line.size() - 1] == '\r'))
+			line.resize(line.size() - 1);
+		if (line.empty())
+			continue;
+		pairs.clear();
+		splitter.split(line.data(), line.size(), pairs);
+		values.clear();
+		for (size_t i = 0; i < pairs.size(); i++) {
+			values.push_back(std::string(pairs[i].value, pairs[i].valuelen));
+			if (pairs[i].escaped)
+				splitter.unescape(values.back());
+		}
+		std::string key = values[0];
+		values.erase(values.begin());
+		if (header) {
+			if (values.empty()) {
+				error = csv + ": the header needs a key column and at least one value column";
+				return false;
+			}
+			builder.setColumns(values);
+			header = false;
+		} else if (!builder.add(key, values, error)) {
+			char where[32];
+			snprintf(where, sizeof(where), ":%lu: ", lineno);
+			error = csv + where + error;
+			return false;
+		}
+	}
+	if (header) {
+		error = csv + " is empty";
+		return false;
+	}
+	return builder.write(path, error);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+std::mutex LookupSource::registrylock;
+std::vector<std::shared_ptr<LookupSource> > LookupSource::registry;
+int LookupSource::refreshed = -1;
+
+LookupSource::LookupSource()
+	:filepath(), current(), gen(0), reloadlock(), device(0), inode(0), mtime(0), filesize(0)
+{
+}
+
+std::shared_ptr<LookupSource> LookupSource::open(const std::string &path, std::string &error)
+{
+	std::lock_guard<std::mutex> guard(registrylock);
+	for (size_t i = 0; i < registry.size(); i++) {
+		if (registry[i]->filepath == path)
+			return registry[i];
+	}
+	std::shared_ptr<LookupSource> source(new LookupSource());
+	source->filepath = path;
+	if (!source->reload(error))
+		return NULL;
+	registry.push_back(source);
+	return source;
+}
+
+bool LookupSource::changed() const
+{
+	struct stat st;
+	if (stat(filepath.c_str(), &st) != 0)
+		return false; // Keep what we have
+	return ((uint64_t)st.st_dev != device) || ((uint64_t)st.st_ino != inode) || (st.st_size != filesize) ||
+	       ((int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec != mtime);
+}
+
+bool LookupSource::reload(std::string &error)
+{
+	// Identity first: if the file is replaced again while it is mapped, the next refresh sees it
+	struct stat st;
+	if (stat(filepath.c_str(), &st) != 0) {
+		error = "could not open " + filepath + ": " + strerror(errno);
+		return false;
+	}
+	std::shared_ptr<const LookupTable> table = LookupTable::open(filepath, error);
+	if (!table)
+		return false;
+	device = st.st_dev;
+	inode = st.st_ino;
+	filesize = st.st_size;
+	mtime = (int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+	std::atomic_store(&current, table);
+	gen.fetch_add(1, std::memory_order_release);
+	return true;
+}
+
+void LookupSource::refresh(int configversion)
+{
+	std::vector<std::shared_ptr<LookupSource> > sources;
+	{
+		std::lock_guard<std::mutex> guard(registrylock);
+		if (configversion == refreshed)
+			return;
+		refreshed = configversion;
+		sources = registry;
+	}
+	// Mapping a table is checking its header: the workers keep going on the old one meanwhile
+	for (size_t i = 0; i < sources.size(); i++) {
+		LookupSource &source = *sources[i];
+		std::lock_guard<std::mutex> guard(source.reloadlock);
+		if (!source.changed())
+			continue;
+		std::string error;
+		if (source.reload(error))
+			NOTICE("Lookup table %s reloaded: %u entries", source.filepath.c_str(), source.table()->entryCount());
+		else
+			WARN("Lookup table %s not reloaded, keeping the one in use: %s", source.filepath.c_str(), error.c_str());
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+LookupCache::LookupCache(size_t c)
+	:capacity(0), nodes(), buckets(), head(END), tail(END)
+{
+	setCapacity(c);
+}
+
+void LookupCache::setCapacity(size_t c)
+{
+	capacity = c;
+	size_t n = 1;
+	while (n < 2 * c)
+		n <<= 1;
+	buckets.assign(n, (uint32_t)END);
+	nodes.clear();
+	nodes.reserve(c);
+	head = tail = END;
+}
+
+void LookupCache::clear()
+{
+	std::fill(buckets.begin(), buckets.end(), (uint32_t)END);
+	nodes.clear();
+	head = tail = END;
+}
+
+uint32_t LookupCache::findNode(const std::string &key, uint64_t hash) const
+{
+	for (uint32_t n = buckets[hash & (buckets.size() - 1)]; n != END; n = nodes[n].chain) {
+		if ((nodes[n].hash == hash) && (nodes[n].key == key))
+			return n;
+	}
+	return END;
+}
+
+void LookupCache::unlink(uint32_t n)
+{
+	Node &node = nodes[n];
+	if (node.prev != END)
+		nodes[node.prev].next = node.next;
+	else
+		head = node.next;
+	if (node.next != END)
+		nodes[node.next].prev = node.prev;
+	else
+		tail = node.prev;
+}
+
+void LookupCache::pushFront(uint32_t n)
+{
+	nodes[n].prev = END;
+	nodes[n].next = head;
+	if (head != END)
+		nodes[head].prev = n;
+	head = n;
+	if (tail == END)
+		tail = n;
+}
+
+void LookupCache::unchain(uint32_t n)
+{
+	uint32_t *link = &buckets[nodes[n].hash & (buckets.size() - 1)];
+	while (*link != n)
+		link = &nodes[*link].chain;
+	*link = nodes[n].chain;
+}
+
+bool LookupCache::get(const std::string &key, uint32_t &entry)
+{
+	if (!capacity)
+		return false;
+	uint32_t n = findNode(key, StringInterner::hash(key.data(), key.size()));
+	if (n == END)
+		return false;
+	if (n != head) {
+		unlink(n);
+		pushFront(n);
+	}
+	entry = nodes[n].entry;
+	return true;
+}
+
+void LookupCache::put(const std::string &key, uint32_t entry)
+{
+	if (!capacity)
+		return;
+	uint64_t hash = StringInterner::hash(key.data(), key.size());
+	uint32_t n = findNode(key, hash);
+	if (n != END) {
+		nodes[n].entry = entry;
+		return;
+	}
+	if (nodes.size() < capacity) {
+		n = nodes.size();
+		nodes.push_back(Node());
+	} else {
+		// Evict the least recently used key
+		n = tail;
+		unlink(n);
+		unchain(n);
+	}
+	Node &node = nodes[n];
+	node.key.assign(key);
+	node.hash = hash;
+	node.entry = entry;
+	uint32_t &bucket = buckets[hash & (buckets.size() - 1)];
+	node.chain = bucket;
+	bucket = n;
+	pushFront(n);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+LookupPlugin::LookupPlugin()
+	:field(), prefix(), wanted(), source(), table(), generation(0), columns(), outnames(), cache(), caching(true)
+{
+}
+
+bool LookupPlugin::init(const FilterStep &step)
+{
+	std::string path;
+	int cachesize = -1;
+	for (int i = 0; i < step.parameter_size(); i++) {
+		const Field &p = step.parameter(i);
+		if (p.key() == "table") {
+			path = p.value();
+		} else if (p.key() == "field") {
+			field = p.value();
+		} else if (p.key() == "prefix") {
+			prefix = p.value();
+		} else if (p.key() == "cache_size") {
+			cachesize = atoi(p.value().c_str());
+			if (cachesize < 0) {
+				ERR("lookup: invalid cache_size '%s'", p.value().c_str());
+				return false;
+			}
+		} else if (p.key() == "columns") {
+			size_t pos = 0;
+			while (pos <= p.value().size()) {
+				size_t comma = std::min(p.value().find(',', pos), p.value().size());
+				size_t b = p.value().find_first_not_of(' ', pos), e = p.value().find_last_not_of(' ', comma - 1);
+				if ((b < comma) && (e != std::string::npos) && (e >= b))
+					wanted.push_back(p.value().substr(b, e - b + 1));
+				pos = comma + 1;
+			}
+		} else {
+			WARN("lookup: unknown parameter '%s' ignored", p.key().c_str());
+		}
+	}
+	if (path.empty()) {
+		ERR("lookup: no table given");
+		return false;
+	}
+	std::string error;
+	source = LookupSource::open(path, error);
+	if (!source) {
+		ERR("lookup: %s", error.c_str());
+		return false;
+	}
+	generation = source->generation();
+	table = source->table();
+	// A perfect hash lookup in a table that is paged in is as quick as the cache
+	if (cachesize < 0)
+		cachesize = (table->kind() == LOOKUP_RANGE) ? LOOKUP_CACHE_SIZE : 0;
+	caching = (cachesize > 0);
+	cache.setCapacity(cachesize);
+	return useTable();
+}
+
+bool LookupPlugin::useTable()
+{
+	bool ok = true;
+	columns.clear();
+	outnames.clear();
+	cache.clear();
+	if (wanted.empty()) {
+		for (uint32_t c = 0; c < table->columnCount(); c++)
+			columns.push_back(c);
+	}
+	for (size_t i = 0; i < wanted.size(); i++) {
+		uint32_t c = table->column(wanted[i]);
+		if (c == LookupTable::NONE) {
+			ERR("lookup: table %s has no column '%s'", source->path().c_str(), wanted[i].c_str());
+			ok = false;
+			continue;
+		}
+		columns.push_back(c);
+	}
+	for (size_t i = 0; i < columns.size(); i++)
+		outnames.push_back(prefix + table->columnName(columns[i]));
+	return ok;
+}
+
+StepResult LookupPlugin::process(LogEvent &event)
+{
+	const std::string *key = NULL;
+	if (field.empty()) {
+		key = &event.message();
+	} else {
+		for (int i = 0; (i < event.field_size()) && !key; i++) {
+			if (event.field(i).key() == field)
+				key = &event.field(i).value();
+		}
+	}
+	if (!key)
+		return STEP_FAILED;
+
+	// A reloaded table: switch to it at this event, the cached entries were of the old one
+	uint32_t gen = source->generation();
+	if (gen != generation) {
+		generation = gen;
+		table = source->table();
+		useTable();
+	}
+
+	uint32_t entry;
+	if (!caching || !cache.get(*key, entry)) {
+		entry = table->find(key->data(), key->size());
+		if (caching)
+			cache.put(*key, entry);
+	}
+	if (entry == LookupTable::NONE)
+		return STEP_FAILED;
+
+	int existing = event.field_size();
+	for (size_t c = 0; c < columns.size(); c++) {
+		const char *text;
+		size_t len;
+		table->value(entry, columns[c], text, len);
+		Field *f = NULL;
+		for (int i = 0; (i < existing) && !f; i++) {
+			if (event.field(i).key() == outnames[c])
+				f = event.mutable_field(i);
+		}
+		if (!f) {
+			f = event.add_field();
+			f->mutable_key()->assign(outnames[c]);
+		}
+		f->mutable_value()->assign(text, len);
+		FieldValue::clearType(*f);
+	}
+	return STEP_OK;
+}
+
+SAWMILL_REGISTER_PLUGIN("lookup", LookupPlugin);
+
+} // namespace sawmill
+
+/////////////////////////////////////////////////////////////////////////////
+// Tests and benchmark
+/////////////////////////////////////////////////////////////////////////////
+
+#ifdef DEBUG_LOOKUPTABLE_CPP
+
+#include <map>
+#include <time.h>
+#include "testcheck.h"
+
+#define BENCH_KEYS    1000000
+#define BENCH_RANGES  500000
+#define BENCH_LOOKUPS 5000000
+
+using namespace sawmill;
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void writeFile(const std::string &path, const std::string &content)
+{
+	FILE *f = fopen(path.c_str(), "w");
+	fwrite(content.data(), content.size(), 1, f);
+	fclose(f);
+}
+
+/**
+ * Column 0 of the entry the table has for 'key', "-" if none.
+ */
+static std::string lookup(const LookupTable &table, const std::string &key, uint32_t column = 0)
+{
+	uint32_t e = table.find(key.data(), key.size());
+	if (e == LookupTable::NONE)
+		return "-";
+	const char *text;
+	size_t len;
+	table.value(e, column, text, len);
+	return std::string(text, len);
+}
+
+static FilterStep lookupStep(const char *const *params)
+{
+	FilterStep step;
+	step.set_plugin("lookup");
+	step.set_stepnumber(1);
+	for (size_t i = 0; params[i]; i += 2) {
+		Field *p = step.add_parameter();
+		p->set_key(params[i]);
+		p->set_value(params[i + 1]);
+	}
+	return step;
+}
+
+static std::string fieldValue(const LogEvent &event, const std::string &key)
+{
+	for (int i = 0; i < event.field_size(); i++) {
+		if (event.field(i).key() == key)
+			return event.field(i).value();
+	}
+	return "-";
+}
+
+static std::string keyOf(unsigned i)
+{
+	char buf[32];
+	snprintf(buf, sizeof(buf), "host-%07u.example", i);
+	return buf;
+}
+
+int main()
+{
+	int rc = 0;
+	std::string error;
+	const std::string dir = "/tmp/lookuptable_test";
+	mkdir(dir.c_str(), 0755);
+
+	// Exact keys
+	writeFile(dir + "/owners.csv", "host,owner,team\r\nweb-1,alice,\"web, frontend\"\n\nweb-2,bob,ops\ndb-1,carol,\"\"\"data\"\"\"\n");
+	rc |= check("CSV to exact table", LookupTableBuilder::fromCsv(dir + "/owners.csv", LOOKUP_EXACT, dir + "/owners.lkp", error));
+	std::shared_ptr<const LookupTable> owners = LookupTable::open(dir + "/owners.lkp", error);
+	rc |= check("Open exact table", owners && (owners->entryCount() == 3) && (owners->columnCount() == 2) &&
+	            (owners->columnName(1) == "team") && (owners->column("owner") == 0));
+	rc |= check("Exact lookups", owners && (lookup(*owners, "web-1") == "alice") && (lookup(*owners, "web-1", 1) == "web, frontend") &&
+	            (lookup(*owners, "db-1", 1) == "\"data\"") && (lookup(*owners, "web-3") == "-") && (lookup(*owners, "") == "-"));
+	writeFile(dir + "/dup.csv", "host,owner\na,x\nb,y\na,z\n");
+	rc |= check("Duplicate keys are refused", !LookupTableBuilder::fromCsv(dir + "/dup.csv", LOOKUP_EXACT, dir + "/dup.lkp", error) &&
+	            (error.find("duplicate") != std::string::npos));
+	writeFile(dir + "/short.csv", "host,owner,team\na,x\n");
+	rc |= check("Missing values are refused", !LookupTableBuilder::fromCsv(dir + "/short.csv", LOOKUP_EXACT, dir + "/short.lkp", error) &&
+	            (error.find("short.csv:2:") != std::string::npos));
+
+	// Ranges, nested ones cut up
+	writeFile(dir + "/sites.csv", "range,site\n10.0.0.0/8,corp\n10.1.0.0/16,lab\n10.1.2.0/24,rack\n10.1.255.255,edge\n"
+	          "192.168.1.10-192.168.1.20,office\n2001:db8::/32,v6\n0.0.0.0/0,internet\n");
+	rc |= check("CSV to range table", LookupTableBuilder::fromCsv(dir + "/sites.csv", LOOKUP_RANGE, dir + "/sites.lkp", error));
+	std::shared_ptr<const LookupTable> sites = LookupTable::open(dir + "/sites.lkp", error);
+	static const char *const expect[][2] = {
+		{ "10.1.2.3", "rack" }, { "10.1.3.1", "lab" }, { "10.1.255.255", "edge" }, { "10.1.255.254", "lab" },
+		{ "10.2.0.1", "corp" }, { "10.255.255.255", "corp" }, { "11.0.0.0", "internet" }, { "0.0.0.0", "internet" },
+		{ "192.168.1.10", "office" }, { "192.168.1.20", "office" }, { "192.168.1.21", "internet" },
+		{ "2001:db8:1::1", "v6" }, { "2001:db9::1", "-" }, { "::1", "-" }, { "not an address", "-" }
+	};
+	bool ok = (sites != NULL);
+	for (size_t i = 0; ok && (i < sizeof(expect) / sizeof(expect[0])); i++) {
+		ok = (lookup(*sites, expect[i][0]) == expect[i][1]);
+		if (!ok)
+			printf("  %s: got %s, expected %s\n", expect[i][0], lookup(*sites, expect[i][0]).c_str(), expect[i][1]);
+	}
+	rc |= check("Range lookups", ok);
+	writeFile(dir + "/overlap.csv", "range,site\n10.0.0.0-10.0.0.20,a\n10.0.0.10-10.0.0.30,b\n");
+	rc |= check("Overlapping ranges are refused", !LookupTableBuilder::fromCsv(dir + "/overlap.csv", LOOKUP_RANGE, dir + "/o.lkp", error));
+	writeFile(dir + "/bad.csv", "range,site\n10.0.0.0/33,a\n");
+	rc |= check("Invalid prefix is refused", !LookupTableBuilder::fromCsv(dir + "/bad.csv", LOOKUP_RANGE, dir + "/o.lkp", error));
+	writeFile(dir + "/damaged.lkp", std::string(LOOKUP_MAGIC "\x01\0\0\0\x01\0\0\0", 16) + std::string(200, '\xff'));
+	rc |= check("Damaged table is refused", !LookupTable::open(dir + "/damaged.lkp", error));
+
+	// LRU
+	{
+		LookupCache cache(2);
+		uint32_t e = 0;
+		cache.put("a", 1);
+		cache.put("b", 2);
+		cache.get("a", e);
+		cache.put("c", 3); // Evicts b
+		rc |= check("LRU evicts the least recently used", cache.get("a", e) && (e == 1) && !cache.get("b", e) &&
+		            cache.get("c", e) && (e == 3) && (cache.size() == 2));
+	}
+
+	// Plugin, and a reload of its table
+	{
+		static const char *const params[] = { "table", "/tmp/lookuptable_test/owners.lkp", "field", "host",
+		                                      "columns", "owner", "prefix", "host_", NULL };
+		LookupPlugin plugin;
+		rc |= check("Plugin init", plugin.init(lookupStep(params)));
+		LogEvent event;
+		Field *f = event.add_field();
+		f->set_key("host");
+		f->set_value("web-2");
+		StepResult res = plugin.process(event);
+		rc |= check("Plugin sets the columns", (res == STEP_OK) && (fieldValue(event, "host_owner") == "bob") &&
+		            (fieldValue(event, "host_team") == "-"));
+
+		writeFile(dir + "/owners.csv", "host,team,owner\nweb-2,ops,dave\n");
+		LookupTableBuilder::fromCsv(dir + "/owners.csv", LOOKUP_EXACT, dir + "/owners.lkp", error);
+		res = plugin.process(event);
+		rc |= check("Old table until the config changes", (res == STEP_OK) && (fieldValue(event, "host_owner") == "bob"));
+		LookupSource::refresh(1);
+		res = plugin.process(event);
+		rc |= check("New table after the config changed", (res == STEP_OK) && (fieldValue(event, "host_owner") == "dave") &&
+		            (event.field_size() == 2));
+		event.mutable_field(0)->set_value("web-1");
+		rc |= check("Plugin fails on unknown keys", plugin.process(event) == STEP_FAILED);
+
+		static const char *const missing[] = { "table", "/tmp/lookuptable_test/nothere.lkp", NULL };
+		LookupPlugin other;
+		rc |= check("Plugin init fails without table", !other.init(lookupStep(missing)));
+	}
+
+	// Benchmark: exact keys
+	{
+		std::string csv = "host,owner,site\n";
+		for (unsigned i = 0; i < BENCH_KEYS; i++) {
+			char line[96];
+			snprintf(line, sizeof(line), "%s,user%u,site%u\n", keyOf(i).c_str(), i % 5000, i % 40);
+			csv += line;
+		}
+		writeFile(dir + "/big.csv", csv);
+		uint64_t t0 = now_ns();
+		bool built = LookupTableBuilder::fromCsv(dir + "/big.csv", LOOKUP_EXACT, dir + "/big.lkp", error);
+		uint64_t t1 = now_ns();
+		std::shared_ptr<const LookupTable> big = LookupTable::open(dir + "/big.lkp", error);
+		uint64_t t2 = now_ns();
+
+		// What the table saves: parsing the CSV into a map at every start
+		std::map<std::string, std::vector<std::string> > map;
+		{
+			std::ifstream in((dir + "/big.csv").c_str());
+			std::string line;
+			std::getline(in, line);
+			while (std::getline(in, line)) {
+				size_t a = line.find(','), b = line.find(',', a + 1);
+				std::vector<std::string> &v = map[line.substr(0, a)];
+				v.push_back(line.substr(a + 1, b - a - 1));
+				v.push_back(line.substr(b + 1));
+			}
+		}
+		uint64_t t3 = now_ns();
+		rc |= check("Big exact table", built && big && (big->entryCount() == BENCH_KEYS) &&
+		            (lookup(*big, keyOf(123456), 1) == "site16"));
+		struct stat st;
+		stat((dir + "/big.lkp").c_str(), &st);
+		printf("%d keys: built in %.0f ms (%.1f MB), mapped in %.3f ms; CSV into a std::map: %.0f ms\n", BENCH_KEYS,
+		       (t1 - t0) / 1e6, st.st_size / 1048576.0, (t2 - t1) / 1e6, (t3 - t2) / 1e6);
+
+		// Skewed keys: most events are from a few hosts
+		std::vector<std::string> keys(BENCH_LOOKUPS);
+		srand(7);
+		for (size_t i = 0; i < keys.size(); i++)
+			keys[i] = keyOf((rand() % 10) ? rand() % 500 : rand() % BENCH_KEYS);
+		size_t found = 0;
+		uint64_t start = now_ns();
+		for (size_t i = 0; i < keys.size(); i++)
+			found += map.count(keys[i]);
+		double mapns = now_ns() - start;
+		start = now_ns();
+		for (size_t i = 0; i < keys.size(); i++)
+			found += big->find(keys[i].data(), keys[i].size()) != LookupTable::NONE;
+		double hashns = now_ns() - start;
+		LookupCache cache;
+		start = now_ns();
+		for (size_t i = 0; i < keys.size(); i++) {
+			uint32_t e;
+			if (!cache.get(keys[i], e)) {
+				e = big->find(keys[i].data(), keys[i].size());
+				cache.put(keys[i], e);
+			}
+			found += (e != LookupTable::NONE);
+		}
+		double lruns = now_ns() - start;
+		rc |= check("All keys found", found == 3 * (size_t)BENCH_LOOKUPS);
+		printf("  lookups/s: std::map %.2fM, perfect hash %.2fM, with LRU %.2fM\n", BENCH_LOOKUPS / (mapns / 1e3),
+		       BENCH_LOOKUPS / (hashns / 1e3), BENCH_LOOKUPS / (lruns / 1e3));
+	}
+
+	// Benchmark: ranges
+	{
+		LookupTableBuilder builder(LOOKUP_RANGE);
+		builder.setColumns(std::vector<std::string>(1, "site"));
+		std::vector<std::string> values(1);
+		for (unsigned i = 0; i < BENCH_RANGES; i++) {
+			char key[48];
+			snprintf(key, sizeof(key), "%u.%u.%u.0/24", 10 + i / 65536, (i / 256) % 256, i % 256);
+			values[0] = "site" + std::to_string(i % 300);
+			builder.add(key, values, error);
+		}
+		builder.write(dir + "/ranges.lkp", error);
+		std::shared_ptr<const LookupTable> ranges = LookupTable::open(dir + "/ranges.lkp", error);
+		std::vector<std::string> addrs(BENCH_LOOKUPS);
+		// A few hundred busy clients and a tail of others
+		for (size_t i = 0; i < addrs.size(); i++) {
+			unsigned r = (rand() % 10) ? rand() % 500 : rand() % BENCH_RANGES;
+			addrs[i] = std::to_string(10 + r / 65536) + "." + std::to_string((r / 256) % 256) + "." +
+			           std::to_string(r % 256) + "." + std::to_string((rand() % 10) ? r % 256 : rand() % 256);
+		}
+		size_t found = 0;
+		uint64_t start = now_ns();
+		for (size_t i = 0; i < addrs.size(); i++)
+			found += ranges->find(addrs[i].data(), addrs[i].size()) != LookupTable::NONE;
+		double searchns = now_ns() - start;
+		LookupCache cache;
+		start = now_ns();
+		for (size_t i = 0; i < addrs.size(); i++) {
+			uint32_t e;
+			if (!cache.get(addrs[i], e)) {
+				e = ranges->find(addrs[i].data(), addrs[i].size());
+				cache.put(addrs[i], e);
+			}
+			found += (e != LookupTable::NONE);
+		}
+		double lruns = now_ns() - start;
+		rc |= check("All addresses found", ranges && (found == 2 * (size_t)BENCH_LOOKUPS));
+		printf("%d ranges, lookups/s: binary search %.2fM, with LRU %.2fM\n", BENCH_RANGES,
+		       BENCH_LOOKUPS / (searchns / 1e3), BENCH_LOOKUPS / (lruns / 1e3));
+	}
+
+	printf("%s\n", rc ? "FAILED" : "All tests passed");
+	return rc;
+}
+
+#endif // DEBUG_LOOKUPTABLE_CPP
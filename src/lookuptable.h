@@ -0,0 +1,286 @@
+#ifndef __LOOKUPTABLE_H
+# define __LOOKUPTABLE_H
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+#include "plugin.h"
+
+#define LOOKUP_MAGIC      "SAWLKUP1"
+#define LOOKUP_CACHE_SIZE 1024 // Default LRU entries per plugin instance
+
+namespace sawmill {
+
+enum LookupKind {
+	LOOKUP_EXACT = 1, // String keys, found with a perfect hash
+	LOOKUP_RANGE = 2  // IPv4/IPv6 address ranges, found with a binary search
+};
+
+/**
+ * Header of a lookup table file, in the byte order of the host. The file is:
+ *   - this header
+ *   - the column names: LookupString[columns]
+ *   - the entries, sorted for ranges: LookupExactEntry or LookupRangeEntry, each followed by
+ *     LookupString[columns] with its values
+ *   - exact tables: the perfect hash, uint32_t[buckets] displacements and uint32_t[slots] entries
+ *   - the string pool, the strings point in here
+ */
+struct LookupHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t kind;     // LookupKind
+	uint32_t columns;
+	uint32_t entries;
+	uint32_t buckets;
+	uint32_t slots;
+	uint64_t names;    // File offsets of the parts
+	uint64_t entry;
+	uint64_t hash;
+	uint64_t strings;
+};
+
+struct LookupString {
+	uint32_t offset;  // In the string pool
+	uint32_t length;
+};
+
+struct LookupExactEntry {
+	LookupString key;
+};
+
+/**
+ * Addresses are 128 bits, IPv4 addresses are mapped into ::ffff:0:0/96. The ranges of a table
+ * don't overlap, nested ranges are cut up when the table is built.
+ */
+struct LookupRangeEntry {
+	uint64_t starthi;
+	uint64_t startlo;
+	uint64_t endhi;
+	uint64_t endlo;
+};
+
+/**
+ * A lookup table file, mapped read only. Opening one is checking the header, the pages are only
+ * read as entries are looked up, so a table of any size is ready at once and shared by all
+ * processes that use it.
+ */
+class LookupTable
+{
+public:
+	static const uint32_t NONE = (uint32_t)-1;
+
+	~LookupTable();
+
+	/**
+	 * Map the table at 'path'. Returns NULL with the reason in 'error'.
+	 */
+	static std::shared_ptr<const LookupTable> open(const std::string &path, std::string &error);
+
+	LookupKind kind() const { return (LookupKind)header->kind; }
+	uint32_t columnCount() const { return header->columns; }
+	uint32_t entryCount() const { return header->entries; }
+	/**
+	 * Index of the column, NONE if the table doesn't have it.
+	 */
+	uint32_t column(const std::string &name) const;
+	std::string columnName(uint32_t column) const;
+
+	/**
+	 * The entry of a key (exact tables) or of the range the address in 'key' is in (range
+	 * tables), NONE if there is none.
+	 */
+	uint32_t find(const char *key, size_t len) const;
+	/**
+	 * Value of a column of an entry.
+	 */
+	void value(uint32_t entry, uint32_t column, const char *&text, size_t &len) const;
+
+	/**
+	 * Parse an IPv4 or IPv6 address into the 128 bit form of the ranges.
+	 */
+	static bool parseAddress(const char *text, size_t len, uint64_t &hi, uint64_t &lo);
+	static uint32_t slotOf(uint64_t hash, uint32_t displacement, uint32_t slots);
+private:
+	LookupTable();
+
+	const LookupString *values(uint32_t entry) const;
+	void text(const LookupString &s, const char *&text, size_t &len) const;
+
+	const char *map;
+	size_t size;
+	const LookupHeader *header;
+	size_t stride;     // Bytes per entry
+	const uint32_t *displacements;
+	const uint32_t *slots;
+
+	// Not copyable
+	LookupTable(const LookupTable &);
+	LookupTable &operator=(const LookupTable &);
+};
+
+/**
+ * Builds a lookup table file. The file is written next to its path and renamed over it, so a
+ * table that is in use is replaced at once and stays mapped as it was for who still has it.
+ */
+class LookupTableBuilder
+{
+public:
+	explicit LookupTableBuilder(LookupKind kind);
+
+	/**
+	 * Names of the value columns.
+	 */
+	void setColumns(const std::vector<std::string> &names);
+	/**
+	 * Add an entry. For range tables the key is "address", "start-end" or "address/prefix".
+	 * Returns false if the key is invalid or a duplicate.
+	 */
+	bool add(const std::string &key, const std::vector<std::string> &values, std::string &error);
+	bool write(const std::string &path, std::string &error);
+
+	/**
+	 * Build a table from a CSV file: a header line with the name of the key column and the value
+	 * columns, then a line per entry. Values can be quoted, but can't span lines.
+	 */
+	static bool fromCsv(const std::string &csv, LookupKind kind, const std::string &path, std::string &error);
+private:
+	struct Range {
+		uint64_t starthi, startlo, endhi, endlo;
+		uint32_t row;
+	};
+
+	uint32_t addString(const std::string &s);
+	bool buildHash(std::vector<uint32_t> &displacements, std::vector<uint32_t> &slots) const;
+	bool flattenRanges(std::vector<Range> &out, std::string &error) const;
+
+	LookupKind tablekind;
+	std::vector<std::string> columns;
+	std::vector<std::string> keys;                 // Exact tables
+	std::vector<Range> ranges;                     // Range tables, as added
+	std::vector<std::vector<LookupString> > rows;  // Values, in the string pool
+	std::string pool;
+	std::unordered_map<std::string, uint32_t> pooled;
+};
+
+/**
+ * A table by path, shared by all plugin instances of the process that use it. refresh() maps
+ * the tables whose file was replaced again, workers see the new table from their next event on
+ * and the old mapping goes away when the last of them let go of it.
+ */
+class LookupSource
+{
+public:
+	/**
+	 * The source for 'path', mapped the first time. Returns NULL with the reason in 'error'.
+	 */
+	static std::shared_ptr<LookupSource> open(const std::string &path, std::string &error);
+	/**
+	 * Check all tables for a new file, once per config version.
+	 */
+	static void refresh(int configversion);
+
+	const std::string &path() const { return filepath; }
+	/**
+	 * Goes up every time the table is replaced.
+	 */
+	uint32_t generation() const { return gen.load(std::memory_order_acquire); }
+	std::shared_ptr<const LookupTable> table() const { return std::atomic_load(&current); }
+private:
+	LookupSource();
+	bool changed() const;
+	bool reload(std::string &error);
+
+	std::string filepath;
+	std::shared_ptr<const LookupTable> current;
+	std::atomic<uint32_t> gen;
+	std::mutex reloadlock;
+	// Identity of the mapped file
+	uint64_t device;
+	uint64_t inode;
+	int64_t mtime;
+	int64_t filesize;
+
+	static std::mutex registrylock;
+	static std::vector<std::shared_ptr<LookupSource> > registry;
+	static int refreshed;
+};
+
+/**
+ * Least recently used keys and the entry they were found at (or NONE), so the hot keys are not
+ * looked up in the table over and over. A fixed number of nodes on a list in order of use, found
+ * through their key hash in a bucket array. An evicted node keeps the room its key had.
+ */
+class LookupCache
+{
+public:
+	explicit LookupCache(size_t capacity = LOOKUP_CACHE_SIZE);
+
+	void setCapacity(size_t capacity);
+	bool get(const std::string &key, uint32_t &entry);
+	void put(const std::string &key, uint32_t entry);
+	void clear();
+	size_t size() const { return nodes.size(); }
+private:
+	struct Node {
+		std::string key;
+		uint64_t hash;
+		uint32_t entry;
+		uint32_t prev;  // Use order
+		uint32_t next;
+		uint32_t chain; // Next node in the bucket
+	};
+	static const uint32_t END = (uint32_t)-1;
+
+	uint32_t findNode(const std::string &key, uint64_t hash) const;
+	void unlink(uint32_t n);
+	void pushFront(uint32_t n);
+	void unchain(uint32_t n);
+
+	size_t capacity;
+	std::vector<Node> nodes;
+	std::vector<uint32_t> buckets; // A power of two, at least twice the capacity
+	uint32_t head;
+	uint32_t tail;
+};
+
+/**
+ * Plugin "lookup": enrich events with the values a lookup table has for one of their fields.
+ *
+ * Parameters:
+ *   table:      path of the table file (see LookupTableBuilder)
+ *   field:      field with the key, the message if not given
+ *   columns:    comma separated columns to set, all if not given
+ *   prefix:     prepended to the column names for the field keys
+ *   cache_size: LRU entries of this instance, 0 for none. The default is LOOKUP_CACHE_SIZE for
+ *               range tables and none for exact ones
+ *
+ * Existing fields are overwritten. Fails when the key is not in the table.
+ */
+class LookupPlugin : public FilterPlugin
+{
+public:
+	LookupPlugin();
+	bool init(const FilterStep &step);
+	StepResult process(LogEvent &event);
+private:
+	bool useTable();
+
+	std::string field;
+	std::string prefix;
+	std::vector<std::string> wanted;   // Columns asked for, empty for all
+	std::shared_ptr<LookupSource> source;
+	std::shared_ptr<const LookupTable> table;
+	uint32_t generation;
+	std::vector<uint32_t> columns;     // Of the current table
+	std::vector<std::string> outnames; // Field key per column
+	LookupCache cache;
+	bool caching;
+};
+
+} // namespace sawmill
+
+#endif // ifndef __LOOKUPTABLE_H
@@ -0,0 +1,412 @@
+/****************************************************************************
+ * Project: SawMill
+ * Authors:
+ *          Bart Meuris <bart . meuris @ gmail . com>
+ *
+ * License: (to be discussed LGPL version 2.0?)
+ ****************************************************************************
+ * Module description:
+ *     Multiline assembler: joins the lines of a record into one event.
+ *
+ ***************************************************************************/
+
+#include "multiline.h"
+#include "regexset.h"
+#include "sawlog.h"
+#include <algorithm>
+#include <time.h>
+
+#define MULTILINE_RESERVE 4096 // Initial size of the text buffer of a source
+
+namespace sawmill {
+
+static uint64_t clock_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+bool MultilineInput::Pattern::compile(const std::string &pattern)
+{
+	set = !pattern.empty();
+	literal.clear();
+	if (!set)
+		return true;
+	bool exact = false;
+	RegexSet::analyze(pattern, literal, exact);
+	if (!exact || literal.empty()) {
+		literal.clear();
+		try {
+			regex.assign(pattern, boost::regex::perl);
+		} catch (boost::regex_error &e) {
+			ERR("Invalid multiline pattern '%s': %s", pattern.c_str(), e.what());
+			set = false;
+			return false;
+		}
+	}
+	return true;
+}
+
+bool MultilineInput::Pattern::match(const std::string &text) const
+{
+	if (!literal.empty())
+		return text.find(literal) != std::string::npos;
+	return boost::regex_search(text, regex);
+}
+
+MultilineInput::MultilineInput(EventInput *in)
+	:input(in), rules(), start(), cont(), records(), pending(0), pool(), target(NULL), acksink(NULL), taken(0),
+	 unacked(), emitted(0), now_ms(0), nextflush_ms(UINT64_MAX)
+{
+}
+
+MultilineInput::~MultilineInput()
+{
+	for (std::unordered_map<std::string, Record>::iterator it = records.begin(); it != records.end(); ++it) {
+		delete it->second.event;
+	}
+}
+
+bool MultilineInput::setRules(const MultilineRules &r)
+{
+	rules = r;
+	if (rules.maxlines < 1)
+		rules.maxlines = 1;
+	bool ok = start.compile(rules.start);
+	return cont.compile(rules.cont) && ok;
+}
+
+long MultilineInput::timeout() const
+{
+	long t = input->timeout();
+	if (!pending)
+		return t;
+	uint64_t now = clock_ms();
+	long flush = (nextflush_ms > now) ? (long)(nextflush_ms - now) : 0;
+	return ((t < 0) || (flush < t)) ? flush : t;
+}
+
+size_t MultilineInput::read(EventSink &sink, size_t max)
+{
+	target = &sink;
+	acksink = &sink;
+	emitted = 0;
+	now_ms = clock_ms();
+	input->read(*this, max);
+
+	if (pending && (now_ms >= nextflush_ms)) {
+		// Records without new lines for too long are complete, forget their sources
+		nextflush_ms = UINT64_MAX;
+		for (std::unordered_map<std::string, Record>::iterator it = records.begin(); it != records.end(); ) {
+			Record &record = it->second;
+			if (record.event && (record.deadline_ms > now_ms)) {
+				if (record.deadline_ms < nextflush_ms)
+					nextflush_ms = record.deadline_ms;
+				++it;
+				continue;
+			}
+			if (record.event)
+				emit(record);
+			it = records.erase(it);
+		}
+	}
+	dropAcked();
+	target = NULL;
+	return emitted;
+}
+
+void MultilineInput::flush(EventSink &sink)
+{
+	target = &sink;
+	acksink = &sink;
+	for (std::unordered_map<std::string, Record>::iterator it = records.begin(); it != records.end(); ++it) {
+		if (it->second.event)
+			emit(it->second);
+	}
+	records.clear();
+	nextflush_ms = UINT64_MAX;
+	target = NULL;
+}
+
+LogEvent *MultilineInput::newEvent()
+{
+	return pool.get();
+}
+
+uint64_t MultilineInput::oldestPending() const
+{
+	uint64_t oldest = taken;
+	dropAcked();
+	if (!unacked.empty())
+		oldest = unacked.front().second;
+	if (pending) {
+		for (std::unordered_map<std::string, Record>::const_iterator it = records.begin(); it != records.end(); ++it) {
+			if (it->second.event && (it->second.first < oldest))
+				oldest = it->second.first;
+		}
+	}
+	return oldest;
+}
+
+void MultilineInput::dropAcked() const
+{
+	if (!acksink || unacked.empty())
+		return;
+	uint64_t done = acksink->oldestPending();
+	while (!unacked.empty() && (unacked.front().first <= done)) {
+		unacked.pop_front();
+	}
+}
+
+void MultilineInput::submit(LogEvent *event)
+{
+	Record &record = records[event->source()];
+	const std::string &line = event->message();
+	taken++;
+
+	if (record.event && continues(line)) {
+		if ((record.lines < rules.maxlines) && (record.text.size() + 1 + line.size() <= rules.maxbytes)) {
+			record.text.push_back('\n');
+			record.text.append(line);
+			record.lines++;
+			record.deadline_ms = now_ms + rules.timeout_ms;
+			if (record.deadline_ms < nextflush_ms)
+				nextflush_ms = record.deadline_ms;
+			pool.put(event);
+			return;
+		}
+		DBG("Multiline record of %s cut at %d lines", event->source().c_str(), (int)record.lines);
+	}
+	if (record.event)
+		emit(record);
+	begin(record, event);
+}
+
+bool MultilineInput::continues(const std::string &line) const
+{
+	if (cont.set && cont.match(line))
+		return true;
+	if (rules.indent && !line.empty() && ((line[0] == ' ') || (line[0] == '\t')))
+		return true;
+	return start.set && !start.match(line);
+}
+
+void MultilineInput::begin(Record &record, LogEvent *event)
+{
+	if (record.text.capacity() < MULTILINE_RESERVE)
+		record.text.reserve(std::min((size_t)MULTILINE_RESERVE, rules.maxbytes));
+	record.event = event;
+	record.text.assign(event->message());
+	record.lines = 1;
+	record.first = taken - 1;
+	record.deadline_ms = now_ms + rules.timeout_ms;
+	if (record.deadline_ms < nextflush_ms)
+		nextflush_ms = record.deadline_ms;
+	pending++;
+}
+
+void MultilineInput::emit(Record &record)
+{
+	if (record.lines > 1)
+		record.event->mutable_message()->assign(record.text);
+	LogEvent *out = target->newEvent();
+	out->Swap(record.event);
+	target->submit(out);
+	// The record's lines are done once the sink is done with its event
+	uint64_t end = target->submitted();
+	while (!unacked.empty() && (unacked.back().second >= record.first)) {
+		unacked.pop_back();
+	}
+	unacked.push_back(std::make_pair(end, record.first));
+	pool.put(record.event);
+	record.event = NULL;
+	pending--;
+	emitted++;
+}
+
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Test and benchmark
+/////////////////////////////////////////////////////////////////////////////
+
+#ifdef DEBUG_MULTILINE_CPP
+
+#include <cstdio>
+#include <vector>
+#include <unistd.h>
+#include "testcheck.h"
+
+#define BENCH_TRACES 100000
+#define BENCH_DEPTH  20
+
+using namespace sawmill;
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Hands out a fixed list of (source, line) pairs.
+ */
+class ListInput : public EventInput
+{
+public:
+	ListInput() :lines(), next(0) {}
+	void add(const char *source, const std::string &line) { lines.push_back(std::make_pair(std::string(source), line)); }
+	int fd() const { return -1; }
+	long timeout() const { return (next < lines.size()) ? 0 : -1; }
+	size_t read(EventSink &sink, size_t max)
+	{
+		size_t count = 0;
+		for (; (next < lines.size()) && (count < max); next++, count++) {
+			LogEvent *event = sink.newEvent();
+			event->mutable_source()->assign(lines[next].first);
+			event->mutable_message()->assign(lines[next].second);
+			sink.submit(event);
+		}
+		return count;
+	}
+	std::vector<std::pair<std::string, std::string> > lines;
+	size_t next;
+};
+
+class CollectSink : public EventSink
+{
+public:
+	CollectSink() :messages(), count(0), keep(true), pool() {}
+	LogEvent *newEvent() { return pool.get(); }
+	void submit(LogEvent *event)
+	{
+		if (keep)
+			messages.push_back(event->source() + "|" + event->message());
+		count++;
+		pool.put(event);
+	}
+	std::vector<std::string> messages;
+	long count;
+	bool keep;
+	EventPool pool;
+};
+
+static void drain(MultilineInput &ml, EventSink &sink)
+{
+	while (ml.timeout() == 0) {
+		ml.read(sink, 4096);
+	}
+}
+
+int main()
+{
+	int rc = 0;
+
+	// Java style: a record starts with a date, interleaved with another source
+	{
+		ListInput in;
+		in.add("a", "2026-10-19 12:00:00 ERROR boom");
+		in.add("a", "java.lang.NullPointerException");
+		in.add("b", "2026-10-19 12:00:00 INFO other");
+		in.add("a", "\tat Foo.bar(Foo.java:1)");
+		in.add("a", "2026-10-19 12:00:01 INFO next");
+		MultilineRules rules;
+		rules.start = "^\\d{4}-\\d{2}-\\d{2} ";
+		MultilineInput ml(&in);
+		rc |= check("Rules compile", ml.setRules(rules));
+		CollectSink sink;
+		drain(ml, sink);
+		ml.flush(sink);
+		rc |= check("Start pattern joins per source", (sink.messages.size() == 3) &&
+		            (sink.messages[0] == "a|2026-10-19 12:00:00 ERROR boom\njava.lang.NullPointerException\n\tat Foo.bar(Foo.java:1)") &&
+		            (sink.messages[1] == "b|2026-10-19 12:00:00 INFO other") &&
+		            (sink.messages[2] == "a|2026-10-19 12:00:01 INFO next"));
+	}
+
+	// Python style: indentation plus a continue pattern
+	{
+		ListInput in;
+		in.add("p", "Traceback (most recent call last):");
+		in.add("p", "  File \"x.py\", line 1, in <module>");
+		in.add("p", "ValueError: bad");
+		in.add("p", "plain line");
+		MultilineRules rules;
+		rules.indent = true;
+		rules.cont = "^[A-Za-z]+Error: ";
+		MultilineInput ml(&in);
+		ml.setRules(rules);
+		CollectSink sink;
+		drain(ml, sink);
+		ml.flush(sink);
+		rc |= check("Indent and continue pattern", (sink.messages.size() == 2) &&
+		            (sink.messages[0] == "p|Traceback (most recent call last):\n  File \"x.py\", line 1, in <module>\nValueError: bad"));
+	}
+
+	// Line limit and timeout
+	{
+		ListInput in;
+		for (int i = 0; i < 10; i++) {
+			in.add("c", "  more");
+		}
+		MultilineRules rules;
+		rules.indent = true;
+		rules.maxlines = 4;
+		rules.timeout_ms = 50;
+		MultilineInput ml(&in);
+		ml.setRules(rules);
+		CollectSink sink;
+		drain(ml, sink);
+		rc |= check("Cut at the line limit", sink.messages.size() == 2);
+		usleep(60000);
+		while (ml.timeout() == 0 && (sink.messages.size() < 3))
+			ml.read(sink, 4096);
+		rc |= check("Flushed after the timeout", (sink.messages.size() == 3) && (ml.timeout() < 0));
+	}
+
+	// Benchmark: stack traces, against concatenating the messages
+	ListInput in;
+	char line[128];
+	for (int t = 0; t < BENCH_TRACES; t++) {
+		snprintf(line, sizeof(line), "2026-10-19 12:00:00 ERROR request %d failed", t);
+		in.add("app", line);
+		for (int d = 0; d < BENCH_DEPTH; d++) {
+			snprintf(line, sizeof(line), "\tat com.example.Service.method%d(Service.java:%d)", d, d * 10);
+			in.add("app", line);
+		}
+	}
+	MultilineRules rules;
+	rules.start = "^\\d{4}-";
+	MultilineInput ml(&in);
+	ml.setRules(rules);
+	CollectSink sink;
+	sink.keep = false;
+	uint64_t begin = now_ns();
+	drain(ml, sink);
+	ml.flush(sink);
+	uint64_t elapsed = now_ns() - begin;
+	printf("Assembler: %ld records, %.0f lines/s\n", sink.count, in.lines.size() * 1e9 / elapsed);
+	rc |= check("All records", sink.count == BENCH_TRACES);
+
+	// Same decisions, joined by concatenating the messages
+	boost::regex re(rules.start, boost::regex::perl);
+	begin = now_ns();
+	std::string record;
+	long records = 0;
+	for (size_t i = 0; i < in.lines.size(); i++) {
+		const std::string &l = in.lines[i].second;
+		if (boost::regex_search(l, re)) {
+			if (!record.empty())
+				records++;
+			record = l;
+		} else {
+			record = record + "\n" + l;
+		}
+	}
+	elapsed = now_ns() - begin;
+	printf("Concatenation: %ld records, %.0f lines/s\n", records + 1, in.lines.size() * 1e9 / elapsed);
+	return rc;
+}
+
+#endif // DEBUG_MULTILINE_CPP
@@ -0,0 +1,122 @@
+#ifndef __MULTILINE_H
+# define __MULTILINE_H
+
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <stdint.h>
+#include <boost/regex.hpp>
+#include "eventinput.h"
+#include "eventbatch.h"
+
+namespace sawmill {
+
+/**
+ * When lines belong to the record before them.
+ */
+struct MultilineRules
+{
+	std::string start;    // Regex: a matching line starts a record, the others continue it
+	std::string cont;     // Regex: a matching line continues the record
+	bool indent;          // Lines starting with a space or tab continue the record
+	size_t maxlines;      // A record is cut after this many lines...
+	size_t maxbytes;      // ...or this many bytes
+	long timeout_ms;      // A record without new lines for this long is complete
+
+	MultilineRules() :start(), cont(), indent(false), maxlines(500), maxbytes(65536), timeout_ms(1000) {}
+};
+
+/**
+ * Sits between an input and the dispatcher and joins the lines of multiline records, like
+ * stack traces, into one event per record.
+ *
+ * Records are assembled per source. The first line's event is kept for the record, the text of
+ * the next lines is appended to a buffer per source that keeps its memory from record to record,
+ * so at steady state appending a line doesn't allocate. A record is complete when a line that
+ * doesn't continue it comes in from the same source, when it reaches the line or byte limit, or
+ * after the timeout.
+ *
+ * The lines taken from the input are numbered, so an input that asks which of its lines are done
+ * (see EventSink::oldestPending()) only sees a line as done once its record is complete and the
+ * sink is done with the record's event.
+ */
+class MultilineInput : public EventInput, private EventSink
+{
+public:
+	/**
+	 * The input is not owned.
+	 */
+	explicit MultilineInput(EventInput *input);
+	~MultilineInput();
+
+	/**
+	 * Returns false if one of the regexes doesn't compile.
+	 */
+	bool setRules(const MultilineRules &rules);
+
+	/**
+	 * Submit all records that are being assembled.
+	 */
+	void flush(EventSink &sink);
+
+	// EventInput
+	int fd() const { return input->fd(); }
+	long timeout() const;
+	size_t read(EventSink &sink, size_t max);
+private:
+	struct Record {
+		LogEvent *event; // First line, NULL when there is no record
+		std::string text;
+		size_t lines;
+		uint64_t first;  // Number of the first line
+		uint64_t deadline_ms;
+	};
+	struct Pattern {
+		bool set;
+		std::string literal; // The pattern is just this literal, no regex needed
+		boost::regex regex;
+
+		Pattern() :set(false), literal(), regex() {}
+		bool compile(const std::string &pattern);
+		bool match(const std::string &text) const;
+	};
+
+	// EventSink, for the input
+	LogEvent *newEvent();
+	void submit(LogEvent *event);
+	uint64_t submitted() const { return taken; }
+	uint64_t oldestPending() const;
+
+	bool continues(const std::string &line) const;
+	void begin(Record &record, LogEvent *event);
+	void emit(Record &record);
+	void dropAcked() const;
+
+	EventInput *input;
+	MultilineRules rules;
+	Pattern start;
+	Pattern cont;
+	std::unordered_map<std::string, Record> records; // By source
+	size_t pending;       // Records being assembled
+	EventPool pool;       // Events of the lines, before they go to the sink
+	EventSink *target;    // Only set during read() and flush()
+	EventSink *acksink;   // Of the last read() or flush(), asked which records it is done with
+	uint64_t taken;       // Lines taken from the input
+	/**
+	 * Sink event number after an emitted record, and the oldest first line of the records
+	 * emitted up to it that the sink may not be done with. Later records with an older first
+	 * line replace the ones before them, so the front always has the oldest.
+	 */
+	mutable std::deque<std::pair<uint64_t, uint64_t> > unacked;
+	size_t emitted;
+	uint64_t now_ms;
+	uint64_t nextflush_ms;
+
+	// Not copyable
+	MultilineInput(const MultilineInput &);
+	MultilineInput &operator=(const MultilineInput &);
+};
+
+} // namespace sawmill
+
+#endif // ifndef __MULTILINE_H
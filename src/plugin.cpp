@@ -0,0 +1,85 @@
+/****************************************************************************
+ * Project: SawMill
+ * Authors:
+ *          Bart Meuris <bart . meuris @ gmail . com>
+ *
+ * License: (to be discussed LGPL version 2.0?)
+ ****************************************************************************
+ * Module description:
+ *     Registry of the available filter plugins. Builtin plugins are known
+ *     by ID so the engine can run them without a virtual call.
+ *
+ ***************************************************************************/
+
+#include "plugin.h"
+
+namespace sawmill {
+
+PluginRegistry::PluginRegistry()
+	:plugins()
+{
+	static const struct {
+		const char *name;
+		BuiltinPlugin id;
+	} builtins[] = {
+		{ "addtag",      BUILTIN_ADDTAG },
+		{ "removetag",   BUILTIN_REMOVETAG },
+		{ "setfield",    BUILTIN_SETFIELD },
+		{ "removefield", BUILTIN_REMOVEFIELD },
+		{ "settype",     BUILTIN_SETTYPE },
+		{ "drop",        BUILTIN_DROP },
+		{ "convert",     BUILTIN_CONVERT },
+	};
+	for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+		Entry &e = plugins[builtins[i].name];
+		e.builtin = builtins[i].id;
+		e.factory = NULL;
+	}
+}
+
+PluginRegistry &PluginRegistry::instance()
+{
+	// Function local so registration from static initializers in other files is safe
+	static PluginRegistry registry;
+	return registry;
+}
+
+bool PluginRegistry::add(const std::string &name, PluginFactory factory)
+{
+	if (plugins.find(name) != plugins.end())
+		return false;
+	Entry &e = plugins[name];
+	e.builtin = BUILTIN_NONE;
+	e.factory = factory;
+	return true;
+}
+
+bool PluginRegistry::has(const std::string &name) const
+{
+	return plugins.find(name) != plugins.end();
+}
+
+BuiltinPlugin PluginRegistry::builtin(const std::string &name) const
+{
+	std::map<std::string, Entry>::const_iterator it = plugins.find(name);
+	if (it == plugins.end())
+		return BUILTIN_NONE;
+	return it->second.builtin;
+}
+
+FilterPlugin *PluginRegistry::create(const std::string &name) const
+{
+	std::map<std::string, Entry>::const_iterator it = plugins.find(name);
+	if ((it == plugins.end()) || (it->second.factory == NULL))
+		return NULL;
+	return it->second.factory();
+}
+
+void PluginRegistry::getNames(std::vector<std::string> &names) const
+{
+	for (std::map<std::string, Entry>::const_iterator it = plugins.begin(); it != plugins.end(); ++it) {
+		names.push_back(it->first);
+	}
+}
+
+}
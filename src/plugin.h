@@ -0,0 +1,107 @@
+#ifndef __PLUGIN_H
+# define __PLUGIN_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include "command.pb.h"
+#include "logevent.pb.h"
+
+namespace sawmill {
+
+/**
+ * Result of running a filter step on an event
+ */
+enum StepResult {
+	STEP_OK = 0,  // Continue with the next step
+	STEP_STOP,    // Skip the remaining steps of this filter, keep the event
+	STEP_DROP,    // Drop the event
+	STEP_FAILED,  // The plugin failed on this event, the event is kept as it was at that point
+	STEP_CONTINUE // The step runs on another slave, processing has to continue there
+};
+
+/**
+ * Plugins that are compiled in and executed by the engine without virtual calls.
+ */
+enum BuiltinPlugin {
+	BUILTIN_NONE = 0, // Not a builtin, use the FilterPlugin instance
+	BUILTIN_ADDTAG,
+	BUILTIN_REMOVETAG,
+	BUILTIN_SETFIELD,
+	BUILTIN_REMOVEFIELD,
+	BUILTIN_SETTYPE,
+	BUILTIN_DROP,
+	BUILTIN_CONVERT
+};
+
+/**
+ * Base class for external plugins. An instance is created for every filter step that uses the
+ * plugin, so it can parse its parameters once in init() and keep state between events.
+ */
+class FilterPlugin
+{
+public:
+	virtual ~FilterPlugin() {}
+
+	virtual bool init(const FilterStep &step) { (void)step; return true; }
+	virtual StepResult process(LogEvent &event) = 0;
+};
+
+typedef FilterPlugin *(*PluginFactory)();
+
+/**
+ * Static registry of all available plugins, by name.
+ */
+class PluginRegistry
+{
+public:
+	static PluginRegistry &instance();
+
+	bool add(const std::string &name, PluginFactory factory);
+	bool has(const std::string &name) const;
+
+	/**
+	 * Returns the builtin ID of a plugin, BUILTIN_NONE if it is an external plugin or unknown.
+	 */
+	BuiltinPlugin builtin(const std::string &name) const;
+	/**
+	 * Create an instance of an external plugin. Returns NULL for builtins and unknown plugins.
+	 */
+	FilterPlugin *create(const std::string &name) const;
+
+	/**
+	 * List of all plugin names, as sent in the HELLO message.
+	 */
+	void getNames(std::vector<std::string> &names) const;
+private:
+	struct Entry {
+		BuiltinPlugin builtin;
+		PluginFactory factory;
+	};
+	PluginRegistry();
+	std::map<std::string, Entry> plugins;
+};
+
+template<class T> FilterPlugin *createPlugin()
+{
+	return new T();
+}
+
+template<class T> class PluginRegistration
+{
+public:
+	explicit PluginRegistration(const char *name)
+	{
+		PluginRegistry::instance().add(name, &createPlugin<T>);
+	}
+};
+
+} // namespace sawmill
+
+/**
+ * Register an external plugin class under a name, use at file scope in the plugin source file.
+ */
+#define SAWMILL_REGISTER_PLUGIN(name, cls) \
+	static sawmill::PluginRegistration<cls> _sawmill_plugin_##cls(name)
+
+#endif // ifndef __PLUGIN_H
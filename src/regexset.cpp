@@ -0,0 +1,383 @@
+/****************************************************************************
+ * Project: SawMill
+ * Authors:
+ *          Bart Meuris <bart . meuris @ gmail . com>
+ *
+ * License: (to be discussed LGPL version 2.0?)
+ ****************************************************************************
+ * Module description:
+ *     Multi-pattern prefilter for the requireMatch regexes: the required
+ *     literals of all patterns are found in one pass over the message.
+ *
+ ***************************************************************************/
+
+#include "regexset.h"
+#include <cctype>
+#include <cstring>
+
+// Escapes that match a single character or an assertion, without consuming more of the pattern
+#define SIMPLE_ESCAPES "dDwWsSbBAzZGntrfvae"
+
+namespace sawmill {
+
+const uint32_t RegexSet::NONE;
+
+static void flush(std::string &run, std::string &literal)
+{
+	if (run.size() > literal.size())
+		literal = run;
+	run.clear();
+}
+
+/**
+ * Returns the position after the character class starting at 'i', npos if it can't be parsed.
+ */
+static size_t skip_class(const std::string &re, size_t i)
+{
+	size_t n = re.size();
+	i++;
+	if ((i < n) && (re[i] == '^'))
+		i++;
+	if ((i < n) && (re[i] == ']'))
+		i++;
+	while (i < n) {
+		if (re[i] == '\\') {
+			i += 2;
+		} else if (re[i] == '[') {
+			return std::string::npos; // POSIX classes, don't bother
+		} else if (re[i] == ']') {
+			return i + 1;
+		} else {
+			i++;
+		}
+	}
+	return std::string::npos;
+}
+
+/**
+ * Returns the position after the group starting at 'i', npos if it can't be parsed.
+ */
+static size_t skip_group(const std::string &re, size_t i)
+{
+	size_t n = re.size();
+	int depth = 0;
+	while (i < n) {
+		switch (re[i]) {
+		case '\\':
+			i += 2;
+			break;
+		case '[':
+			i = skip_class(re, i);
+			if (i == std::string::npos)
+				return i;
+			break;
+		case '(':
+			depth++;
+			i++;
+			break;
+		case ')':
+			i++;
+			if (--depth == 0)
+				return i;
+			break;
+		default:
+			i++;
+			break;
+		}
+	}
+	return std::string::npos;
+}
+
+/**
+ * Collects the runs of plain characters outside of groups and classes. Returns false for
+ * patterns where that would not give a required literal (alternation, flags, unknown escapes).
+ */
+static bool required_literal(const std::string &re, std::string &literal, bool &exact)
+{
+	std::string run;
+	size_t n = re.size();
+	size_t i = 0;
+	while (i < n) {
+		char c = re[i];
+		switch (c) {
+		case '\\':
+			if (i + 1 >= n)
+				return false;
+			c = re[i + 1];
+			i += 2;
+			if (isalnum((unsigned char)c)) {
+				if (!strchr(SIMPLE_ESCAPES, c))
+					return false;
+				flush(run, literal);
+				exact = false;
+			} else {
+				run += c;
+			}
+			break;
+		case '*':
+		case '?':
+		case '{':
+			// The previous character is optional
+			if (!run.empty())
+				run.erase(run.size() - 1);
+			flush(run, literal);
+			exact = false;
+			if (c == '{') {
+				i = re.find('}', i);
+				if (i == std::string::npos)
+					return false;
+			}
+			i++;
+			break;
+		case '+':
+		case '.':
+		case '^':
+		case '$':
+		case ']':
+		case '}':
+			flush(run, literal);
+			exact = false;
+			i++;
+			break;
+		case '[':
+			flush(run, literal);
+			exact = false;
+			i = skip_class(re, i);
+			if (i == std::string::npos)
+				return false;
+			break;
+		case '(':
+			// Flags like (?i) change how the rest of the pattern matches
+			if ((i + 2 < n) && (re[i + 1] == '?') && !strchr(":=!<>#", re[i + 2]))
+				return false;
+			flush(run, literal);
+			exact = false;
+			i = skip_group(re, i);
+			if (i == std::string::npos)
+				return false;
+			break;
+		case '|':
+		case ')':
+			return false;
+		default:
+			run += c;
+			i++;
+			break;
+		}
+	}
+	flush(run, literal);
+	return true;
+}
+
+void RegexSet::analyze(const std::string &regex, std::string &literal, bool &exact)
+{
+	literal.clear();
+	exact = true;
+	if (!required_literal(regex, literal, exact))
+		literal.clear();
+	if (literal.empty())
+		exact = false;
+}
+
+RegexSet::RegexSet()
+	:ids(), literals(), classes(1), transitions(), outbegin(), outputs()
+{
+	memset(classmap, 0, sizeof(classmap));
+}
+
+void RegexSet::clear()
+{
+	ids.clear();
+	literals.clear();
+	transitions.clear();
+	outbegin.clear();
+	outputs.clear();
+}
+
+uint32_t RegexSet::add(const std::string &literal)
+{
+	if (literal.empty())
+		return NONE;
+	std::map<std::string, uint32_t>::iterator it = ids.find(literal);
+	if (it != ids.end())
+		return it->second;
+	uint32_t id = literals.size();
+	ids[literal] = id;
+	literals.push_back(literal);
+	return id;
+}
+
+void RegexSet::compile()
+{
+	// Every byte that is used in a literal gets its own class, all others share class 0
+	memset(classmap, 0, sizeof(classmap));
+	classes = 1;
+	for (size_t l = 0; l < literals.size(); l++) {
+		for (size_t i = 0; i < literals[l].size(); i++) {
+			unsigned char b = literals[l][i];
+			if (classmap[b] == 0)
+				classmap[b] = classes++;
+		}
+	}
+
+	// Trie of the literals
+	transitions.assign(classes, NONE);
+	std::vector<std::vector<uint32_t> > out(1);
+	for (size_t l = 0; l < literals.size(); l++) {
+		uint32_t state = 0;
+		for (size_t i = 0; i < literals[l].size(); i++) {
+			size_t t = state * classes + classmap[(unsigned char)literals[l][i]];
+			if (transitions[t] == NONE) {
+				transitions[t] = out.size();
+				out.resize(out.size() + 1);
+				transitions.resize(out.size() * classes, NONE);
+			}
+			state = transitions[t];
+		}
+		out[state].push_back(l);
+	}
+
+	// Failure links, breadth first. The missing transitions are filled in with those of the
+	// failure state, which turns the trie into a DFA.
+	std::vector<uint32_t> fail(out.size(), 0);
+	std::vector<uint32_t> queue;
+	for (size_t c = 0; c < classes; c++) {
+		if (transitions[c] == NONE) {
+			transitions[c] = 0;
+		} else {
+			queue.push_back(transitions[c]);
+		}
+	}
+	for (size_t q = 0; q < queue.size(); q++) {
+		uint32_t state = queue[q];
+		const std::vector<uint32_t> &inherited = out[fail[state]];
+		out[state].insert(out[state].end(), inherited.begin(), inherited.end());
+		for (size_t c = 0; c < classes; c++) {
+			uint32_t &next = transitions[state * classes + c];
+			uint32_t onfail = transitions[fail[state] * classes + c];
+			if (next == NONE) {
+				next = onfail;
+			} else {
+				fail[next] = onfail;
+				queue.push_back(next);
+			}
+		}
+	}
+
+	outbegin.resize(out.size() + 1);
+	outputs.clear();
+	for (size_t s = 0; s < out.size(); s++) {
+		outbegin[s] = outputs.size();
+		outputs.insert(outputs.end(), out[s].begin(), out[s].end());
+	}
+	outbegin[out.size()] = outputs.size();
+}
+
+void RegexSet::scan(const std::string &text, std::vector<uint64_t> &found) const
+{
+	found.assign((literals.size() + 63) / 64, 0);
+	if (literals.empty())
+		return;
+	uint32_t state = 0;
+	for (size_t i = 0; i < text.size(); i++) {
+		state = transitions[state * classes + classmap[(unsigned char)text[i]]];
+		for (uint32_t o = outbegin[state]; o < outbegin[state + 1]; o++) {
+			found[outputs[o] >> 6] |= 1ULL << (outputs[o] & 63);
+		}
+	}
+}
+
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Benchmark: one regex_search per pattern against a single scan
+/////////////////////////////////////////////////////////////////////////////
+
+#ifdef DEBUG_REGEXSET_CPP
+
+#include <cstdio>
+#include <time.h>
+#include <boost/regex.hpp>
+
+#define BENCH_EVENTS  100000
+
+using namespace sawmill;
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static const char *patterns[] = {
+	" 404 ", " 500 ", "GET /admin", "POST /login", "Failed password", "Accepted publickey",
+	"session opened for user \\w+", "CRON\\[\\d+\\]", "kernel: \\[ *\\d+\\.\\d+\\] usb",
+	"error|warning", "(?i)timeout", "^\\d+\\.\\d+\\.\\d+\\.\\d+ ", "disk (full|quota)",
+	"segfault at [0-9a-f]+", "User-Agent: .*bot", "connection (reset|refused) by peer",
+	"out of memory", "sshd\\[\\d+\\]: Invalid user", "HTTP/1\\.[01]\" 30[12]", "\\.php\\?id=",
+};
+
+static const char *messages[] = {
+	"127.0.0.1 - - [10/Oct/2013:13:55:36 +0200] \"GET /index.html HTTP/1.1\" 200 2326",
+	"127.0.0.1 - - [10/Oct/2013:13:55:36 +0200] \"GET /missing HTTP/1.1\" 404 0",
+	"Oct 10 13:55:36 host sshd[1234]: Failed password for root from 10.0.0.1 port 22 ssh2",
+	"Oct 10 13:55:36 host CRON[4321]: (root) CMD (run-parts /etc/cron.hourly)",
+	"Oct 10 13:55:36 host kernel: [ 12.345678] usb 1-1: new high-speed USB device",
+	"Oct 10 13:55:36 host app: Connection TIMEOUT while talking to backend",
+};
+
+int main()
+{
+	size_t npatterns = sizeof(patterns) / sizeof(patterns[0]);
+	size_t nmessages = sizeof(messages) / sizeof(messages[0]);
+	std::vector<boost::regex> regexes;
+	std::vector<uint32_t> ids;
+	std::vector<bool> exact;
+	RegexSet set;
+	for (size_t p = 0; p < npatterns; p++) {
+		std::string literal;
+		bool e;
+		RegexSet::analyze(patterns[p], literal, e);
+		regexes.push_back(boost::regex(patterns[p]));
+		ids.push_back(set.add(literal));
+		exact.push_back(e);
+		printf("%-40s literal '%s'%s\n", patterns[p], literal.c_str(), e ? " (exact)" : "");
+	}
+	set.compile();
+
+	std::vector<std::string> msgs(messages, messages + nmessages);
+	std::vector<uint64_t> found;
+	long matched = 0, setmatched = 0;
+	bool ok = true;
+
+	uint64_t t0 = now_ns();
+	for (int e = 0; e < BENCH_EVENTS; e++) {
+		const std::string &msg = msgs[e % nmessages];
+		for (size_t p = 0; p < npatterns; p++) {
+			matched += boost::regex_search(msg, regexes[p]);
+		}
+	}
+	uint64_t t1 = now_ns();
+	for (int e = 0; e < BENCH_EVENTS; e++) {
+		const std::string &msg = msgs[e % nmessages];
+		set.scan(msg, found);
+		for (size_t p = 0; p < npatterns; p++) {
+			bool m;
+			if ((ids[p] != RegexSet::NONE) && !RegexSet::has(found, ids[p]))
+				m = false;
+			else
+				m = exact[p] || boost::regex_search(msg, regexes[p]);
+			setmatched += m;
+			if (e < (int)nmessages)
+				ok &= (m == boost::regex_search(msg, regexes[p]));
+		}
+	}
+	uint64_t t2 = now_ns();
+
+	printf("Results: %s (%ld/%ld matches)\n", ok && (matched == setmatched) ? "OK" : "DIFFERENT", matched, setmatched);
+	printf("%d patterns, regex_search each: %.1f ns/event\n", (int)npatterns, (double)(t1 - t0) / BENCH_EVENTS);
+	printf("%d patterns, set scan + regex:  %.1f ns/event\n", (int)npatterns, (double)(t2 - t1) / BENCH_EVENTS);
+	return 0;
+}
+#endif
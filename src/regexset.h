@@ -0,0 +1,64 @@
+#ifndef __REGEXSET_H
+# define __REGEXSET_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+namespace sawmill {
+
+/**
+ * Set of requireMatch patterns that is scanned over a message in a single pass.
+ *
+ * Every pattern is reduced to the longest literal a match has to contain. Those literals are
+ * compiled into one Aho-Corasick automaton with dense transitions over byte classes, so a scan
+ * is a table lookup per byte, whatever the number of patterns. A pattern that is a plain
+ * literal is fully decided by the scan, for the others it is a prefilter: the regex only has to
+ * run when its literal was found. Patterns without a usable literal are not in the set and are
+ * always matched individually.
+ */
+class RegexSet
+{
+public:
+	static const uint32_t NONE = 0xFFFFFFFF;
+
+	RegexSet();
+
+	/**
+	 * Find the longest literal any match of the (perl syntax) regex contains. 'exact' is set when
+	 * the regex is that literal, 'literal' is left empty if there is none.
+	 */
+	static void analyze(const std::string &regex, std::string &literal, bool &exact);
+
+	void clear();
+	/**
+	 * Add a literal, returns its ID. Adding the same literal again returns the same ID.
+	 */
+	uint32_t add(const std::string &literal);
+	/**
+	 * Build the automaton, call after adding the literals and before scanning.
+	 */
+	void compile();
+	size_t size() const { return literals.size(); }
+
+	/**
+	 * Set bit 'id' in 'found' for every literal that occurs in the text.
+	 */
+	void scan(const std::string &text, std::vector<uint64_t> &found) const;
+	static bool has(const std::vector<uint64_t> &found, uint32_t id) { return (found[id >> 6] >> (id & 63)) & 1; }
+private:
+	std::map<std::string, uint32_t> ids;
+	std::vector<std::string> literals;
+
+	// Automaton
+	uint16_t classmap[256];           // Byte to byte class, 0 for the bytes in none of the literals
+	size_t classes;
+	std::vector<uint32_t> transitions; // Next state per state and byte class
+	std::vector<uint32_t> outbegin;    // Per state, range in outputs of the literals ending there
+	std::vector<uint32_t> outputs;
+};
+
+} // namespace sawmill
+
+#endif // ifndef __REGEXSET_H
@@ -8,16 +8,24 @@
  ***************************************************************************/
 #include <string>
 #include <iostream>
+#include <cstdlib>
+#include <algorithm>
 #include <signal.h>
 #include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
 #include <boost/program_options.hpp>
 
 #include "command.pb.h"
 #include "logevent.pb.h"
 
 #include "config.h"
+#include "filterslave.h"
+#include "lookuptable.h"
 #include "sawmill.h"
+#include "timeparser.h"
 #include "version.h"
+#include "sawlog.h"
 
 namespace po = boost::program_options;
 
@@ -25,13 +33,146 @@ using namespace sawmill;
 
 
 SawMill::SawMill()
-	: initialized(false), configset()
+	: initialized(false), configset(), filterdispatcher(SM_DEFAULT_ENDPOINT), filetail(), tailmultiline(&filetail),
+	  usemultiline(false), sysloginput(), queuedir(), statsinterval(0), fileoutput(), outputpath(),
+	  archivewriter(), archivepath(), replayinput(), replaypath(), replayfrom(0), replayto(0), replaytype()
 {
 }
 
+void SawMill::setReplay(const std::string &path, int64_t from, int64_t to, const std::string &type)
+{
+	replaypath = path;
+	replayfrom = from;
+	replayto = to;
+	replaytype = type;
+}
+
+bool SawMill::setTailMultiline(const MultilineRules &rules)
+{
+	usemultiline = true;
+	return tailmultiline.setRules(rules);
+}
+
+static volatile sig_atomic_t stop_requested = 0;
+static volatile sig_atomic_t reload_requested = 0;
+
+void SawMill::stop()
+{
+	stop_requested = 1;
+}
+
+void SawMill::reload()
+{
+	reload_requested = 1;
+}
+
+static void signal_handler(int sig)
+{
+	if (sig == SIGHUP) {
+		SawMill::reload();
+	} else {
+		SawMill::stop();
+	}
+}
+
 void SawMill::run(void)
 {
 	this->config().check();
+
+	signal(SIGINT, signal_handler);
+	signal(SIGTERM, signal_handler);
+	signal(SIGHUP, signal_handler);
+
+	if (!outputpath.empty()) {
+		if (!fileoutput.open(outputpath))
+			return;
+		this->dispatcher().setOutput(&fileoutput);
+	}
+	if (!archivepath.empty()) {
+		if (!archivewriter.open(archivepath))
+			return;
+		this->dispatcher().setOutput(&archivewriter);
+	}
+	if (!this->dispatcher().start(this->config().getFilters())) {
+		fileoutput.close();
+		archivewriter.close();
+		return;
+	}
+	EventInput *tailinput = usemultiline ? static_cast<EventInput *>(&tailmultiline) : &this->tail();
+	QueuedInput tailqueue(tailinput);
+	QueuedInput syslogqueue(&this->syslog());
+	if (!queuedir.empty())
+		mkdir(queuedir.c_str(), 0755);
+	if (this->tail().fileCount()) {
+		if (!this->tail().start()) {
+			this->dispatcher().stop();
+			return;
+		}
+		if (queuedir.empty()) {
+			this->dispatcher().addInput(tailinput);
+		} else if (tailqueue.open(queuedir + "/tail")) {
+			this->dispatcher().addInput(&tailqueue);
+		} else {
+			this->dispatcher().stop();
+			return;
+		}
+	}
+	if (this->syslog().isConfigured()) {
+		if (!this->syslog().start()) {
+			this->dispatcher().stop();
+			return;
+		}
+		if (queuedir.empty()) {
+			this->dispatcher().addInput(&this->syslog());
+		} else if (syslogqueue.open(queuedir + "/syslog")) {
+			this->dispatcher().addInput(&syslogqueue);
+		} else {
+			this->syslog().stop();
+			this->dispatcher().stop();
+			return;
+		}
+	}
+	if (!replaypath.empty()) {
+		if (!replayinput.open(replaypath, replayfrom, replayto, replaytype)) {
+			this->syslog().stop();
+			this->dispatcher().stop();
+			return;
+		}
+		this->dispatcher().addInput(&replayinput);
+	}
+	time_t nextstats = time(NULL) + statsinterval;
+	while (!stop_requested) {
+		if ((statsinterval > 0) && (time(NULL) >= nextstats)) {
+			DispatcherStats stats;
+			this->dispatcher().getStats(stats);
+			NOTICE("Queued %lu/%lu events, %lu in flight in %lu batches for %lu credits, %lu slaves ready, "
+			       "%llu submitted, inputs paused %llu times, %llu bytes on disk",
+			       (unsigned long)stats.queued, (unsigned long)stats.queuelimit, (unsigned long)stats.inflight,
+			       (unsigned long)stats.batches, (unsigned long)stats.credits, (unsigned long)stats.readyslaves,
+			       (unsigned long long)stats.submitted, (unsigned long long)stats.paused,
+			       (unsigned long long)(tailqueue.queue().backlog() + syslogqueue.queue().backlog()));
+			nextstats = time(NULL) + statsinterval;
+		}
+		if (reload_requested) {
+			reload_requested = 0;
+			unsigned int version = this->config().getVersion();
+			this->config().reload();
+			if (version != this->config().getVersion()) {
+				this->dispatcher().configChanged();
+			}
+		}
+		this->dispatcher().poll(100);
+	}
+	this->syslog().stop();
+	if (usemultiline)
+		tailmultiline.flush(tailqueue.queue().isOpen() ? tailqueue.spool() : this->dispatcher());
+	this->dispatcher().stop();
+	fileoutput.close();
+	archivewriter.close();
+	// Queued events that were not done with are submitted again after the restart
+	tailqueue.close();
+	syslogqueue.close();
+	this->tail().saveState();
 }
 
 bool SawMill::ready()
@@ -48,6 +189,16 @@ void SawMill::showVersion(std::ostream &out)
 }
 
 
+/**
+ * Time given on the command line, in nanoseconds since the epoch.
+ */
+static bool parseTime(const std::string &text, int64_t &ns)
+{
+	TimestampParser parser;
+	TimestampParser::Format format = TimestampParser::detect(text);
+	return (format != TimestampParser::FORMAT_UNKNOWN) && parser.parse(format, text, ns);
+}
+
 int main(int argc, char* argv[])
 {
 	SawMill mill;
@@ -59,6 +210,42 @@ int main(int argc, char* argv[])
 		("version,v", "Show the version")
 		("foreground,f", "Run in foreground")
 		("config,c", po::value< std::vector<std::string> >(), "Specify a config file to use")
+		("slaves,s", po::value<int>(), "Number of filter slaves to start (default: number of CPU's)")
+		("endpoint,e", po::value<std::string>(), "0MQ endpoint for the filter slaves (default: " SM_DEFAULT_ENDPOINT ")")
+		("batch,b", po::value<int>()->default_value(512), "Maximum number of events per batch sent to a slave")
+		("latency,l", po::value<int>()->default_value(5), "Maximum time in ms events wait to fill up a batch")
+		("tail,t", po::value< std::vector<std::string> >(), "Log file to follow, can be given multiple times")
+		("state", po::value<std::string>()->default_value(SM_DEFAULT_STATEFILE), "File to keep the read positions of the followed files in")
+		("multiline-start", po::value<std::string>(), "Regex for the first line of a multiline record in the followed files")
+		("multiline-continue", po::value<std::string>(), "Regex for the next lines of a multiline record in the followed files")
+		("multiline-indent", "Indented lines in the followed files continue the record before them")
+		("multiline-max-lines", po::value<int>()->default_value(500), "Maximum number of lines in a multiline record")
+		("multiline-max-bytes", po::value<int>()->default_value(65536), "Maximum size in bytes of a multiline record")
+		("multiline-timeout", po::value<int>()->default_value(1000), "Time in ms after which a multiline record without new lines is complete")
+		("syslog", po::value<std::string>(), "Receive syslog over UDP and TCP on [address:]port")
+		("syslog-threads", po::value<int>()->default_value(2), "Number of syslog receiver threads")
+		("queue", po::value<std::string>(), "Directory to queue the events of the inputs in on disk, until the filters are done with them")
+		("queue-limit", po::value<int>()->default_value(65536), "Events queued in memory before the inputs are paused (or only spool to disk)")
+		("slave-credits", po::value<int>()->default_value(SLAVE_DEFAULT_CREDITS), "Batches a filter slave gets at once")
+		("stats", po::value<int>()->default_value(0), "Log the queue depths every this many seconds")
+		("output,o", po::value<std::string>(), "File to write the filtered events to")
+		("output-format", po::value<std::string>()->default_value("json"), "Format of the output file: json (lines) or protobuf (length delimited)")
+		("output-codec", po::value<std::string>()->default_value("none"), "Compression of the output file: none, gzip, lz4 or zstd")
+		("output-level", po::value<int>()->default_value(0), "Compression level, 0 for the default of the codec")
+		("output-rotate-size", po::value<int>()->default_value(0), "Rotate the output file after this many MB, 0 for never")
+		("output-rotate-age", po::value<int>()->default_value(0), "Rotate the output file after this many seconds, 0 for never")
+		("output-sync", po::value<std::string>()->default_value("interval"), "When to sync the output file: none, interval or always")
+		("output-sync-interval", po::value<int>()->default_value(1000), "Time in ms between syncs of the output file")
+		("archive", po::value<std::string>(), "Time indexed archive to write the filtered events to, instead of --output")
+		("archive-codec", po::value<std::string>()->default_value("zlib"), "Compression of the archive blocks: none, zlib, lz4 or zstd")
+		("archive-block-span", po::value<int>()->default_value(ARCHIVE_BLOCK_SPAN), "Seconds of events in one archive block at most")
+		("replay", po::value<std::string>(), "Archive to replay events from")
+		("replay-from", po::value<std::string>(), "Replay the events from this time on (ISO 8601 or epoch)")
+		("replay-to", po::value<std::string>(), "Replay the events before this time (ISO 8601 or epoch)")
+		("replay-type", po::value<std::string>(), "Replay only the events of this type")
+		("lookup-build", po::value<std::string>(), "Build a lookup table from this CSV file and exit")
+		("lookup-kind", po::value<std::string>()->default_value("exact"), "Kind of lookup table to build: exact (keys) or range (IP addresses and ranges)")
+		("lookup-output", po::value<std::string>(), "Lookup table file to build")
 	;
 	po::variables_map vm;
 
@@ -80,6 +267,25 @@ int main(int argc, char* argv[])
 		std::cout << desc << std::endl;
 		return 0;
 	}
+
+	if (vm.count("lookup-build")) {
+		const std::string &kindname = vm["lookup-kind"].as<std::string>();
+		if ((kindname != "exact") && (kindname != "range")) {
+			std::cerr << "Invalid lookup table kind: " << kindname << std::endl;
+			return 1;
+		}
+		if (!vm.count("lookup-output")) {
+			std::cerr << "--lookup-build needs --lookup-output" << std::endl;
+			return 1;
+		}
+		std::string error;
+		if (!LookupTableBuilder::fromCsv(vm["lookup-build"].as<std::string>(), (kindname == "exact") ? LOOKUP_EXACT : LOOKUP_RANGE,
+		                                 vm["lookup-output"].as<std::string>(), error)) {
+			std::cerr << "Lookup table not built: " << error << std::endl;
+			return 1;
+		}
+		return 0;
+	}
 	
 	// Use boost::asio:::signal_set to handle signals/ctrl-c/...
 	
@@ -88,6 +294,103 @@ int main(int argc, char* argv[])
 	if (vm.count("config") > 0) {
 		mill.config().addConfigSource( vm["config"].as< std::vector< std::string> >() );
 	}
+	if (vm.count("slaves")) {
+		mill.dispatcher().setSlaveCount(vm["slaves"].as<int>());
+	}
+	if (vm.count("endpoint")) {
+		mill.dispatcher().setEndpoint(vm["endpoint"].as<std::string>());
+	}
+	if (vm.count("tail")) {
+		const std::vector<std::string> &paths = vm["tail"].as< std::vector<std::string> >();
+		for (size_t i = 0; i < paths.size(); i++) {
+			mill.tail().addFile(paths[i]);
+		}
+		mill.tail().setStateFile(vm["state"].as<std::string>());
+	}
+	if (vm.count("multiline-start") || vm.count("multiline-continue") || vm.count("multiline-indent")) {
+		MultilineRules rules;
+		if (vm.count("multiline-start"))
+			rules.start = vm["multiline-start"].as<std::string>();
+		if (vm.count("multiline-continue"))
+			rules.cont = vm["multiline-continue"].as<std::string>();
+		rules.indent = vm.count("multiline-indent") > 0;
+		rules.maxlines = vm["multiline-max-lines"].as<int>();
+		rules.maxbytes = vm["multiline-max-bytes"].as<int>();
+		rules.timeout_ms = vm["multiline-timeout"].as<int>();
+		if (!mill.setTailMultiline(rules))
+			return 1;
+	}
+	if (vm.count("syslog")) {
+		const std::string &listen = vm["syslog"].as<std::string>();
+		size_t colon = listen.rfind(':');
+		std::string address = (colon == std::string::npos) ? "" : listen.substr(0, colon);
+		int port = atoi(listen.c_str() + ((colon == std::string::npos) ? 0 : colon + 1));
+		if (port <= 0) {
+			std::cerr << "Invalid syslog port: " << listen << std::endl;
+			return 1;
+		}
+		mill.syslog().setAddress(address, port);
+		mill.syslog().setThreads(vm["syslog-threads"].as<int>());
+	}
+	if (vm.count("queue")) {
+		mill.setQueueDir(vm["queue"].as<std::string>());
+	}
+	mill.dispatcher().setQueueLimit(std::max(1, vm["queue-limit"].as<int>()));
+	mill.dispatcher().setSlaveCredits(vm["slave-credits"].as<int>());
+	mill.setStatsInterval(vm["stats"].as<int>());
+	if (vm.count("output")) {
+		FileOutput &out = mill.fileOutput();
+		const std::string &format = vm["output-format"].as<std::string>();
+		if ((format != "json") && (format != "protobuf")) {
+			std::cerr << "Invalid output format: " << format << std::endl;
+			return 1;
+		}
+		out.setFormat((format == "json") ? FileOutput::JSON : FileOutput::PROTOBUF);
+		FileOutput::Codec codec;
+		const std::string &codecname = vm["output-codec"].as<std::string>();
+		if (!FileOutput::parseCodec(codecname, codec) || !out.setCodec(codec, vm["output-level"].as<int>())) {
+			std::cerr << "Invalid or unavailable output codec: " << codecname << std::endl;
+			return 1;
+		}
+		out.setRotation((uint64_t)std::max(0, vm["output-rotate-size"].as<int>()) * 1024 * 1024, vm["output-rotate-age"].as<int>());
+		const std::string &sync = vm["output-sync"].as<std::string>();
+		if (sync == "none") {
+			out.setSync(FileOutput::SYNC_NONE);
+		} else if (sync == "always") {
+			out.setSync(FileOutput::SYNC_ALWAYS);
+		} else if (sync == "interval") {
+			out.setSync(FileOutput::SYNC_INTERVAL, vm["output-sync-interval"].as<int>());
+		} else {
+			std::cerr << "Invalid output sync policy: " << sync << std::endl;
+			return 1;
+		}
+		mill.setOutputFile(vm["output"].as<std::string>());
+	}
+	if (vm.count("archive")) {
+		if (vm.count("output")) {
+			std::cerr << "Only one of --output and --archive can be given" << std::endl;
+			return 1;
+		}
+		ArchiveCodec codec;
+		const std::string &codecname = vm["archive-codec"].as<std::string>();
+		if (!ArchiveWriter::parseCodec(codecname, codec) || !mill.archive().setCodec(codec)) {
+			std::cerr << "Invalid or unavailable archive codec: " << codecname << std::endl;
+			return 1;
+		}
+		mill.archive().setBlockSpan(std::max(1, vm["archive-block-span"].as<int>()));
+		mill.setArchiveFile(vm["archive"].as<std::string>());
+	}
+	if (vm.count("replay")) {
+		int64_t from = INT64_MIN, to = INT64_MAX;
+		if ((vm.count("replay-from") && !parseTime(vm["replay-from"].as<std::string>(), from)) ||
+		    (vm.count("replay-to") && !parseTime(vm["replay-to"].as<std::string>(), to))) {
+			std::cerr << "Invalid replay time, use ISO 8601 or seconds since the epoch" << std::endl;
+			return 1;
+		}
+		mill.setReplay(vm["replay"].as<std::string>(), from, to,
+		               vm.count("replay-type") ? vm["replay-type"].as<std::string>() : std::string());
+	}
+	mill.dispatcher().batching().setLimits(16, vm["batch"].as<int>(), vm["latency"].as<int>() * 1000L);
 	// Check configuration and state
 	if ( !mill.ready()) {
 		mill.showVersion(std::cout);
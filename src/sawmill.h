@@ -3,7 +3,14 @@
 
 #include <string>
 #include <vector>
+#include "archive.h"
 #include "configmanager.h"
+#include "diskqueue.h"
+#include "dispatcher.h"
+#include "fileoutput.h"
+#include "filetail.h"
+#include "multiline.h"
+#include "sysloginput.h"
 
 namespace sawmill {
 
@@ -14,12 +21,61 @@ public:
 
 	void showVersion(std::ostream &out);
 	ConfigManager &config() { return configset; }
+	Dispatcher &dispatcher() { return filterdispatcher; }
+	FileTail &tail() { return filetail; }
+	FileOutput &fileOutput() { return fileoutput; }
+	SyslogInput &syslog() { return sysloginput; }
+	/**
+	 * Join the lines of multiline records in the followed files.
+	 */
+	bool setTailMultiline(const MultilineRules &rules);
+	/**
+	 * Queue the events of the inputs on disk, in subdirectories of 'dir'. Empty to not queue them.
+	 */
+	void setQueueDir(const std::string &dir) { queuedir = dir; }
+	/**
+	 * Log the queue depths every 'seconds', 0 to not log them.
+	 */
+	void setStatsInterval(int seconds) { statsinterval = seconds; }
+	/**
+	 * Write the filtered events to 'path', set up with fileOutput().
+	 */
+	void setOutputFile(const std::string &path) { outputpath = path; }
+	/**
+	 * Write the filtered events to the time indexed archive 'path' instead, set up with archive().
+	 */
+	ArchiveWriter &archive() { return archivewriter; }
+	void setArchiveFile(const std::string &path) { archivepath = path; }
+	/**
+	 * Replay the events of 'type' (empty for all) between 'from' and 'to' (timestamp_ns) from the
+	 * archive 'path'.
+	 */
+	void setReplay(const std::string &path, int64_t from, int64_t to, const std::string &type);
 
 	void run();
 	bool ready();
+
+	static void stop();
+	static void reload();
 private:
 	bool initialized;
 	ConfigManager configset;
+	Dispatcher filterdispatcher;
+	FileTail filetail;
+	MultilineInput tailmultiline;
+	bool usemultiline;
+	SyslogInput sysloginput;
+	std::string queuedir;
+	int statsinterval;
+	FileOutput fileoutput;
+	std::string outputpath;
+	ArchiveWriter archivewriter;
+	std::string archivepath;
+	ArchiveInput replayinput;
+	std::string replaypath;
+	int64_t replayfrom;
+	int64_t replayto;
+	std::string replaytype;
 };
 
 } // namespace sawmill
@@ -0,0 +1,416 @@
+/****************************************************************************
+ * Project: SawMill
+ * Authors:
+ *          Bart Meuris <bart . meuris @ gmail . com>
+ *
+ * License: (to be discussed LGPL version 2.0?)
+ ****************************************************************************
+ * Module description:
+ *     Shared memory rings between the dispatcher and its local slaves.
+ *
+ ***************************************************************************/
+
+#include "shmring.h"
+#include "sawlog.h"
+#include <new>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+
+namespace sawmill {
+
+struct ShmRing::Header
+{
+	std::atomic<uint64_t> head; // Bytes ever written, only the producer changes it
+	char pad1[64 - sizeof(std::atomic<uint64_t>)];
+	std::atomic<uint64_t> tail; // Bytes ever read, only the consumer changes it
+	char pad2[64 - sizeof(std::atomic<uint64_t>)];
+	std::atomic<uint32_t> waiting; // The consumer is waiting on the eventfd
+	std::atomic<uint32_t> broken;  // Set by either side, never cleared
+
+	Header() :head(0), tail(0), waiting(0), broken(0) {}
+};
+
+// Every record is its length followed by the message, padded to keep the lengths aligned
+static inline size_t record_size(size_t len)
+{
+	return (sizeof(uint32_t) + len + 7) & ~(size_t)7;
+}
+
+ShmRing::ShmRing()
+	:header(NULL), data(NULL), size(0), wakefd(-1)
+{
+}
+
+ShmRing::~ShmRing()
+{
+	if (header)
+		munmap(header, sysconf(_SC_PAGESIZE));
+	if (data)
+		munmap(data, size * 2);
+	if (wakefd >= 0)
+		close(wakefd);
+}
+
+ShmRing *ShmRing::create(size_t capacity)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	ShmRing *ring = new ShmRing();
+	ring->size = page;
+	while (ring->size < capacity) {
+		ring->size *= 2;
+	}
+
+	int fd = memfd_create("sawmill-ring", MFD_CLOEXEC);
+	if (fd < 0) {
+		ERR("Could not create shared memory for a ring: %s", strerror(errno));
+		delete ring;
+		return NULL;
+	}
+	bool ok = (ftruncate(fd, page + ring->size) == 0);
+	if (ok) {
+		void *hdr = mmap(NULL, page, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		ok = (hdr != MAP_FAILED);
+		if (ok)
+			ring->header = new (hdr) Header();
+	}
+	if (ok) {
+		// Reserve twice the size, then map the data there twice
+		void *base = mmap(NULL, ring->size * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		ok = (base != MAP_FAILED);
+		if (ok) {
+			ring->data = static_cast<char *>(base);
+			ok = (mmap(ring->data, ring->size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, page) != MAP_FAILED) &&
+			     (mmap(ring->data + ring->size, ring->size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, page) != MAP_FAILED);
+		}
+	}
+	if (ok) {
+		ring->wakefd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		ok = (ring->wakefd >= 0);
+	}
+	if (!ok) {
+		ERR("Could not map a ring of %d bytes: %s", (int)ring->size, strerror(errno));
+		delete ring;
+		ring = NULL;
+	}
+	// The mappings keep the memory
+	close(fd);
+	return ring;
+}
+
+char *ShmRing::reserve(size_t len, WriteResult &result)
+{
+	if (broken()) {
+		result = WRITE_BROKEN;
+		return NULL;
+	}
+	size_t rec = record_size(len);
+	if ((rec > size) || (len > UINT32_MAX)) {
+		result = WRITE_TOO_BIG;
+		return NULL;
+	}
+	uint64_t head = header->head.load(std::memory_order_relaxed);
+	uint64_t tail = header->tail.load(std::memory_order_acquire);
+	if (head - tail + rec > size) {
+		result = WRITE_FULL;
+		return NULL;
+	}
+	result = WRITE_OK;
+	return data + (head & (size - 1));
+}
+
+void ShmRing::commit(char *record, size_t len)
+{
+	uint32_t len32 = len;
+	memcpy(record, &len32, sizeof(len32));
+	uint64_t head = header->head.load(std::memory_order_relaxed);
+	header->head.store(head + record_size(len), std::memory_order_release);
+
+	// Pairs with the fence in prepareWait(): either we see the consumer waiting, or it sees
+	// the new head
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (header->waiting.load(std::memory_order_relaxed)) {
+		uint64_t one = 1;
+		if (::write(wakefd, &one, sizeof(one)) < 0) {
+			// Counter overflow can't happen with a single waiter, nothing to do
+		}
+	}
+}
+
+ShmRing::WriteResult ShmRing::write(const google::protobuf::Message &msg)
+{
+	size_t len = msg.ByteSizeLong();
+	WriteResult result;
+	char *record = reserve(len, result);
+	if (!record)
+		return result;
+	msg.SerializeWithCachedSizesToArray(reinterpret_cast<google::protobuf::uint8 *>(record + sizeof(uint32_t)));
+	commit(record, len);
+	return WRITE_OK;
+}
+
+ShmRing::WriteResult ShmRing::write(const char *buf, size_t len)
+{
+	WriteResult result;
+	char *record = reserve(len, result);
+	if (!record)
+		return result;
+	memcpy(record + sizeof(uint32_t), buf, len);
+	commit(record, len);
+	return WRITE_OK;
+}
+
+bool ShmRing::drained() const
+{
+	return header->tail.load(std::memory_order_acquire) == header->head.load(std::memory_order_relaxed);
+}
+
+bool ShmRing::empty() const
+{
+	return broken() || (header->tail.load(std::memory_order_relaxed) == header->head.load(std::memory_order_acquire));
+}
+
+bool ShmRing::broken() const
+{
+	return header->broken.load(std::memory_order_relaxed) != 0;
+}
+
+void ShmRing::markBroken()
+{
+	header->broken.store(1, std::memory_order_relaxed);
+}
+
+bool ShmRing::read(google::protobuf::Message &msg)
+{
+	if (broken())
+		return false;
+	uint64_t tail = header->tail.load(std::memory_order_relaxed);
+	uint64_t head = header->head.load(std::memory_order_acquire);
+	if (tail == head)
+		return false;
+	// The other side writes the lengths, don't read beyond what it wrote
+	uint64_t avail = head - tail;
+	const char *record = data + (tail & (size - 1));
+	uint32_t len = 0;
+	if ((avail <= size) && (avail >= sizeof(uint32_t)))
+		memcpy(&len, record, sizeof(len));
+	if ((avail > size) || (avail < sizeof(uint32_t)) || (len > size - sizeof(uint32_t)) || (record_size(len) > avail)) {
+		ERR("Ring corrupted: record of %u bytes with %llu bytes written, giving it up", len, (unsigned long long)avail);
+		markBroken();
+		return false;
+	}
+	bool ok = msg.ParseFromArray(record + sizeof(uint32_t), len);
+	header->tail.store(tail + record_size(len), std::memory_order_release);
+	return ok;
+}
+
+bool ShmRing::prepareWait()
+{
+	header->waiting.store(1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (!empty()) {
+		header->waiting.store(0, std::memory_order_relaxed);
+		return false;
+	}
+	return true;
+}
+
+void ShmRing::finishWait()
+{
+	header->waiting.store(0, std::memory_order_relaxed);
+	uint64_t count;
+	if (::read(wakefd, &count, sizeof(count)) < 0) {
+		// EAGAIN: woken up by something else
+	}
+}
+
+ShmChannel *ShmChannel::create(size_t capacity)
+{
+	ShmChannel *channel = new ShmChannel();
+	channel->down = ShmRing::create(capacity);
+	channel->up = ShmRing::create(capacity);
+	if (!channel->down || !channel->up) {
+		delete channel;
+		return NULL;
+	}
+	return channel;
+}
+
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Benchmark: shared memory rings against 0MQ ipc://, to a forked echo process
+/////////////////////////////////////////////////////////////////////////////
+
+#ifdef DEBUG_SHMRING_CPP
+
+#include <cstdio>
+#include <cstdlib>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <zmq.hpp>
+#include "command.pb.h"
+#include "zmqutil.h"
+
+#define BENCH_RINGSIZE   (4 * 1024 * 1024)
+#define BENCH_ROUNDS     20000
+#define BENCH_WINDOW     8
+
+using namespace sawmill;
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void ring_wait(ShmRing *ring)
+{
+	if (!ring->prepareWait())
+		return;
+	struct pollfd item = { ring->fd(), POLLIN, 0 };
+	::poll(&item, 1, -1);
+	ring->finishWait();
+}
+
+static void make_batch(FilterMessage &batch, int events)
+{
+	batch.Clear();
+	batch.set_command(FilterMessage::PROCESS);
+	for (int i = 0; i < events; i++) {
+		LogEvent *event = batch.add_events();
+		event->set_type("syslog");
+		event->set_source("/var/log/messages");
+		event->set_message("Oct 19 12:00:00 host sshd[1234]: Accepted publickey for user from 10.0.0.1 port 22");
+		Field *field = event->add_field();
+		field->set_key("program");
+		field->set_value("sshd");
+	}
+}
+
+static void ring_echo(ShmChannel *channel)
+{
+	FilterMessage msg;
+	for (;;) {
+		if (!channel->down->read(msg)) {
+			ring_wait(channel->down);
+			continue;
+		}
+		if (msg.command() == FilterMessage::BYE)
+			_exit(0);
+		while (channel->up->write(msg) == ShmRing::WRITE_FULL) {
+			usleep(10);
+		}
+	}
+}
+
+/**
+ * Sends 'rounds' batches with at most 'window' unanswered, returns the nanoseconds it took.
+ */
+static uint64_t ring_run(ShmChannel *channel, const FilterMessage &batch, int rounds, int window)
+{
+	FilterMessage reply;
+	int sent = 0, received = 0;
+	uint64_t start = now_ns();
+	while (received < rounds) {
+		while ((sent < rounds) && (sent - received < window) && (channel->down->write(batch) == ShmRing::WRITE_OK)) {
+			sent++;
+		}
+		if (channel->up->read(reply)) {
+			received++;
+		} else {
+			ring_wait(channel->up);
+		}
+	}
+	return now_ns() - start;
+}
+
+static void zmq_echo(const std::string &endpoint)
+{
+	zmq::context_t context(1);
+	zmq::socket_t socket(context, ZMQ_PAIR);
+	socket.connect(endpoint.c_str());
+	FilterMessage msg;
+	for (;;) {
+		if (!zmq_recv_message(socket, msg))
+			continue;
+		if (msg.command() == FilterMessage::BYE)
+			_exit(0);
+		zmq_send_message(socket, msg);
+	}
+}
+
+static uint64_t zmq_run(zmq::socket_t &socket, const FilterMessage &batch, int rounds, int window)
+{
+	FilterMessage reply;
+	int sent = 0, received = 0;
+	uint64_t start = now_ns();
+	while (received < rounds) {
+		while ((sent < rounds) && (sent - received < window)) {
+			zmq_send_message(socket, batch);
+			sent++;
+		}
+		if (zmq_recv_message(socket, reply))
+			received++;
+	}
+	return now_ns() - start;
+}
+
+static void report(const char *transport, int events, int window, uint64_t ns)
+{
+	if (window == 1) {
+		printf("%-4s %4d events/batch: %8.2f us round trip\n", transport, events, ns / 1000.0 / BENCH_ROUNDS);
+	} else {
+		printf("%-4s %4d events/batch: %8.0f events/s with %d batches in flight\n", transport, events,
+			(double)events * BENCH_ROUNDS * 1e9 / ns, window);
+	}
+}
+
+int main()
+{
+	const int sizes[] = { 1, 64, 512 };
+	FilterMessage batch, bye;
+	bye.set_command(FilterMessage::BYE);
+
+	ShmChannel *channel = ShmChannel::create(BENCH_RINGSIZE);
+	if (!channel) {
+		fprintf(stderr, "Could not create the rings\n");
+		return 1;
+	}
+	pid_t pid = fork();
+	if (pid == 0)
+		ring_echo(channel);
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		make_batch(batch, sizes[i]);
+		report("shm", sizes[i], 1, ring_run(channel, batch, BENCH_ROUNDS, 1));
+		report("shm", sizes[i], BENCH_WINDOW, ring_run(channel, batch, BENCH_ROUNDS, BENCH_WINDOW));
+	}
+	channel->down->write(bye);
+	waitpid(pid, NULL, 0);
+	delete channel;
+
+	char endpoint[64];
+	snprintf(endpoint, sizeof(endpoint), "ipc:///tmp/sawmill-bench-%d", (int)getpid());
+	zmq::context_t context(1);
+	zmq::socket_t socket(context, ZMQ_PAIR);
+	socket.bind(endpoint);
+	pid = fork();
+	if (pid == 0)
+		zmq_echo(endpoint);
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		make_batch(batch, sizes[i]);
+		report("zmq", sizes[i], 1, zmq_run(socket, batch, BENCH_ROUNDS, 1));
+		report("zmq", sizes[i], BENCH_WINDOW, zmq_run(socket, batch, BENCH_ROUNDS, BENCH_WINDOW));
+	}
+	zmq_send_message(socket, bye);
+	waitpid(pid, NULL, 0);
+	unlink(endpoint + 6);
+	return 0;
+}
+
+#endif // DEBUG_SHMRING_CPP
@@ -0,0 +1,120 @@
+#ifndef __SHMRING_H
+# define __SHMRING_H
+
+#include <string>
+#include <atomic>
+#include <stdint.h>
+#include <google/protobuf/message.h>
+
+namespace sawmill {
+
+/**
+ * Single producer, single consumer ring of serialized messages in shared memory, for the
+ * dispatcher and the slaves on the same host.
+ *
+ * The ring lives in a memfd that is mapped twice in a row, so every message is contiguous and
+ * is serialized straight into the ring and parsed straight out of it. The mapping is shared
+ * with forked children, create the rings before forking. The consumer is woken up through an
+ * eventfd, which can be polled together with 0MQ sockets. The producer only writes to it when
+ * the consumer said it is going to sleep, so a busy ring costs no system calls.
+ */
+class ShmRing
+{
+public:
+	enum WriteResult {
+		WRITE_OK = 0,
+		WRITE_FULL,   // No room right now, try again once the consumer caught up
+		WRITE_TOO_BIG, // The message will never fit
+		WRITE_BROKEN   // The ring is broken, use another way
+	};
+
+	/**
+	 * Create a ring with room for 'capacity' bytes, rounded up to whole pages. Returns NULL if
+	 * the shared memory could not be set up.
+	 */
+	static ShmRing *create(size_t capacity);
+	~ShmRing();
+
+	size_t capacity() const { return size; }
+
+	// Producer side
+	WriteResult write(const google::protobuf::Message &msg);
+	WriteResult write(const char *data, size_t len);
+	/**
+	 * The consumer read everything that was written.
+	 */
+	bool drained() const;
+
+	// Consumer side
+	/**
+	 * Parse the oldest message into 'msg' and remove it. Returns false if the ring is empty or
+	 * the message could not be parsed (it is removed all the same then, check empty()). A record
+	 * that doesn't fit in what was written breaks the ring: it returns false and broken() is set.
+	 */
+	bool read(google::protobuf::Message &msg);
+	/**
+	 * Also true once the ring is broken.
+	 */
+	bool empty() const;
+
+	/**
+	 * The ring is not used anymore by either side, everything still in it is lost.
+	 */
+	bool broken() const;
+	void markBroken();
+	/**
+	 * The eventfd to wait on, readable after a write while the consumer is waiting.
+	 */
+	int fd() const { return wakefd; }
+	/**
+	 * Call before waiting on fd(). Returns false if there are messages already, don't wait then.
+	 */
+	bool prepareWait();
+	/**
+	 * Call after waiting on fd(), whether it became readable or not.
+	 */
+	void finishWait();
+private:
+	struct Header;
+
+	ShmRing();
+	char *reserve(size_t len, WriteResult &result);
+	void commit(char *record, size_t len);
+
+	Header *header;
+	char *data;  // Mapped twice: data[i] and data[i + size] are the same byte
+	size_t size; // Power of two
+	int wakefd;
+
+	// Not copyable
+	ShmRing(const ShmRing &);
+	ShmRing &operator=(const ShmRing &);
+};
+
+/**
+ * Both directions between the dispatcher and one local slave.
+ */
+struct ShmChannel
+{
+	ShmRing *down; // Dispatcher to slave
+	ShmRing *up;   // Slave to dispatcher
+
+	ShmChannel() :down(NULL), up(NULL) {}
+	~ShmChannel() { delete down; delete up; }
+
+	static ShmChannel *create(size_t capacity);
+
+	/**
+	 * When one ring breaks both are given up, the messages go over 0MQ from then on.
+	 */
+	bool broken() const { return down->broken() || up->broken(); }
+	void markBroken() { down->markBroken(); up->markBroken(); }
+private:
+	// Not copyable
+	ShmChannel(const ShmChannel &);
+	ShmChannel &operator=(const ShmChannel &);
+};
+
+} // namespace sawmill
+
+#endif // ifndef __SHMRING_H
@@ -0,0 +1,733 @@
+/****************************************************************************
+ * Project: SawMill
+ * Authors:
+ *          Bart Meuris <bart . meuris @ gmail . com>
+ *
+ * License: (to be discussed LGPL version 2.0?)
+ ****************************************************************************
+ * Module description:
+ *     Key/value and CSV splitter plugins.
+ *
+ ***************************************************************************/
+
+#include "splitter.h"
+#include "fieldvalue.h"
+#include "interner.h"
+#include "sawlog.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+
+namespace sawmill {
+
+FieldSplitter::FieldSplitter()
+	:splitmode(KEYVALUE), quote(0), simd(true), classes(), needles(), needlecount(0)
+{
+	setKeyValue(" ", "=", '"');
+}
+
+bool FieldSplitter::hasSimd()
+{
+#ifdef __SSE2__
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool FieldSplitter::addNeedle(char c, uint8_t cls)
+{
+	if (classes[(unsigned char)c])
+		return false;
+	classes[(unsigned char)c] = cls;
+	needles[needlecount++] = c;
+	return true;
+}
+
+bool FieldSplitter::setKeyValue(const std::string &separators, const std::string &assign, char q)
+{
+	if (separators.empty() || assign.empty() || (separators.size() > SPLIT_MAX_CHARS) || (assign.size() > SPLIT_MAX_CHARS))
+		return false;
+	memset(classes, 0, sizeof(classes));
+	needlecount = 0;
+	splitmode = KEYVALUE;
+	quote = q;
+	bool ok = true;
+	for (size_t i = 0; i < separators.size(); i++)
+		ok = addNeedle(separators[i], CLASS_SEPARATOR) && ok;
+	for (size_t i = 0; i < assign.size(); i++)
+		ok = addNeedle(assign[i], CLASS_ASSIGN) && ok;
+	if (quote)
+		ok = addNeedle(quote, CLASS_QUOTE) && addNeedle('\\', CLASS_ESCAPE) && ok;
+	return ok;
+}
+
+bool FieldSplitter::setCsv(char separator, char q)
+{
+	memset(classes, 0, sizeof(classes));
+	needlecount = 0;
+	splitmode = CSV;
+	quote = q;
+	bool ok = addNeedle(separator, CLASS_SEPARATOR);
+	if (quote)
+		ok = addNeedle(quote, CLASS_QUOTE) && ok;
+	return ok;
+}
+
+void FieldSplitter::reset(State &st, size_t start)
+{
+	st.start = start;
+	st.keyend = NONE;
+	st.valstart = NONE;
+	st.inquote = false;
+	st.quotestart = st.quoteend = NONE;
+	st.keyquotestart = st.keyquoteend = NONE;
+	st.escaped = false;
+}
+
+inline void FieldSplitter::step(State &st, const char *text, size_t len, size_t i, std::vector<Pair> &pairs) const
+{
+	if (i < st.skip)
+		return;
+	uint8_t cls = classes[(unsigned char)text[i]];
+	if (st.inquote) {
+		if (cls == CLASS_ESCAPE) {
+			st.escaped = true;
+			st.skip = i + 2;
+		} else if (cls == CLASS_QUOTE) {
+			if ((splitmode == CSV) && (i + 1 < len) && (text[i + 1] == quote)) {
+				st.escaped = true;
+				st.skip = i + 2;
+			} else {
+				st.inquote = false;
+				st.quoteend = i;
+			}
+		}
+		return;
+	}
+	switch (cls) {
+	case CLASS_QUOTE:
+		// Only opens at the start of a key, value or column
+		if (i == ((st.keyend == NONE) ? st.start : st.valstart)) {
+			st.inquote = true;
+			st.quotestart = i;
+		}
+		break;
+	case CLASS_SEPARATOR:
+		endToken(st, text, i, pairs);
+		reset(st, i + 1);
+		break;
+	case CLASS_ASSIGN:
+		if (st.keyend == NONE) {
+			st.keyend = i;
+			st.valstart = i + 1;
+			st.keyquotestart = st.quotestart;
+			st.keyquoteend = st.quoteend;
+			st.quotestart = st.quoteend = NONE;
+			st.escaped = false;
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+inline void FieldSplitter::endToken(State &st, const char *text, size_t end, std::vector<Pair> &pairs) const
+{
+	Pair p;
+	if (splitmode == KEYVALUE) {
+		if (st.keyend == NONE)
+			return;
+		p.key = text + st.start;
+		p.keylen = st.keyend - st.start;
+		if (st.keyquoteend != NONE) {
+			p.key = text + st.keyquotestart + 1;
+			p.keylen = st.keyquoteend - st.keyquotestart - 1;
+		}
+		if (!p.keylen)
+			return;
+	} else {
+		p.key = NULL;
+		p.keylen = 0;
+		st.valstart = st.start;
+	}
+	if ((st.quoteend != NONE) && !st.inquote) {
+		p.value = text + st.quotestart + 1;
+		p.valuelen = st.quoteend - st.quotestart - 1;
+		p.escaped = st.escaped;
+	} else {
+		// Not quoted, or the quote never closed: as it is
+		p.value = text + st.valstart;
+		p.valuelen = end - st.valstart;
+		p.escaped = false;
+	}
+	pairs.push_back(p);
+}
+
+size_t FieldSplitter::split(const char *text, size_t len, std::vector<Pair> &pairs, size_t max) const
+{
+	size_t before = pairs.size();
+	State st;
+	reset(st, 0);
+	st.skip = 0;
+	size_t i = 0;
+#ifdef __SSE2__
+	if (simd) {
+		// 32 bytes at a time into one bit mask of the characters that matter
+		__m128i n[sizeof(needles)];
+		for (size_t k = 0; k < needlecount; k++)
+			n[k] = _mm_set1_epi8(needles[k]);
+		for (; i + 32 <= len; i += 32) {
+			__m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i *>(text + i));
+			__m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i *>(text + i + 16));
+			__m128i mlo = _mm_cmpeq_epi8(lo, n[0]);
+			__m128i mhi = _mm_cmpeq_epi8(hi, n[0]);
+			for (size_t k = 1; k < needlecount; k++) {
+				mlo = _mm_or_si128(mlo, _mm_cmpeq_epi8(lo, n[k]));
+				mhi = _mm_or_si128(mhi, _mm_cmpeq_epi8(hi, n[k]));
+			}
+			uint32_t mask = (uint32_t)_mm_movemask_epi8(mlo) | ((uint32_t)_mm_movemask_epi8(mhi) << 16);
+			while (mask) {
+				step(st, text, len, i + __builtin_ctz(mask), pairs);
+				mask &= mask - 1;
+			}
+			if (max && (pairs.size() - before >= max)) {
+				pairs.resize(before + max);
+				return max;
+			}
+		}
+	}
+#endif
+	for (; i < len; i++) {
+		if (classes[(unsigned char)text[i]])
+			step(st, text, len, i, pairs);
+	}
+	endToken(st, text, len, pairs);
+	if (max && (pairs.size() - before > max))
+		pairs.resize(before + max);
+	return pairs.size() - before;
+}
+
+void FieldSplitter::unescape(std::string &value) const
+{
+	size_t o = 0;
+	for (size_t i = 0; i < value.size(); i++, o++) {
+		if (splitmode == KEYVALUE) {
+			if ((value[i] == '\\') && (i + 1 < value.size()))
+				i++;
+		} else if ((value[i] == quote) && (i + 1 < value.size()) && (value[i + 1] == quote)) {
+			i++;
+		}
+		value[o] = value[i];
+	}
+	value.resize(o);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+SplitPlugin::SplitPlugin(FieldSplitter::Mode mode)
+	:pluginname((mode == FieldSplitter::KEYVALUE) ? "kv" : "csv"), fieldsplitter(), field(), maxfields(0), include(),
+	 exclude(), cache(), columns(), columnnames(), columnkeep(), pairs()
+{
+	memset(cache, 0, sizeof(cache));
+	if (mode == FieldSplitter::CSV)
+		fieldsplitter.setCsv(',', '"');
+}
+
+void SplitPlugin::addKeys(const std::string &list, std::vector<uint32_t> &ids)
+{
+	size_t pos = 0;
+	while (pos <= list.size()) {
+		size_t comma = list.find(',', pos);
+		if (comma == std::string::npos)
+			comma = list.size();
+		size_t b = list.find_first_not_of(' ', pos), e = list.find_last_not_of(' ', comma - 1);
+		if ((b < comma) && (e != std::string::npos) && (e >= b))
+			ids.push_back(StringInterner::keys().intern(list.data() + b, e - b + 1));
+		pos = comma + 1;
+	}
+}
+
+bool SplitPlugin::init(const FilterStep &step)
+{
+	bool kv = (fieldsplitter.mode() == FieldSplitter::KEYVALUE);
+	std::string fieldsplit = " ", valuesplit = "=", quote = "\"", separator = ",";
+	for (int i = 0; i < step.parameter_size(); i++) {
+		const Field &p = step.parameter(i);
+		if (p.key() == "field") {
+			field = p.value();
+		} else if (p.key() == "include_keys") {
+			addKeys(p.value(), include);
+		} else if (p.key() == "exclude_keys") {
+			addKeys(p.value(), exclude);
+		} else if (p.key() == "max_fields") {
+			int max = atoi(p.value().c_str());
+			if (max < 0) {
+				ERR("%s: invalid max_fields '%s'", pluginname, p.value().c_str());
+				return false;
+			}
+			maxfields = max;
+		} else if (p.key() == "quote") {
+			quote = p.value();
+		} else if (kv && (p.key() == "field_split")) {
+			fieldsplit = p.value();
+		} else if (kv && (p.key() == "value_split")) {
+			valuesplit = p.value();
+		} else if (!kv && (p.key() == "separator")) {
+			separator = p.value();
+		} else if (!kv && (p.key() == "columns")) {
+			std::vector<uint32_t> ids;
+			addKeys(p.value(), ids);
+			for (size_t c = 0; c < ids.size(); c++)
+				columns.push_back(StringInterner::keys().name(ids[c]));
+		} else {
+			WARN("%s: unknown parameter '%s' ignored", pluginname, p.key().c_str());
+		}
+	}
+	if (quote.size() > 1) {
+		ERR("%s: the quote has to be one character, not '%s'", pluginname, quote.c_str());
+		return false;
+	}
+	char q = quote.empty() ? 0 : quote[0];
+	if (kv && !fieldsplitter.setKeyValue(fieldsplit, valuesplit, q)) {
+		ERR("%s: field_split '%s' and value_split '%s' need 1 to %d characters that are not the quote or used twice",
+		    pluginname, fieldsplit.c_str(), valuesplit.c_str(), SPLIT_MAX_CHARS);
+		return false;
+	}
+	if (!kv && ((separator.size() != 1) || !fieldsplitter.setCsv(separator[0], q))) {
+		ERR("%s: separator '%s' has to be one character that is not the quote", pluginname, separator.c_str());
+		return false;
+	}
+	std::sort(include.begin(), include.end());
+	std::sort(exclude.begin(), exclude.end());
+
+	// The named columns are known now
+	StringInterner &keys = StringInterner::keys();
+	for (size_t c = 0; (c < columns.size()) && (c < SPLIT_MAX_COLUMNS); c++) {
+		uint32_t id = keys.intern(columns[c]);
+		columnnames.push_back(&keys.name(id));
+		columnkeep.push_back(keepKey(id));
+	}
+	return true;
+}
+
+bool SplitPlugin::keepKey(uint32_t id) const
+{
+	if (!include.empty())
+		return std::binary_search(include.begin(), include.end(), id);
+	return !std::binary_search(exclude.begin(), exclude.end(), id);
+}
+
+bool SplitPlugin::keyName(const char *key, size_t len, const std::string *&name)
+{
+	CacheEntry &e = cache[StringInterner::hash(key, len) & (SPLIT_CACHE_SIZE - 1)];
+	if (e.name && (e.name->size() == len) && (memcmp(e.name->data(), key, len) == 0)) {
+		name = e.name;
+		return e.keep;
+	}
+	StringInterner &keys = StringInterner::keys();
+	uint32_t id = keys.find(key, len);
+	if (id == StringInterner::NONE) {
+		// The listed keys are interned, so an unknown key is not on them. Keys of the messages are
+		// not interned: they are set as they are, so a flood of unique keys can't grow the dictionary
+		name = NULL;
+		return include.empty();
+	}
+	e.name = &keys.name(id);
+	e.keep = keepKey(id);
+	name = e.name;
+	return e.keep;
+}
+
+const std::string *SplitPlugin::columnName(size_t column, bool &keep)
+{
+	if (column >= SPLIT_MAX_COLUMNS) {
+		keep = false;
+		return NULL;
+	}
+	while (columnnames.size() <= column) {
+		char name[32];
+		snprintf(name, sizeof(name), "column%lu", (unsigned long)columnnames.size() + 1);
+		uint32_t id = StringInterner::keys().intern(name, strlen(name));
+		columnnames.push_back(&StringInterner::keys().name(id));
+		columnkeep.push_back(keepKey(id));
+	}
+	keep = columnkeep[column];
+	return columnnames[column];
+}
+
+void SplitPlugin::setField(LogEvent &event, int existing, const std::string *name, const FieldSplitter::Pair &pair)
+{
+	const char *key = name ? name->data() : pair.key;
+	size_t keylen = name ? name->size() : pair.keylen;
+	Field *f = NULL;
+	for (int i = 0; (i < existing) && !f; i++) {
+		const std::string &k = event.field(i).key();
+		if ((k.size() == keylen) && (memcmp(k.data(), key, keylen) == 0))
+			f = event.mutable_field(i);
+	}
+	if (!f) {
+		// Cleared fields of a recycled event are reused, with the room their strings had
+		f = event.add_field();
+		f->mutable_key()->assign(key, keylen);
+	}
+	// assign() keeps the room the string had, set_value() would go through a temporary
+	f->mutable_value()->assign(pair.value, pair.valuelen);
+	if (pair.escaped)
+		fieldsplitter.unescape(*f->mutable_value());
+	FieldValue::clearType(*f);
+}
+
+StepResult SplitPlugin::process(LogEvent &event)
+{
+	const std::string *text = NULL;
+	if (field.empty()) {
+		text = &event.message();
+	} else {
+		for (int i = 0; (i < event.field_size()) && !text; i++) {
+			if (event.field(i).key() == field)
+				text = &event.field(i).value();
+		}
+	}
+	if (!text)
+		return STEP_FAILED;
+
+	pairs.clear();
+	bool filtered = !include.empty() || !exclude.empty();
+	fieldsplitter.split(text->data(), text->size(), pairs, filtered ? 0 : maxfields);
+	int existing = event.field_size();
+	size_t set = 0;
+	const FieldSplitter::Pair *self = NULL; // The last pair for the split field itself
+	const std::string *selfname = NULL;
+	for (size_t i = 0; (i < pairs.size()) && (!maxfields || (set < maxfields)); i++) {
+		const FieldSplitter::Pair &p = pairs[i];
+		const std::string *name;
+		bool keep;
+		if (p.key)
+			keep = keyName(p.key, p.keylen, name);
+		else
+			name = columnName(i, keep);
+		if (!keep)
+			continue;
+		// The pairs point into the split text: a pair that replaces it goes last
+		if (!field.empty() && (name ? (*name == field) : ((p.keylen == field.size()) && !memcmp(p.key, field.data(), p.keylen)))) {
+			self = &p;
+			selfname = name;
+			continue;
+		}
+		setField(event, existing, name, p);
+		set++;
+	}
+	if (self && (!maxfields || (set < maxfields))) {
+		setField(event, existing, selfname, *self);
+		set++;
+	}
+	return set ? STEP_OK : STEP_FAILED;
+}
+
+SAWMILL_REGISTER_PLUGIN("kv", KeyValuePlugin);
+SAWMILL_REGISTER_PLUGIN("csv", CsvPlugin);
+
+} // namespace sawmill
+
+/////////////////////////////////////////////////////////////////////////////
+// Tests and benchmark
+/////////////////////////////////////////////////////////////////////////////
+
+#ifdef DEBUG_SPLITTER_CPP
+
+#include <cstdio>
+#include <new>
+#include <time.h>
+#include "testcheck.h"
+
+#define BENCH_EVENTS 1000000
+
+// Count the allocations, to check that the plugin doesn't allocate once it is warmed up
+static size_t allocations = 0;
+
+void *operator new(size_t n)
+{
+	allocations++;
+	void *p = malloc(n ? n : 1);
+	if (!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void operator delete(void *p) noexcept
+{
+	free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+	free(p);
+}
+
+using namespace sawmill;
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static FilterStep splitStep(const char *plugin, const char *const *params)
+{
+	FilterStep step;
+	step.set_plugin(plugin);
+	step.set_stepnumber(1);
+	for (size_t i = 0; params && params[i]; i += 2) {
+		Field *p = step.add_parameter();
+		p->set_key(params[i]);
+		p->set_value(params[i + 1]);
+	}
+	return step;
+}
+
+/**
+ * The fields of the event as "key=value|key=value".
+ */
+static std::string fields(const LogEvent &event)
+{
+	std::string s;
+	for (int i = 0; i < event.field_size(); i++) {
+		if (i)
+			s += "|";
+		s += event.field(i).key() + "=" + event.field(i).value();
+	}
+	return s;
+}
+
+static std::string run(const char *plugin, const char *const *params, const std::string &message, StepResult *res = NULL)
+{
+	KeyValuePlugin kv;
+	CsvPlugin csv;
+	SplitPlugin *p = (strcmp(plugin, "kv") == 0) ? static_cast<SplitPlugin *>(&kv) : &csv;
+	std::string out;
+	if (p->init(splitStep(plugin, params))) {
+		LogEvent event;
+		event.set_message(message);
+		StepResult r = p->process(event);
+		if (res)
+			*res = r;
+		out = fields(event);
+	} else {
+		out = "<init failed>";
+	}
+	return out;
+}
+
+static int test(const char *plugin, const char *const *params, const std::string &message, const std::string &expected)
+{
+	std::string got = run(plugin, params, message);
+	if (got != expected)
+		printf("  '%s': got '%s', expected '%s'\n", message.c_str(), got.c_str(), expected.c_str());
+	return check(std::string(plugin) + ": " + message.substr(0, 50), got == expected);
+}
+
+static void makeLine(std::string &line, unsigned i)
+{
+	char buf[512];
+	snprintf(buf, sizeof(buf), "ts=2026-10-19T12:%02u:%02uZ level=info host=web-%02u method=GET path=/api/v1/items/%u status=%u "
+	         "bytes=%u duration=%u.%03u user=\"john doe\" agent=\"curl/7.68 (x86_64)\" req_id=%08x",
+	         (i / 60) % 60, i % 60, i % 32, i, (i % 13) ? 200 : 500, 100 + i % 90000, i % 3, i % 1000, i * 2654435761u);
+	line = buf;
+}
+
+/**
+ * The usual way: find() the separators and substr() the keys and values.
+ */
+static void naiveSplit(LogEvent &event)
+{
+	const std::string &msg = event.message();
+	size_t pos = 0;
+	while (pos < msg.size()) {
+		size_t eq = msg.find('=', pos);
+		if (eq == std::string::npos)
+			break;
+		std::string key = msg.substr(pos, eq - pos);
+		std::string value;
+		size_t end;
+		if ((eq + 1 < msg.size()) && (msg[eq + 1] == '"')) {
+			end = msg.find('"', eq + 2);
+			if (end == std::string::npos)
+				end = msg.size();
+			value = msg.substr(eq + 2, end - eq - 2);
+			end++;
+		} else {
+			end = msg.find(' ', eq + 1);
+			if (end == std::string::npos)
+				end = msg.size();
+			value = msg.substr(eq + 1, end - eq - 1);
+		}
+		Field *f = event.add_field();
+		f->set_key(key);
+		f->set_value(value);
+		pos = end + 1;
+	}
+}
+
+int main()
+{
+	int rc = 0;
+
+	// Key/value
+	rc |= test("kv", NULL, "a=1 b=\"two words\" c=3", "a=1|b=two words|c=3");
+	rc |= test("kv", NULL, "msg=\"say \\\"hi\\\"\" x=1", "msg=say \"hi\"|x=1");
+	rc |= test("kv", NULL, "foo a=1  b= c=x=y", "a=1|b=|c=x=y");
+	rc |= test("kv", NULL, "\"quoted key\"=v z=\"unterminated", "quoted key=v|z=\"unterminated");
+	static const char *const commas[] = { "field_split", ", ", "value_split", ":=", NULL };
+	rc |= test("kv", commas, "a=1, b:2,c=3", "a=1|b=2|c=3");
+	static const char *const inc[] = { "include_keys", "a, c", NULL };
+	rc |= test("kv", inc, "a=1 b=2 c=3 d=4", "a=1|c=3");
+	static const char *const exc[] = { "exclude_keys", "b", "max_fields", "2", NULL };
+	rc |= test("kv", exc, "a=1 b=2 c=3 d=4", "a=1|c=3");
+	static const char *const max[] = { "max_fields", "2", NULL };
+	rc |= test("kv", max, "a=1 b=2 c=3 d=4", "a=1|b=2");
+	static const char *const noquote[] = { "quote", "", NULL };
+	rc |= test("kv", noquote, "a=\"x y\"", "a=\"x");
+	static const char *const bad[] = { "field_split", "=", NULL };
+	rc |= test("kv", bad, "a=1", "<init failed>");
+	StepResult res = STEP_OK;
+	run("kv", NULL, "no pairs here", &res);
+	rc |= check("kv: fails without pairs", res == STEP_FAILED);
+
+	// Keys of the messages are not interned
+	{
+		size_t interned = StringInterner::keys().size();
+		std::string got = run("kv", NULL, "unseen_key_1=a unseen_key_2=b");
+		rc |= check("kv: unknown keys not interned", (got == "unseen_key_1=a|unseen_key_2=b") &&
+		            (StringInterner::keys().size() == interned));
+	}
+
+	// CSV
+	static const char *const cols[] = { "columns", "x,y,z", NULL };
+	rc |= test("csv", cols, "a,\"b,c\",\"d \"\"e\"\"\",extra", "x=a|y=b,c|z=d \"e\"|column4=extra");
+	rc |= test("csv", cols, "a,,", "x=a|y=|z=");
+	static const char *const colinc[] = { "columns", "x,y,z", "include_keys", "z", NULL };
+	rc |= test("csv", colinc, "1,2,3", "z=3");
+	static const char *const tabs[] = { "separator", "\t", NULL };
+	rc |= test("csv", tabs, "a\tb", "column1=a|column2=b");
+
+	// Existing fields are overwritten, the split field itself last
+	{
+		static const char *const params[] = { "field", "kv", NULL };
+		KeyValuePlugin p;
+		p.init(splitStep("kv", params));
+		LogEvent event;
+		Field *f = event.add_field();
+		f->set_key("kv");
+		f->set_value("a=1 kv=inner b=2");
+		f = event.add_field();
+		f->set_key("a");
+		f->set_value("old");
+		f->set_type(Field::INT);
+		f->set_int_value(5);
+		rc |= check("kv: into existing fields", (p.process(event) == STEP_OK) &&
+		            (fields(event) == "kv=inner|a=1|b=2") && !event.field(1).has_type());
+	}
+
+	// SIMD and scalar give the same pairs, on random text with all the special characters
+	{
+		static const char alphabet[] = "ab =\"\\,x";
+		FieldSplitter simd, scalar;
+		scalar.setSimd(false);
+		FieldSplitter csvsimd, csvscalar;
+		csvsimd.setCsv(',', '"');
+		csvscalar.setCsv(',', '"');
+		csvscalar.setSimd(false);
+		std::vector<FieldSplitter::Pair> a, b;
+		bool same = true;
+		srand(42);
+		for (int n = 0; (n < 20000) && same; n++) {
+			std::string text(rand() % 200, ' ');
+			for (size_t i = 0; i < text.size(); i++)
+				text[i] = alphabet[rand() % (sizeof(alphabet) - 1)];
+			for (int m = 0; m < 2; m++) {
+				a.clear();
+				b.clear();
+				(m ? csvsimd : simd).split(text.data(), text.size(), a);
+				(m ? csvscalar : scalar).split(text.data(), text.size(), b);
+				same = same && (a.size() == b.size());
+				for (size_t i = 0; same && (i < a.size()); i++) {
+					same = (a[i].key == b[i].key) && (a[i].keylen == b[i].keylen) && (a[i].value == b[i].value) &&
+					       (a[i].valuelen == b[i].valuelen) && (a[i].escaped == b[i].escaped);
+				}
+			}
+		}
+		rc |= check(std::string("SIMD and scalar agree") + (FieldSplitter::hasSimd() ? "" : " (no SIMD)"), same);
+	}
+
+	// Benchmark
+	std::vector<std::string> lines(BENCH_EVENTS);
+	size_t bytes = 0;
+	for (unsigned i = 0; i < BENCH_EVENTS; i++) {
+		makeLine(lines[i], i);
+		bytes += lines[i].size();
+	}
+	LogEvent event;
+	uint64_t t0 = now_ns();
+	for (int i = 0; i < BENCH_EVENTS; i++) {
+		event.Clear();
+		event.set_message(lines[i]);
+		naiveSplit(event);
+	}
+	uint64_t t1 = now_ns();
+	std::string naive = fields(event);
+
+	double ns[2];
+	size_t allocs[2];
+	std::string result[2];
+	for (int simd = 0; simd < 2; simd++) {
+		KeyValuePlugin plugin;
+		plugin.init(splitStep("kv", NULL));
+		plugin.splitter().setSimd(simd);
+		// Warm up: the event gets its fields
+		for (int i = 0; i < 1000; i++) {
+			event.Clear();
+			event.set_message(lines[i]);
+			plugin.process(event);
+		}
+		size_t before = allocations;
+		uint64_t start = now_ns();
+		for (int i = 0; i < BENCH_EVENTS; i++) {
+			event.Clear();
+			event.set_message(lines[i]);
+			plugin.process(event);
+		}
+		ns[simd] = now_ns() - start;
+		allocs[simd] = allocations - before;
+		result[simd] = fields(event);
+	}
+	rc |= check("Same fields as the naive splitter", (result[0] == naive) && (result[1] == naive));
+	rc |= check("No allocations once warmed up", !allocs[0] && !allocs[1]);
+
+	// The scan alone
+	std::vector<FieldSplitter::Pair> pairs;
+	double scan[2];
+	for (int simd = 0; simd < 2; simd++) {
+		FieldSplitter splitter;
+		splitter.setSimd(simd);
+		uint64_t start = now_ns();
+		for (int i = 0; i < BENCH_EVENTS; i++) {
+			pairs.clear();
+			splitter.split(lines[i].data(), lines[i].size(), pairs);
+		}
+		scan[simd] = now_ns() - start;
+	}
+	printf("%d lines of %lu bytes with 11 pairs:\n", BENCH_EVENTS, (unsigned long)(bytes / BENCH_EVENTS));
+	printf("  naive:          %9.0f events/s\n", BENCH_EVENTS / ((t1 - t0) / 1e9));
+	printf("  plugin, scalar: %9.0f events/s, scan %6.0f MB/s\n", BENCH_EVENTS / (ns[0] / 1e9), bytes / (scan[0] / 1e3));
+	printf("  plugin, SSE2:   %9.0f events/s, scan %6.0f MB/s\n", BENCH_EVENTS / (ns[1] / 1e9), bytes / (scan[1] / 1e3));
+
+	printf("%s\n", rc ? "FAILED" : "All tests passed");
+	return rc;
+}
+
+#endif // DEBUG_SPLITTER_CPP
@@ -0,0 +1,163 @@
+#ifndef __SPLITTER_H
+# define __SPLITTER_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "plugin.h"
+
+#define SPLIT_MAX_CHARS   4    // Separator characters of one kind
+#define SPLIT_CACHE_SIZE  256  // Keys remembered per plugin, a power of two
+#define SPLIT_MAX_COLUMNS 256  // CSV columns that get a name
+
+namespace sawmill {
+
+/**
+ * Splits key=value records or CSV lines into fields, without copying.
+ *
+ * The separators, quotes and escapes are found 32 bytes at a time with SSE2 into a bit mask, and
+ * a small state machine only runs on the bits that are set. The results point into the text.
+ *
+ * Key/value: pairs are separated by any of the separators, the key from the value by the first of
+ * the assign characters. A key or value that starts with the quote character runs to the next
+ * unescaped quote (backslash escapes), and the quotes are stripped. Tokens without an assign
+ * character are skipped.
+ *
+ * CSV: columns are separated by the separator. A column that starts with the quote character
+ * runs to the closing quote, quotes in it are doubled.
+ */
+class FieldSplitter
+{
+public:
+	enum Mode { KEYVALUE, CSV };
+
+	struct Pair {
+		const char *key;   // NULL for CSV columns
+		size_t keylen;
+		const char *value;
+		size_t valuelen;
+		bool escaped;      // The value has escapes to remove with unescape()
+	};
+
+	FieldSplitter();
+
+	bool setKeyValue(const std::string &separators, const std::string &assign, char quote);
+	bool setCsv(char separator, char quote);
+	/**
+	 * Use the SSE2 scan when it is compiled in (the default), or the scalar one.
+	 */
+	void setSimd(bool on) { simd = on; }
+	static bool hasSimd();
+	Mode mode() const { return splitmode; }
+
+	/**
+	 * Append the pairs of the text to 'pairs', at most 'max' (0 for all). Returns the number added.
+	 */
+	size_t split(const char *text, size_t len, std::vector<Pair> &pairs, size_t max = 0) const;
+	/**
+	 * Remove the escapes from a value that had Pair::escaped set.
+	 */
+	void unescape(std::string &value) const;
+private:
+	enum {
+		CLASS_SEPARATOR = 1,
+		CLASS_ASSIGN    = 2,
+		CLASS_QUOTE     = 4,
+		CLASS_ESCAPE    = 8
+	};
+	struct State {
+		size_t start;     // Of the current key or column
+		size_t keyend;    // Of the key, NONE while still in it
+		size_t valstart;
+		bool inquote;
+		size_t quotestart; // The quoted part of the token, NONE if it isn't quoted
+		size_t quoteend;
+		size_t keyquotestart; // The quoted part of the key, once the value started
+		size_t keyquoteend;
+		bool escaped;
+		size_t skip;       // Escaped characters before this are not looked at
+	};
+	static const size_t NONE = (size_t)-1;
+
+	bool addNeedle(char c, uint8_t cls);
+	void step(State &st, const char *text, size_t len, size_t i, std::vector<Pair> &pairs) const;
+	void endToken(State &st, const char *text, size_t end, std::vector<Pair> &pairs) const;
+	static void reset(State &st, size_t start);
+
+	Mode splitmode;
+	char quote;
+	bool simd;
+	uint8_t classes[256];
+	char needles[SPLIT_MAX_CHARS * 2 + 2];
+	size_t needlecount;
+};
+
+/**
+ * Plugins "kv" and "csv": split the message (or a field) into fields.
+ *
+ * Parameters (all optional):
+ *   field:        split the value of this field instead of the message
+ *   include_keys: comma separated keys (CSV: column names) to keep, the others are skipped
+ *   exclude_keys: comma separated keys to skip
+ *   max_fields:   set at most this many fields
+ * kv:
+ *   field_split:  characters between the pairs (default " ")
+ *   value_split:  characters between key and value (default "=")
+ *   quote:        quote character (default '"'), empty for none
+ * csv:
+ *   columns:      comma separated column names, the other columns are named "column<n>"
+ *   separator:    default ","
+ *   quote:        default '"'
+ *
+ * Keys are looked up, not interned: a key that is known already is matched against the include
+ * and exclude lists and set from its interned name with a lookup in a small cache, other keys are
+ * set as they are. Existing fields with the same key are overwritten. Fails when no field was set.
+ */
+class SplitPlugin : public FilterPlugin
+{
+public:
+	explicit SplitPlugin(FieldSplitter::Mode mode);
+	bool init(const FilterStep &step);
+	StepResult process(LogEvent &event);
+
+	FieldSplitter &splitter() { return fieldsplitter; }
+private:
+	struct CacheEntry {
+		const std::string *name;
+		bool keep;
+	};
+
+	bool keepKey(uint32_t id) const;
+	bool keyName(const char *key, size_t len, const std::string *&name);
+	const std::string *columnName(size_t column, bool &keep);
+	void setField(LogEvent &event, int existing, const std::string *name, const FieldSplitter::Pair &pair);
+	static void addKeys(const std::string &list, std::vector<uint32_t> &ids);
+
+	const char *pluginname;
+	FieldSplitter fieldsplitter;
+	std::string field;
+	size_t maxfields;
+	std::vector<uint32_t> include; // Sorted key ID's
+	std::vector<uint32_t> exclude;
+	CacheEntry cache[SPLIT_CACHE_SIZE];
+	std::vector<std::string> columns;             // Configured CSV column names
+	std::vector<const std::string *> columnnames; // Interned names of the columns, NULL if not known yet
+	std::vector<uint8_t> columnkeep;
+	std::vector<FieldSplitter::Pair> pairs;
+};
+
+class KeyValuePlugin : public SplitPlugin
+{
+public:
+	KeyValuePlugin() :SplitPlugin(FieldSplitter::KEYVALUE) {}
+};
+
+class CsvPlugin : public SplitPlugin
+{
+public:
+	CsvPlugin() :SplitPlugin(FieldSplitter::CSV) {}
+};
+
+} // namespace sawmill
+
+#endif // ifndef __SPLITTER_H
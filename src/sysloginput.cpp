@@ -0,0 +1,829 @@
+/****************************************************************************
+ * Project: SawMill
+ * Authors:
+ *          Bart Meuris <bart . meuris @ gmail . com>
+ *
+ * License: (to be discussed LGPL version 2.0?)
+ ****************************************************************************
+ * Module description:
+ *     Syslog input: UDP and TCP receiver threads sharing a port.
+ *
+ ***************************************************************************/
+
+#include "sysloginput.h"
+#include "fieldvalue.h"
+#include "sawlog.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#define SYSLOG_BATCH       256             // Events per batch handed to the dispatcher
+#define SYSLOG_MAX_BATCHES 64              // Receivers wait when this many batches are queued
+#define SYSLOG_VLEN        64              // Datagrams per recvmmsg()
+#define SYSLOG_MAX_DGRAM   8192            // Longer datagrams are cut
+#define SYSLOG_UDP_ROUNDS  16              // recvmmsg() calls before looking at the other sockets
+#define SYSLOG_MAX_FRAME   (1024 * 1024)   // TCP connections with longer frames are closed
+#define SYSLOG_RCVBUF      (4 * 1024 * 1024)
+#define SYSLOG_EPOLL_EVENTS 64
+
+namespace sawmill {
+
+struct SyslogInput::Receiver
+{
+	struct Connection {
+		std::string buffer; // Data without a complete frame yet
+		std::string peer;
+	};
+
+	int udpfd;
+	int tcpfd;
+	int epfd;
+	std::thread thread;
+	Batch *batch; // Being filled
+	std::map<int, Connection> connections;
+
+	// recvmmsg() buffers
+	std::vector<char> buffers;
+	std::vector<struct mmsghdr> msgs;
+	std::vector<struct iovec> iovs;
+	std::vector<struct sockaddr_storage> addrs;
+
+	Receiver() :udpfd(-1), tcpfd(-1), epfd(-1), thread(), batch(NULL), connections(),
+		buffers(SYSLOG_VLEN * SYSLOG_MAX_DGRAM), msgs(SYSLOG_VLEN), iovs(SYSLOG_VLEN), addrs(SYSLOG_VLEN)
+	{
+		memset(&msgs[0], 0, sizeof(struct mmsghdr) * SYSLOG_VLEN);
+		for (int i = 0; i < SYSLOG_VLEN; i++) {
+			iovs[i].iov_base = &buffers[i * SYSLOG_MAX_DGRAM];
+			iovs[i].iov_len = SYSLOG_MAX_DGRAM;
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+			msgs[i].msg_hdr.msg_name = &addrs[i];
+		}
+	}
+};
+
+static int open_socket(const std::string &address, int port, int type)
+{
+	struct addrinfo hints, *res;
+	char service[16];
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = type;
+	hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+	snprintf(service, sizeof(service), "%d", port);
+	int rc = getaddrinfo(address.empty() ? NULL : address.c_str(), service, &hints, &res);
+	if (rc != 0) {
+		ERR("Could not resolve %s: %s", address.c_str(), gai_strerror(rc));
+		return -1;
+	}
+	int fd = socket(res->ai_family, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	int one = 1;
+	bool ok = (fd >= 0) &&
+	          (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == 0) &&
+	          (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == 0) &&
+	          (bind(fd, res->ai_addr, res->ai_addrlen) == 0) &&
+	          ((type != SOCK_STREAM) || (listen(fd, SOMAXCONN) == 0));
+	freeaddrinfo(res);
+	if (!ok) {
+		ERR("Could not listen for syslog on %s port %d: %s", address.empty() ? "*" : address.c_str(), port, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	if (type == SOCK_DGRAM) {
+		// Not fatal, it only absorbs bursts
+		int size = SYSLOG_RCVBUF;
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	}
+	return fd;
+}
+
+static void format_peer(const struct sockaddr_storage &addr, std::string &out)
+{
+	char text[INET6_ADDRSTRLEN];
+	const char *ok = NULL;
+	if (addr.ss_family == AF_INET) {
+		ok = inet_ntop(AF_INET, &((const struct sockaddr_in *)&addr)->sin_addr, text, sizeof(text));
+	} else if (addr.ss_family == AF_INET6) {
+		const struct in6_addr *a6 = &((const struct sockaddr_in6 *)&addr)->sin6_addr;
+		if (IN6_IS_ADDR_V4MAPPED(a6)) {
+			ok = inet_ntop(AF_INET, &a6->s6_addr[12], text, sizeof(text));
+		} else {
+			ok = inet_ntop(AF_INET6, a6, text, sizeof(text));
+		}
+	}
+	out.assign(ok ? text : "unknown");
+}
+
+SyslogInput::SyslogInput()
+	:address(), port(0), threadcount(2), udp(true), tcp(true), wakefd(-1), stopfd(-1), receivers(), lock(),
+	 notfull(), full(), spare(), queued(0), stopping(false), current(NULL), currentpos(0)
+{
+}
+
+SyslogInput::~SyslogInput()
+{
+	stop();
+}
+
+void SyslogInput::setAddress(const std::string &addr, int p)
+{
+	address = addr;
+	port = p;
+}
+
+void SyslogInput::setThreads(int count)
+{
+	threadcount = (count > 0) ? count : 1;
+}
+
+void SyslogInput::setProtocols(bool useudp, bool usetcp)
+{
+	udp = useudp;
+	tcp = usetcp;
+}
+
+bool SyslogInput::start()
+{
+	if ((port <= 0) || (!udp && !tcp)) {
+		ERR("No syslog port or protocol set");
+		return false;
+	}
+	stopping = false;
+	wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	stopfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if ((wakefd < 0) || (stopfd < 0)) {
+		ERR("Could not create eventfd: %s", strerror(errno));
+		stop();
+		return false;
+	}
+	for (int i = 0; i < threadcount; i++) {
+		Receiver *receiver = new Receiver();
+		receivers.push_back(receiver);
+		if (udp && ((receiver->udpfd = open_socket(address, port, SOCK_DGRAM)) < 0)) {
+			stop();
+			return false;
+		}
+		if (tcp && ((receiver->tcpfd = open_socket(address, port, SOCK_STREAM)) < 0)) {
+			stop();
+			return false;
+		}
+		receiver->epfd = epoll_create1(EPOLL_CLOEXEC);
+		int fds[] = { receiver->udpfd, receiver->tcpfd, stopfd };
+		for (size_t f = 0; f < sizeof(fds) / sizeof(fds[0]); f++) {
+			if (fds[f] < 0)
+				continue;
+			struct epoll_event ev;
+			ev.events = EPOLLIN;
+			ev.data.fd = fds[f];
+			epoll_ctl(receiver->epfd, EPOLL_CTL_ADD, fds[f], &ev);
+		}
+	}
+	for (size_t i = 0; i < receivers.size(); i++) {
+		receivers[i]->thread = std::thread(&SyslogInput::receive, this, receivers[i]);
+	}
+	NOTICE("Receiving syslog on %s port %d (%s%s%s), %d threads", address.empty() ? "*" : address.c_str(), port,
+	       udp ? "udp" : "", (udp && tcp) ? "/" : "", tcp ? "tcp" : "", threadcount);
+	return true;
+}
+
+void SyslogInput::stop()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+	}
+	notfull.notify_all();
+	if (stopfd >= 0) {
+		uint64_t one = 1;
+		if (::write(stopfd, &one, sizeof(one)) < 0) {
+			// Can only fail on overflow, it is readable then anyway
+		}
+	}
+
+	std::vector<Batch *> batches;
+	for (size_t i = 0; i < receivers.size(); i++) {
+		Receiver *receiver = receivers[i];
+		if (receiver->thread.joinable())
+			receiver->thread.join();
+		for (std::map<int, Receiver::Connection>::iterator it = receiver->connections.begin(); it != receiver->connections.end(); ++it) {
+			close(it->first);
+		}
+		if (receiver->udpfd >= 0)
+			close(receiver->udpfd);
+		if (receiver->tcpfd >= 0)
+			close(receiver->tcpfd);
+		if (receiver->epfd >= 0)
+			close(receiver->epfd);
+		if (receiver->batch)
+			batches.push_back(receiver->batch);
+		delete receiver;
+	}
+	receivers.clear();
+
+	batches.insert(batches.end(), full.begin(), full.end());
+	batches.insert(batches.end(), spare.begin(), spare.end());
+	if (current)
+		batches.push_back(current);
+	for (size_t i = 0; i < batches.size(); i++) {
+		for (size_t e = 0; e < batches[i]->events.size(); e++) {
+			delete batches[i]->events[e];
+		}
+		delete batches[i];
+	}
+	full.clear();
+	spare.clear();
+	current = NULL;
+	queued = 0;
+
+	if (wakefd >= 0)
+		close(wakefd);
+	if (stopfd >= 0)
+		close(stopfd);
+	wakefd = -1;
+	stopfd = -1;
+}
+
+long SyslogInput::timeout() const
+{
+	return (current || queued) ? 0 : -1;
+}
+
+size_t SyslogInput::read(EventSink &sink, size_t max)
+{
+	uint64_t value;
+	if ((wakefd < 0) || ((::read(wakefd, &value, sizeof(value)) < 0) && !current && !queued))
+		return 0;
+
+	size_t count = 0;
+	while (count < max) {
+		if (!current) {
+			std::lock_guard<std::mutex> guard(lock);
+			if (full.empty())
+				break;
+			current = full.front();
+			full.pop_front();
+			queued -= current->count;
+			currentpos = 0;
+			notfull.notify_one();
+		}
+		for (; (currentpos < current->count) && (count < max); currentpos++) {
+			// Swap the contents, the batch keeps the (empty) event of the sink
+			LogEvent *event = sink.newEvent();
+			event->Swap(current->events[currentpos]);
+			sink.submit(event);
+			count++;
+		}
+		if (currentpos == current->count) {
+			std::lock_guard<std::mutex> guard(lock);
+			spare.push_back(current);
+			current = NULL;
+		}
+	}
+	return count;
+}
+
+void SyslogInput::wake()
+{
+	uint64_t one = 1;
+	if (::write(wakefd, &one, sizeof(one)) < 0) {
+		// Overflow: it is readable anyway
+	}
+}
+
+LogEvent *SyslogInput::nextEvent(Receiver *receiver)
+{
+	if (receiver->batch && (receiver->batch->count == SYSLOG_BATCH))
+		pushBatch(receiver);
+	if (!receiver->batch) {
+		std::lock_guard<std::mutex> guard(lock);
+		if (spare.empty()) {
+			receiver->batch = new Batch();
+			receiver->batch->events.reserve(SYSLOG_BATCH);
+		} else {
+			receiver->batch = spare.back();
+			spare.pop_back();
+		}
+		receiver->batch->count = 0;
+	}
+	Batch *batch = receiver->batch;
+	if (batch->count == batch->events.size())
+		batch->events.push_back(new LogEvent());
+	LogEvent *event = batch->events[batch->count++];
+	event->Clear();
+	return event;
+}
+
+void SyslogInput::pushBatch(Receiver *receiver)
+{
+	Batch *batch = receiver->batch;
+	if (!batch || !batch->count)
+		return;
+	{
+		std::unique_lock<std::mutex> guard(lock);
+		while ((full.size() >= SYSLOG_MAX_BATCHES) && !stopping) {
+			notfull.wait(guard);
+		}
+		if (stopping) {
+			spare.push_back(batch);
+		} else {
+			full.push_back(batch);
+			queued += batch->count;
+		}
+	}
+	receiver->batch = NULL;
+	wake();
+}
+
+void SyslogInput::receive(Receiver *receiver)
+{
+	struct epoll_event events[SYSLOG_EPOLL_EVENTS];
+
+	for (;;) {
+		int count = epoll_wait(receiver->epfd, events, SYSLOG_EPOLL_EVENTS, -1);
+		if (count < 0) {
+			if (errno == EINTR)
+				continue;
+			ERR("Syslog receiver failed: %s", strerror(errno));
+			break;
+		}
+		bool stop = false;
+		for (int i = 0; i < count; i++) {
+			int fd = events[i].data.fd;
+			if (fd == stopfd) {
+				stop = true;
+			} else if (fd == receiver->udpfd) {
+				receiveUdp(receiver);
+			} else if (fd == receiver->tcpfd) {
+				acceptTcp(receiver);
+			} else if (!receiveTcp(receiver, fd)) {
+				epoll_ctl(receiver->epfd, EPOLL_CTL_DEL, fd, NULL);
+				close(fd);
+				receiver->connections.erase(fd);
+			}
+		}
+		// Don't hold back events for a full batch when it is quiet
+		pushBatch(receiver);
+		if (stop)
+			break;
+	}
+}
+
+bool SyslogInput::receiveUdp(Receiver *receiver)
+{
+	for (int round = 0; round < SYSLOG_UDP_ROUNDS; round++) {
+		for (int i = 0; i < SYSLOG_VLEN; i++) {
+			receiver->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+		}
+		int count = recvmmsg(receiver->udpfd, &receiver->msgs[0], SYSLOG_VLEN, MSG_DONTWAIT, NULL);
+		if (count < 0) {
+			if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) {
+				ERR("Could not receive syslog datagrams: %s", strerror(errno));
+				return false;
+			}
+			return true;
+		}
+		for (int i = 0; i < count; i++) {
+			LogEvent *event = nextEvent(receiver);
+			if (!parse(&receiver->buffers[i * SYSLOG_MAX_DGRAM], receiver->msgs[i].msg_len, *event))
+				format_peer(receiver->addrs[i], *event->mutable_source());
+		}
+		if (count < SYSLOG_VLEN)
+			break;
+	}
+	return true;
+}
+
+void SyslogInput::acceptTcp(Receiver *receiver)
+{
+	struct sockaddr_storage addr;
+	socklen_t addrlen = sizeof(addr);
+	int fd;
+
+	while ((fd = accept4(receiver->tcpfd, (struct sockaddr *)&addr, &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.fd = fd;
+		if (epoll_ctl(receiver->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			close(fd);
+			continue;
+		}
+		format_peer(addr, receiver->connections[fd].peer);
+		DBG("Syslog connection from %s", receiver->connections[fd].peer.c_str());
+		addrlen = sizeof(addr);
+	}
+}
+
+bool SyslogInput::receiveTcp(Receiver *receiver, int fd)
+{
+	char buf[65536];
+	ssize_t len = ::read(fd, buf, sizeof(buf));
+	if (len < 0)
+		return (errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR);
+	if (len == 0)
+		return false;
+
+	Receiver::Connection &conn = receiver->connections[fd];
+	const char *data = buf;
+	size_t size = len;
+	if (!conn.buffer.empty()) {
+		conn.buffer.append(buf, len);
+		data = conn.buffer.data();
+		size = conn.buffer.size();
+	}
+	size_t pos = 0, used;
+	const char *msg;
+	size_t msglen;
+	while ((used = nextFrame(data + pos, size - pos, msg, msglen)) > 0) {
+		pos += used;
+		if (!msglen)
+			continue;
+		LogEvent *event = nextEvent(receiver);
+		if (!parse(msg, msglen, *event))
+			event->mutable_source()->assign(conn.peer);
+	}
+	if (size - pos > SYSLOG_MAX_FRAME) {
+		WARN("Syslog frame from %s longer than %d bytes, closing the connection", conn.peer.c_str(), SYSLOG_MAX_FRAME);
+		return false;
+	}
+	if (data == buf) {
+		conn.buffer.assign(buf + pos, size - pos);
+	} else {
+		conn.buffer.erase(0, pos);
+	}
+	return true;
+}
+
+size_t SyslogInput::nextFrame(const char *data, size_t len, const char *&msg, size_t &msglen)
+{
+	size_t i = 0, count = 0;
+	while ((i < len) && (i < 10) && (data[i] >= '0') && (data[i] <= '9')) {
+		count = count * 10 + (data[i++] - '0');
+	}
+	if (i && (i < len) && (i < 10) && (data[i] == ' ')) {
+		// Octet counting
+		if (len - i - 1 < count)
+			return 0;
+		msg = data + i + 1;
+		msglen = count;
+		return i + 1 + count;
+	}
+	if (i && (i == len))
+		return 0; // Could still turn out to be a count
+	const char *newline = (const char *)memchr(data, '\n', len);
+	if (!newline)
+		return 0;
+	msg = data;
+	msglen = newline - data;
+	return msglen + 1;
+}
+
+static inline bool is_digit(char c)
+{
+	return (c >= '0') && (c <= '9');
+}
+
+static inline bool is_alpha(char c)
+{
+	return ((c >= 'a') && (c <= 'z')) || ((c >= 'A') && (c <= 'Z'));
+}
+
+static void add_field(LogEvent &event, const char *key, const char *begin, const char *end)
+{
+	Field *field = event.add_field();
+	field->mutable_key()->assign(key);
+	field->mutable_value()->assign(begin, end - begin);
+}
+
+static void add_int(LogEvent &event, const char *key, int value)
+{
+	Field *field = event.add_field();
+	field->mutable_key()->assign(key);
+	FieldValue::setInt(*field, value);
+}
+
+/**
+ * Next space separated RFC 5424 header field, false if it is the nil value "-".
+ */
+static bool next_token(const char *&p, const char *end, const char *&begin, const char *&stop)
+{
+	begin = p;
+	while ((p < end) && (*p != ' '))
+		p++;
+	stop = p;
+	if (p < end)
+		p++;
+	return !((stop - begin == 1) && (*begin == '-')) && (stop > begin);
+}
+
+bool SyslogInput::parse(const char *msg, size_t len, LogEvent &event)
+{
+	const char *p = msg;
+	const char *end = msg + len;
+	const char *begin, *stop;
+	bool hostname = false;
+
+	while ((end > p) && ((end[-1] == '\n') || (end[-1] == '\r') || (end[-1] == '\0')))
+		end--;
+	event.mutable_type()->assign("syslog");
+
+	if ((p < end) && (*p == '<')) {
+		const char *q = p + 1;
+		int pri = 0;
+		while ((q < end) && (q - p <= 3) && is_digit(*q))
+			pri = pri * 10 + (*q++ - '0');
+		if ((q < end) && (*q == '>') && (q > p + 1) && (pri < 192)) {
+			add_int(event, "facility", pri >> 3);
+			add_int(event, "severity", pri & 7);
+			p = q + 1;
+		}
+	}
+
+	if ((end - p >= 2) && is_digit(p[0]) && ((p[1] == ' ') || ((end - p >= 3) && is_digit(p[1]) && (p[2] == ' ')))) {
+		// RFC 5424: VERSION TIMESTAMP HOSTNAME APP-NAME PROCID MSGID STRUCTURED-DATA MSG
+		p += (p[1] == ' ') ? 2 : 3;
+		if (next_token(p, end, begin, stop))
+			event.mutable_timestamp()->assign(begin, stop - begin);
+		if (next_token(p, end, begin, stop)) {
+			event.mutable_source()->assign(begin, stop - begin);
+			hostname = true;
+		}
+		if (next_token(p, end, begin, stop))
+			add_field(event, "program", begin, stop);
+		if (next_token(p, end, begin, stop))
+			add_field(event, "pid", begin, stop);
+		if (next_token(p, end, begin, stop))
+			add_field(event, "msgid", begin, stop);
+		if ((p < end) && (*p == '[')) {
+			begin = p;
+			while ((p < end) && (*p == '[')) {
+				bool quoted = false;
+				for (p++; p < end; p++) {
+					if (quoted && (*p == '\\')) {
+						p++;
+					} else if (*p == '"') {
+						quoted = !quoted;
+					} else if (!quoted && (*p == ']')) {
+						p++;
+						break;
+					}
+				}
+			}
+			if (p > end)
+				p = end;
+			add_field(event, "structured_data", begin, p);
+		} else if ((p < end) && (*p == '-')) {
+			p++;
+		}
+		if ((p < end) && (*p == ' '))
+			p++;
+		if ((end - p >= 3) && (memcmp(p, "\xEF\xBB\xBF", 3) == 0))
+			p += 3;
+	} else if ((end - p >= 15) && is_alpha(p[0]) && is_alpha(p[1]) && is_alpha(p[2]) && (p[3] == ' ') &&
+	           (p[6] == ' ') && (p[9] == ':') && (p[12] == ':')) {
+		// RFC 3164: Mmm dd hh:mm:ss HOSTNAME TAG[PID]: MSG, the hostname is often left out
+		event.mutable_timestamp()->assign(p, 15);
+		p += 15;
+		if ((p < end) && (*p == ' '))
+			p++;
+		const char *q = p;
+		while ((q < end) && (*q != ' ') && (*q != '['))
+			q++;
+		if ((q < end) && (*q == ' ') && (q > p) && (q[-1] != ':')) {
+			event.mutable_source()->assign(p, q - p);
+			hostname = true;
+			p = q + 1;
+		}
+		q = p;
+		while ((q < end) && (q - p < 48) && (*q != '[') && (*q != ':') && (*q != ' '))
+			q++;
+		if ((q < end) && (q > p) && ((*q == '[') || (*q == ':'))) {
+			add_field(event, "program", p, q);
+			if (*q == '[') {
+				begin = ++q;
+				while ((q < end) && (*q != ']'))
+					q++;
+				add_field(event, "pid", begin, q);
+				if (q < end)
+					q++;
+			}
+			if ((q < end) && (*q == ':'))
+				q++;
+			if ((q < end) && (*q == ' '))
+				q++;
+			p = q;
+		}
+	}
+	event.mutable_message()->assign(p, end - p);
+	return hostname;
+}
+
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Test and benchmark: load generator over the loopback interface
+/////////////////////////////////////////////////////////////////////////////
+
+#ifdef DEBUG_SYSLOGINPUT_CPP
+
+#include <poll.h>
+#include <time.h>
+#include "eventbatch.h"
+#include "testcheck.h"
+
+#define BENCH_PORT     15514
+#define BENCH_THREADS  2
+#define BENCH_UDP      400000
+#define BENCH_TCP      200000
+
+using namespace sawmill;
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+class CountingSink : public EventSink
+{
+public:
+	CountingSink() :count(0), withhost(0), pool() {}
+	LogEvent *newEvent() { return pool.get(); }
+	void submit(LogEvent *event)
+	{
+		count++;
+		if (event->source() == "loadgen")
+			withhost++;
+		pool.put(event);
+	}
+	long count;
+	long withhost;
+	EventPool pool;
+};
+
+static const char *field(const LogEvent &event, const char *key)
+{
+	for (int i = 0; i < event.field_size(); i++) {
+		if (event.field(i).key() == key)
+			return event.field(i).value().c_str();
+	}
+	return "";
+}
+
+static void send_udp(int count)
+{
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(BENCH_PORT);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+
+	char bufs[SYSLOG_VLEN][256];
+	struct mmsghdr msgs[SYSLOG_VLEN];
+	struct iovec iovs[SYSLOG_VLEN];
+	memset(msgs, 0, sizeof(msgs));
+	for (int sent = 0; sent < count; ) {
+		int n = (count - sent < SYSLOG_VLEN) ? count - sent : SYSLOG_VLEN;
+		for (int i = 0; i < n; i++) {
+			iovs[i].iov_base = bufs[i];
+			iovs[i].iov_len = snprintf(bufs[i], sizeof(bufs[i]),
+				"<34>Oct 19 12:00:00 loadgen app[%d]: request %d served in %d ms", i, sent + i, i % 97);
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+		int done = sendmmsg(fd, msgs, n, 0);
+		if (done > 0)
+			sent += done;
+	}
+	close(fd);
+}
+
+static void send_tcp(int count)
+{
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(BENCH_PORT);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("connect");
+		return;
+	}
+	std::string out;
+	for (int i = 0; i < count; i++) {
+		char msg[256], frame[300];
+		int len = snprintf(msg, sizeof(msg), "<165>1 2026-10-19T12:00:00.123Z loadgen app %d ID47 [ex@32473 seq=\"%d\"] request %d", i, i, i);
+		out.append(frame, snprintf(frame, sizeof(frame), "%d %s", len, msg));
+		if ((out.size() > 60000) || (i == count - 1)) {
+			for (size_t done = 0; done < out.size(); ) {
+				ssize_t n = write(fd, out.data() + done, out.size() - done);
+				if (n <= 0)
+					break;
+				done += n;
+			}
+			out.clear();
+		}
+	}
+	close(fd);
+}
+
+static double receive(SyslogInput &input, CountingSink &sink, long expected)
+{
+	uint64_t start = now_ns(), last = start;
+	long before = sink.count;
+	while ((sink.count - before < expected) && (now_ns() - last < 1000000000ULL)) {
+		struct pollfd item = { input.fd(), POLLIN, 0 };
+		::poll(&item, 1, input.timeout() == 0 ? 0 : 100);
+		if (input.read(sink, 4096))
+			last = now_ns();
+	}
+	return (sink.count - before) * 1e9 / (last - start);
+}
+
+int main()
+{
+	int rc = 0;
+	LogEvent event;
+
+	const char *rfc3164 = "<34>Oct 19 22:14:15 mymachine su[123]: 'su root' failed for lonvick on /dev/pts/8\n";
+	rc |= check("RFC 3164 has hostname", SyslogInput::parse(rfc3164, strlen(rfc3164), event));
+	rc |= check("RFC 3164 fields", (event.timestamp() == "Oct 19 22:14:15") && (event.source() == "mymachine") &&
+	            !strcmp(field(event, "program"), "su") && !strcmp(field(event, "pid"), "123") &&
+	            !strcmp(field(event, "facility"), "4") && !strcmp(field(event, "severity"), "2") &&
+	            (event.message() == "'su root' failed for lonvick on /dev/pts/8"));
+
+	event.Clear();
+	const char *nohost = "<13>Oct  9 22:14:15 kernel: eth0 link up";
+	rc |= check("RFC 3164 without hostname", !SyslogInput::parse(nohost, strlen(nohost), event) &&
+	            !strcmp(field(event, "program"), "kernel") && (event.message() == "eth0 link up"));
+
+	event.Clear();
+	const char *rfc5424 = "<165>1 2003-10-11T22:14:15.003Z mymachine.example.com evntslog - ID47 "
+	                      "[exampleSDID@32473 iut=\"3\" eventSource=\"Appl\\]ication\"][x@1 a=\"b\"] \xEF\xBB\xBF" "An application event";
+	rc |= check("RFC 5424 has hostname", SyslogInput::parse(rfc5424, strlen(rfc5424), event));
+	rc |= check("RFC 5424 fields", (event.timestamp() == "2003-10-11T22:14:15.003Z") && (event.source() == "mymachine.example.com") &&
+	            !strcmp(field(event, "program"), "evntslog") && !*field(event, "pid") && !strcmp(field(event, "msgid"), "ID47") &&
+	            !strcmp(field(event, "structured_data"), "[exampleSDID@32473 iut=\"3\" eventSource=\"Appl\\]ication\"][x@1 a=\"b\"]") &&
+	            (event.message() == "An application event"));
+
+	event.Clear();
+	rc |= check("No header", !SyslogInput::parse("just text", 9, event) && (event.message() == "just text"));
+
+	const char *msg;
+	size_t msglen;
+	rc |= check("Octet counted frame", (SyslogInput::nextFrame("5 hello6 world!", 15, msg, msglen) == 7) && (msglen == 5) && !memcmp(msg, "hello", 5));
+	rc |= check("Incomplete frame", SyslogInput::nextFrame("12 hello", 8, msg, msglen) == 0);
+	rc |= check("Newline frame", (SyslogInput::nextFrame("<13>hi\n<13>", 11, msg, msglen) == 7) && (msglen == 6));
+
+	// Parsing alone
+	const int rounds = 1000000;
+	uint64_t start = now_ns();
+	for (int i = 0; i < rounds; i++) {
+		event.Clear();
+		SyslogInput::parse(rfc3164, strlen(rfc3164), event);
+	}
+	printf("Parse RFC 3164: %.0f ns/message\n", (double)(now_ns() - start) / rounds);
+	start = now_ns();
+	for (int i = 0; i < rounds; i++) {
+		event.Clear();
+		SyslogInput::parse(rfc5424, strlen(rfc5424), event);
+	}
+	printf("Parse RFC 5424: %.0f ns/message\n", (double)(now_ns() - start) / rounds);
+
+	// Load over the loopback interface
+	SyslogInput input;
+	CountingSink sink;
+	input.setAddress("127.0.0.1", BENCH_PORT);
+	input.setThreads(BENCH_THREADS);
+	if (!input.start())
+		return 1;
+
+	std::thread udpsender(send_udp, BENCH_UDP);
+	double rate = receive(input, sink, BENCH_UDP);
+	udpsender.join();
+	printf("UDP: %ld/%d messages received (rest dropped by the kernel), %.0f messages/s\n", sink.count, BENCH_UDP, rate);
+	rc |= check("UDP hostnames", (sink.count > 0) && (sink.withhost == sink.count));
+
+	long udpcount = sink.count;
+	std::thread tcpsender(send_tcp, BENCH_TCP);
+	rate = receive(input, sink, BENCH_TCP);
+	tcpsender.join();
+	printf("TCP: %ld/%d messages received, %.0f messages/s\n", sink.count - udpcount, BENCH_TCP, rate);
+	rc |= check("TCP complete", sink.count - udpcount == BENCH_TCP);
+
+	input.stop();
+	return rc;
+}
+
+#endif // DEBUG_SYSLOGINPUT_CPP
@@ -0,0 +1,103 @@
+#ifndef __SYSLOGINPUT_H
+# define __SYSLOGINPUT_H
+
+#include <map>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include <condition_variable>
+#include <stdint.h>
+#include "eventinput.h"
+
+namespace sawmill {
+
+/**
+ * Syslog over UDP and TCP, RFC 3164 and RFC 5424.
+ *
+ * Every receiver thread has its own UDP and TCP socket bound to the same port with
+ * SO_REUSEPORT, so the kernel spreads the datagrams and connections over them. Datagrams are
+ * received many at a time with recvmmsg(). TCP takes octet counted frames (RFC 6587) as well as
+ * newline terminated ones.
+ *
+ * The threads parse the headers straight into the events, into batches that are handed to the
+ * dispatcher thread, which swaps the events into its own. When the dispatcher falls behind the
+ * threads stop receiving: UDP datagrams are then dropped by the kernel and TCP senders slow down.
+ */
+class SyslogInput : public EventInput
+{
+public:
+	SyslogInput();
+	~SyslogInput();
+
+	/**
+	 * Listen on 'address' (empty for all) and 'port'. Call before start().
+	 */
+	void setAddress(const std::string &address, int port);
+	void setThreads(int count);
+	void setProtocols(bool udp, bool tcp);
+	bool isConfigured() const { return port > 0; }
+
+	bool start();
+	void stop();
+
+	// EventInput
+	int fd() const { return wakefd; }
+	long timeout() const;
+	size_t read(EventSink &sink, size_t max);
+
+	/**
+	 * Fill in 'event' from the syslog message. Sets the source only if the message has a
+	 * hostname, returns whether it did.
+	 */
+	static bool parse(const char *msg, size_t len, LogEvent &event);
+	/**
+	 * Find the first complete frame in 'data': octet counted if it starts with a digit, up to
+	 * the newline otherwise. Returns the bytes used including the framing, 0 if incomplete.
+	 */
+	static size_t nextFrame(const char *data, size_t len, const char *&msg, size_t &msglen);
+private:
+	struct Batch {
+		std::vector<LogEvent *> events;
+		size_t count;
+	};
+	struct Receiver;
+
+	void receive(Receiver *receiver);
+	bool receiveUdp(Receiver *receiver);
+	void acceptTcp(Receiver *receiver);
+	bool receiveTcp(Receiver *receiver, int fd);
+	LogEvent *nextEvent(Receiver *receiver);
+	void pushBatch(Receiver *receiver);
+	void wake();
+
+	std::string address;
+	int port;
+	int threadcount;
+	bool udp;
+	bool tcp;
+	int wakefd; // Batches are waiting for the dispatcher
+	int stopfd; // The receivers have to stop
+	std::vector<Receiver *> receivers;
+
+	std::mutex lock;
+	std::condition_variable notfull;
+	std::deque<Batch *> full;
+	std::vector<Batch *> spare;
+	std::atomic<size_t> queued; // Events in 'full'
+	bool stopping;
+
+	// Only used by the dispatcher thread
+	Batch *current;
+	size_t currentpos;
+
+	// Not copyable
+	SyslogInput(const SyslogInput &);
+	SyslogInput &operator=(const SyslogInput &);
+};
+
+} // namespace sawmill
+
+#endif // ifndef __SYSLOGINPUT_H
@@ -0,0 +1,158 @@
+/****************************************************************************
+ * Project: SawMill
+ * Authors:
+ *          Bart Meuris <bart . meuris @ gmail . com>
+ *
+ * License: (to be discussed LGPL version 2.0?)
+ ****************************************************************************
+ * Module description:
+ *     Sets of interned tags, so requireTag guards don't need string
+ *     compares.
+ *
+ ***************************************************************************/
+
+#include "tagset.h"
+#include <algorithm>
+
+namespace sawmill {
+
+void TagSet::addSpill(uint32_t id)
+{
+	std::vector<uint32_t>::iterator it = std::lower_bound(spill.begin(), spill.end(), id);
+	if ((it == spill.end()) || (*it != id))
+		spill.insert(it, id);
+}
+
+void TagSet::removeSpill(uint32_t id)
+{
+	std::vector<uint32_t>::iterator it = std::lower_bound(spill.begin(), spill.end(), id);
+	if ((it != spill.end()) && (*it == id))
+		spill.erase(it);
+}
+
+bool TagSet::hasSpill(uint32_t id) const
+{
+	return std::binary_search(spill.begin(), spill.end(), id);
+}
+
+bool TagSet::containsSpill(const TagSet &mask) const
+{
+	return std::includes(spill.begin(), spill.end(), mask.spill.begin(), mask.spill.end());
+}
+
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Benchmark: requireTag guards with string compares against tag sets
+/////////////////////////////////////////////////////////////////////////////
+
+#ifdef DEBUG_TAGSET_CPP
+
+#include <cstdio>
+#include <string>
+#include <time.h>
+#include "filterengine.h"
+
+#define BENCH_EVENTS     200000
+#define BENCH_TAGS       8
+#define BENCH_STEPS      16
+#define BENCH_BATCHSIZE  256
+
+using namespace sawmill;
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int main()
+{
+	char buf[32];
+	// Tag routing: every step requires two of the tags and adds one
+	FilterConfig config;
+	config.set_version(0);
+	Filter *f = config.add_filter();
+	f->set_filterid(1);
+	f->set_type("syslog");
+	for (int s = 0; s < BENCH_STEPS; s++) {
+		FilterStep *step = f->add_step();
+		step->set_plugin("addtag");
+		step->set_stepnumber(s);
+		snprintf(buf, sizeof(buf), "route-%d", s % BENCH_TAGS);
+		step->add_requiretag(buf);
+		snprintf(buf, sizeof(buf), "route-%d", (s * 3 + 1) % BENCH_TAGS);
+		step->add_requiretag(buf);
+		Field *p = step->add_parameter();
+		p->set_key("tag");
+		snprintf(buf, sizeof(buf), "routed-%d", s);
+		p->set_value(buf);
+	}
+	FilterConfigStore store;
+	store.update(config);
+	FilterEngine engine;
+	engine.load(store);
+
+	// Bit sanity checks, including spilled ID's
+	TagSet a, mask;
+	a.add(3);
+	a.add(200);
+	a.add(70);
+	mask.add(70);
+	mask.add(3);
+	bool ok = a.containsAll(mask) && a.has(200) && !a.has(71);
+	mask.add(71);
+	ok &= !a.containsAll(mask);
+	a.remove(200);
+	ok &= !a.has(200) && a.has(70);
+	ok &= (a.bound() == 71) && (mask.bound() == 72) && (TagSet().bound() == 0);
+	a.remove(70);
+	ok &= (a.bound() == 4);
+	printf("TagSet checks: %s\n", ok ? "OK" : "FAILED");
+
+	// The tags of an event are not interned, the ones interned later are still found
+	{
+		LogEvent e;
+		e.add_tag("never-interned");
+		e.add_tag("interned-later");
+		size_t interned = StringInterner::tags().size();
+		IndexedEvent ie(&e);
+		bool tagsok = ie.tags().empty() && (StringInterner::tags().size() == interned);
+		uint32_t later = StringInterner::tags().intern("interned-later");
+		TagSet want;
+		want.add(later);
+		tagsok = tagsok && ie.hasTag(later) && ie.hasTags(want);
+		ie.removeTag(later);
+		tagsok = tagsok && (e.tag_size() == 1) && !ie.hasTag(later);
+		printf("Event tags looked up, not interned: %s\n", tagsok ? "OK" : "FAILED");
+		ok &= tagsok;
+	}
+	if (!ok)
+		return 1;
+
+	FilterEngine::EventList events;
+	std::vector<StepResult> results;
+	uint64_t total = 0;
+	for (int b = 0; b < BENCH_EVENTS / BENCH_BATCHSIZE; b++) {
+		events.Clear();
+		for (int i = 0; i < BENCH_BATCHSIZE; i++) {
+			LogEvent *e = events.Add();
+			e->set_type("syslog");
+			e->set_message("message");
+			for (int t = 0; t < BENCH_TAGS; t++) {
+				if ((i + t) % 3) {
+					snprintf(buf, sizeof(buf), "route-%d", t);
+					e->add_tag(buf);
+				}
+			}
+		}
+		uint64_t t = now_ns();
+		engine.process(events, results);
+		total += now_ns() - t;
+	}
+	printf("%d steps with 2 requireTag guards: %.1f ns/event, %d tags on the first event\n",
+	       BENCH_STEPS, (double)total / (BENCH_EVENTS / BENCH_BATCHSIZE * BENCH_BATCHSIZE), events.Get(0).tag_size());
+	return 0;
+}
+#endif
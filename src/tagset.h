@@ -0,0 +1,74 @@
+#ifndef __TAGSET_H
+# define __TAGSET_H
+
+#include <vector>
+#include <stdint.h>
+
+#define TAGSET_INLINE_BITS 64
+
+namespace sawmill {
+
+/**
+ * Set of interned tag ID's. ID's below TAGSET_INLINE_BITS are kept in an inline bitmask, the
+ * rest in a small sorted vector. Tags used in the filter config are interned when it is loaded,
+ * so they get the low ID's and a requireTag check is a single AND and compare.
+ */
+class TagSet
+{
+public:
+	TagSet() :bits(0), spill() {}
+
+	void clear() { bits = 0; spill.clear(); }
+	bool empty() const { return (bits == 0) && spill.empty(); }
+
+	void add(uint32_t id)
+	{
+		if (id < TAGSET_INLINE_BITS)
+			bits |= 1ULL << id;
+		else
+			addSpill(id);
+	}
+	void remove(uint32_t id)
+	{
+		if (id < TAGSET_INLINE_BITS)
+			bits &= ~(1ULL << id);
+		else
+			removeSpill(id);
+	}
+	bool has(uint32_t id) const
+	{
+		if (id < TAGSET_INLINE_BITS)
+			return (bits >> id) & 1;
+		return hasSpill(id);
+	}
+	/**
+	 * One more than the highest ID in the set, 0 if it is empty.
+	 */
+	uint32_t bound() const
+	{
+		if (!spill.empty())
+			return spill.back() + 1;
+		return bits ? 64 - __builtin_clzll(bits) : 0;
+	}
+	/**
+	 * True if all tags of 'mask' are in this set.
+	 */
+	bool containsAll(const TagSet &mask) const
+	{
+		if ((bits & mask.bits) != mask.bits)
+			return false;
+		return mask.spill.empty() || containsSpill(mask);
+	}
+private:
+	void addSpill(uint32_t id);
+	void removeSpill(uint32_t id);
+	bool hasSpill(uint32_t id) const;
+	bool containsSpill(const TagSet &mask) const;
+
+	uint64_t bits;
+	std::vector<uint32_t> spill; // Sorted ID's >= TAGSET_INLINE_BITS
+};
+
+} // namespace sawmill
+
+#endif // ifndef __TAGSET_H
@@ -0,0 +1,22 @@
+#ifndef __TESTCHECK_H
+# define __TESTCHECK_H
+
+#include <cstdio>
+#include <string>
+
+/**
+ * Result line of a check in the DEBUG_*_CPP test programs. Returns 1 if it failed, to be or-ed
+ * into the exit code.
+ */
+static inline int check(const char *what, bool ok)
+{
+	printf("%-60s -> %s\n", what, ok ? "OK" : "FAILED");
+	return ok ? 0 : 1;
+}
+
+static inline int check(const std::string &what, bool ok)
+{
+	return check(what.c_str(), ok);
+}
+
+#endif // ifndef __TESTCHECK_H
@@ -0,0 +1,503 @@
+/****************************************************************************
+ * Project: SawMill
+ * Authors:
+ *          Bart Meuris <bart . meuris @ gmail . com>
+ *
+ * License: (to be discussed LGPL version 2.0?)
+ ****************************************************************************
+ * Module description:
+ *     Timestamp parsing into nanoseconds since the epoch, and the parsetime
+ *     plugin that fills in LogEvent.timestamp_ns.
+ *
+ ***************************************************************************/
+
+#include "timeparser.h"
+#include "sawlog.h"
+#include <cstring>
+
+// Sources with their own detected format and parser, cleared when there are more
+#define MAX_SOURCES 4096
+// RFC 3164 timestamps further in the future than this are from last year
+#define RFC3164_FUTURE_SECONDS (2 * 86400)
+
+namespace sawmill {
+
+static inline bool digit(char c)
+{
+	return (c >= '0') && (c <= '9');
+}
+
+/**
+ * Value of the 'n' digits at 's', -1 if they are not all digits.
+ */
+static inline int number(const char *s, int n)
+{
+	int v = 0;
+	for (int i = 0; i < n; i++) {
+		if (!digit(s[i]))
+			return -1;
+		v = v * 10 + (s[i] - '0');
+	}
+	return v;
+}
+
+/**
+ * Month 1-12 from its English abbreviation, 0 if it is none.
+ */
+static int month_number(const char *s)
+{
+	static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+	for (int m = 0; m < 12; m++) {
+		if ((s[0] == months[m * 3]) && (s[1] == months[m * 3 + 1]) && (s[2] == months[m * 3 + 2]))
+			return m + 1;
+	}
+	return 0;
+}
+
+int64_t TimestampParser::daysFromCivil(int64_t year, unsigned month, unsigned day)
+{
+	// Counting from March, so the leap day is the last day of the year
+	year -= (month <= 2);
+	int64_t era = (year >= 0 ? year : year - 399) / 400;
+	unsigned yoe = (unsigned)(year - era * 400);
+	unsigned doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+	unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return era * 146097 + (int64_t)doe - 719468;
+}
+
+TimestampParser::TimestampParser()
+	:minutelen(0), minutebase(0), reference(0)
+{
+}
+
+TimestampParser::Format TimestampParser::detect(const char *s, size_t len)
+{
+	if ((len >= 16) && digit(s[0]) && digit(s[3]) && (s[4] == '-') && (s[7] == '-') &&
+	    ((s[10] == 'T') || (s[10] == 't') || (s[10] == ' ')) && (s[13] == ':'))
+		return FORMAT_ISO8601;
+	if ((len >= 15) && (s[3] == ' ') && (s[6] == ' ') && (s[9] == ':') && (s[12] == ':') && month_number(s))
+		return FORMAT_RFC3164;
+	if ((len > 0) && digit(s[0])) {
+		size_t i = 0;
+		while ((i < len) && digit(s[i])) {
+			i++;
+		}
+		if ((i < len) && (s[i] == '.')) {
+			i++;
+			while ((i < len) && digit(s[i])) {
+				i++;
+			}
+		}
+		if (i == len)
+			return FORMAT_EPOCH;
+	}
+	return FORMAT_UNKNOWN;
+}
+
+TimestampParser::Format TimestampParser::formatByName(const std::string &name)
+{
+	if ((name == "iso8601") || (name == "rfc5424") || (name == "rfc3339"))
+		return FORMAT_ISO8601;
+	if (name == "rfc3164")
+		return FORMAT_RFC3164;
+	if (name == "epoch")
+		return FORMAT_EPOCH;
+	return FORMAT_UNKNOWN;
+}
+
+const char *TimestampParser::formatName(Format format)
+{
+	switch (format) {
+	case FORMAT_ISO8601:
+		return "iso8601";
+	case FORMAT_RFC3164:
+		return "rfc3164";
+	case FORMAT_EPOCH:
+		return "epoch";
+	case FORMAT_UNKNOWN:
+		break;
+	}
+	return "unknown";
+}
+
+bool TimestampParser::parse(Format format, const char *text, size_t len, int64_t &ns)
+{
+	switch (format) {
+	case FORMAT_ISO8601:
+		return parseIso8601(text, len, ns);
+	case FORMAT_RFC3164:
+		return parseRfc3164(text, len, ns);
+	case FORMAT_EPOCH:
+		return parseEpoch(text, len, ns);
+	case FORMAT_UNKNOWN:
+		break;
+	}
+	return false;
+}
+
+bool TimestampParser::cachedMinute(const char *s, size_t len, int64_t &base) const
+{
+	if ((minutelen != len) || (memcmp(s, minutetext, len) != 0))
+		return false;
+	base = minutebase;
+	return true;
+}
+
+void TimestampParser::cacheMinute(const char *s, size_t len, int64_t base)
+{
+	memcpy(minutetext, s, len);
+	minutelen = len;
+	minutebase = base;
+}
+
+/**
+ * Seconds and fraction after the minute, ":ss[.fff...]". Returns the position after them, 0 if
+ * they are invalid.
+ */
+static size_t parse_seconds(const char *s, size_t i, size_t len, int &sec, int64_t &frac)
+{
+	sec = 0;
+	frac = 0;
+	if ((i >= len) || (s[i] != ':'))
+		return i;
+	if ((i + 3 > len) || ((sec = number(s + i + 1, 2)) < 0) || (sec > 60))
+		return 0;
+	i += 3;
+	if ((i < len) && ((s[i] == '.') || (s[i] == ','))) {
+		i++;
+		size_t start = i;
+		int64_t scale = 100000000;
+		while ((i < len) && digit(s[i])) {
+			// Below nanoseconds is ignored
+			frac += (s[i] - '0') * scale;
+			scale /= 10;
+			i++;
+		}
+		if (i == start)
+			return 0;
+	}
+	return i;
+}
+
+bool TimestampParser::parseIso8601(const char *s, size_t len, int64_t &ns)
+{
+	// YYYY-MM-DD[T ]hh:mm
+	if (len < MAX_MINUTE)
+		return false;
+	int64_t base;
+	if (!cachedMinute(s, MAX_MINUTE, base)) {
+		int year = number(s, 4), month = number(s + 5, 2), day = number(s + 8, 2);
+		int hour = number(s + 11, 2), minute = number(s + 14, 2);
+		if ((s[4] != '-') || (s[7] != '-') || ((s[10] != 'T') && (s[10] != 't') && (s[10] != ' ')) || (s[13] != ':'))
+			return false;
+		if ((year < 0) || (month < 1) || (month > 12) || (day < 1) || (day > 31) ||
+		    (hour < 0) || (hour > 23) || (minute < 0) || (minute > 59))
+			return false;
+		base = daysFromCivil(year, month, day) * 86400 + hour * 3600 + minute * 60;
+		cacheMinute(s, MAX_MINUTE, base);
+	}
+
+	int sec;
+	int64_t frac;
+	size_t i = parse_seconds(s, MAX_MINUTE, len, sec, frac);
+	if (i == 0)
+		return false;
+
+	// Zone: Z, +hh:mm, +hhmm or +hh. Without a zone the time is taken as UTC.
+	int offset = 0;
+	if (i < len) {
+		if ((s[i] == 'Z') || (s[i] == 'z')) {
+			i++;
+		} else if ((s[i] == '+') || (s[i] == '-')) {
+			int sign = (s[i] == '-') ? -1 : 1;
+			int hours = (i + 3 <= len) ? number(s + i + 1, 2) : -1;
+			if (hours < 0)
+				return false;
+			i += 3;
+			if ((i < len) && (s[i] == ':'))
+				i++;
+			int minutes = 0;
+			if (i < len) {
+				if ((i + 2 > len) || ((minutes = number(s + i, 2)) < 0))
+					return false;
+				i += 2;
+			}
+			offset = sign * (hours * 3600 + minutes * 60);
+		}
+	}
+	if (i != len)
+		return false;
+	ns = (base + sec - offset) * 1000000000LL + frac;
+	return true;
+}
+
+bool TimestampParser::parseRfc3164(const char *s, size_t len, int64_t &ns)
+{
+	// Mmm dd hh:mm:ss, the day padded with a space
+	if (len < 15)
+		return false;
+	int64_t base;
+	if (!cachedMinute(s, 12, base)) {
+		int month = month_number(s);
+		int day = (s[4] == ' ') ? number(s + 5, 1) : number(s + 4, 2);
+		int hour = number(s + 7, 2), minute = number(s + 10, 2);
+		if ((s[3] != ' ') || (s[6] != ' ') || (s[9] != ':'))
+			return false;
+		if ((month == 0) || (day < 1) || (day > 31) || (hour < 0) || (hour > 23) || (minute < 0) || (minute > 59))
+			return false;
+
+		// No year: take the current one, unless that is too far in the future (December's
+		// events read in January)
+		time_t now = reference ? reference : time(NULL);
+		struct tm tm;
+		gmtime_r(&now, &tm);
+		int64_t year = tm.tm_year + 1900;
+		base = daysFromCivil(year, month, day) * 86400 + hour * 3600 + minute * 60;
+		if (base > (int64_t)now + RFC3164_FUTURE_SECONDS)
+			base = daysFromCivil(year - 1, month, day) * 86400 + hour * 3600 + minute * 60;
+		cacheMinute(s, 12, base);
+	}
+	int sec;
+	int64_t frac;
+	size_t i = parse_seconds(s, 12, len, sec, frac);
+	if ((i == 0) || (i != len))
+		return false;
+	ns = (base + sec) * 1000000000LL + frac;
+	return true;
+}
+
+bool TimestampParser::parseEpoch(const char *s, size_t len, int64_t &ns)
+{
+	size_t i = 0;
+	uint64_t value = 0;
+	while ((i < len) && digit(s[i])) {
+		value = value * 10 + (s[i] - '0');
+		i++;
+	}
+	size_t digits = i;
+	if ((digits == 0) || (digits > 19))
+		return false;
+
+	// The unit follows from the number of digits: seconds until 2286, then milli, micro and nano
+	int64_t unit;
+	if (digits <= 10)
+		unit = 1000000000LL;
+	else if (digits <= 13)
+		unit = 1000000LL;
+	else if (digits <= 16)
+		unit = 1000LL;
+	else
+		unit = 1;
+	if (value > (uint64_t)INT64_MAX / unit)
+		return false;
+
+	int64_t frac = 0;
+	if ((i < len) && (s[i] == '.')) {
+		i++;
+		for (int64_t scale = unit / 10; (i < len) && digit(s[i]); i++, scale /= 10) {
+			frac += (s[i] - '0') * scale;
+		}
+	}
+	if (i != len)
+		return false;
+	ns = (int64_t)value * unit + frac;
+	return true;
+}
+
+ParseTimePlugin::ParseTimePlugin()
+	:field(), format(TimestampParser::FORMAT_UNKNOWN), sources(), last(NULL), lastname()
+{
+}
+
+bool ParseTimePlugin::init(const FilterStep &step)
+{
+	for (int i = 0; i < step.parameter_size(); i++) {
+		const Field &p = step.parameter(i);
+		if (p.key() == "field") {
+			field = p.value();
+		} else if (p.key() == "format") {
+			format = TimestampParser::formatByName(p.value());
+			if (format == TimestampParser::FORMAT_UNKNOWN) {
+				ERR("parsetime: unknown timestamp format '%s'", p.value().c_str());
+				return false;
+			}
+		} else {
+			WARN("parsetime: unknown parameter '%s' ignored", p.key().c_str());
+		}
+	}
+	return true;
+}
+
+ParseTimePlugin::Source &ParseTimePlugin::source(const std::string &name)
+{
+	// Events of a batch mostly come from the same source
+	if (last && (name == lastname))
+		return *last;
+	if (sources.size() >= MAX_SOURCES)
+		sources.clear();
+	last = &sources[name];
+	lastname = name;
+	return *last;
+}
+
+StepResult ParseTimePlugin::process(LogEvent &event)
+{
+	const std::string *text = NULL;
+	if (field.empty()) {
+		if (event.has_timestamp())
+			text = &event.timestamp();
+	} else {
+		for (int i = 0; (i < event.field_size()) && !text; i++) {
+			if (event.field(i).key() == field)
+				text = &event.field(i).value();
+		}
+	}
+	if (!text)
+		return STEP_FAILED;
+
+	Source &src = source(event.source());
+	int64_t ns;
+	if (format != TimestampParser::FORMAT_UNKNOWN) {
+		if (!src.parser.parse(format, *text, ns))
+			return STEP_FAILED;
+	} else if ((src.format == TimestampParser::FORMAT_UNKNOWN) || !src.parser.parse(src.format, *text, ns)) {
+		// First event of the source, or it changed its format
+		TimestampParser::Format detected = TimestampParser::detect(*text);
+		if (!src.parser.parse(detected, *text, ns))
+			return STEP_FAILED;
+		if (detected != src.format) {
+			DBG("parsetime: source '%s' uses %s timestamps", event.source().c_str(), TimestampParser::formatName(detected));
+			src.format = detected;
+		}
+	}
+	event.set_timestamp_ns(ns);
+	return STEP_OK;
+}
+
+SAWMILL_REGISTER_PLUGIN("parsetime", ParseTimePlugin);
+
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Benchmark: strptime() and timegm() against the cached parser
+/////////////////////////////////////////////////////////////////////////////
+
+#ifdef DEBUG_TIMEPARSER_CPP
+
+#include <cstdio>
+#include <cstdlib>
+
+#define BENCH_EVENTS 1000000
+
+using namespace sawmill;
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int64_t libc_parse(const char *text, const char *fmt)
+{
+	struct tm tm;
+	memset(&tm, 0, sizeof(tm));
+	tm.tm_year = 2013 - 1900;
+	const char *rest = strptime(text, fmt, &tm);
+	if (!rest)
+		return -1;
+	int64_t ns = (int64_t)timegm(&tm) * 1000000000LL;
+	if (*rest == '.')
+		ns += (int64_t)(atof(rest) * 1e9 + 0.5);
+	return ns;
+}
+
+int main()
+{
+	static const struct {
+		const char *text;
+		int64_t expected;
+	} checks[] = {
+		{ "2013-10-10T13:55:36Z", 1381413336000000000LL },
+		{ "2013-10-10T13:55:36.123+02:00", 1381406136123000000LL },
+		{ "2013-10-10 13:55:36,5-0130", 1381418736500000000LL },
+		{ "2000-02-29T00:00", 951782400000000000LL },
+		{ "1969-12-31T23:59:59Z", -1000000000LL },
+		{ "Oct 10 13:55:36", 1381413336000000000LL },
+		{ "Feb  1 00:00:00", 1359676800000000000LL },
+		{ "1381413336", 1381413336000000000LL },
+		{ "1381413336.25", 1381413336250000000LL },
+		{ "1381413336123", 1381413336123000000LL },
+		{ "1381413336123456789", 1381413336123456789LL },
+	};
+	static const char *invalid[] = { "2013-13-10T13:55:36Z", "2013-10-10T13:55:36+", "Foo 10 13:55:36", "13814133x6", "-", "" };
+
+	bool ok = true;
+	for (size_t i = 0; i < sizeof(checks) / sizeof(checks[0]); i++) {
+		TimestampParser parser;
+		parser.setReferenceTime(1381413336); // 2013-10-10
+		TimestampParser::Format format = TimestampParser::detect(checks[i].text, strlen(checks[i].text));
+		int64_t ns = 0;
+		bool parsed = parser.parse(format, checks[i].text, strlen(checks[i].text), ns);
+		if (!parsed || (ns != checks[i].expected)) {
+			printf("FAILED: '%s' (%s) gave %lld, expected %lld\n", checks[i].text, TimestampParser::formatName(format),
+			       (long long)ns, (long long)checks[i].expected);
+			ok = false;
+		}
+	}
+	for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+		TimestampParser parser;
+		int64_t ns;
+		if (parser.parse(TimestampParser::detect(invalid[i], strlen(invalid[i])), invalid[i], strlen(invalid[i]), ns)) {
+			printf("FAILED: '%s' should not parse\n", invalid[i]);
+			ok = false;
+		}
+	}
+	printf("Checks: %s\n", ok ? "OK" : "FAILED");
+
+	// A second's worth of events per timestamp, as a busy log has
+	char text[64];
+	std::vector<std::string> iso, bsd;
+	for (int i = 0; i < 3600; i++) {
+		snprintf(text, sizeof(text), "2013-10-10T13:%02d:%02d.%03dZ", i / 60, i % 60, i % 1000);
+		iso.push_back(text);
+		snprintf(text, sizeof(text), "Oct 10 13:%02d:%02d", i / 60, i % 60);
+		bsd.push_back(text);
+	}
+
+	int64_t sum1 = 0, sum2 = 0;
+	uint64_t t0 = now_ns();
+	for (int e = 0; e < BENCH_EVENTS; e++) {
+		sum1 += libc_parse(iso[e * 3600LL / BENCH_EVENTS].c_str(), "%Y-%m-%dT%H:%M:%S");
+	}
+	uint64_t t1 = now_ns();
+	TimestampParser parser;
+	for (int e = 0; e < BENCH_EVENTS; e++) {
+		const std::string &s = iso[e * 3600LL / BENCH_EVENTS];
+		int64_t ns = 0;
+		parser.parse(TimestampParser::FORMAT_ISO8601, s, ns);
+		sum2 += ns;
+	}
+	uint64_t t2 = now_ns();
+	printf("ISO-8601: strptime+timegm %.1f ns/event, parser %.1f ns/event (%s)\n",
+	       (double)(t1 - t0) / BENCH_EVENTS, (double)(t2 - t1) / BENCH_EVENTS, (sum1 == sum2) ? "same" : "DIFFERENT");
+
+	sum1 = sum2 = 0;
+	t0 = now_ns();
+	for (int e = 0; e < BENCH_EVENTS; e++) {
+		sum1 += libc_parse(bsd[e * 3600LL / BENCH_EVENTS].c_str(), "%b %d %H:%M:%S");
+	}
+	t1 = now_ns();
+	parser.setReferenceTime(1381413336);
+	for (int e = 0; e < BENCH_EVENTS; e++) {
+		const std::string &s = bsd[e * 3600LL / BENCH_EVENTS];
+		int64_t ns = 0;
+		parser.parse(TimestampParser::FORMAT_RFC3164, s, ns);
+		sum2 += ns;
+	}
+	t2 = now_ns();
+	printf("RFC 3164: strptime+timegm %.1f ns/event, parser %.1f ns/event (%s)\n",
+	       (double)(t1 - t0) / BENCH_EVENTS, (double)(t2 - t1) / BENCH_EVENTS, (sum1 == sum2) ? "same" : "DIFFERENT");
+	return ok ? 0 : 1;
+}
+#endif
@@ -0,0 +1,108 @@
+#ifndef __TIMEPARSER_H
+# define __TIMEPARSER_H
+
+#include <string>
+#include <unordered_map>
+#include <stdint.h>
+#include <time.h>
+#include "plugin.h"
+
+namespace sawmill {
+
+/**
+ * Fast parser for the common log timestamp formats, into nanoseconds since the epoch.
+ *
+ * The parsers are hand written for their fixed layout, no strptime() or locale. The date and
+ * time up to the minute are kept with the seconds they add up to, so the next timestamp in the
+ * same minute only has to parse its seconds and fraction. Use one parser per source, so
+ * interleaved sources don't keep replacing each other's minute.
+ */
+class TimestampParser
+{
+public:
+	enum Format {
+		FORMAT_UNKNOWN = 0,
+		FORMAT_ISO8601, // 2013-10-10T13:55:36.123+02:00, also the RFC 5424 syslog timestamp
+		FORMAT_RFC3164, // Oct 10 13:55:36, taken as UTC, the year is the one that puts it closest to now
+		FORMAT_EPOCH    // 1381413336.123, or milli/micro/nanoseconds by the number of digits
+	};
+
+	TimestampParser();
+
+	/**
+	 * Find out the format from the layout of the text, without fully parsing it.
+	 */
+	static Format detect(const char *text, size_t len);
+	static Format detect(const std::string &text) { return detect(text.data(), text.size()); }
+	static Format formatByName(const std::string &name);
+	static const char *formatName(Format format);
+
+	/**
+	 * Parse the text in the given format. Returns false if it isn't a valid timestamp in that
+	 * format, 'ns' is left untouched then.
+	 */
+	bool parse(Format format, const char *text, size_t len, int64_t &ns);
+	bool parse(Format format, const std::string &text, int64_t &ns) { return parse(format, text.data(), text.size(), ns); }
+
+	/**
+	 * RFC 3164 timestamps get their year from this time instead of the current time.
+	 */
+	void setReferenceTime(time_t ref) { reference = ref; minutelen = 0; }
+
+	/**
+	 * Days between 1970-01-01 and a date of the proleptic Gregorian calendar.
+	 */
+	static int64_t daysFromCivil(int64_t year, unsigned month, unsigned day);
+private:
+	enum { MAX_MINUTE = 16 }; // Length of "YYYY-MM-DDThh:mm"
+
+	bool parseIso8601(const char *s, size_t len, int64_t &ns);
+	bool parseRfc3164(const char *s, size_t len, int64_t &ns);
+	static bool parseEpoch(const char *s, size_t len, int64_t &ns);
+	bool cachedMinute(const char *s, size_t len, int64_t &base) const;
+	void cacheMinute(const char *s, size_t len, int64_t base);
+
+	// The last minute: its text and the seconds since the epoch at its start
+	char minutetext[MAX_MINUTE];
+	size_t minutelen;
+	int64_t minutebase;
+	time_t reference; // 0 for the current time
+};
+
+/**
+ * Plugin "parsetime": sets timestamp_ns from the timestamp of the event.
+ *
+ * Parameters (all optional):
+ *   field:  parse the value of this field instead of the timestamp
+ *   format: iso8601, rfc5424, rfc3164 or epoch. Without it the format is detected on the first
+ *           event of every source, and again when it stops matching.
+ *
+ * Fails on events without a parseable timestamp.
+ */
+class ParseTimePlugin : public FilterPlugin
+{
+public:
+	ParseTimePlugin();
+
+	bool init(const FilterStep &step);
+	StepResult process(LogEvent &event);
+private:
+	struct Source {
+		TimestampParser::Format format;
+		TimestampParser parser;
+
+		Source() :format(TimestampParser::FORMAT_UNKNOWN), parser() {}
+	};
+
+	Source &source(const std::string &name);
+
+	std::string field;
+	TimestampParser::Format format; // FORMAT_UNKNOWN to detect it per source
+	std::unordered_map<std::string, Source> sources;
+	Source *last;
+	std::string lastname;
+};
+
+} // namespace sawmill
+
+#endif // ifndef __TIMEPARSER_H
@@ -0,0 +1,644 @@
+/****************************************************************************
+ * Project: SawMill
+ * Authors:
+ *          Bart Meuris <bart . meuris @ gmail . com>
+ *
+ * License: (to be discussed LGPL version 2.0?)
+ ****************************************************************************
+ * Module description:
+ *     Work-stealing pool of in-process filter threads, and the per-source
+ *     sequencing of their output.
+ *
+ ***************************************************************************/
+
+#include "workerpool.h"
+#include "lookuptable.h"
+#include "sawlog.h"
+#include <algorithm>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#define DEFAULT_GRAINSIZE 64
+
+namespace sawmill {
+
+/////////////////////////////////////////////////////////////////////////////
+// OutputSequencer
+/////////////////////////////////////////////////////////////////////////////
+
+OutputSequencer::OutputSequencer()
+	:lock(), drained(), output(NULL), states(), prunesize(SEQUENCER_PRUNE_KEYS), heldcount(0), heldmax(0), waiters(0), pool()
+{
+}
+
+OutputSequencer::~OutputSequencer()
+{
+	for (KeyStates::iterator it = states.begin(); it != states.end(); ++it) {
+		std::map<uint64_t, LogEvent *> &held = it->second.held;
+		for (std::map<uint64_t, LogEvent *>::iterator h = held.begin(); h != held.end(); ++h) {
+			if (h->second)
+				pool.put(h->second);
+		}
+	}
+}
+
+void OutputSequencer::setOutput(EventOutput *out)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	output = out;
+}
+
+void OutputSequencer::assign(const FilterEngine::EventList &events, std::vector<uint64_t> &keys, std::vector<uint64_t> &seqs)
+{
+	int count = events.size();
+	keys.resize(count);
+	seqs.resize(count);
+	// Hashed outside of the lock, and not interned: the sources come from the input
+	for (int i = 0; i < count; i++) {
+		const std::string &source = events.Get(i).source();
+		keys[i] = StringInterner::hash(source.data(), source.size());
+	}
+	std::lock_guard<std::mutex> guard(lock);
+	if (states.size() >= prunesize)
+		prune();
+	for (int i = 0; i < count; i++) {
+		seqs[i] = states[keys[i]].assigned++;
+	}
+}
+
+void OutputSequencer::prune()
+{
+	// A key with everything released has no events in flight, it can start over from 0
+	for (KeyStates::iterator it = states.begin(); it != states.end(); ) {
+		if (it->second.assigned == it->second.released)
+			it = states.erase(it);
+		else
+			++it;
+	}
+	prunesize = std::max((size_t)SEQUENCER_PRUNE_KEYS, states.size() * 2);
+}
+
+void OutputSequencer::release(KeyState &state, LogEvent *event)
+{
+	if (event && output)
+		output->output(*event);
+	state.released++;
+	// Whatever was waiting for this one
+	while (!state.held.empty() && (state.held.begin()->first == state.released)) {
+		LogEvent *next = state.held.begin()->second;
+		state.held.erase(state.held.begin());
+		heldcount--;
+		if (next) {
+			if (output)
+				output->output(*next);
+			pool.put(next);
+		}
+		state.released++;
+	}
+}
+
+void OutputSequencer::complete(FilterEngine::EventList &events, const std::vector<StepResult> &results,
+                               const std::vector<uint64_t> &keys, const std::vector<uint64_t> &seqs)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	for (int i = 0; i < events.size(); i++) {
+		KeyState &state = states[keys[i]];
+		bool dropped = (results[i] == STEP_DROP);
+		if (seqs[i] == state.released) {
+			release(state, dropped ? NULL : events.Mutable(i));
+			continue;
+		}
+		// Too early, an event of the same source submitted before is still being filtered
+		LogEvent *event = NULL;
+		if (!dropped) {
+			event = pool.get();
+			event->Swap(events.Mutable(i));
+		}
+		state.held[seqs[i]] = event;
+		heldcount++;
+	}
+	if (waiters && (heldcount < heldmax))
+		drained.notify_all();
+}
+
+size_t OutputSequencer::held() const
+{
+	std::lock_guard<std::mutex> guard(lock);
+	return heldcount;
+}
+
+void OutputSequencer::waitHeld(size_t max)
+{
+	std::unique_lock<std::mutex> guard(lock);
+	if (heldcount < max)
+		return;
+	// The events they wait for were submitted already, the workers get to them
+	heldmax = max;
+	waiters++;
+	while (heldcount >= max) {
+		drained.wait(guard);
+	}
+	if (--waiters == 0)
+		heldmax = 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// WorkerPool
+/////////////////////////////////////////////////////////////////////////////
+
+struct WorkerPool::Task
+{
+	FilterEngine::EventList events;
+	std::vector<uint64_t> keys; // Sequencer key and sequence number of every event
+	std::vector<uint64_t> seqs;
+};
+
+struct WorkerPool::Worker
+{
+	std::thread thread;
+	std::mutex lock; // Protects tasks
+	std::deque<Task *> tasks;
+	std::mutex enginelock;
+	FilterEngine engine;
+	std::vector<StepResult> results;
+
+	std::atomic<uint64_t> batches;
+	std::atomic<uint64_t> events;
+	std::atomic<uint64_t> stolen;
+	std::atomic<uint64_t> splits;
+
+	Worker()
+		:thread(), lock(), tasks(), enginelock(), engine(), results(), batches(0), events(0), stolen(0), splits(0)
+	{}
+};
+
+WorkerPool::WorkerPool()
+	:workercount(1), affinity(), grainsize(DEFAULT_GRAINSIZE), stealing(true), config(NULL), sequencer(),
+	 workers(), nextworker(0), poollock(), wakeup(), queued(0), idle(0), stopping(false), flushlock(),
+	 flushed(), outstanding(0), sparelock(), sparetasks()
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus > 0)
+		workercount = cpus;
+}
+
+WorkerPool::~WorkerPool()
+{
+	stop();
+	for (size_t i = 0; i < sparetasks.size(); i++) {
+		delete sparetasks[i];
+	}
+}
+
+void WorkerPool::setWorkerCount(int count)
+{
+	workercount = (count > 0) ? count : 1;
+}
+
+int WorkerPool::getWorkerCount() const
+{
+	return workercount;
+}
+
+void WorkerPool::setAffinity(const std::vector<int> &cpus)
+{
+	affinity = cpus;
+}
+
+void WorkerPool::setGrainSize(size_t events)
+{
+	grainsize = (events > 0) ? events : 1;
+}
+
+void WorkerPool::setStealing(bool enable)
+{
+	stealing = enable;
+}
+
+void WorkerPool::setOutput(EventOutput *out)
+{
+	sequencer.setOutput(out);
+}
+
+bool WorkerPool::start(const FilterConfigStore &cfg)
+{
+	if (!workers.empty())
+		return false;
+	config = &cfg;
+	stopping = false;
+	for (int i = 0; i < workercount; i++) {
+		Worker *worker = new Worker();
+		worker->engine.load(cfg);
+		workers.push_back(worker);
+	}
+	for (int i = 0; i < workercount; i++) {
+		workers[i]->thread = std::thread(&WorkerPool::run, this, i);
+	}
+	NOTICE("Started %d filter workers%s", workercount, stealing ? "" : " without work stealing");
+	return true;
+}
+
+void WorkerPool::stop()
+{
+	if (workers.empty())
+		return;
+	{
+		std::lock_guard<std::mutex> guard(poollock);
+		stopping = true;
+	}
+	wakeup.notify_all();
+	for (size_t i = 0; i < workers.size(); i++) {
+		workers[i]->thread.join();
+		delete workers[i];
+	}
+	workers.clear();
+}
+
+void WorkerPool::configChanged()
+{
+	// Replaced lookup tables are mapped before the workers are stopped for their engine
+	LookupSource::refresh(config->getVersion());
+	for (size_t i = 0; i < workers.size(); i++) {
+		std::lock_guard<std::mutex> guard(workers[i]->enginelock);
+		workers[i]->engine.load(*config);
+	}
+}
+
+WorkerPool::Task *WorkerPool::newTask()
+{
+	std::lock_guard<std::mutex> guard(sparelock);
+	if (sparetasks.empty())
+		return new Task();
+	Task *task = sparetasks.back();
+	sparetasks.pop_back();
+	return task;
+}
+
+void WorkerPool::freeTask(Task *task)
+{
+	// Clear() keeps the events allocated, the next submit() hands them back to the caller
+	task->events.Clear();
+	std::lock_guard<std::mutex> guard(sparelock);
+	sparetasks.push_back(task);
+}
+
+void WorkerPool::queueTask(int w, Task *task)
+{
+	{
+		std::lock_guard<std::mutex> guard(workers[w]->lock);
+		workers[w]->tasks.push_back(task);
+	}
+	{
+		std::lock_guard<std::mutex> guard(poollock);
+		queued++;
+	}
+	// Without stealing only worker w can run it, and we can't wake up a specific one
+	if (stealing)
+		wakeup.notify_one();
+	else
+		wakeup.notify_all();
+}
+
+void WorkerPool::submit(FilterEngine::EventList &events, int worker)
+{
+	if (workers.empty()) {
+		ERR("Events submitted to a worker pool that is not running");
+		return;
+	}
+	size_t count = events.size();
+	if (count == 0)
+		return;
+
+	sequencer.waitHeld(SEQUENCER_MAX_HELD);
+	Task *task = newTask();
+	task->events.Swap(&events);
+	sequencer.assign(task->events, task->keys, task->seqs);
+	{
+		std::lock_guard<std::mutex> guard(flushlock);
+		outstanding += count;
+	}
+	if ((worker < 0) || (worker >= (int)workers.size()))
+		worker = nextworker++ % workers.size();
+	queueTask(worker, task);
+}
+
+WorkerPool::Task *WorkerPool::take(int w)
+{
+	Worker &self = *workers[w];
+	for (;;) {
+		Task *task = NULL;
+		{
+			// Oldest first, so the events of a source are done about in order and the sequencer
+			// doesn't have to hold them
+			std::lock_guard<std::mutex> guard(self.lock);
+			if (!self.tasks.empty()) {
+				task = self.tasks.front();
+				self.tasks.pop_front();
+			}
+		}
+		for (size_t i = 1; !task && stealing && (i < workers.size()); i++) {
+			// Oldest first from the others, they are the furthest from being run by their owner
+			Worker &victim = *workers[(w + i) % workers.size()];
+			std::lock_guard<std::mutex> guard(victim.lock);
+			if (!victim.tasks.empty()) {
+				task = victim.tasks.front();
+				victim.tasks.pop_front();
+				self.stolen++;
+			}
+		}
+
+		std::unique_lock<std::mutex> guard(poollock);
+		if (task) {
+			queued--;
+			return task;
+		}
+		for (;;) {
+			bool work;
+			if (stealing) {
+				work = (queued > 0);
+			} else {
+				std::lock_guard<std::mutex> own(self.lock);
+				work = !self.tasks.empty();
+			}
+			if (work)
+				break;
+			if (stopping)
+				return NULL;
+			idle++;
+			wakeup.wait(guard);
+			idle--;
+		}
+	}
+}
+
+WorkerPool::Task *WorkerPool::split(Task *task)
+{
+	Task *half = newTask();
+	int count = task->events.size();
+	int keep = count / 2;
+	for (int i = keep; i < count; i++) {
+		half->events.Add()->Swap(task->events.Mutable(i));
+	}
+	for (int i = keep; i < count; i++) {
+		task->events.RemoveLast();
+	}
+	half->keys.assign(task->keys.begin() + keep, task->keys.end());
+	half->seqs.assign(task->seqs.begin() + keep, task->seqs.end());
+	task->keys.resize(keep);
+	task->seqs.resize(keep);
+	return half;
+}
+
+void WorkerPool::run(int w)
+{
+	Worker &self = *workers[w];
+	if (!affinity.empty()) {
+		int cpu = affinity[w % affinity.size()];
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+			WARN("Could not pin filter worker %d to CPU %d", w, cpu);
+	}
+
+	Task *task;
+	while ((task = take(w)) != NULL) {
+		// Give the idle workers a part of big batches, they steal it from our deque
+		for (int spare = stealing ? (int)idle : 0; (spare > 0) && ((size_t)task->events.size() > grainsize); spare--) {
+			queueTask(w, split(task));
+			self.splits++;
+		}
+
+		size_t count = task->events.size();
+		{
+			std::lock_guard<std::mutex> guard(self.enginelock);
+			self.engine.process(task->events, self.results);
+		}
+		sequencer.complete(task->events, self.results, task->keys, task->seqs);
+		self.batches++;
+		self.events += count;
+		freeTask(task);
+
+		std::lock_guard<std::mutex> guard(flushlock);
+		outstanding -= count;
+		if (outstanding == 0)
+			flushed.notify_all();
+	}
+}
+
+void WorkerPool::flush()
+{
+	std::unique_lock<std::mutex> guard(flushlock);
+	while (outstanding > 0) {
+		flushed.wait(guard);
+	}
+}
+
+size_t WorkerPool::pending() const
+{
+	std::lock_guard<std::mutex> guard(flushlock);
+	return outstanding;
+}
+
+void WorkerPool::getStats(std::vector<WorkerStats> &stats) const
+{
+	stats.resize(workers.size());
+	for (size_t i = 0; i < workers.size(); i++) {
+		stats[i].batches = workers[i]->batches;
+		stats[i].events = workers[i]->events;
+		stats[i].stolen = workers[i]->stolen;
+		stats[i].splits = workers[i]->splits;
+	}
+}
+
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Benchmark: static partitioning by type against work stealing, with a
+// skewed type distribution and one expensive filter
+/////////////////////////////////////////////////////////////////////////////
+
+#ifdef DEBUG_WORKERPOOL_CPP
+
+#include <cstdio>
+#include <cmath>
+#include <cstdlib>
+#include <time.h>
+
+#define BENCH_EVENTS     400000
+#define BENCH_BATCHSIZE  512
+#define BENCH_TYPES      8
+#define BENCH_SOURCES    16
+#define BENCH_WORKERS    4
+
+using namespace sawmill;
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Checks that the events of every source come out in the order they went in.
+ */
+class OrderCheck : public EventOutput
+{
+public:
+	OrderCheck() :count(0), errors(0), last(BENCH_SOURCES, -1) {}
+	void output(LogEvent &event)
+	{
+		int source = atoi(event.source().c_str() + 5);
+		int seq = atoi(event.field(0).value().c_str());
+		if (seq <= last[source])
+			errors++;
+		last[source] = seq;
+		count++;
+	}
+	long count;
+	long errors;
+	std::vector<int> last;
+};
+
+static void build_config(FilterConfig &config)
+{
+	char type[32];
+	config.set_version(0);
+	for (int t = 0; t < BENCH_TYPES; t++) {
+		Filter *f = config.add_filter();
+		f->set_filterid(t + 1);
+		snprintf(type, sizeof(type), "type-%d", t);
+		f->set_type(type);
+		// The dominant type also has the expensive filter
+		int steps = (t == 0) ? 12 : 1;
+		for (int s = 0; s < steps; s++) {
+			FilterStep *step = f->add_step();
+			step->set_plugin("addtag");
+			step->set_stepnumber(s);
+			if (t == 0)
+				step->set_requirematch("user=\\w+ (id|uid)=\\d+ \\w+ from [0-9.]+");
+			Field *p = step->add_parameter();
+			p->set_key("tag");
+			p->set_value("seen");
+		}
+	}
+}
+
+/**
+ * Type with a Zipf-like distribution: type-0 gets about 65% of the events.
+ */
+static int skewed_type(unsigned &rnd)
+{
+	static double cumulative[BENCH_TYPES];
+	static bool init = false;
+	if (!init) {
+		double total = 0;
+		for (int t = 0; t < BENCH_TYPES; t++) {
+			total += 1.0 / ((t + 1) * (t + 1));
+			cumulative[t] = total;
+		}
+		for (int t = 0; t < BENCH_TYPES; t++) {
+			cumulative[t] /= total;
+		}
+		init = true;
+	}
+	double r = (double)(rand_r(&rnd) % 100000) / 100000.0;
+	for (int t = 0; t < BENCH_TYPES; t++) {
+		if (r < cumulative[t])
+			return t;
+	}
+	return BENCH_TYPES - 1;
+}
+
+static void run(const FilterConfigStore &store, bool stealing)
+{
+	char buf[64];
+	OrderCheck check;
+	WorkerPool pool;
+	pool.setWorkerCount(BENCH_WORKERS);
+	pool.setStealing(stealing);
+	pool.setOutput(&check);
+	pool.start(store);
+
+	std::vector<FilterEngine::EventList> bytype(BENCH_TYPES);
+	std::vector<int> seq(BENCH_SOURCES, 0);
+	unsigned rnd = 42;
+	uint64_t t0 = now_ns();
+	for (int b = 0; b < BENCH_EVENTS / BENCH_BATCHSIZE; b++) {
+		// Split up by type, like an input would for static partitioning
+		for (int i = 0; i < BENCH_BATCHSIZE; i++) {
+			int type = skewed_type(rnd);
+			int source = rand_r(&rnd) % BENCH_SOURCES;
+			LogEvent *e = bytype[type].Add();
+			snprintf(buf, sizeof(buf), "type-%d", type);
+			e->set_type(buf);
+			snprintf(buf, sizeof(buf), "host-%d", source);
+			e->set_source(buf);
+			e->set_message("Accepted publickey for user=admin id=1000 ssh2 from 10.0.0.1");
+		}
+		for (int t = 0; t < BENCH_TYPES; t++) {
+			// Number the events of every source in the order they are submitted
+			for (int i = 0; i < bytype[t].size(); i++) {
+				LogEvent *e = bytype[t].Mutable(i);
+				Field *f = e->add_field();
+				f->set_key("seq");
+				snprintf(buf, sizeof(buf), "%d", seq[atoi(e->source().c_str() + 5)]++);
+				f->set_value(buf);
+			}
+			pool.submit(bytype[t], t % BENCH_WORKERS);
+			bytype[t].Clear();
+		}
+	}
+	pool.flush();
+	uint64_t total = now_ns() - t0;
+
+	std::vector<WorkerPool::WorkerStats> stats;
+	pool.getStats(stats);
+	pool.stop();
+	printf("%s: %.1f ns/event, %ld events output, order %s\n", stealing ? "work stealing" : "static by type",
+	       (double)total / BENCH_EVENTS, check.count, check.errors ? "BROKEN" : "OK");
+	for (size_t w = 0; w < stats.size(); w++) {
+		printf("  worker %d: %8lu events %6lu batches %6lu stolen %6lu splits\n", (int)w, (unsigned long)stats[w].events,
+		       (unsigned long)stats[w].batches, (unsigned long)stats[w].stolen, (unsigned long)stats[w].splits);
+	}
+}
+
+int main()
+{
+	FilterConfig config;
+	build_config(config);
+	FilterConfigStore store;
+	store.update(config);
+
+	run(store, false);
+	run(store, true);
+
+	// Every event from another source: no interned sources, no states left behind
+	OrderCheck check;
+	WorkerPool pool;
+	pool.setWorkerCount(BENCH_WORKERS);
+	pool.setOutput(&check);
+	pool.start(store);
+	FilterEngine::EventList events;
+	char buf[64];
+	for (int b = 0; b < BENCH_EVENTS / BENCH_BATCHSIZE; b++) {
+		for (int i = 0; i < BENCH_BATCHSIZE; i++) {
+			LogEvent *e = events.Add();
+			e->set_type("type-1");
+			snprintf(buf, sizeof(buf), "host-0-%d", b * BENCH_BATCHSIZE + i);
+			e->set_source(buf);
+			e->add_field()->set_value("0");
+		}
+		pool.submit(events);
+		events.Clear();
+	}
+	pool.flush();
+	pool.stop();
+	bool ok = (check.count == (BENCH_EVENTS / BENCH_BATCHSIZE) * BENCH_BATCHSIZE) && (StringInterner::sources().size() == 0);
+	printf("unique sources: %ld events output, %d sources interned -> %s\n", check.count,
+	       (int)StringInterner::sources().size(), ok ? "OK" : "FAILED");
+	return ok ? 0 : 1;
+}
+#endif
@@ -0,0 +1,191 @@
+#ifndef __WORKERPOOL_H
+# define __WORKERPOOL_H
+
+#include <map>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <unordered_map>
+#include <stdint.h>
+#include "filterconfig.h"
+#include "filterengine.h"
+#include "eventbatch.h"
+#include "eventoutput.h"
+
+#define SEQUENCER_MAX_HELD   65536 // Events held out of order before submit() waits
+#define SEQUENCER_PRUNE_KEYS 1024  // Keys kept before the idle ones are dropped
+
+namespace sawmill {
+
+/**
+ * Puts the events of every key (a hash of their source) back in submission order before they
+ * are passed to the output, whatever order the workers finish them in. Sources with the same
+ * hash are just kept in order together.
+ *
+ * Events that come in early are held until all events submitted before them with the same key
+ * are output or dropped. The output is called with the sequencer lock held, so it is never
+ * called concurrently. Held events come from a pool, and the state of keys without events in
+ * flight is dropped once there are many of them.
+ */
+class OutputSequencer
+{
+public:
+	OutputSequencer();
+	~OutputSequencer();
+
+	void setOutput(EventOutput *out);
+
+	/**
+	 * Give every event its key and its sequence number within that key.
+	 */
+	void assign(const FilterEngine::EventList &events, std::vector<uint64_t> &keys, std::vector<uint64_t> &seqs);
+	/**
+	 * The events went through the filters. Events that can't be output yet are swapped out of
+	 * 'events' and held.
+	 */
+	void complete(FilterEngine::EventList &events, const std::vector<StepResult> &results,
+	              const std::vector<uint64_t> &keys, const std::vector<uint64_t> &seqs);
+	size_t held() const;
+	/**
+	 * Wait until less than 'max' events are held.
+	 */
+	void waitHeld(size_t max);
+private:
+	struct KeyState {
+		uint64_t assigned;
+		uint64_t released;
+		std::map<uint64_t, LogEvent *> held; // By sequence number, NULL for dropped events
+
+		KeyState() :assigned(0), released(0), held() {}
+	};
+	typedef std::unordered_map<uint64_t, KeyState> KeyStates;
+
+	void release(KeyState &state, LogEvent *event);
+	void prune();
+
+	mutable std::mutex lock;
+	std::condition_variable drained;
+	EventOutput *output;
+	KeyStates states;
+	size_t prunesize; // Drop the idle keys when there are this many
+	size_t heldcount;
+	size_t heldmax;   // The threads in waitHeld() wait for less than this
+	size_t waiters;
+	EventPool pool;   // Held events
+
+	// Not copyable
+	OutputSequencer(const OutputSequencer &);
+	OutputSequencer &operator=(const OutputSequencer &);
+};
+
+/**
+ * Pool of in-process filter threads with work stealing, each running its own FilterEngine.
+ *
+ * Every worker has a deque of event batches. A worker runs its own batches in the order they
+ * were queued and steals the oldest batch of another worker when its own deque is empty, so one
+ * dominant log type can't leave the other cores idle. While workers are idle, a worker splits
+ * batches larger than the grain size in halves and queues the second half, so an expensive
+ * filter on one big batch is spread as well. The OutputSequencer keeps the events of each source
+ * in order.
+ *
+ * This is a building block for embedding the filters in-process: sawmill itself still filters in
+ * the slaves of the Dispatcher, so the worker count and affinity are set through this API only.
+ */
+class WorkerPool
+{
+public:
+	struct WorkerStats {
+		uint64_t batches; // Batches processed
+		uint64_t events;
+		uint64_t stolen;  // Batches taken from another worker
+		uint64_t splits;  // Batches split to feed idle workers
+	};
+
+	WorkerPool();
+	~WorkerPool();
+
+	/**
+	 * Settings, only taken into account by start().
+	 */
+	void setWorkerCount(int count);
+	int getWorkerCount() const;
+	/**
+	 * Pin worker i to CPU cpus[i % cpus.size()], an empty list leaves the placement to the OS.
+	 */
+	void setAffinity(const std::vector<int> &cpus);
+	void setGrainSize(size_t events);
+	/**
+	 * Without stealing, workers only run the batches submitted to them (static partitioning).
+	 */
+	void setStealing(bool enable);
+	void setOutput(EventOutput *out);
+
+	bool start(const FilterConfigStore &config);
+	/**
+	 * Finish all queued batches and stop the workers.
+	 */
+	void stop();
+	/**
+	 * The config store has a new version: reload the engines of all workers. Each worker
+	 * finishes the batch it is running first.
+	 */
+	void configChanged();
+
+	/**
+	 * Queue a batch of events for the deque of 'worker', -1 to spread them round robin. The
+	 * events are taken over and 'events' gets recycled events from an earlier batch. Waits while
+	 * the sequencer holds more than SEQUENCER_MAX_HELD events.
+	 */
+	void submit(FilterEngine::EventList &events, int worker = -1);
+	/**
+	 * Wait until all submitted events are output or dropped.
+	 */
+	void flush();
+	size_t pending() const;
+	void getStats(std::vector<WorkerStats> &stats) const;
+private:
+	struct Task;
+	struct Worker;
+
+	void run(int w);
+	Task *take(int w);
+	Task *split(Task *task);
+	void queueTask(int w, Task *task);
+	Task *newTask();
+	void freeTask(Task *task);
+
+	int workercount;
+	std::vector<int> affinity;
+	size_t grainsize;
+	bool stealing;
+	const FilterConfigStore *config;
+	OutputSequencer sequencer;
+	std::vector<Worker *> workers;
+	std::atomic<unsigned> nextworker;
+
+	// Sleeping and waking up of the workers
+	std::mutex poollock;
+	std::condition_variable wakeup;
+	size_t queued;         // Batches in all deques
+	std::atomic<int> idle; // Workers waiting for work
+	bool stopping;
+
+	// flush()
+	mutable std::mutex flushlock;
+	std::condition_variable flushed;
+	size_t outstanding; // Events submitted but not completed yet
+
+	std::mutex sparelock;
+	std::vector<Task *> sparetasks;
+
+	// Not copyable
+	WorkerPool(const WorkerPool &);
+	WorkerPool &operator=(const WorkerPool &);
+};
+
+} // namespace sawmill
+
+#endif // ifndef __WORKERPOOL_H
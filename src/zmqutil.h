@@ -0,0 +1,71 @@
+#ifndef __ZMQUTIL_H
+# define __ZMQUTIL_H
+
+#include <string>
+#include <cstring>
+#include <zmq.hpp>
+#include <google/protobuf/message.h>
+
+namespace sawmill {
+
+/**
+ * zmq_poll with the timeout in milliseconds, 0MQ 2.x expects microseconds.
+ */
+inline int zmq_poll_ms(zmq::pollitem_t *items, int count, long timeout)
+{
+#if ZMQ_VERSION_MAJOR < 3
+	if (timeout > 0)
+		timeout *= 1000;
+#endif
+	return zmq::poll(items, count, timeout);
+}
+
+inline bool zmq_send_frame(zmq::socket_t &socket, const std::string &data, int flags = 0)
+{
+	zmq::message_t msg(data.size());
+	memcpy(msg.data(), data.data(), data.size());
+	return socket.send(msg, flags);
+}
+
+inline bool zmq_send_message(zmq::socket_t &socket, const google::protobuf::Message &pb, int flags = 0)
+{
+	zmq::message_t msg(pb.ByteSizeLong());
+	pb.SerializeWithCachedSizesToArray(static_cast<google::protobuf::uint8 *>(msg.data()));
+	return socket.send(msg, flags);
+}
+
+inline bool zmq_recv_frame(zmq::socket_t &socket, std::string &data, int flags = 0)
+{
+	zmq::message_t msg;
+	if (!socket.recv(&msg, flags))
+		return false;
+	data.assign(static_cast<const char *>(msg.data()), msg.size());
+	return true;
+}
+
+inline bool zmq_recv_message(zmq::socket_t &socket, google::protobuf::Message &pb, int flags = 0)
+{
+	zmq::message_t msg;
+	if (!socket.recv(&msg, flags))
+		return false;
+	return pb.ParseFromArray(msg.data(), msg.size());
+}
+
+inline bool zmq_has_more(zmq::socket_t &socket)
+{
+	int64_t more = 0;
+	size_t size = sizeof(more);
+#if ZMQ_VERSION_MAJOR >= 3
+	int imore = 0;
+	size = sizeof(imore);
+	socket.getsockopt(ZMQ_RCVMORE, &imore, &size);
+	more = imore;
+#else
+	socket.getsockopt(ZMQ_RCVMORE, &more, &size);
+#endif
+	return more != 0;
+}
+
+} // namespace sawmill
+
+#endif // ifndef __ZMQUTIL_H